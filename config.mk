@@ -18,7 +18,7 @@ OS              = $(shell sh -c 'uname 2> /dev/null || echo Unknown_OS')
 # Libs
 #
 LIBS            = $(shell pkg-config --libs gtk+-3.0 mpv libebur128)
-LIBS           += $(shell pkg-config --libs libavformat libavutil sndfile)
+LIBS           += $(shell pkg-config --libs libavformat libavcodec libavutil)
 LIBS           += -lm
 ifeq ($(OS),Darwin)
     LIBS       += $(shell pkg-config --libs gtk-mac-integration-gtk3)
@@ -29,7 +29,7 @@ endif
 # Includes
 #
 INCLUDES        = $(shell pkg-config --cflags gtk+-3.0 mpv libebur128)
-INCLUDES       += $(shell pkg-config --cflags libavformat libavutil sndfile)
+INCLUDES       += $(shell pkg-config --cflags libavformat libavcodec libavutil)
 INCLUDES       += -I/usr/include/mpv
 ifeq ($(OS),Darwin)
     INCLUDES   += $(shell pkg-config --cflags gtk-mac-integration-gtk3)
@@ -64,14 +64,14 @@ DESKTOP_MIME    = application/ogg;application/x-ogg;audio/aac;audio/x-aac;audio/
 # Debian .deb
 #
 DEB_DEPS        = libgtk-3-0, libmpv1, libebur128-1,
-DEB_DEPS       += libavformat58, libavutil56, libsndfile1
+DEB_DEPS       += libavformat58, libavcodec58, libavutil56
 
 
 ################################################################################
 # Apt
 #
 APT_DEPS        = libgtk-3-dev libmpv-dev libebur128-dev
-APT_DEPS       += libavformat-dev libavutil-dev libsndfile1-dev
+APT_DEPS       += libavformat-dev libavcodec-dev libavutil-dev
 
 
 ################################################################################
@@ -0,0 +1,194 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        analysis.h
+ * @brief       ebu r128 loudness analysis
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <glib.h>
+
+#include "ingest.h"
+#include "track.h"
+
+/**
+ * Minimum length of a segment in seconds
+ *
+ * files at least twice this long are split in time segments that are
+ * analyzed concurrently, one per core, each with its own ebur128 state
+ *
+ * segments are aligned to the waveform window and the r128 gating blocks
+ * and every segment but the first is fed 300ms of pre-roll, so the set of
+ * gating blocks is the same as for a sequential scan. The results differ
+ * from the sequential path only by:
+ *  - floating point summation order of the gating blocks (~1e-12 LU)
+ *  - the K-weighting filter settling during pre-roll, which only affects
+ *    the first gating blocks of a segment (well below 0.001 LU)
+ *  - for lossy formats, seek accuracy of the decoder (< 0.01 LU)
+ */
+#define ANALYSIS_SEGMENT_MIN 300.0
+
+/**
+ * Maximum number of waveform values when streaming
+ *
+ * longer tracks merge windows in pairs until they fit, one value then
+ * covers a power of 2 times TIME_WINDOW, see Track.waveform_window
+ * 16384 windows of 200ms is about 55 minutes
+ */
+#define ANALYSIS_WAVEFORM_MAX 16384
+
+/**
+ * Sample type of analysis_set_sample that reads what the decoder produces
+ */
+#define ANALYSIS_NATIVE -1
+
+/**
+ * What analysis_run measures
+ *
+ * every profile measures everything the profiles before it do, tracks
+ * analyzed with a cheap profile can be analyzed again with a higher one
+ */
+typedef enum AnalysisProfile {
+    ANALYSIS_QUICK,         /**< integrated loudness and sample peak */
+    ANALYSIS_STANDARD,      /**< and the waveform */
+    ANALYSIS_FULL,          /**< and true peak, loudness range and maxima */
+} AnalysisProfile;
+
+/**
+ * Time spent per stage of loading and analyzing tracks
+ *
+ * summed over all threads, in usec
+ */
+typedef struct AnalysisStats {
+    guint64 tracks;         /**< tracks analyzed */
+    guint64 frames;         /**< frames decoded */
+    guint64 mapped;         /**< frames of those read from a mapped file */
+    gint64 open;            /**< opening the file and the decoder */
+    gint64 probe;           /**< reading tags and stream info */
+    gint64 decode;          /**< demuxing, decoding and sample conversion */
+    gint64 loudness;        /**< loudness accumulation, including peak */
+    gint64 windows;         /**< short-term loudness of the waveform windows */
+    gint64 waveform;        /**< stitching segments and the waveform pyramid */
+} AnalysisStats;
+
+/**
+ * Decode the file and calculate loudness, peak and waveform
+ *
+ * sets the .lufs, .peak and .length properties of the track, the .waveform
+ * (ANALYSIS_STANDARD) and .true_peak, .lra, .momentary_max and
+ * .short_term_max (ANALYSIS_FULL, NAN otherwise)
+ * see analysis_set_streaming for the memory used
+ * long files are analyzed in parallel segments, see ANALYSIS_SEGMENT_MIN,
+ * all analyses of the process share the processors: a file only gets extra
+ * segment threads for the processors no other analysis is using
+ *
+ * the cancel flag is checked (atomically) before every read window, all
+ * segments stop within one window when it is set
+ *
+ * @param track the track object
+ * @param ingest the track file opened for decoding
+ * @param profile what to measure
+ * @param cancel stop decoding when set to non-zero or NULL
+ * @return 0 on success or -1 when failed or cancelled
+ */
+extern int analysis_run(Track* track, Ingest* ingest, AnalysisProfile profile,
+const int* cancel);
+
+/**
+ * @param name quick, standard or full
+ * @return the AnalysisProfile or -1 when the name is unknown
+ */
+extern int analysis_profile_parse(const char* name);
+
+/**
+ * @param profile an AnalysisProfile
+ * @return its name
+ */
+extern const char* analysis_profile_name(int profile);
+
+/**
+ * Measure the true peak or only the sample peak
+ *
+ * the true peak is measured by ANALYSIS_FULL, this enables the oversampling
+ * for the other profiles too, to measure its cost (default FALSE)
+ *
+ * @param enable TRUE to measure the true peak
+ */
+extern void analysis_set_true_peak(int enable);
+
+/**
+ * Limit the number of segments a file is split in
+ *
+ * meant to measure one file per thread, long files are split over the
+ * idle processors by default (0)
+ *
+ * @param max segments per file, 1 to never split or 0 for no limit
+ */
+extern void analysis_set_segments(unsigned int max);
+
+/**
+ * Measure loudness with the in-tree kernel or with libebur128
+ *
+ * meant to compare both (default ANALYSIS_KERNEL)
+ *
+ * @param enable TRUE for the kernel, FALSE for libebur128
+ */
+extern void analysis_set_kernel(int enable);
+
+/**
+ * Set the sample type the analysis reads and feeds to the loudness meter
+ *
+ * the native type of the decoder is the fastest (eg short for 16 bit
+ * files) and exact, this is meant to compare it with the other types
+ * (default ANALYSIS_NATIVE)
+ *
+ * @param sample an IngestSample or ANALYSIS_NATIVE
+ */
+extern void analysis_set_sample(int sample);
+
+/**
+ * Analyze with bounded memory or keep everything
+ *
+ * streaming counts gating blocks and short-term windows in histograms and
+ * folds waveforms longer than ANALYSIS_WAVEFORM_MAX, so the memory per
+ * track is fixed, otherwise every block is kept and the waveform has a
+ * value per TIME_WINDOW (default ANALYSIS_STREAMING)
+ *
+ * @param enable TRUE for bounded memory
+ */
+extern void analysis_set_streaming(int enable);
+
+/**
+ * Read uncompressed files from a memory mapping or decode them
+ *
+ * wav and aiff pcm is fed to the kernel where it's mapped, without the
+ * decoder and its copies, other formats, libebur128 and a forced sample
+ * type (analysis_set_sample) always decode (default ANALYSIS_MMAP)
+ *
+ * @param enable TRUE to map uncompressed files
+ */
+extern void analysis_set_mmap(int enable);
+
+/**
+ * Add to the process wide stage statistics
+ *
+ * @param stats times to add
+ */
+extern void analysis_stats_add(const AnalysisStats* stats);
+
+/**
+ * Get the process wide stage statistics
+ *
+ * @param stats destination
+ */
+extern void analysis_stats_get(AnalysisStats* stats);
+
+/**
+ * Reset the process wide stage statistics
+ */
+extern void analysis_stats_reset(void);
+
+#endif
@@ -0,0 +1,44 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        batch.h
+ * @brief       headless batch analysis
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+/**
+ * Option that selects the batch mode, must be the first argument
+ */
+#define BATCH_OPTION "--analyze"
+
+/**
+ * Exit status when the arguments are invalid or there's nothing to analyze
+ * 0 means all files were analyzed, 1 that some failed
+ */
+#define BATCH_EXIT_USAGE 2
+
+/**
+ * Analyze files without gui
+ *
+ * files and directories (recursive) are analyzed like track_new does, by a
+ * pool of worker threads, gtk and mpv are never initialized
+ * one record is written to stdout per file as soon as it is done, in the
+ * order they complete
+ *
+ * options:
+ *  --jobs N    number of worker threads (default: number of processors)
+ *  --profile P quick, standard or full (default: ANALYSIS_PROFILE)
+ *  --json      one json object per line (default)
+ *  --csv       csv with a header line
+ *  --waveform  include the waveform in the records
+ *
+ * @param argc number of arguments
+ * @param argv arguments following BATCH_OPTION
+ * @return exit status, EXIT_SUCCESS, EXIT_FAILURE or BATCH_EXIT_USAGE
+ */
+extern int batch_run(int argc, char** argv);
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        cache.h
+ * @brief       persistent analysis cache
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <gtk/gtk.h>
+
+#include "track.h"
+
+/**
+ * Cache
+ *
+ * on-disk store of track analysis results (loudness, peak, length, waveform
+ * and the other measurements of the profile the track was analyzed with)
+ * one binary file per track, named after a hash of the track path
+ * entries are only valid for the file size and mtime they were created with
+ */
+typedef struct {
+    gchar* dir;             /**< absolute path of the cache directory */
+    gsize max_size;         /**< evict entries when total size exceeds this */
+    gsize size;             /**< current total size of all entries */
+    GMutex lock;            /**< guards size - cache is used by load threads */
+} Cache;
+
+/**
+ * Constructor
+ *
+ * create the cache directory if needed and sum the size of existing entries
+ *
+ * @param dir absolute path of the cache directory
+ * @param max_size maximum total size of the cache in bytes
+ * @return the newly created cache or NULL when the directory is not usable
+ */
+extern Cache* cache_new(const gchar* dir, gsize max_size);
+
+/**
+ * Restore the analysis results of a track
+ *
+ * the header is read first, the entry is only accepted when the file
+ * size, mtime (and content hash if enabled) match
+ *
+ * @param this the cache object
+ * @param track the probed track - the analysis results and profile are set
+ * @param size file size in bytes
+ * @param mtime file modification time in seconds since epoch
+ * @return TRUE on cache hit, FALSE when track must be analyzed
+ */
+extern gboolean cache_lookup(Cache* this, Track* track, gint64 size, gint64 mtime);
+
+/**
+ * Store the analysis results of a track
+ *
+ * oldest entries are evicted when max_size is exceeded
+ *
+ * @param this the cache object
+ * @param track the analyzed track
+ * @param size file size in bytes
+ * @param mtime file modification time in seconds since epoch
+ */
+extern void cache_store(Cache* this, Track* track, gint64 size, gint64 mtime);
+
+/**
+ * Free all resources
+ *
+ * entries on disk are left untouched
+ *
+ * @param this the cache object
+ */
+extern void cache_free(Cache* this);
+
+#endif
@@ -66,6 +66,103 @@
  */
 #define TIMELINE_AVG_HEIGHT         0.5
 
+/**
+ * name of the analysis cache directory
+ * created in $XDG_CACHE_HOME (or ~/.cache)
+ */
+#define CACHE_DIR                   "alphabet"
+
+/**
+ * maximum size of the analysis cache in bytes
+ * least recently used entries are evicted when the cache grows beyond
+ */
+#define CACHE_MAX_SIZE              (256UL * 1024 * 1024)
+
+/**
+ * also key cache entries on a hash of the file contents
+ * only the head and tail (CACHE_HASH_BLOCK bytes) of the file are hashed
+ * so files touched without changing size or mtime are detected
+ * 0 = key on path, size and mtime only
+ */
+#define CACHE_CONTENT_HASH          0
+
+/**
+ * number of bytes hashed at the start and end of the file
+ */
+#define CACHE_HASH_BLOCK            (64UL * 1024)
+
+/**
+ * number of mpv instances kept loaded for switching tracks
+ * the selected track and its neighbours in the list are kept playing in
+ * sync (muted), switching to one of them is an unmute instead of a loadfile
+ * every instance decodes its track, so this costs cpu and memory
+ * 0 = a single instance loads every track on switch
+ */
+#define PLAYER_POOL_SIZE            0
+
+/**
+ * max drift in seconds of a pooled instance before it's seeked back in sync
+ */
+#define PLAYER_POOL_DRIFT           0.010
+
+/**
+ * play through the native engine (see engine.h) instead of mpv
+ * "null" discards the audio, anything else is the path of a wav file the
+ * mix is written to
+ * leave undefined to play with mpv
+ */
+/* #define PLAYER_ENGINE_SINK          "null" */
+
+/**
+ * crossfade of the native engine on track switch in msec, 0 = hard switch
+ */
+#define ENGINE_CROSSFADE            5
+
+/**
+ * seconds of audio decoded ahead per track by the native engine
+ */
+#define ENGINE_BUFFER               2.0
+
+/**
+ * measure loudness with the in-tree kernel (see r128.h) instead of libebur128
+ * the kernel is vectorized for the cpu it runs on and gives the same
+ * results within floating point rounding
+ * 0 = libebur128
+ */
+#define ANALYSIS_KERNEL             1
+
+/**
+ * what is measured when tracks are imported, see analysis.h
+ * ANALYSIS_QUICK = integrated loudness and sample peak
+ * ANALYSIS_STANDARD = and the waveform
+ * ANALYSIS_FULL = and true peak, loudness range and maxima
+ * overridden by the --profile option
+ */
+#define ANALYSIS_PROFILE            ANALYSIS_STANDARD
+
+/**
+ * profile tracks are upgraded to in the background once an import
+ * is done, eg quick imports that get a waveform later
+ * ANALYSIS_PROFILE = never analyze again
+ * overridden by the --upgrade option
+ */
+#define ANALYSIS_UPGRADE            ANALYSIS_PROFILE
+
+/**
+ * analyze with a fixed memory ceiling per track, however long it is:
+ * gating blocks are counted in histograms of 0.1 LU (loudness within
+ * 0.05 LU) and long waveforms merge windows, see ANALYSIS_WAVEFORM_MAX
+ * 0 = keep every gating block and window
+ */
+#define ANALYSIS_STREAMING          1
+
+/**
+ * measure wav and aiff pcm straight from a memory mapping of the file
+ * instead of decoding it, only with ANALYSIS_KERNEL
+ * 0 = decode every file
+ */
+#define ANALYSIS_MMAP               1
+
 /**
  * Convert double to duration string
  *
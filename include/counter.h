@@ -36,14 +36,15 @@ typedef struct {
 extern Counter* counter_new(Player* player);
 
 /**
-* update timeline
+* update counter
 *
-* call to notify timeline should update itself
-* new position will be queried from player
+* call to notify counter should update itself
+* the label is only changed when the displayed time differs
 *
-* @param this the timeline object
+* @param this the counter object
+* @param position the position to display in seconds
 */
-extern void counter_update(Counter* this);
+extern void counter_update(Counter* this, gdouble position);
 
 /**
  * Free all resources
@@ -0,0 +1,213 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        engine.h
+ * @brief       native decode and mix playback engine
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "ingest.h"
+#include "sink.h"
+#include "track.h"
+
+/**
+ * number of frames mixed at once
+ */
+#define ENGINE_PERIOD 1024
+
+/**
+ * max number of tracks decoded at the same time
+ */
+#define ENGINE_SOURCES 8
+
+struct Engine;
+
+/**
+ * EngineSource
+ *
+ * one track decoded by its own thread into a ring buffer
+ * frames are addressed by their index in the stream the mixer plays, the
+ * ring holds the frames from the engine cursor up to write_pos
+ * at the end of a loop the decoder continues at the loop start, the
+ * stream goes on so the mixer wraps without waiting for a seek
+ * all members but ring are protected by the engine lock, the ring between
+ * write_pos and the engine cursor is only written by the thread
+ */
+typedef struct EngineSource {
+    struct Engine* engine;  /**< the engine the source belongs to */
+    char* path;             /**< file being decoded */
+    float* ring;            /**< interleaved frames */
+    size_t capacity;        /**< size of ring in frames */
+    uint64_t write_pos;     /**< stream index of the next frame to decode */
+    uint64_t file_pos;      /**< frame of the file decoded at write_pos */
+    int reseek;             /**< decoder must seek to file_pos first */
+    guint epoch;            /**< incremented when write_pos is moved back */
+    guint generation;       /**< engine generation write_pos belongs to */
+    double gain;            /**< linear gain applied by the mixer */
+    int eof;                /**< no frames after write_pos */
+    int failed;             /**< file can't be played, source is silent */
+    int quit;               /**< thread must stop */
+    GThread* thread;        /**< decoder thread */
+} EngineSource;
+
+/**
+ * Engine statistics
+ */
+typedef struct EngineStats {
+    guint64 periods;        /**< periods mixed */
+    guint64 frames;         /**< frames mixed */
+    guint64 underruns;      /**< times the mixer waited for the decoder */
+    guint64 switches;       /**< track switches */
+    gint64 mix_time;        /**< total time spent mixing in usec */
+} EngineStats;
+
+/**
+ * Engine
+ *
+ * all tracks are decoded at the same frame index, switching tracks changes
+ * the source the mixer reads from at a period boundary, with a crossfade of
+ * ENGINE_CROSSFADE msec
+ * the format is taken from the first file that opens, files with another
+ * sample rate or channel count are resampled in their decoder thread
+ */
+typedef struct Engine {
+    Sink* sink;                             /**< audio output */
+    int realtime;                           /**< pace the mixer to the clock */
+    unsigned int sample_rate;               /**< format, 0 until known */
+    unsigned int channels;                  /**< format, 0 until known */
+    EngineSource* sources[ENGINE_SOURCES];  /**< decoded tracks or NULL */
+    EngineSource* active;                   /**< source being played */
+    EngineSource* fade_from;                /**< source faded out or NULL */
+    size_t fade_pos;                        /**< frames of crossfade done */
+    size_t fade_len;                        /**< frames of crossfade */
+    uint64_t position;                      /**< frame of the file mixed next */
+    uint64_t cursor;                        /**< stream index mixed next */
+    uint64_t loop_start;                    /**< loop start frame */
+    uint64_t loop_stop;                     /**< loop stop frame or 0 */
+    double pending_position;                /**< seek in seconds until the
+                                                 format is known */
+    double pending_loop_start;              /**< loop start in seconds until
+                                                 the format is known */
+    double pending_loop_stop;               /**< loop stop in seconds or 0
+                                                 until the format is known */
+    guint generation;                       /**< incremented on every seek */
+    int playing;                            /**< mixer is running */
+    int quit;                               /**< mixer must stop */
+    gint64 clock;                           /**< realtime pacing start or 0 */
+    uint64_t clock_frames;                  /**< frames mixed since clock */
+    GMutex lock;                            /**< protects all members */
+    GCond cond;                             /**< signals frames or state */
+    GThread* thread;                        /**< mixer thread */
+    void (*notify)(void*);                  /**< called on state change */
+    void* notify_data;                      /**< argument of notify */
+    EngineStats stats;                      /**< statistics */
+} Engine;
+
+/**
+ * Constructor
+ *
+ * @param sink SINK_NULL_NAME or the path of a wav file
+ * @param realtime mix at the speed of the sample rate, else as fast as the
+ * decoders go (eg to benchmark or render)
+ * @return the newly created engine or NULL when failed
+ */
+extern Engine* engine_new(const char* sink, int realtime);
+
+/**
+ * Keep a set of tracks decoded
+ *
+ * sources of other tracks are stopped (but not the active one), the new
+ * tracks are decoded from the current position as long as there's room
+ *
+ * @param this the engine object
+ * @param tracks tracks to decode (NULL entries are skipped)
+ * @param n number of tracks
+ */
+extern void engine_prepare(Engine* this, Track** tracks, guint n);
+
+/**
+ * Switch to a track
+ *
+ * the track is decoded first if it wasn't prepared, the mixer waits for it
+ *
+ * @param this the engine object
+ * @param track the track to play
+ * @param gain gain in dB
+ * @return 0 on success or -1 when no source is available
+ */
+extern int engine_select(Engine* this, Track* track, double gain);
+
+/**
+ * Set the gain of the active track
+ *
+ * @param this the engine object
+ * @param gain gain in dB
+ */
+extern void engine_set_gain(Engine* this, double gain);
+
+/**
+ * Start or stop the mixer
+ *
+ * @param this the engine object
+ * @param play TRUE to play
+ */
+extern void engine_play(Engine* this, int play);
+
+/**
+ * @param this the engine object
+ * @return TRUE when playing
+ */
+extern int engine_playing(Engine* this);
+
+/**
+ * Move all tracks to a position
+ *
+ * @param this the engine object
+ * @param position position in seconds
+ */
+extern void engine_seek(Engine* this, double position);
+
+/**
+ * @param this the engine object
+ * @return position of the next frame mixed in seconds
+ */
+extern double engine_get_position(Engine* this);
+
+/**
+ * Loop a region
+ *
+ * @param this the engine object
+ * @param start loop start in seconds
+ * @param stop loop stop in seconds or 0 to cancel the loop
+ */
+extern void engine_set_loop(Engine* this, double start, double stop);
+
+/**
+ * Set the function called when the play state or position changes
+ *
+ * called from the mixer thread at the end of the track
+ *
+ * @param this the engine object
+ * @param notify the callback
+ * @param data argument of notify
+ */
+extern void engine_set_notify(Engine* this, void (*notify)(void*), void* data);
+
+extern void engine_print_stats(Engine* this);
+
+/**
+ * Free all resources
+ *
+ * threads are stopped and the sink is closed
+ *
+ * @param this the engine object
+ */
+extern void engine_free(Engine* this);
+
+#endif
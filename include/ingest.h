@@ -0,0 +1,171 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        ingest.h
+ * @brief       libav audio file reader
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <stddef.h>
+
+/**
+ * Sample type of decoded PCM
+ *
+ * the types of the ebur128_add_frames_* functions, integer samples are
+ * full scale at their type's range
+ */
+typedef enum IngestSample {
+    INGEST_SHORT,           /**< 16 bit integer */
+    INGEST_INT,             /**< 32 bit integer (eg 24 bit pcm and flac) */
+    INGEST_FLOAT,           /**< 32 bit float, -1.0 .. 1.0 */
+    INGEST_DOUBLE,          /**< 64 bit float, -1.0 .. 1.0 */
+} IngestSample;
+
+/**
+ * IngestPcm
+ *
+ * layout of the samples of a memory mapped file, see ingest_map
+ * integers are full scale at their size, 24 bit samples are packed in
+ * 3 bytes
+ */
+typedef struct IngestPcm {
+    const unsigned char* data;  /**< first byte of the first frame */
+    size_t frames;              /**< number of frames */
+    unsigned int bytes;         /**< bytes per sample: 2, 3, 4 or 8 */
+    int floating;               /**< ieee float instead of integer */
+    int big_endian;             /**< byte order of the samples */
+} IngestPcm;
+
+/**
+ * Ingest
+ *
+ * streaming reader for any audio file libavformat can open
+ * tags, duration, sample rate and decoded PCM all come from one open file
+ */
+typedef struct Ingest {
+    AVFormatContext* format;    /**< demuxer */
+    AVCodecContext* codec;      /**< decoder or NULL when opened for probing */
+    AVPacket* packet;           /**< packet being decoded */
+    AVFrame* frame;             /**< last decoded frame */
+    int stream;                 /**< index of the audio stream */
+    int frame_pos;              /**< samples of frame already returned */
+    int eof;                    /**< demuxer reached end of file */
+    unsigned int channels;      /**< number of channels */
+    unsigned int sample_rate;   /**< sample rate in Hz */
+    double duration;            /**< duration in seconds as told by container */
+    IngestSample sample;        /**< type the decoder produces without loss */
+    void* map;                  /**< mapping of the file or NULL */
+    size_t map_size;            /**< size of map in bytes */
+    IngestPcm pcm;              /**< samples in map */
+} Ingest;
+
+/**
+ * Constructor
+ *
+ * open a file and find the best audio stream
+ * when decode is not set, only the header is read which is enough for
+ * tags, duration, channels and sample rate
+ *
+ * @param path absolute path of the file
+ * @param decode open the decoder so samples can be read
+ * @return the newly created ingest object or NULL when failed
+ */
+extern Ingest* ingest_open(const char* path, int decode);
+
+/**
+ * Get a metadata tag
+ *
+ * container tags are searched first, then the audio stream tags
+ * (eg vorbis comments in ogg)
+ *
+ * @param this the ingest object
+ * @param key tag name, case insensitive
+ * @return tag value owned by ingest or NULL when not present
+ */
+extern const char* ingest_tag(Ingest* this, const char* key);
+
+/**
+ * Read decoded samples
+ *
+ * samples are converted to interleaved samples of type sample, reading
+ * this->sample moves the least bytes and doesn't lose precision
+ * a short read only happens at the end of the file
+ *
+ * @param this the ingest object
+ * @param buffer destination, must hold frames * channels samples
+ * @param frames number of frames to read
+ * @param sample sample type of buffer
+ * @return number of frames read, 0 at end of file or on error
+ */
+extern size_t ingest_read(Ingest* this, void* buffer, size_t frames,
+IngestSample sample);
+
+/**
+ * Read decoded samples as doubles, see ingest_read
+ *
+ * @param this the ingest object
+ * @param buffer destination, must hold frames * channels doubles
+ * @param frames number of frames to read
+ * @return number of frames read, 0 at end of file or on error
+ */
+extern size_t ingest_read_double(Ingest* this, double* buffer, size_t frames);
+
+/**
+ * Map the samples of an uncompressed file into memory
+ *
+ * only wav and aiff files of 16, 24 or 32 bit integer or 32 or 64 bit
+ * float pcm are mapped, their samples can then be measured where they are
+ * instead of being decoded and copied
+ * the mapping is advised to be read sequentially, see ingest_willneed
+ *
+ * @param this the ingest object, opened with decode
+ * @return layout of the samples, owned by ingest, or NULL when the file
+ * can't be mapped
+ */
+extern const IngestPcm* ingest_map(Ingest* this);
+
+/**
+ * Ask the kernel to read ahead mapped samples
+ *
+ * @param this the ingest object, mapped by ingest_map
+ * @param frame first frame to read
+ * @param frames number of frames, clipped to the end of the samples
+ */
+extern void ingest_willneed(Ingest* this, size_t frame, size_t frames);
+
+/**
+ * @param sample a sample type
+ * @return size of one sample in bytes
+ */
+extern size_t ingest_sample_size(IngestSample sample);
+
+/**
+ * Seek to a sample position
+ *
+ * the demuxer seeks to a keyframe before the position and the decoded
+ * samples up to the position are discarded, so the next read starts at
+ * exactly this sample for formats with accurate timestamps (eg pcm, flac)
+ * when the first frame decoded after the seek already starts past the
+ * position, the next read starts there instead, see landed
+ *
+ * @param this the ingest object
+ * @param frame position in frames from the start of the stream
+ * @param landed destination of the position the next read starts at or
+ * NULL
+ * @return 0 on success or -1 when failed
+ */
+extern int ingest_seek(Ingest* this, size_t frame, size_t* landed);
+
+/**
+ * Close the file and free all resources
+ *
+ * @param this the ingest object
+ */
+extern void ingest_close(Ingest* this);
+
+#endif
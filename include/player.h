@@ -9,6 +9,7 @@
 #ifndef PLAYER_H
 #define PLAYER_H
 
+#include "../include/engine.h"
 #include "../include/track.h"
 
 #include <mpv/client.h>
@@ -19,10 +20,76 @@ typedef enum PlayState {
     PLAY_STATE_PAUSE,
 } PlayState;
 
+/**
+ * Observed mpv properties
+ *
+ * used as reply_userdata of mpv_observe_property so property events are
+ * dispatched without comparing names, 0 is used by commands
+ */
+typedef enum PlayerProperty {
+    PLAYER_PROPERTY_NONE,
+    PLAYER_PROPERTY_CORE_IDLE,
+    PLAYER_PROPERTY_TIME_POS,
+    PLAYER_PROPERTY_LENGTH,
+    PLAYER_PROPERTY_SPEED,
+    PLAYER_PROPERTY_PAUSE,
+} PlayerProperty;
+
+/**
+ * State of a track switch
+ */
+typedef enum PlayerSwitch {
+    PLAYER_SWITCH_IDLE,         /**< no loadfile in flight */
+    PLAYER_SWITCH_COMMAND,      /**< loadfile sent, waiting for its reply */
+    PLAYER_SWITCH_OPENING,      /**< file is being opened and seeked */
+} PlayerSwitch;
+
+/**
+ * Event dispatch statistics
+ */
+typedef struct PlayerStats {
+    guint64 events;             /**< events handled */
+    guint64 drains;             /**< calls to player_event_handler */
+    gint64 drain_time;          /**< total time spent draining in usec */
+    gint64 drain_max;           /**< longest drain in usec */
+    gint64 window_start;        /**< start of the events per second window */
+    guint64 window_events;      /**< events handled in the window */
+    double events_per_sec;      /**< events per second of the last window */
+    guint64 switches;           /**< track switches completed */
+    guint64 switch_requests;    /**< calls to player_load_track */
+    guint64 switch_aborts;      /**< loadfile commands aborted */
+    gint64 switch_last;         /**< latency of the last switch in usec */
+    gint64 switch_total;        /**< total latency of all switches in usec */
+    gint64 switch_max;          /**< longest switch latency in usec */
+    guint64 switch_warm;        /**< switches to a pre-loaded instance */
+    guint64 syncs;              /**< seeks to keep the pool in sync */
+    gint64 restart_time;        /**< when playback last (re)started */
+    gint64 time_pos_time;       /**< when time-pos was last reported */
+    double time_pos;            /**< last reported time-pos */
+} PlayerStats;
+
+/**
+ * Pooled mpv instance
+ *
+ * see PLAYER_POOL_SIZE, only the active slot is audible, the others play
+ * their track muted at the position of the active slot
+ */
+typedef struct PlayerSlot {
+    mpv_handle* mpv;            /**< the mpv instance */
+    gchar* path;                /**< file loaded in the instance or NULL */
+    int loaded;                 /**< file is opened and can be unmuted */
+    int seeking;                /**< a sync seek is in flight */
+    double position;            /**< last time-pos of the instance */
+    gint64 position_time;       /**< when position was reported */
+    gint64 seek_time;           /**< when the last sync seek was sent */
+    gint64 lag;                 /**< time the last sync seek took in usec */
+} PlayerSlot;
+
 typedef struct Player {
     mpv_handle* mpv;
     Track* current;
     double position;
+    gint64 position_time;
     double loop_start;
     double loop_stop;
     double marker;
@@ -30,10 +97,29 @@ typedef struct Player {
     int rtn;
     double speed;
     double min_lufs;
+    gint dispatch_pending;
+    int switch_pending;
+    int switch_continue;
+    double switch_position;
+    gint64 switch_time;
+    guint switch_idle;
+    PlayerSwitch switch_state;
+    uint64_t load_tag;
+    uint64_t load_next_tag;
+    gint64 load_time;
+    PlayerSlot* slots;
+    guint n_slots;
+    guint active;
+    Engine* engine;
+    guint n_prepare;
+    void (*event_callback)(void*);
+    PlayerStats stats;
 } Player;
 
 extern void player_set_gain(Player* this, double gain);
 
+extern void player_update_gain(Player* this);
+
 extern void player_set_speed(Player* this, double speed);
 
 extern void player_stop(Player* this);
@@ -50,16 +136,92 @@ extern void player_mark(Player* this);
 
 extern void player_goto(Player* this, double position);
 
+/**
+ * Get the playing position now
+ *
+ * answered by the position model, mpv is not queried
+ * see player_get_position_at
+ *
+ * @param this the player object
+ * @return position in seconds
+ */
 extern double player_get_position(Player* this);
 
+/**
+ * Get the playing position at a given time
+ *
+ * the player keeps a model of the position: the last time-pos reported
+ * by mpv (or requested by a seek), the monotonic time it was valid at,
+ * the speed and the play state
+ * while playing, the position is extrapolated from there
+ *
+ * @param this the player object
+ * @param time monotonic time in usec, eg g_get_monotonic_time
+ * @return position in seconds
+ */
+extern double player_get_position_at(Player* this, gint64 time);
+
+/**
+ * Switch to a track
+ *
+ * the track becomes the current track immediately but it's loaded by mpv
+ * from an idle source, requests made before that are coalesced and only
+ * the last one is loaded
+ * while a loadfile is in flight, its command is aborted and the latest
+ * request is loaded when mpv is done with the previous one
+ *
+ * @param this the player object
+ * @param track the track to play
+ */
 extern void player_load_track(Player* this, Track* track);
 
+/**
+ * Pre-load tracks in the pool
+ *
+ * the tracks that are not loaded yet replace the tracks of the inactive
+ * instances (or engine sources) that are not in the list, tracks that don't
+ * fit are ignored so the most likely switches should come first
+ * n_prepare is the number of tracks that can be kept loaded, 0 when the
+ * pool is disabled (see PLAYER_POOL_SIZE) and the engine is not used
+ *
+ * @param this the player object
+ * @param tracks the tracks to keep loaded (NULL entries are skipped)
+ * @param n number of tracks
+ */
+extern void player_prepare(Player* this, Track** tracks, guint n);
+
 extern int player_event_handler(Player* this);
 
 extern void player_set_event_callback(Player* this, void(*event_callback)(void*));
 
+/**
+ * Set an mpv option of all instances
+ *
+ * eg "ao" to "null" to play headless
+ *
+ * @param this the player object
+ * @param name the option
+ * @param value the value as a string
+ * @return 0 on success or -1 when failed
+ */
+extern int player_set_option(Player* this, const char* name, const char* value);
+
 extern Player* player_init(void);
 
+/**
+ * Constructor of a player that plays through the native engine
+ *
+ * mpv is not used, the same player functions control the engine
+ * see engine.h
+ *
+ * @param sink SINK_NULL_NAME or the path of a wav file
+ * @param realtime play at normal speed, else as fast as possible
+ * @return the newly created player or NULL when failed
+ */
+extern Player* player_init_engine(const char* sink, int realtime);
+
+extern void player_print_stats(Player* this);
+
 extern void player_free(Player* this);
 
 #endif
@@ -0,0 +1,278 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        r128.h
+ * @brief       ebu r128 loudness kernel
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef R128_H
+#define R128_H
+
+#include <stddef.h>
+
+/**
+ * mode flag of r128_new, measure the true peak (oversampled)
+ */
+#define R128_TRUE_PEAK 1
+
+/**
+ * mode flag of r128_new, keep the short-term windows for the loudness range,
+ * see r128_loudness_range_multiple
+ */
+#define R128_RANGE 2
+
+/**
+ * mode flag of r128_new, count gating blocks and short-term windows in a
+ * histogram of 0.1 LU bins instead of keeping them, memory stays the same
+ * however long the stream is (like EBUR128_MODE_HISTOGRAM)
+ */
+#define R128_HISTOGRAM 4
+
+/**
+ * bins of the histograms, 0.1 LU each from -70 to +30 LUFS
+ */
+#define R128_BINS 1000
+
+/**
+ * 100ms steps of a short-term window
+ */
+#define R128_SHORT_TERM 30
+
+/**
+ * Instruction sets of the kernels, in order of preference
+ */
+typedef enum R128Isa {
+    R128_SCALAR,            /**< plain c */
+    R128_SSE2,              /**< 2 doubles per instruction */
+    R128_AVX2,              /**< 4 doubles per instruction */
+} R128Isa;
+
+struct R128;
+
+/**
+ * K-weighting filter of a chunk
+ *
+ * @param this the r128 object
+ * @param src interleaved samples
+ * @param frames number of frames
+ * @param energy destination of the weighted energy of every frame
+ */
+typedef void (*R128Filter)(struct R128* this, const double* src, size_t frames,
+double* energy);
+
+/**
+ * True peak of a chunk
+ *
+ * @param this the r128 object
+ * @param src interleaved samples
+ * @param frames number of frames
+ */
+typedef void (*R128Peak)(struct R128* this, const double* src, size_t frames);
+
+/**
+ * R128
+ *
+ * integrated loudness, short windows, sample and true peak of one stream,
+ * computed like libebur128 does with its default channel map:
+ *  - K-weighting as one 4th order filter per channel
+ *  - the weighted energy of every frame is kept for 400ms (or more) for
+ *    the windows of r128_loudness_window
+ *  - the energy sum of every 100ms is kept for 3s, a gating block and a
+ *    short-term window are summed from it every 100ms
+ *  - blocks under the absolute gate are dropped, the others are kept or
+ *    counted in a histogram (R128_HISTOGRAM), so are the short-term windows
+ *    of every second for the loudness range (R128_RANGE)
+ *  - true peak by 4x (2x from 96 kHz, none from 192 kHz) oversampling
+ *    with the same 49 tap interpolator
+ *
+ * the filters are specialized for mono, stereo and 5.1, and vectorized
+ * across channels (the filter) or phases (the interpolator) with SSE2 or
+ * AVX2, selected at runtime
+ */
+typedef struct R128 {
+    unsigned int channels;      /**< number of channels */
+    unsigned int sample_rate;   /**< sample rate in Hz */
+    int mode;                   /**< R128_TRUE_PEAK | R128_RANGE | ... or 0 */
+    R128Isa isa;                /**< instruction set of the kernels */
+    double b[5];                /**< K-weighting numerator */
+    double a[5];                /**< K-weighting denominator, a[0] is 1 */
+    double* weights;            /**< weight per channel, 0 when unused (LFE) */
+    double* state;              /**< filter state v1..v4, [k * channels + c] */
+    double* scratch;            /**< chunk of input converted to double */
+    double* energy;             /**< ring of the weighted energy per frame */
+    size_t ring_frames;         /**< size of energy */
+    size_t ring_pos;            /**< index of the next frame in energy */
+    size_t block_frames;        /**< frames per 100ms */
+    size_t needed;              /**< frames until the next 100ms */
+    double sums[R128_SHORT_TERM]; /**< energy sum of the last 100ms steps */
+    size_t step;                /**< 100ms steps since the start of the stream */
+    size_t first;               /**< step of the first frame added */
+    size_t start;               /**< step of the first frame measured */
+    double* blocks;             /**< gating blocks above the absolute gate */
+    size_t n_blocks;            /**< number of blocks */
+    size_t blocks_capacity;     /**< allocated size of blocks */
+    double* short_term;         /**< short-term windows above the absolute gate */
+    size_t n_short_term;        /**< number of short-term windows */
+    size_t short_term_capacity; /**< allocated size of short_term */
+    unsigned long* block_bins;  /**< histogram of the gating blocks */
+    unsigned long* short_term_bins; /**< histogram of the short-term windows */
+    double momentary_max;       /**< highest energy of a gating block */
+    double short_term_max;      /**< highest energy of a short-term window */
+    double* sample_peak;        /**< sample peak per channel */
+    double* true_peak;          /**< true peak per channel */
+    unsigned int factor;        /**< oversampling factor, 1 for none */
+    unsigned int delay;         /**< interpolator taps per phase */
+    double* coeff;              /**< interpolator, [k * factor + phase] */
+    double* taps;               /**< last delay samples twice, per channel */
+    size_t taps_pos;            /**< index of the next sample in taps */
+    R128Filter filter;          /**< K-weighting kernel */
+    R128Peak peak;              /**< true peak kernel */
+} R128;
+
+/**
+ * Constructor
+ *
+ * @param channels number of channels
+ * @param sample_rate sample rate in Hz
+ * @param mode R128_TRUE_PEAK, R128_RANGE, R128_HISTOGRAM or 0 for only the
+ * integrated loudness, windows, maxima and sample peak
+ * @return the newly created r128 object or NULL when failed
+ */
+extern R128* r128_new(unsigned int channels, unsigned int sample_rate, int mode);
+
+/**
+ * Set where the frames that will be added start in the stream
+ *
+ * meant for streams measured in segments: the frames before a segment are
+ * added as pre-roll, only the blocks and windows that end after it are
+ * counted, and the short-term windows of the loudness range are taken
+ * every second of the whole stream
+ * must be called before frames are added, both positions are rounded down
+ * to 100ms
+ *
+ * @param this the r128 object
+ * @param frame position of the first frame in the stream
+ * @param preroll frames that only fill the windows
+ */
+extern void r128_set_origin(R128* this, size_t frame, size_t preroll);
+
+/**
+ * Add interleaved frames
+ *
+ * integers are scaled like libebur128 does, full scale is 32768 or 2^31
+ *
+ * @param this the r128 object
+ * @param src interleaved samples
+ * @param frames number of frames
+ */
+extern void r128_add_frames_short(R128* this, const short* src, size_t frames);
+extern void r128_add_frames_int(R128* this, const int* src, size_t frames);
+extern void r128_add_frames_float(R128* this, const float* src, size_t frames);
+extern void r128_add_frames_double(R128* this, const double* src, size_t frames);
+
+/**
+ * Add interleaved frames of packed pcm as stored in a file
+ *
+ * the samples are converted while they're read, meant for memory mapped
+ * wav and aiff files, integers are scaled like r128_add_frames_int
+ *
+ * @param this the r128 object
+ * @param src interleaved samples
+ * @param frames number of frames
+ * @param bytes bytes per sample: 2, 3 or 4 for integers, 4 or 8 for floats
+ * @param floating ieee float instead of integer
+ * @param big_endian byte order of the samples
+ */
+extern void r128_add_frames_pcm(R128* this, const void* src, size_t frames,
+unsigned int bytes, int floating, int big_endian);
+
+/**
+ * Loudness of the last frames
+ *
+ * @param this the r128 object
+ * @param window length in msec, at most 400
+ * @param out loudness in LUFS, -HUGE_VAL for silence
+ * @return 0 on success or -1 when the window is too long
+ */
+extern int r128_loudness_window(R128* this, unsigned long window, double* out);
+
+/**
+ * Integrated loudness of several streams, as if they were one
+ *
+ * @param states r128 objects
+ * @param n number of objects
+ * @param out loudness in LUFS, -HUGE_VAL when all blocks are gated
+ */
+extern void r128_loudness_global_multiple(R128** states, size_t n, double* out);
+
+/**
+ * Loudness range of several streams, like libebur128 calculates it
+ *
+ * short-term windows every second, gated at -70 LUFS and 20 LU under
+ * their average, range between the 10th and 95th percentile
+ *
+ * @param states r128 objects created with R128_RANGE, all with or all
+ * without R128_HISTOGRAM
+ * @param n number of objects
+ * @param out loudness range in LU, 0 when there's nothing above the gates
+ * @return 0 on success or -1 when the windows weren't kept
+ */
+extern int r128_loudness_range_multiple(R128** states, size_t n, double* out);
+
+/**
+ * @param this the r128 object
+ * @return highest momentary loudness in LUFS, -HUGE_VAL for silence
+ */
+extern double r128_momentary_max(R128* this);
+
+/**
+ * @param this the r128 object
+ * @return highest short-term loudness in LUFS, -HUGE_VAL for silence or
+ * less than 3s
+ */
+extern double r128_short_term_max(R128* this);
+
+/**
+ * @param this the r128 object
+ * @param channel channel index
+ * @return sample peak of the channel, linear
+ */
+extern double r128_sample_peak(R128* this, unsigned int channel);
+
+/**
+ * @param this the r128 object
+ * @param channel channel index
+ * @return true peak of the channel, linear, at least the sample peak
+ */
+extern double r128_true_peak(R128* this, unsigned int channel);
+
+/**
+ * Limit the instruction set of r128 objects created after this call
+ *
+ * meant to compare kernels, the best supported set is used by default
+ *
+ * @param isa the best instruction set to use
+ */
+extern void r128_set_isa(R128Isa isa);
+
+/**
+ * @return the instruction set new r128 objects use, the best this cpu
+ * supports limited by r128_set_isa
+ */
+extern R128Isa r128_get_isa(void);
+
+/**
+ * @param isa an instruction set
+ * @return its name
+ */
+extern const char* r128_isa_name(R128Isa isa);
+
+/**
+ * Free all resources
+ *
+ * @param this the r128 object
+ */
+extern void r128_free(R128* this);
+
+#endif
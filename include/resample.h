@@ -0,0 +1,100 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        resample.h
+ * @brief       sample rate and channel conversion of decoded files
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ingest.h"
+
+/**
+ * taps of the interpolation filter, input frames per output frame
+ */
+#define RESAMPLE_TAPS 32
+
+/**
+ * phases of the filter table, the filter between two phases is
+ * interpolated
+ */
+#define RESAMPLE_PHASES 256
+
+/**
+ * input frames read from the file at once
+ */
+#define RESAMPLE_CHUNK 1024
+
+/**
+ * Resample
+ *
+ * reads an ingest object at another sample rate and channel count
+ * output frame k is the input at time k * in_rate / out_rate exactly, so a
+ * resampled file stays at the same time as the others, the filter is a
+ * blackman windowed sinc with its cutoff at the lowest nyquist frequency
+ * channels: mono is copied to every channel, everything is averaged to
+ * mono, otherwise the first channels are copied and the others silent
+ */
+typedef struct Resample {
+    Ingest* ingest;             /**< the file, owned by the caller */
+    unsigned int in_rate;       /**< sample rate of the file */
+    unsigned int out_rate;      /**< sample rate of the output */
+    unsigned int in_channels;   /**< channels of the file */
+    unsigned int out_channels;  /**< channels of the output */
+    float* table;               /**< filter per phase, [phase * TAPS + tap] */
+    float* scratch;             /**< chunk read from the file */
+    float* input;               /**< input frames in out_channels */
+    size_t input_len;           /**< frames in input */
+    size_t input_capacity;      /**< allocated frames of input */
+    int64_t input_first;        /**< input frame of input[0], < 0 before
+                                     the start of the file */
+    uint64_t position;          /**< output frame read next */
+    int eof;                    /**< the file has no frames after end */
+    int64_t end;                /**< input frame after the last, at eof */
+} Resample;
+
+/**
+ * Constructor
+ *
+ * the file must be at its start, the output starts at frame 0
+ *
+ * @param ingest the file, opened with decode
+ * @param sample_rate sample rate of the output
+ * @param channels channels of the output
+ * @return the newly created resample object or NULL when failed
+ */
+extern Resample* resample_new(Ingest* ingest, unsigned int sample_rate,
+unsigned int channels);
+
+/**
+ * Seek to an output frame
+ *
+ * @param this the resample object
+ * @param frame output frame
+ * @return 0 on success or -1 when the file failed to seek
+ */
+extern int resample_seek(Resample* this, uint64_t frame);
+
+/**
+ * Read output frames
+ *
+ * @param this the resample object
+ * @param dest destination, must hold frames * out_channels floats
+ * @param frames number of frames
+ * @return number of frames read, less only at the end of the file
+ */
+extern size_t resample_read(Resample* this, float* dest, size_t frames);
+
+/**
+ * Free all resources, the ingest object is not closed
+ *
+ * @param this the resample object
+ */
+extern void resample_free(Resample* this);
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        sink.h
+ * @brief       audio output of the playback engine
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Name of the sink that discards all audio
+ */
+#define SINK_NULL_NAME "null"
+
+typedef enum SinkType {
+    SINK_NULL,              /**< audio is discarded */
+    SINK_WAV,               /**< audio is written to a 32 bit float wav file */
+} SinkType;
+
+/**
+ * Sink
+ *
+ * receives interleaved float frames from the mixer
+ */
+typedef struct Sink {
+    SinkType type;          /**< kind of output */
+    char* path;             /**< wav file or NULL */
+    FILE* file;             /**< opened wav file or NULL */
+    unsigned int sample_rate;
+    unsigned int channels;
+    uint64_t frames;        /**< number of frames written */
+} Sink;
+
+/**
+ * Constructor
+ *
+ * the output is only opened by sink_open, once the format is known
+ *
+ * @param name SINK_NULL_NAME or the path of a wav file
+ * @return the newly created sink or NULL when failed
+ */
+extern Sink* sink_new(const char* name);
+
+/**
+ * Open the output
+ *
+ * @param this the sink object
+ * @param sample_rate frames per second
+ * @param channels number of channels per frame
+ * @return 0 on success or -1 when failed
+ */
+extern int sink_open(Sink* this, unsigned int sample_rate, unsigned int channels);
+
+/**
+ * Write frames
+ *
+ * @param this the sink object
+ * @param frames interleaved samples, count * channels floats
+ * @param count number of frames
+ * @return 0 on success or -1 when failed
+ */
+extern int sink_write(Sink* this, const float* frames, size_t count);
+
+/**
+ * Free all resources
+ *
+ * the wav header is completed with the number of frames written
+ *
+ * @param this the sink object
+ */
+extern void sink_free(Sink* this);
+
+#endif
@@ -21,6 +21,18 @@ typedef struct {
     GdkRGBA marker;
     GdkRGBA wave;
     GtkImage* image;
+    GtkWidget* darea;                   /**< drawing area */
+    cairo_surface_t* surface;           /**< rendered waveform or NULL */
+    Track* surface_track;               /**< track rendered in surface */
+    Waveform* surface_pyramid;          /**< waveform rendered in surface */
+    gdouble surface_lufs;               /**< loudness rendered in surface */
+    gint surface_w;                     /**< width of surface */
+    gint surface_h;                     /**< height of surface */
+    gdouble playhead;                   /**< position to draw the cursor at */
+    gdouble cursor;                     /**< drawn cursor x or -1.0 */
+    gdouble loop_start;                 /**< drawn loop start */
+    gdouble loop_stop;                  /**< drawn loop stop */
+    gdouble mark;                       /**< drawn marker */
 } Timeline;
 
 /**
@@ -38,8 +50,9 @@ extern Timeline* timeline_new(Player* player);
 *
 * call to notify timeline should update itself
 * @param this the timeline object
+* @param position the position of the playhead in seconds
 */
-extern void timeline_update(Timeline* this);
+extern void timeline_update(Timeline* this, gdouble position);
 
 /**
  * Free all resources
@@ -10,6 +10,7 @@
 #define TRACK_H
 
 #include "config.h"
+#include "waveform.h"
 
 /**
  * Waveform loudness scanning time window
@@ -19,25 +20,55 @@
  */
 #define TIME_WINDOW 200UL
 
+/**
+ * TrackArena
+ *
+ * owner of the strings of tracks, they are freed all at once
+ * path and name are copied, strings that repeat across tracks (artist,
+ * album and date) are stored once
+ * the copies of freed tracks and replaced names stay in the chunk until
+ * the arena is compacted
+ * tracks are probed by worker threads, inserting is locked
+ */
+typedef struct TrackArena {
+    GStringChunk* chunk;    /**< storage of all strings */
+    GHashTable* interned;   /**< repeated strings in chunk */
+    GMutex lock;            /**< protects all members */
+    gsize strings;          /**< number of strings inserted */
+    gsize requested;        /**< bytes inserted, with terminators */
+    gsize stored;           /**< bytes stored in chunk */
+    gsize released;         /**< bytes stored of copies no track uses */
+} TrackArena;
+
 /**
  * Track
  *
  * represents an audio file on disk
  */
 typedef struct Track {
-    char* name;             /**< file basename or TITLE/NAME tag */
-    char* path;             /**< file absolute path */
+    TrackArena* arena;      /**< owner of the strings */
+    int owns_arena;         /**< arena was created for this track only */
+    const char* name;       /**< file basename or TITLE/NAME tag */
+    const char* path;       /**< file absolute path */
     double length;          /**< estimated length (samplerate * samples */
     int offset;             /**< TODO: auto*align */
     double lufs;            /**< averge loudness level as calculated by r128 */
-    double peak;            /**< true peak level */
-    char* artist;           /**< ARTIST tag if present or NULL */
-    char* album;            /**< ALBUM tag if present or NULL */
-    char* date;             /**< DATE tag if present or NULL */
-    char* format;           /**< TODO: audio file format eg flac, mp3, wav */
-    char* sample_rate;      /**< sample rate eg 44100 96000 */
-    double* waveform;       /**< */
-    size_t waveform_len;    /**< */
+    double peak;            /**< sample peak level of the first channel */
+    double true_peak;       /**< true peak of all channels or NAN */
+    double lra;             /**< loudness range in LU or NAN */
+    double momentary_max;   /**< highest momentary loudness or NAN */
+    double short_term_max;  /**< highest short-term loudness or NAN */
+    const char* artist;     /**< ARTIST tag if present or NULL */
+    const char* album;      /**< ALBUM tag if present or NULL */
+    const char* date;       /**< DATE tag if present or NULL */
+    const char* format;     /**< TODO: audio file format eg flac, mp3, wav */
+    unsigned int sample_rate; /**< sample rate in Hz or 0 when unknown */
+    WaveformValue* waveform; /**< loudness per waveform_window, quantized */
+    size_t waveform_len;    /**< number of waveform values */
+    unsigned long waveform_window; /**< msec per value, TIME_WINDOW * 2^n */
+    Waveform* pyramid;      /**< waveform at every zoom level for drawing */
+    int analyzed;           /**< the results of profile are valid */
+    int profile;            /**< AnalysisProfile the track was analyzed with */
 } Track;
 
 /**
@@ -46,11 +77,54 @@ typedef struct Track {
  * create new track based on path and name
  * name will be overwritten by the file TITLE or NAME tag of it exists
  *
+ * @param arena owner of the strings or NULL for a track on its own
+ * @param path absolute path of the file
+ * @param name displayed name of the file
+ * @param profile AnalysisProfile, what to measure
+ * @param cancel stop analyzing when set to non-zero or NULL
+ * @return the newly created Track or NULL when failed or cancelled
+ */
+extern Track* track_new(TrackArena* arena, const char* name, const char* path,
+int profile, const int* cancel);
+
+/**
+ * Constructor without analysis
+ *
+ * create new track and read the file tags but do not decode the file
+ * loudness, peak, length and waveform are left empty until track_analyze
+ * is called or the values are restored from cache
+ *
+ * @param arena owner of the strings or NULL for a track on its own
  * @param path absolute path of the file
  * @param name displayed name of the file
  * @return the newly created Track or NULL when failed
  */
-extern Track* track_new(const char* name, const char* path);
+extern Track* track_probe(TrackArena* arena, const char* name, const char* path);
+
+/**
+ * Decode the file and calculate loudness, peak, length and waveform
+ *
+ * decoding stops within one TIME_WINDOW when cancel is set (atomically)
+ * by another thread
+ *
+ * @param this the track object
+ * @param profile AnalysisProfile, what to measure
+ * @param cancel stop decoding when set to non-zero or NULL
+ * @return 0 on success or -1 when the file could not be decoded or cancelled
+ */
+extern int track_analyze(Track* this, int profile, const int* cancel);
+
+/**
+ * Take over the analysis results of another track
+ *
+ * loudness, peak, length, sample rate, waveform and the measurements of
+ * the profile are moved from src
+ * name, path and tags of this track are kept
+ *
+ * @param this the track object
+ * @param src an analyzed track of the same file, its waveform is taken over
+ */
+extern void track_set_analysis(Track* this, Track* src);
 
 /**
  * Print all track properties
@@ -61,8 +135,47 @@ extern void track_print(Track* this);
 /**
  * Free all resources
  *
+ * the strings are freed with the arena, unless the track has its own
+ *
  * @param this the track object
  */
 extern void track_free(Track* this);
 
+/**
+ * Constructor
+ *
+ * @return the newly created arena or NULL when failed
+ */
+extern TrackArena* track_arena_new(void);
+
+/**
+ * Free an arena and all strings in it
+ *
+ * the tracks using it must be freed first, or at least not used anymore
+ *
+ * @param this the arena or NULL
+ */
+extern void track_arena_free(TrackArena* this);
+
+/**
+ * Check whether an arena is worth compacting
+ *
+ * @param this the arena
+ * @return TRUE when more than half of the stored bytes are released
+ */
+extern int track_arena_fragmented(TrackArena* this);
+
+/**
+ * Copy the strings in use into a new chunk and free the old one
+ *
+ * the strings of the tracks are replaced by their new copies, no other
+ * thread may insert into the arena or use the strings of the tracks meanwhile
+ *
+ * @param this the arena
+ * @param tracks all tracks with strings in the arena
+ * @param n number of tracks
+ * @return 0 on success or -1 when failed, the arena is unchanged then
+ */
+extern int track_arena_compact(TrackArena* this, Track** tracks, size_t n);
+
 #endif
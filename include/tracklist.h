@@ -11,6 +11,7 @@
 
 #include <gtk/gtk.h>
 
+#include "cache.h"
 #include "player.h"
 
 /**
@@ -47,7 +48,23 @@ typedef struct {
     GtkTreeView* tree;          /**< gui widget (file-manager-like) */
     Player* player;             /**< reference to the player object */
     gdouble min_lufs;           /**< min val of all track.lugfs */
-    GThreadPool* load_thread;   /**< thread pool for loading tracks */
+    GThreadPool* load_thread;   /**< thread pool for probing files */
+    GThreadPool* analyze_thread;/**< thread pool for analyzing tracks */
+    GQueue load_jobs;           /**< undelivered load jobs, in order of push */
+    GQueue analyze_jobs;        /**< undelivered analysis jobs, main loop only */
+    GQueue analyze_done;        /**< analyzed jobs waiting for delivery */
+    GMutex load_lock;           /**< guards finished jobs and load_idle */
+    guint load_idle;            /**< idle source delivering finished jobs */
+    gint closing;               /**< no idle sources are added when set */
+    guint load_pending;         /**< files not in the list yet */
+    guint analyze_pending;      /**< tracks in the list waiting for analysis */
+    guint analyze_total;        /**< tracks queued since the queue was empty */
+    GtkProgressBar* progress;   /**< import progress, hidden when idle */
+    Cache* cache;               /**< analysis cache or NULL when unavailable */
+    TrackArena* arena;          /**< strings of the tracks, see track_arena_new */
+    int profile;                /**< AnalysisProfile of imported tracks */
+    int upgrade;                /**< AnalysisProfile tracks get when idle */
+    gboolean upgrade_pending;   /**< tracks were imported since the upgrade */
 } Tracklist;
 
 /**
@@ -65,6 +82,8 @@ extern Tracklist* tracklist_new(Player* player);
 /**
  * Generate the gui elements of the tree
  *
+ * this also creates the progress bar, which is not packed in the tree
+ *
  * @param this tracklist object
  */
 extern void tracklist_init(Tracklist* this);
@@ -73,6 +92,8 @@ extern void tracklist_init(Tracklist* this);
  * Add a track to the tracklist
  *
  * insert track after TreePath or append to the list (NULL)
+ * tracks that are not analyzed yet are queued for analysis, the loudness
+ * and peak columns are filled in when the results arrive
  *
  * all Tracks will be free-ed by tracklist
  * @param this tracklist object
@@ -104,6 +125,7 @@ extern void tracklist_append_file(Tracklist* this, GFile* file);
  * track will be inserted in the list before or after (pos) given row (path)
  * set path to NULL to append
  * file will be free-ed when async loader has finished
+ * path is not taken over and can be free-ed by the caller
  *
  * @param this tracklist object
  * @param file file to be added
@@ -112,9 +134,25 @@ extern void tracklist_append_file(Tracklist* this, GFile* file);
  */
 extern void tracklist_insert_file(Tracklist* this, GFile* file, GtkTreePath* path, GtkTreeViewDropPosition pos);
 
+/**
+ * Insert multiple files as tracks to the tracklist
+ *
+ * like tracklist_insert_file but all files keep the order of the array
+ * in the list, no matter which file finishes loading first
+ *
+ * @param this tracklist object
+ * @param files files to be added
+ * @param n number of files
+ * @param path new tracks will be inserted before or after path
+ * @param pos insert before (GTK_TREE_VIEW_DROP_POSITION_BEFORE) or (..._AFTER)
+ */
+extern void tracklist_insert_files(Tracklist* this, GFile** files, gint n, GtkTreePath* path, GtkTreeViewDropPosition pos);
+
 /**
  * Remove the currently selected (in treeview) row
  *
+ * analysis of the track is cancelled if it's still running
+ *
  * @param this tracklist object
  */
 extern void tracklist_remove_selected(Tracklist* this);
@@ -123,12 +161,17 @@ extern void tracklist_remove_selected(Tracklist* this);
  * Create a new track from file
  *
  * tracklist_add_file calls this function in a threadpool
+ * only the header is read, the analysis results are restored from cache
+ * when available, otherwise the track is not analyzed (.analyzed not set)
  * return track free-ed by tracklist_free or track_free
+ * file is not unreffed
  *
  * @param file the file used to create a track
+ * @param size return location for the file size, used as cache key
+ * @param mtime return location for the modification time, used as cache key
  * @return the newly created track or NULL
  */
-extern Track* tracklist_file_to_track(Tracklist* this, GFile* file);
+extern Track* tracklist_file_to_track(Tracklist* this, GFile* file, gint64* size, gint64* mtime);
 
 /**
  * Re-calculate the lowest average loudness of all tracks
@@ -137,9 +180,23 @@ extern Track* tracklist_file_to_track(Tracklist* this, GFile* file);
  */
 extern void tracklist_update_min_lufs(Tracklist* this);
 
+/**
+ * Set what is measured when tracks are imported
+ *
+ * tracks analyzed with a lower profile than upgrade (eg restored from cache
+ * or imported quickly) are analyzed again in the background once the
+ * import queue is empty, the new results replace the old ones
+ *
+ * @param this the tracklist object
+ * @param profile AnalysisProfile of imported tracks
+ * @param upgrade AnalysisProfile tracks are upgraded to, at least profile
+ */
+extern void tracklist_set_profile(Tracklist* this, int profile, int upgrade);
+
 /**
  * Free all resources
  *
+ * queued files are dropped and running analyses are cancelled
  * this includes:
  *      all tracks
  *      treeview
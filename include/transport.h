@@ -13,6 +13,19 @@
 
 #include "../include/player.h"
 
+/**
+ * Buttons that swap with another button
+ *
+ * used to only show/hide buttons when the state of the player changed
+ */
+typedef enum TransportShow {
+    TRANSPORT_SHOW_RTN      = 1 << 0,
+    TRANSPORT_SHOW_CTD      = 1 << 1,
+    TRANSPORT_SHOW_MARK     = 1 << 2,
+    TRANSPORT_SHOW_LOOP     = 1 << 3,
+    TRANSPORT_SHOW_PAUSE    = 1 << 4,
+} TransportShow;
+
 /**
  * Transport button widget
  *
@@ -35,6 +48,7 @@ typedef struct {
     GtkWidget* mark;            /**< set marker button/display */
     GtkWidget* loop;            /**< set loop A/B/cancel */
     GtkWidget* noloop;          /**< loop is canceled display */
+    guint state;                /**< TransportShow flags of the shown buttons */
 } Transport;
 
 /**
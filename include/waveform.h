@@ -0,0 +1,118 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        waveform.h
+ * @brief       multi-resolution loudness curve
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Loudness of a waveform point, fixed point in steps of WAVEFORM_STEP LU
+ *
+ * a quarter of a double, the drawing only needs it for a pixel height
+ */
+typedef int16_t WaveformValue;
+
+/**
+ * LU per step of a WaveformValue, the range is -327.67 to +327.67 LUFS
+ */
+#define WAVEFORM_STEP 0.01
+
+/**
+ * WaveformValue of silence, -inf LUFS
+ */
+#define WAVEFORM_SILENCE INT16_MIN
+
+/**
+ * Maximum number of levels of a waveform pyramid
+ *
+ * every level halves the number of points, 48 levels is plenty for any
+ * size_t length
+ */
+#define WAVEFORM_LEVELS 48
+
+/**
+ * WaveformLevel
+ *
+ * the loudness curve reduced by a power of two
+ * every point covers 2^level windows of TIME_WINDOW msec, the last point
+ * covers the remaining windows
+ */
+typedef struct WaveformLevel {
+    WaveformValue* min;     /**< lowest loudness of the windows of a point */
+    WaveformValue* max;     /**< highest loudness of the windows of a point */
+    WaveformValue* mean;    /**< average loudness of the windows of a point */
+    size_t len;             /**< number of points */
+} WaveformLevel;
+
+/**
+ * Waveform
+ *
+ * pyramid of the loudness curve of a track
+ * level 0 has one point per window, the last level has a single point
+ */
+typedef struct Waveform {
+    WaveformLevel levels[WAVEFORM_LEVELS];  /**< from fine to coarse */
+    size_t n;                               /**< number of levels */
+} Waveform;
+
+/**
+ * Constructor
+ *
+ * build all levels of the pyramid from the loudness curve
+ *
+ * @param values loudness per window as calculated by the analysis
+ * @param len number of values
+ * @return the newly created waveform or NULL when len is 0 or failed
+ */
+extern Waveform* waveform_new(const WaveformValue* values, size_t len);
+
+/**
+ * Quantize a loudness
+ *
+ * louder or quieter than the range is clamped, silence (-inf) and NAN are
+ * WAVEFORM_SILENCE
+ *
+ * @param loudness in LUFS
+ * @return the value
+ */
+extern WaveformValue waveform_encode(double loudness);
+
+/**
+ * @param value a quantized loudness
+ * @return the loudness in LUFS, -HUGE_VAL for WAVEFORM_SILENCE
+ */
+extern double waveform_decode(WaveformValue value);
+
+/**
+ * Get the level to draw in a given width
+ *
+ * the finest level with no more points than pixels is returned, so drawing
+ * never costs more than one point per pixel
+ *
+ * @param this the waveform object
+ * @param width available width in pixels
+ * @return the level, owned by waveform
+ */
+extern const WaveformLevel* waveform_level(Waveform* this, size_t width);
+
+/**
+ * @param this the waveform object or NULL
+ * @return bytes allocated for the levels
+ */
+extern size_t waveform_size(const Waveform* this);
+
+/**
+ * Free all resources
+ *
+ * @param this the waveform object
+ */
+extern void waveform_free(Waveform* this);
+
+#endif
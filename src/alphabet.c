@@ -20,6 +20,8 @@
 #include <gtkosxapplication.h>
 #endif
 
+#include "../include/analysis.h"
+#include "../include/batch.h"
 #include "../include/config.h"
 #include "../include/counter.h"
 #include "../include/player.h"
@@ -36,6 +38,9 @@ Tracklist* tracklist;
 Transport* transport;
 Varispeed* varispeed;
 GtkWidget* button;
+guint ui_tick;
+int profile = ANALYSIS_PROFILE;
+int upgrade = ANALYSIS_UPGRADE;
 
 /**
  * activate callback
@@ -56,6 +61,16 @@ static gboolean on_destroy(GtkWidget* window, GtkApplication* alphabet);
  */
 static void on_open(GApplication *alphabet, GFile **files, gint n, const char* hint);
 
+/**
+ * command line options callback
+ *
+ * --profile and --upgrade, runs before startup
+ *
+ * @return -1 to continue or the exit status when an option is invalid
+ */
+static gint on_options(GApplication* alphabet, GVariantDict* options,
+gpointer data);
+
 /**
  * startup callback
  *
@@ -65,9 +80,22 @@ static void on_startup(GApplication* alphabet, gpointer data);
 
 /**
  * update the UI elements
- * no data is passed, just a trigger to update
+ *
+ * tick callback, runs at most once per frame of the frame clock
+ * the position is extrapolated to the time of the frame
+ * the callback removes itself when the player is not playing
  */
-static gboolean update_ui(gpointer data);
+static gboolean update_ui(GtkWidget* widget, GdkFrameClock* clock, gpointer data);
+
+/**
+ * Schedule an update of the UI elements in the next frame
+ */
+static void schedule_ui(void);
+
+/**
+ * handle player events and update the UI
+ */
+static gboolean on_player_event(gpointer data);
 
 /**
  * player event callback
@@ -75,6 +103,7 @@ static gboolean update_ui(gpointer data);
  * connect the player callback method to the player event
  * called functions must be short and non-blocking
  * wil be called whenever player changes state (eg, play, position update, ...)
+ * not called again until the pending events are handled by on_player_event
  */
 static void event_callback(gpointer data);
 
@@ -113,6 +142,10 @@ void on_click_add(GtkWindow* window)
 
 gboolean keypress_handler(GtkWidget *window, GdkEventKey *event)
 {
+    /* a paused player doesn't tick, marks and loops are drawn by an update
+     * scheduled here
+     */
+
     switch (event->keyval) {
 
         case GDK_KEY_f:
@@ -132,6 +165,7 @@ gboolean keypress_handler(GtkWidget *window, GdkEventKey *event)
 
         case GDK_KEY_l:
             gtk_button_clicked(GTK_BUTTON(transport->loop));
+            schedule_ui();
             return TRUE;
 
         case GDK_KEY_space:
@@ -149,6 +183,7 @@ gboolean keypress_handler(GtkWidget *window, GdkEventKey *event)
         case GDK_KEY_m:
         case GDK_KEY_KP_Enter:
             player_mark(player);
+            schedule_ui();
             return TRUE;
 
         case GDK_KEY_Return:
@@ -161,18 +196,44 @@ gboolean keypress_handler(GtkWidget *window, GdkEventKey *event)
     return FALSE;
 }
 
-gboolean update_ui(UNUSED gpointer data)
+gboolean update_ui(UNUSED GtkWidget* widget, GdkFrameClock* clock,
+UNUSED gpointer data)
 {
-    timeline_update(timeline);
-    counter_update(counter);
+    gdouble position;
+
+    position = player_get_position_at(player,
+            gdk_frame_clock_get_frame_time(clock));
+
+    timeline_update(timeline, position);
+    counter_update(counter, position);
     transport_update(transport);
-    return FALSE;
+
+    /* keep ticking while playing, a stopped or paused player only updates
+     * the UI when it emits an event
+     */
+
+    if (player->play_state == PLAY_STATE_PLAY) return G_SOURCE_CONTINUE;
+
+    ui_tick = 0;
+    return G_SOURCE_REMOVE;
+}
+
+void schedule_ui(void)
+{
+    if (ui_tick || !timeline) return;
+    ui_tick = gtk_widget_add_tick_callback(timeline->box, update_ui, NULL, NULL);
+}
+
+gboolean on_player_event(gpointer data)
+{
+    player_event_handler(data);
+    schedule_ui();
+    return G_SOURCE_REMOVE;
 }
 
 void event_callback(gpointer data)
 {
-    g_idle_add(G_SOURCE_FUNC(player_event_handler), data);
-    g_idle_add(G_SOURCE_FUNC(update_ui), data);
+    g_idle_add(on_player_event, data);
 }
 
 void on_activate(GtkApplication* alphabet)
@@ -229,6 +290,8 @@ void on_activate(GtkApplication* alphabet)
     gtk_action_bar_pack_end(GTK_ACTION_BAR(bar), transport->box_control);
     gtk_action_bar_pack_end(GTK_ACTION_BAR(bar), transport->box_movement);
 
+    gtk_action_bar_pack_end(GTK_ACTION_BAR(bar), GTK_WIDGET(tracklist->progress));
+
     /* event_callback will be called whenever player received event */
     player_set_event_callback(player, event_callback);
 
@@ -252,7 +315,34 @@ void on_startup(UNUSED GApplication* alphabet, UNUSED gpointer data)
     if (!(tracklist = tracklist_new(player))) {
         on_destroy(NULL, NULL);
         g_application_quit(alphabet);
+        return;
+    }
+    tracklist_set_profile(tracklist, profile, upgrade);
+}
+
+gint on_options(UNUSED GApplication* alphabet, GVariantDict* options,
+UNUSED gpointer data)
+{
+    const gchar* name;
+
+    if (g_variant_dict_lookup(options, "profile", "&s", &name)) {
+        if ((profile = analysis_profile_parse(name)) < 0) {
+            g_printerr("invalid profile \"%s\"\n", name);
+            return EXIT_FAILURE;
+        }
+
+        /* without --upgrade tracks keep the profile they're imported with */
+
+        upgrade = profile;
+    }
+
+    if (g_variant_dict_lookup(options, "upgrade", "&s", &name)) {
+        if ((upgrade = analysis_profile_parse(name)) < 0) {
+            g_printerr("invalid profile \"%s\"\n", name);
+            return EXIT_FAILURE;
+        }
     }
+    return -1;
 }
 
 void on_open(GApplication *alphabet, GFile **files, gint n, UNUSED const char* hint)
@@ -303,8 +393,22 @@ int main(int argc, char *argv[])
                             | G_APPLICATION_REPLACE
                             | G_APPLICATION_HANDLES_OPEN;
 
+    /* batch analysis runs without gtk and mpv */
+
+    if (argc > 1 && strcmp(argv[1], BATCH_OPTION) == 0) {
+        return batch_run(argc - 2, argv + 2);
+    }
+
     alphabet = gtk_application_new(ID, flags);
 
+    g_application_add_main_option(G_APPLICATION(alphabet), "profile", 0,
+            G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+            "What to measure on import: quick, standard or full", "PROFILE");
+    g_application_add_main_option(G_APPLICATION(alphabet), "upgrade", 0,
+            G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+            "Profile tracks are analyzed with in the background", "PROFILE");
+
+    g_signal_connect(alphabet, "handle-local-options", G_CALLBACK(on_options), NULL);
     g_signal_connect(alphabet, "startup", G_CALLBACK(on_startup), NULL);
     g_signal_connect(alphabet, "open", G_CALLBACK(on_open), NULL);
     g_signal_connect(alphabet, "activate", G_CALLBACK(on_activate), NULL);
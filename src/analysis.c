@@ -0,0 +1,1000 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        analysis.c
+ * @brief       ebu r128 loudness analysis
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <ebur128.h>
+#include <errno.h>
+#include <gtk/gtk.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/ingest.h"
+#include "../include/r128.h"
+#include "../include/track.h"
+#include "../include/waveform.h"
+
+#include "../include/analysis.h"
+
+/**
+ * Segment
+ *
+ * part of a file analyzed by one thread
+ */
+typedef struct Segment {
+    const char* path;       /**< file to open when ingest is NULL */
+    Ingest* ingest;         /**< opened file, owned when opened by segment */
+    size_t start;           /**< first frame of the segment */
+    size_t frames;          /**< number of frames or SIZE_MAX until the end */
+    size_t preroll;         /**< frames fed to the meter before start */
+    int kernel;             /**< measure with r128 instead of ebur128 */
+    AnalysisProfile profile;/**< what to measure */
+    ebur128_state* st;      /**< loudness state of this segment (ebur128) */
+    R128* r128;             /**< loudness state of this segment (kernel) */
+    double* waveform;       /**< energy sum of decimation windows per value */
+    size_t waveform_len;    /**< number of waveform values */
+    size_t waveform_capacity; /**< allocated size of waveform */
+    size_t waveform_max;    /**< values before the waveform is folded */
+    size_t first_window;    /**< index of the first window in the file */
+    size_t windows;         /**< number of windows analyzed */
+    size_t decimation;      /**< windows per waveform value, a power of 2 */
+    size_t frames_read;     /**< number of frames analyzed (without preroll) */
+    double momentary_max;   /**< highest momentary loudness (ebur128) */
+    double short_term_max;  /**< highest short-term loudness (ebur128) */
+    const IngestPcm* pcm;   /**< mapped samples or NULL to decode */
+    size_t position;        /**< next frame of pcm */
+    const int* cancel;      /**< stop when set, shared by all segments */
+    AnalysisStats stats;    /**< stage times of this segment */
+    int status;             /**< 0 on success or -1 when failed */
+} Segment;
+
+/**
+ * stage statistics of all analyses, see analysis_stats_get
+ */
+static AnalysisStats analysis_stats;
+static GMutex analysis_stats_lock;
+
+/**
+ * peak mode, see analysis_set_true_peak
+ */
+static int analysis_true_peak = FALSE;
+
+/**
+ * segments per file, see analysis_set_segments
+ */
+static unsigned int analysis_segments = 0;
+
+/**
+ * loudness meter, see analysis_set_kernel
+ */
+static int analysis_kernel = ANALYSIS_KERNEL;
+
+/**
+ * sample type fed to the meter, see analysis_set_sample
+ */
+static int analysis_sample = ANALYSIS_NATIVE;
+
+/**
+ * bounded memory, see analysis_set_streaming
+ */
+static int analysis_streaming = ANALYSIS_STREAMING;
+
+/**
+ * reading mapped pcm, see analysis_set_mmap
+ */
+static int analysis_mmap = ANALYSIS_MMAP;
+
+/**
+ * segments being analyzed in the whole process, see analysis_reserve
+ */
+static unsigned int analysis_running = 0;
+static GMutex analysis_running_lock;
+
+/**
+ * Analyze one segment
+ *
+ * opens the file if needed, seeks to the start minus pre-roll and scans
+ * the segment window by window
+ *
+ * @param this the segment
+ */
+static void analysis_segment(Segment* this);
+
+/**
+ * Read the next frames of a segment and add them to its meter
+ *
+ * frames are taken from the mapping when the file is mapped, decoded into
+ * buffer otherwise, the time spent is added to the stats of the segment
+ *
+ * @param this the segment
+ * @param buffer decoded samples, must hold frames of type sample
+ * @param frames number of frames to read
+ * @param sample sample type of buffer
+ * @return number of frames read, 0 at end of file or on error
+ */
+static size_t analysis_read(Segment* this, void* buffer, size_t frames,
+IngestSample sample);
+
+/**
+ * Add frames to the meter of a segment with the function of their sample type
+ *
+ * @param this the segment
+ * @param buffer interleaved samples
+ * @param frames number of frames
+ * @param sample sample type of buffer
+ */
+static void analysis_add_frames(Segment* this, const void* buffer,
+size_t frames, IngestSample sample);
+
+/**
+ * Measure the window that was just added
+ *
+ * adds the energy of the window to the waveform (ANALYSIS_STANDARD) and
+ * samples the maxima (ANALYSIS_FULL with libebur128)
+ *
+ * @param this the segment
+ * @return 0 on success or -1 when failed to allocate
+ */
+static int analysis_window(Segment* this);
+
+/**
+ * Halve the number of waveform values of a segment
+ *
+ * values are merged in pairs of the whole file, not of the segment, so the
+ * values of all segments still line up after folding
+ *
+ * @param this the segment
+ */
+static void analysis_fold(Segment* this);
+
+/**
+ * Stitch the waveform of all segments back together
+ *
+ * the segments are folded to the coarsest of them, the values on a
+ * segment boundary are shared and summed
+ *
+ * @param segments the analyzed segments
+ * @param n number of segments
+ * @param waveform destination of the quantized loudness per value, NULL
+ * when the segments have no waveform
+ * @param len destination of the number of values
+ * @return windows per value or 0 when failed to allocate
+ */
+static size_t analysis_stitch(Segment* segments, unsigned int n,
+WaveformValue** waveform, size_t* len);
+
+/**
+ * @param this the segment
+ * @return sample peak of the first channel of a segment
+ */
+static double analysis_sample_peak(Segment* this);
+
+/**
+ * Set the ANALYSIS_FULL measurements of a track
+ *
+ * the kernel only counts the windows that end after the pre-roll so the
+ * loudness range sees the same windows as a sequential scan, libebur128
+ * computes it from its own short-term windows per segment
+ *
+ * @param track the track object
+ * @param segments the analyzed segments
+ * @param states ebur128 state of every segment
+ * @param kernels r128 state of every segment
+ * @param n number of segments
+ */
+static void analysis_full(Track* track, Segment* segments,
+ebur128_state** states, R128** kernels, unsigned int n);
+
+/**
+ * Thread function for analysis_segment
+ */
+static gpointer analysis_segment_thread(gpointer data);
+
+/**
+ * Free the resources of a segment
+ *
+ * @param this the segment
+ * @param owned close the ingest object
+ */
+static void analysis_segment_clear(Segment* this, int owned);
+
+/**
+ * Check the cancel flag of an analysis
+ *
+ * @param cancel the flag or NULL when the analysis can't be cancelled
+ * @return TRUE when cancelled
+ */
+static gboolean analysis_cancelled(const int* cancel);
+
+/**
+ * Reserve the segments of an analysis
+ *
+ * the calling thread always gets its own segment, extra segments only get
+ * the processors no other analysis is using, so the file workers of the
+ * tracklist or batch pool and the segment threads together never run more
+ * decoders than there are processors (or workers)
+ *
+ * @param wanted number of segments the file could be split in, at least 1
+ * @return number of segments reserved, at least 1
+ */
+static unsigned int analysis_reserve(unsigned int wanted);
+
+/**
+ * Release segments reserved by analysis_reserve
+ *
+ * @param n number of segments
+ */
+static void analysis_release(unsigned int n);
+
+/**
+ * Greatest common divisor
+ */
+static size_t gcd(size_t a, size_t b);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+int analysis_run(Track* track, Ingest* ingest, AnalysisProfile profile,
+const int* cancel)
+{
+    Segment* segments;
+    ebur128_state** states;
+    R128** kernels;
+    GThread** threads;
+    AnalysisStats stats = { 0 };
+    gint64 start;
+    unsigned int n = 1;
+    size_t window, block, align, length, waveform_len = 0, frames = 0;
+    size_t decimation = 1;
+    double lufs, peak = 0.0;
+    int status = 0;
+
+    if (!ingest->sample_rate || !ingest->channels) {
+        fprintf(stderr, "invalid audio format in \"%s\"\n", track->path);
+        return -1;
+    }
+
+    /* segment boundaries must be a multiple of the waveform window and of the
+     * 100ms step of the ebur128 gating blocks (rounded like libebur128 does)
+     * so stitching the segments gives the same windows and blocks
+     */
+
+    window = (size_t)((gdouble)ingest->sample_rate * TIME_WINDOW/1000.0);
+    block = (ingest->sample_rate + 5) / 10;
+    align = window / gcd(window, block) * block;
+
+    if (track->length >= 2 * ANALYSIS_SEGMENT_MIN) {
+        n = MIN(g_get_num_processors(),
+                (unsigned int)(track->length / ANALYSIS_SEGMENT_MIN));
+        if (analysis_segments) n = MIN(n, analysis_segments);
+        n = MAX(n, 1);
+    }
+
+    n = analysis_reserve(n);
+
+    length = (size_t)(track->length * ingest->sample_rate) / n / align * align;
+    if (!length) {
+        analysis_release(n - 1);
+        n = 1;
+    }
+
+    /* streaming keeps the waveform under ANALYSIS_WAVEFORM_MAX values by
+     * merging windows, the length in the header tells how many, a file that
+     * turns out longer is folded further while it's analyzed
+     */
+
+    if (analysis_streaming) {
+        const size_t windows = (size_t)(track->length * 1000.0 / TIME_WINDOW) + 1;
+        while (windows / decimation > ANALYSIS_WAVEFORM_MAX) decimation *= 2;
+    }
+
+    segments = calloc(n, sizeof(Segment));
+    states = calloc(n, sizeof(ebur128_state*));
+    kernels = calloc(n, sizeof(R128*));
+    threads = calloc(n, sizeof(GThread*));
+    if (!segments || !states || !kernels || !threads) {
+        fprintf(stderr, "analysis malloc failed\n");
+        free(segments);
+        free(states);
+        free(kernels);
+        free(threads);
+        analysis_release(n);
+        return -1;
+    }
+
+    /* the first segment reuses the file opened by the caller and runs in
+     * this thread, the others open the file again in their own thread
+     * every segment but the first is fed the 300ms before its start so its
+     * first gating blocks overlap the previous segment like they would in a
+     * sequential scan, or the 3s before it for the short-term windows of
+     * the kernel (ANALYSIS_FULL)
+     */
+
+    for (unsigned int i = 0; i < n; i++) {
+        segments[i].path = track->path;
+        segments[i].ingest = i == 0 ? ingest : NULL;
+        segments[i].start = i * length;
+        segments[i].frames = i == n - 1 ? SIZE_MAX : length;
+        segments[i].preroll = i == 0 ? 0
+            : (analysis_kernel && profile == ANALYSIS_FULL ? 30 : 3) * block;
+        segments[i].kernel = analysis_kernel;
+        segments[i].waveform_max = analysis_streaming ? ANALYSIS_WAVEFORM_MAX : SIZE_MAX;
+        segments[i].first_window = segments[i].start / window;
+        segments[i].decimation = decimation;
+        segments[i].profile = profile;
+        segments[i].momentary_max = -HUGE_VAL;
+        segments[i].short_term_max = -HUGE_VAL;
+        segments[i].cancel = cancel;
+    }
+
+    for (unsigned int i = 1; i < n; i++) {
+        threads[i] = g_thread_new("analysis", analysis_segment_thread,
+                &segments[i]);
+    }
+
+    analysis_segment(&segments[0]);
+
+    for (unsigned int i = 1; i < n; i++) {
+        g_thread_join(threads[i]);
+    }
+    free(threads);
+    analysis_release(n);
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (segments[i].status != 0) status = -1;
+        states[i] = segments[i].st;
+        kernels[i] = segments[i].r128;
+        frames += segments[i].frames_read;
+
+        stats.frames += segments[i].stats.frames;
+        stats.mapped += segments[i].stats.mapped;
+        stats.open += segments[i].stats.open;
+        stats.decode += segments[i].stats.decode;
+        stats.loudness += segments[i].stats.loudness;
+        stats.windows += segments[i].stats.windows;
+    }
+    analysis_stats_add(&stats);
+
+    /* a segment can fail when the header lied about the duration or the
+     * format can't seek, the file is then analyzed sequentially
+     * unless it failed because it was cancelled
+     */
+
+    if (status != 0 && n > 1 && !analysis_cancelled(cancel)) {
+        Ingest* retry;
+
+        for (unsigned int i = 0; i < n; i++) {
+            analysis_segment_clear(&segments[i], i != 0);
+        }
+        free(segments);
+        free(states);
+        free(kernels);
+
+        fprintf(stderr, "parallel analysis failed, retrying \"%s\"\n", track->path);
+
+        if (!(retry = ingest_open(track->path, TRUE))) return -1;
+        track->length = 0.0;
+        status = analysis_run(track, retry, profile, cancel);
+        ingest_close(retry);
+        return status;
+    }
+
+    start = g_get_monotonic_time();
+
+    if (status == 0) {
+        WaveformValue* waveform;
+
+        /* ANALYSIS_QUICK has no waveform */
+
+        if (!(decimation = analysis_stitch(segments, n, &waveform, &waveform_len))) {
+            status = -1;
+        } else {
+            if (profile == ANALYSIS_FULL) {
+                analysis_full(track, segments, states, kernels, n);
+            }
+
+            for (unsigned int i = 0; i < n; i++) {
+                peak = MAX(peak, analysis_sample_peak(&segments[i]));
+            }
+
+            if (segments[0].kernel) r128_loudness_global_multiple(kernels, n, &lufs);
+            else ebur128_loudness_global_multiple(states, n, &lufs);
+
+            free(track->waveform);
+            track->waveform = waveform;
+            track->waveform_len = waveform_len;
+            track->waveform_window = TIME_WINDOW * decimation;
+
+            /* the pyramid is built once here so drawing doesn't depend on
+             * the length of the track
+             */
+
+            waveform_free(track->pyramid);
+            track->pyramid = waveform ? waveform_new(waveform, waveform_len) : NULL;
+            track->lufs = lufs;
+            track->peak = peak;
+
+            if (profile != ANALYSIS_FULL) {
+                track->true_peak = NAN;
+                track->lra = NAN;
+                track->momentary_max = NAN;
+                track->short_term_max = NAN;
+            }
+
+            /* the number of decoded samples is more accurate than the header */
+            if (frames) {
+                track->length = (double)frames / (double)ingest->sample_rate;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        analysis_segment_clear(&segments[i], i != 0);
+    }
+    free(segments);
+    free(states);
+    free(kernels);
+
+    memset(&stats, 0, sizeof(stats));
+    stats.tracks = status == 0;
+    stats.waveform = g_get_monotonic_time() - start;
+    analysis_stats_add(&stats);
+
+    return status;
+}
+
+int analysis_profile_parse(const char* name)
+{
+    if (!name) return -1;
+    if (strcmp(name, "quick") == 0) return ANALYSIS_QUICK;
+    if (strcmp(name, "standard") == 0) return ANALYSIS_STANDARD;
+    if (strcmp(name, "full") == 0) return ANALYSIS_FULL;
+    return -1;
+}
+
+const char* analysis_profile_name(int profile)
+{
+    switch (profile) {
+        case ANALYSIS_QUICK:
+            return "quick";
+        case ANALYSIS_STANDARD:
+            return "standard";
+        case ANALYSIS_FULL:
+            return "full";
+        default:
+            return "unknown";
+    }
+}
+
+void analysis_set_true_peak(int enable)
+{
+    analysis_true_peak = enable;
+}
+
+void analysis_set_segments(unsigned int max)
+{
+    analysis_segments = max;
+}
+
+void analysis_set_kernel(int enable)
+{
+    analysis_kernel = enable;
+}
+
+void analysis_set_sample(int sample)
+{
+    analysis_sample = sample;
+}
+
+void analysis_set_streaming(int enable)
+{
+    analysis_streaming = enable;
+}
+
+void analysis_set_mmap(int enable)
+{
+    analysis_mmap = enable;
+}
+
+void analysis_stats_add(const AnalysisStats* stats)
+{
+    g_mutex_lock(&analysis_stats_lock);
+    analysis_stats.tracks += stats->tracks;
+    analysis_stats.frames += stats->frames;
+    analysis_stats.mapped += stats->mapped;
+    analysis_stats.open += stats->open;
+    analysis_stats.probe += stats->probe;
+    analysis_stats.decode += stats->decode;
+    analysis_stats.loudness += stats->loudness;
+    analysis_stats.windows += stats->windows;
+    analysis_stats.waveform += stats->waveform;
+    g_mutex_unlock(&analysis_stats_lock);
+}
+
+void analysis_stats_get(AnalysisStats* stats)
+{
+    g_mutex_lock(&analysis_stats_lock);
+    *stats = analysis_stats;
+    g_mutex_unlock(&analysis_stats_lock);
+}
+
+void analysis_stats_reset(void)
+{
+    g_mutex_lock(&analysis_stats_lock);
+    memset(&analysis_stats, 0, sizeof(analysis_stats));
+    g_mutex_unlock(&analysis_stats_lock);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void analysis_segment(Segment* this)
+{
+    size_t frames_read, window, landed;
+    void* buffer;
+    IngestSample sample;
+    gint64 t0;
+    const int full = this->profile == ANALYSIS_FULL;
+    const int true_peak = analysis_true_peak || full;
+    const int histogram = this->waveform_max != SIZE_MAX;
+    int failed = FALSE;
+    int flags = EBUR128_MODE_I | (full ? EBUR128_MODE_LRA : 0)
+        | (true_peak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK)
+        | (histogram ? EBUR128_MODE_HISTOGRAM : 0);
+
+    this->status = -1;
+
+    if (!this->ingest) {
+        t0 = g_get_monotonic_time();
+        this->ingest = ingest_open(this->path, TRUE);
+        this->stats.open += g_get_monotonic_time() - t0;
+        if (!this->ingest) return;
+    }
+
+    /* streaming counts gating blocks and short-term windows in histograms,
+     * the memory of the meters doesn't grow with the length of the file
+     */
+
+    if (this->kernel) {
+        this->r128 = r128_new(this->ingest->channels, this->ingest->sample_rate,
+                (true_peak ? R128_TRUE_PEAK : 0) | (full ? R128_RANGE : 0)
+                | (histogram ? R128_HISTOGRAM : 0));
+        if (!this->r128) {
+            fprintf(stderr, "could not create r128 state\n");
+            return;
+        }
+        r128_set_origin(this->r128, this->start - this->preroll, this->preroll);
+    } else if (!(this->st = ebur128_init(this->ingest->channels,
+                    this->ingest->sample_rate, flags)))
+    {
+        fprintf(stderr, "ebur128 could not create ebur128_state!\n");
+        return;
+    }
+
+    /* calculate the amount of samples we should read in order to get enough
+     * for the time window used for the waveform
+     */
+
+    window = (size_t)((gdouble)this->ingest->sample_rate * TIME_WINDOW/1000.0);
+
+    /* uncompressed pcm is measured where it's mapped, nothing is decoded or
+     * copied, the kernel converts the samples while it filters them
+     */
+
+    if (this->kernel && analysis_mmap && analysis_sample == ANALYSIS_NATIVE) {
+        t0 = g_get_monotonic_time();
+        this->pcm = ingest_map(this->ingest);
+        this->stats.open += g_get_monotonic_time() - t0;
+    }
+
+    /* allocate buffer used to read chunks of size "window"
+     * samples are read in the type the decoder produces, eg 16 bit pcm is
+     * read as short, a quarter of the bytes of double
+     */
+
+    sample = analysis_sample == ANALYSIS_NATIVE
+        ? this->ingest->sample : (IngestSample)analysis_sample;
+
+    buffer = NULL;
+    if (!this->pcm && !(buffer = malloc(window * this->ingest->channels
+                    * ingest_sample_size(sample))))
+    {
+        fprintf(stderr, "ebur128 malloc failed\n");
+        return;
+    }
+
+    /* allocate waveform buffer based on the duration in the header
+     * we add two to make sure we don't get round-down error due to int
+     * conversion and a value shared with the previous segment, the
+     * duration of compressed files is an estimate so the waveform grows
+     * (or folds) if needed
+     * ANALYSIS_QUICK only reads in windows, without waveform
+     */
+
+    if (this->frames != SIZE_MAX) {
+        this->waveform_capacity = this->frames / window / this->decimation + 2;
+    } else {
+        this->waveform_capacity = 2 + (size_t)(this->ingest->duration * 1000.0
+                / TIME_WINDOW) / this->decimation;
+    }
+    this->waveform_capacity = MIN(this->waveform_capacity, this->waveform_max);
+
+    if (this->profile >= ANALYSIS_STANDARD
+            && !(this->waveform = malloc(this->waveform_capacity * sizeof(double))))
+    {
+        fprintf(stderr, "ebur128 malloc failed\n");
+        free(buffer);
+        return;
+    }
+
+    /* a mapped segment starts anywhere, the whole segment is read ahead */
+
+    t0 = g_get_monotonic_time();
+    if (this->pcm) {
+        this->position = this->start - this->preroll;
+        ingest_willneed(this->ingest, this->position, this->frames == SIZE_MAX
+                ? SIZE_MAX : this->preroll + this->frames);
+    } else if (this->start) {
+        if (ingest_seek(this->ingest, this->start - this->preroll, &landed) != 0) {
+            free(buffer);
+            return;
+        }
+
+        /* a segment that starts late would be stitched misaligned, it fails
+         * and the file is analyzed sequentially
+         */
+
+        if (landed != this->start - this->preroll) {
+            fprintf(stderr, "inaccurate seek in \"%s\"\n", this->path);
+            free(buffer);
+            return;
+        }
+    }
+    this->stats.decode += g_get_monotonic_time() - t0;
+
+    /* pre-roll only feeds the gating blocks, it's part of the previous
+     * segment's waveform
+     */
+
+    for (size_t left = this->preroll; left; left -= frames_read) {
+        if (analysis_cancelled(this->cancel)) break;
+        frames_read = analysis_read(this, buffer, MIN(left, window), sample);
+        if (!frames_read) break;
+        this->stats.frames += frames_read;
+    }
+
+    while (this->frames_read < this->frames) {
+        size_t count = MIN(window, this->frames - this->frames_read);
+
+        if (analysis_cancelled(this->cancel)) {
+            free(buffer);
+            return;
+        }
+
+        if (!(frames_read = analysis_read(this, buffer, count, sample))) break;
+
+        t0 = g_get_monotonic_time();
+        if (analysis_window(this) != 0) {
+            failed = TRUE;
+            break;
+        }
+
+        this->stats.windows += g_get_monotonic_time() - t0;
+        this->stats.frames += frames_read;
+        this->frames_read += frames_read;
+    }
+
+    /* a segment that ends before its length means the file is shorter than
+     * the header said, only the last segment may run into the end of file
+     * a waveform that failed to grow is truncated, it fails either way
+     */
+
+    if (!failed && (this->frames == SIZE_MAX || this->frames_read == this->frames)) {
+        this->status = 0;
+    }
+
+    free(buffer);
+}
+
+size_t analysis_read(Segment* this, void* buffer, size_t frames,
+IngestSample sample)
+{
+    const IngestPcm* pcm = this->pcm;
+    gint64 t0, t1;
+
+    if (pcm) {
+        const size_t size = pcm->bytes * this->ingest->channels;
+
+        if (this->position >= pcm->frames) return 0;
+        frames = MIN(frames, pcm->frames - this->position);
+
+        t0 = g_get_monotonic_time();
+        r128_add_frames_pcm(this->r128, pcm->data + this->position * size,
+                frames, pcm->bytes, pcm->floating, pcm->big_endian);
+        this->stats.loudness += g_get_monotonic_time() - t0;
+        this->stats.mapped += frames;
+        this->position += frames;
+        return frames;
+    }
+
+    t0 = g_get_monotonic_time();
+    frames = ingest_read(this->ingest, buffer, frames, sample);
+    t1 = g_get_monotonic_time();
+    this->stats.decode += t1 - t0;
+    if (!frames) return 0;
+
+    analysis_add_frames(this, buffer, frames, sample);
+    this->stats.loudness += g_get_monotonic_time() - t1;
+    return frames;
+}
+
+void analysis_add_frames(Segment* this, const void* buffer,
+size_t frames, IngestSample sample)
+{
+    R128* r128 = this->r128;
+    ebur128_state* st = this->st;
+
+    switch (sample) {
+        case INGEST_SHORT:
+            if (r128) r128_add_frames_short(r128, buffer, frames);
+            else ebur128_add_frames_short(st, buffer, frames);
+            break;
+        case INGEST_INT:
+            if (r128) r128_add_frames_int(r128, buffer, frames);
+            else ebur128_add_frames_int(st, buffer, frames);
+            break;
+        case INGEST_FLOAT:
+            if (r128) r128_add_frames_float(r128, buffer, frames);
+            else ebur128_add_frames_float(st, buffer, frames);
+            break;
+        case INGEST_DOUBLE:
+        default:
+            if (r128) r128_add_frames_double(r128, buffer, frames);
+            else ebur128_add_frames_double(st, buffer, frames);
+            break;
+    }
+}
+
+int analysis_window(Segment* this)
+{
+    double loudness;
+
+    /* windows are summed as energy, the loudness of a value is the loudness
+     * of all its windows, silence is 0
+     */
+
+    if (this->waveform) {
+        const size_t window = this->first_window + this->windows++;
+        size_t value = window / this->decimation - this->first_window / this->decimation;
+
+        if (this->r128) r128_loudness_window(this->r128, TIME_WINDOW, &loudness);
+        else ebur128_loudness_window(this->st, TIME_WINDOW, &loudness);
+
+        if (value == this->waveform_len && value == this->waveform_max) {
+            analysis_fold(this);
+            value = window / this->decimation - this->first_window / this->decimation;
+        }
+
+        if (value == this->waveform_capacity) {
+            const size_t capacity = MIN(2 * this->waveform_capacity, this->waveform_max);
+            double* grown = realloc(this->waveform, capacity * sizeof(double));
+            if (!grown) {
+                fprintf(stderr, "ebur128 malloc failed\n");
+                return -1;
+            }
+            this->waveform = grown;
+            this->waveform_capacity = capacity;
+        }
+
+        if (value == this->waveform_len) this->waveform[this->waveform_len++] = 0.0;
+        this->waveform[value] += pow(10.0, (loudness + 0.691) / 10.0);
+    }
+
+    /* the kernel measures the maxima every 100ms, libebur128 is sampled
+     * once per window
+     */
+
+    if (this->st && this->profile == ANALYSIS_FULL) {
+        if (ebur128_loudness_momentary(this->st, &loudness) == EBUR128_SUCCESS) {
+            this->momentary_max = MAX(this->momentary_max, loudness);
+        }
+        if (ebur128_loudness_shortterm(this->st, &loudness) == EBUR128_SUCCESS) {
+            this->short_term_max = MAX(this->short_term_max, loudness);
+        }
+    }
+    return 0;
+}
+
+void analysis_fold(Segment* this)
+{
+    const size_t offset = this->first_window / this->decimation;
+    size_t len = 0;
+
+    /* value i of the segment is value offset + i of the file, a value is
+     * never moved up so the merge can be done in place
+     */
+
+    for (size_t i = 0; i < this->waveform_len; i++) {
+        const size_t dest = (offset + i) / 2 - offset / 2;
+
+        if (dest == len) this->waveform[len++] = this->waveform[i];
+        else this->waveform[dest] += this->waveform[i];
+    }
+
+    this->waveform_len = len;
+    this->decimation *= 2;
+}
+
+size_t analysis_stitch(Segment* segments, unsigned int n,
+WaveformValue** waveform, size_t* len)
+{
+    size_t decimation = 1, windows = 0;
+    double* dest;
+
+    *waveform = NULL;
+    *len = 0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        decimation = MAX(decimation, segments[i].decimation);
+        windows += segments[i].windows;
+    }
+    if (!segments[0].waveform || !windows) return decimation;
+
+    for (unsigned int i = 0; i < n; i++) {
+        while (segments[i].decimation < decimation) analysis_fold(&segments[i]);
+    }
+
+    *len = (windows + decimation - 1) / decimation;
+    if (!(dest = calloc(*len, sizeof(double)))) {
+        fprintf(stderr, "analysis malloc failed\n");
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        const size_t offset = segments[i].first_window / decimation;
+        for (size_t j = 0; j < segments[i].waveform_len && offset + j < *len; j++) {
+            dest[offset + j] += segments[i].waveform[j];
+        }
+    }
+
+    /* segments that were each under the limit can be over it together */
+
+    while (*len > segments[0].waveform_max) {
+        for (size_t j = 0; j < *len; j++) {
+            dest[j / 2] = (j % 2 ? dest[j / 2] : 0.0) + dest[j];
+        }
+        *len = (*len + 1) / 2;
+        decimation *= 2;
+    }
+
+    if (!(*waveform = malloc(*len * sizeof(WaveformValue)))) {
+        fprintf(stderr, "analysis malloc failed\n");
+        free(dest);
+        return 0;
+    }
+
+    /* the last value can cover less windows */
+
+    for (size_t j = 0; j < *len; j++) {
+        const size_t count = MIN(decimation, windows - j * decimation);
+        (*waveform)[j] = waveform_encode(dest[j] > 0.0
+                ? 10.0 * log10(dest[j] / (double)count) - 0.691 : -HUGE_VAL);
+    }
+
+    free(dest);
+    return decimation;
+}
+
+void analysis_full(Track* track, Segment* segments, ebur128_state** states,
+R128** kernels, unsigned int n)
+{
+    double true_peak = 0.0;
+
+    track->momentary_max = -HUGE_VAL;
+    track->short_term_max = -HUGE_VAL;
+
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int c = 0; c < segments[i].ingest->channels; c++) {
+            double peak = 0.0;
+            if (segments[i].r128) peak = r128_true_peak(segments[i].r128, c);
+            else ebur128_true_peak(segments[i].st, c, &peak);
+            true_peak = MAX(true_peak, peak);
+        }
+
+        if (segments[i].r128) {
+            segments[i].momentary_max = r128_momentary_max(segments[i].r128);
+            segments[i].short_term_max = r128_short_term_max(segments[i].r128);
+        }
+        track->momentary_max = MAX(track->momentary_max, segments[i].momentary_max);
+        track->short_term_max = MAX(track->short_term_max, segments[i].short_term_max);
+    }
+    track->true_peak = true_peak;
+
+    if (segments[0].r128) {
+        if (r128_loudness_range_multiple(kernels, n, &track->lra) != 0) {
+            track->lra = NAN;
+        }
+    } else if (ebur128_loudness_range_multiple(states, n, &track->lra) != EBUR128_SUCCESS) {
+        track->lra = NAN;
+    }
+}
+
+double analysis_sample_peak(Segment* this)
+{
+    double peak = 0.0;
+
+    /* TODO: unclear what peak value really is exactly
+     * -dBFS ?
+     */
+
+    if (this->r128) peak = r128_sample_peak(this->r128, 0);
+    else if (this->st) ebur128_sample_peak(this->st, 0, &peak);
+    return peak;
+}
+
+gboolean analysis_cancelled(const int* cancel)
+{
+    return cancel && g_atomic_int_get(cancel);
+}
+
+gpointer analysis_segment_thread(gpointer data)
+{
+    analysis_segment(data);
+    return NULL;
+}
+
+void analysis_segment_clear(Segment* this, int owned)
+{
+    if (owned) ingest_close(this->ingest);
+    if (this->st) ebur128_destroy(&this->st);
+    r128_free(this->r128);
+    this->r128 = NULL;
+    free(this->waveform);
+    this->ingest = NULL;
+    this->waveform = NULL;
+}
+
+unsigned int analysis_reserve(unsigned int wanted)
+{
+    const unsigned int cores = g_get_num_processors();
+    unsigned int idle, n;
+
+    g_mutex_lock(&analysis_running_lock);
+    idle = cores > analysis_running + 1 ? cores - analysis_running - 1 : 0;
+    n = 1 + MIN(wanted - 1, idle);
+    analysis_running += n;
+    g_mutex_unlock(&analysis_running_lock);
+
+    return n;
+}
+
+void analysis_release(unsigned int n)
+{
+    g_mutex_lock(&analysis_running_lock);
+    analysis_running -= n;
+    g_mutex_unlock(&analysis_running_lock);
+}
+
+size_t gcd(size_t a, size_t b)
+{
+    while (b) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
@@ -0,0 +1,463 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        batch.c
+ * @brief       headless batch analysis
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/analysis.h"
+#include "../include/config.h"
+#include "../include/track.h"
+
+#include "../include/batch.h"
+
+typedef enum BatchFormat {
+    BATCH_JSON,             /**< one json object per line */
+    BATCH_CSV,              /**< csv with header */
+} BatchFormat;
+
+/**
+ * Batch job
+ *
+ * one file analyzed by the pool, handed back to the main thread through
+ * the done queue
+ */
+typedef struct BatchJob {
+    gchar* path;            /**< file to analyze */
+    Track* track;           /**< the analyzed track or NULL when failed */
+} BatchJob;
+
+/**
+ * Batch
+ *
+ * only the main thread prints, workers push finished jobs to done
+ */
+typedef struct Batch {
+    GThreadPool* pool;      /**< analyzes jobs */
+    GAsyncQueue* done;      /**< finished jobs */
+    BatchFormat format;     /**< output format */
+    int waveform;           /**< print the waveform */
+    AnalysisProfile profile;/**< what to measure */
+    guint pending;          /**< jobs pushed but not printed */
+    guint analyzed;         /**< files analyzed */
+    guint failed;           /**< files that failed */
+} Batch;
+
+/**
+ * Add a file or all audio files of a directory (recursive)
+ *
+ * files given explicitly that aren't audio are reported as failed, other
+ * files in directories (eg cover art) are skipped
+ * symlinked directories are only followed when given explicitly
+ *
+ * @param this the batch object
+ * @param path file or directory
+ * @param explicit the path was given on the command line
+ */
+static void batch_add_path(Batch* this, const char* path, int explicit);
+
+/**
+ * @return TRUE when the content type of a file is audio
+ */
+static int batch_is_audio(const char* path);
+
+/**
+ * Thread pool function, analyze one file
+ *
+ * @param data the BatchJob
+ * @param batch the batch object
+ */
+static void batch_analyze(gpointer data, gpointer batch);
+
+/**
+ * Print finished jobs
+ *
+ * @param this the batch object
+ * @param wait block until all pending jobs are printed
+ */
+static void batch_flush(Batch* this, int wait);
+
+/**
+ * Print the record of a job
+ */
+static void batch_print(Batch* this, BatchJob* job);
+
+static void batch_print_json(Batch* this, BatchJob* job);
+
+static void batch_print_csv(Batch* this, BatchJob* job);
+
+/**
+ * Print a json string, null when str is NULL
+ */
+static void batch_print_json_string(const char* str);
+
+/**
+ * Print a csv field, empty when str is NULL
+ */
+static void batch_print_csv_string(const char* str);
+
+/**
+ * Print a number, null in json or empty in csv when not finite
+ * (eg the loudness of silence)
+ */
+static void batch_print_number(Batch* this, const char* format, double value);
+
+static void batch_usage(void);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+int batch_run(int argc, char** argv)
+{
+    Batch this = { .format = BATCH_JSON, .profile = ANALYSIS_PROFILE };
+    gint jobs = (gint)g_get_num_processors();
+    GError* err = NULL;
+    int i;
+
+    for (i = 0; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            char* end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end || n < 1 || n > G_MAXINT) {
+                fprintf(stderr, "invalid number of jobs \"%s\"\n", argv[i]);
+                return BATCH_EXIT_USAGE;
+            }
+            jobs = (gint)n;
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            int profile = analysis_profile_parse(argv[++i]);
+            if (profile < 0) {
+                fprintf(stderr, "invalid profile \"%s\"\n", argv[i]);
+                return BATCH_EXIT_USAGE;
+            }
+            this.profile = (AnalysisProfile)profile;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            this.format = BATCH_JSON;
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            this.format = BATCH_CSV;
+        } else if (strcmp(argv[i], "--waveform") == 0) {
+            this.waveform = TRUE;
+        } else {
+            batch_usage();
+            return BATCH_EXIT_USAGE;
+        }
+    }
+
+    if (i >= argc) {
+        batch_usage();
+        return BATCH_EXIT_USAGE;
+    }
+
+    /* the waveform is measured from ANALYSIS_STANDARD on */
+
+    if (this.waveform) this.profile = MAX(this.profile, ANALYSIS_STANDARD);
+
+    /* workers are bounded, files are queued until a worker is free
+     * files longer than ANALYSIS_SEGMENT_MIN are split over the processors
+     * the other workers leave idle, see analysis_run
+     */
+
+    this.done = g_async_queue_new();
+    if (!(this.pool = g_thread_pool_new(batch_analyze, &this, jobs, TRUE, &err))) {
+        fprintf(stderr, "failed to create thread pool\n > %s\n", err->message);
+        g_error_free(err);
+        g_async_queue_unref(this.done);
+        return EXIT_FAILURE;
+    }
+
+    if (this.format == BATCH_CSV) {
+        printf("path,status,name,artist,album,date,format,sample_rate,"
+                "length,lufs,peak,true_peak,lra,momentary_max,short_term_max%s\n",
+                this.waveform ? ",waveform_window,waveform" : "");
+    }
+
+    for (; i < argc; i++) batch_add_path(&this, argv[i], TRUE);
+
+    batch_flush(&this, TRUE);
+
+    g_thread_pool_free(this.pool, FALSE, TRUE);
+    g_async_queue_unref(this.done);
+
+    fprintf(stderr, "analyzed %u files, %u failed\n", this.analyzed, this.failed);
+
+    if (this.analyzed + this.failed == 0) return BATCH_EXIT_USAGE;
+    return this.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void batch_add_path(Batch* this, const char* path, int explicit)
+{
+    BatchJob* job;
+    GError* err = NULL;
+    int audio;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        GDir* dir;
+        const gchar* entry;
+
+        /* a symlink found while recursing may point to a parent */
+
+        if (!explicit && g_file_test(path, G_FILE_TEST_IS_SYMLINK)) return;
+
+        if (!(dir = g_dir_open(path, 0, &err))) {
+            fprintf(stderr, "%s\n", err->message);
+            g_error_free(err);
+            this->failed++;
+            return;
+        }
+        while ((entry = g_dir_read_name(dir))) {
+            gchar* child = g_build_filename(path, entry, NULL);
+            batch_add_path(this, child, FALSE);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        return;
+    }
+
+    if (!(audio = batch_is_audio(path)) && !explicit) return;
+
+    if (!(job = malloc(sizeof(BatchJob)))) {
+        fprintf(stderr, "failed to allocate batch job\n");
+        this->failed++;
+        return;
+    }
+    job->path = g_strdup(path);
+    job->track = NULL;
+    this->pending++;
+
+    if (!audio) {
+        fprintf(stderr, "Error loading file \"%s\": Not an audio file\n", path);
+        g_async_queue_push(this->done, job);
+    } else if (!g_thread_pool_push(this->pool, job, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        g_error_free(err);
+        g_async_queue_push(this->done, job);
+    }
+
+    /* print what's done while the rest is being queued */
+
+    batch_flush(this, FALSE);
+}
+
+int batch_is_audio(const char* path)
+{
+    GFile* file = g_file_new_for_path(path);
+    GFileInfo* info;
+    const gchar* type;
+    int result = FALSE;
+
+    /* same test as the tracklist uses for dropped files */
+
+    info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+    if (info && (type = g_file_info_get_content_type(info))) {
+        result = g_strstr_len(type, -1, "audio")
+            || g_strstr_len(type, -1, "org.xiph.flac");
+    }
+
+    if (info) g_object_unref(info);
+    g_object_unref(file);
+    return result;
+}
+
+void batch_analyze(gpointer data, gpointer batch)
+{
+    BatchJob* job = data;
+    Batch* this = batch;
+
+    job->track = track_new(NULL, NULL, job->path, (int)this->profile, NULL);
+    g_async_queue_push(this->done, job);
+}
+
+void batch_flush(Batch* this, int wait)
+{
+    BatchJob* job;
+
+    while (this->pending) {
+        if (wait) job = g_async_queue_pop(this->done);
+        else if (!(job = g_async_queue_try_pop(this->done))) break;
+
+        batch_print(this, job);
+        this->pending--;
+
+        track_free(job->track);
+        g_free(job->path);
+        free(job);
+    }
+}
+
+void batch_print(Batch* this, BatchJob* job)
+{
+    if (job->track) this->analyzed++;
+    else this->failed++;
+
+    if (this->format == BATCH_CSV) batch_print_csv(this, job);
+    else batch_print_json(this, job);
+
+    /* records are read as they come, eg by a pipe */
+
+    fflush(stdout);
+}
+
+void batch_print_json(Batch* this, BatchJob* job)
+{
+    Track* track = job->track;
+
+    printf("{\"path\": ");
+    batch_print_json_string(job->path);
+
+    if (!track) {
+        printf(", \"status\": \"failed\"}\n");
+        return;
+    }
+
+    printf(", \"status\": \"ok\", \"name\": ");
+    batch_print_json_string(track->name);
+    printf(", \"artist\": ");
+    batch_print_json_string(track->artist);
+    printf(", \"album\": ");
+    batch_print_json_string(track->album);
+    printf(", \"date\": ");
+    batch_print_json_string(track->date);
+    printf(", \"format\": ");
+    batch_print_json_string(track->format);
+    printf(", \"sample_rate\": %u", track->sample_rate);
+    printf(", \"length\": ");
+    batch_print_number(this, "%.3f", track->length);
+    printf(", \"lufs\": ");
+    batch_print_number(this, "%.4f", track->lufs);
+    printf(", \"peak\": ");
+    batch_print_number(this, "%.6f", track->peak);
+    printf(", \"true_peak\": ");
+    batch_print_number(this, "%.6f", track->true_peak);
+    printf(", \"lra\": ");
+    batch_print_number(this, "%.4f", track->lra);
+    printf(", \"momentary_max\": ");
+    batch_print_number(this, "%.4f", track->momentary_max);
+    printf(", \"short_term_max\": ");
+    batch_print_number(this, "%.4f", track->short_term_max);
+
+    if (this->waveform) {
+        printf(", \"waveform_window\": %lu", track->waveform_window);
+        printf(", \"waveform\": [");
+        for (size_t i = 0; i < track->waveform_len; i++) {
+            if (i) printf(", ");
+            batch_print_number(this, "%.2f", waveform_decode(track->waveform[i]));
+        }
+        printf("]");
+    }
+
+    printf("}\n");
+}
+
+void batch_print_csv(Batch* this, BatchJob* job)
+{
+    Track* track = job->track;
+
+    batch_print_csv_string(job->path);
+
+    if (!track) {
+        printf(",failed,,,,,,,,,,,,,%s\n", this->waveform ? ",," : "");
+        return;
+    }
+
+    printf(",ok,");
+    batch_print_csv_string(track->name);
+    printf(",");
+    batch_print_csv_string(track->artist);
+    printf(",");
+    batch_print_csv_string(track->album);
+    printf(",");
+    batch_print_csv_string(track->date);
+    printf(",");
+    batch_print_csv_string(track->format);
+    if (track->sample_rate) printf(",%u,", track->sample_rate);
+    else printf(",,");
+    batch_print_number(this, "%.3f", track->length);
+    printf(",");
+    batch_print_number(this, "%.4f", track->lufs);
+    printf(",");
+    batch_print_number(this, "%.6f", track->peak);
+    printf(",");
+    batch_print_number(this, "%.6f", track->true_peak);
+    printf(",");
+    batch_print_number(this, "%.4f", track->lra);
+    printf(",");
+    batch_print_number(this, "%.4f", track->momentary_max);
+    printf(",");
+    batch_print_number(this, "%.4f", track->short_term_max);
+
+    /* the waveform is one field of space separated values */
+
+    if (this->waveform) {
+        printf(",%lu,\"", track->waveform_window);
+        for (size_t i = 0; i < track->waveform_len; i++) {
+            if (i) printf(" ");
+            batch_print_number(this, "%.2f", waveform_decode(track->waveform[i]));
+        }
+        printf("\"");
+    }
+
+    printf("\n");
+}
+
+void batch_print_json_string(const char* str)
+{
+    if (!str) {
+        printf("null");
+        return;
+    }
+
+    putchar('"');
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\') printf("\\%c", *c);
+        else if (*c < 0x20) printf("\\u%04x", *c);
+        else putchar(*c);
+    }
+    putchar('"');
+}
+
+void batch_print_csv_string(const char* str)
+{
+    if (!str) return;
+
+    putchar('"');
+    for (const char* c = str; *c; c++) {
+        if (*c == '"') putchar('"');
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+void batch_print_number(Batch* this, const char* format, double value)
+{
+    if (isfinite(value)) printf(format, value);
+    else if (this->format == BATCH_JSON) printf("null");
+}
+
+void batch_usage(void)
+{
+    fprintf(stderr, "usage: alphabet %s [--jobs N] [--profile quick|standard|full] "
+            "[--json|--csv] [--waveform] files|directories...\n", BATCH_OPTION);
+}
@@ -0,0 +1,524 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        cache.c
+ * @brief       persistent analysis cache
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gtk/gtk.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/config.h"
+#include "../include/track.h"
+
+#include "../include/cache.h"
+
+/**
+ * identifies an alphabet cache entry
+ */
+#define CACHE_MAGIC "ABCACHE"
+
+/**
+ * increment whenever the layout of CacheHeader or the data following it
+ * changes, older entries are then treated as a miss and overwritten
+ */
+#define CACHE_VERSION 4
+
+/**
+ * Cache entry header
+ *
+ * an entry on disk is laid out as:
+ *      CacheHeader
+ *      path (path_len bytes, zero padded to 8 bytes)
+ *      waveform (waveform_len WaveformValue)
+ *
+ * all members are naturally aligned, the waveform is read straight into
+ * an array of WaveformValue
+ */
+typedef struct CacheHeader {
+    char magic[8];          /**< CACHE_MAGIC */
+    guint32 version;        /**< CACHE_VERSION */
+    guint32 path_len;       /**< length of the path without terminator */
+    gint64 size;            /**< size of the file when analyzed */
+    gint64 mtime;           /**< mtime of the file when analyzed */
+    guint8 hash[32];        /**< sha256 of head and tail or zero */
+    gdouble length;         /**< Track.length */
+    gdouble lufs;           /**< Track.lufs */
+    gdouble peak;           /**< Track.peak */
+    gdouble true_peak;      /**< Track.true_peak */
+    gdouble lra;            /**< Track.lra */
+    gdouble momentary_max;  /**< Track.momentary_max */
+    gdouble short_term_max; /**< Track.short_term_max */
+    guint32 sample_rate;    /**< Track.sample_rate */
+    guint32 profile;        /**< Track.profile */
+    guint32 waveform_window;/**< Track.waveform_window */
+    guint32 reserved;       /**< zero */
+    guint64 waveform_len;   /**< Track.waveform_len */
+} CacheHeader;
+
+/**
+ * Entry in the cache directory, used for eviction
+ */
+typedef struct CacheFile {
+    gchar* name;            /**< file name of the entry */
+    gint64 mtime;           /**< last time the entry was used */
+    gsize size;             /**< size on disk */
+} CacheFile;
+
+/**
+ * Round up to multiple of 8 bytes
+ */
+#define CACHE_ALIGN(n) (((n) + 7) & ~(gsize)7)
+
+/**
+ * Get the absolute path of the cache entry for a file
+ *
+ * @param this the cache object
+ * @param path absolute path of the audio file
+ * @return newly allocated path, free with g_free
+ */
+static gchar* cache_entry_path(Cache* this, const gchar* path);
+
+/**
+ * Hash the head and tail of a file
+ *
+ * only used when CACHE_CONTENT_HASH is enabled, hash is zeroed otherwise
+ *
+ * @param path absolute path of the audio file
+ * @param size file size in bytes
+ * @param hash destination of the sha256 digest
+ * @return 0 on success or -1 when the file could not be read
+ */
+static int cache_hash_file(const gchar* path, gint64 size, guint8 hash[32]);
+
+/**
+ * Read bytes at an offset, retried until all are read
+ *
+ * @param fd the open file
+ * @param buffer destination
+ * @param bytes number of bytes
+ * @param offset offset in the file
+ * @return 0 on success or -1 when failed or the file is shorter
+ */
+static int cache_read(int fd, void* buffer, gsize bytes, off_t offset);
+
+/**
+ * Remove least recently used entries until the cache fits max_size
+ *
+ * must be called with lock held
+ *
+ * @param this the cache object
+ */
+static void cache_evict(Cache* this);
+
+/**
+ * Sort CacheFile by mtime, oldest first
+ */
+static gint cache_file_compare(gconstpointer a, gconstpointer b);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+Cache* cache_new(const gchar* dir, gsize max_size)
+{
+    Cache* this;
+    GDir* gdir;
+    const gchar* name;
+    GError* err = NULL;
+
+    if (g_mkdir_with_parents(dir, 0755) != 0) {
+        g_printerr("failed to create cache directory \"%s\": %s\n",
+                dir, strerror(errno));
+        return NULL;
+    }
+
+    if (!(gdir = g_dir_open(dir, 0, &err))) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return NULL;
+    }
+
+    this = malloc(sizeof(Cache));
+    this->dir = g_strdup(dir);
+    this->max_size = max_size;
+    this->size = 0;
+    g_mutex_init(&this->lock);
+
+    /* sum up the size of all entries once, the total is kept up to date
+     * on each store so the directory only needs to be scanned on eviction
+     */
+
+    while ((name = g_dir_read_name(gdir))) {
+        struct stat st;
+        gchar* entry = g_build_filename(dir, name, NULL);
+        if (stat(entry, &st) == 0 && S_ISREG(st.st_mode)) {
+            this->size += (gsize)st.st_size;
+        }
+        g_free(entry);
+    }
+    g_dir_close(gdir);
+
+    return this;
+}
+
+gboolean cache_lookup(Cache* this, Track* track, gint64 size, gint64 mtime)
+{
+    gboolean hit = FALSE;
+    gchar* entry, * path = NULL;
+    CacheHeader header;
+    WaveformValue* waveform = NULL;
+    struct stat st;
+    gsize path_len, expected, room, bytes;
+    guint8 hash[32] = { 0 };
+    int fd;
+
+    if (!this || !track) return FALSE;
+
+    entry = cache_entry_path(this, track->path);
+
+    if ((fd = open(entry, O_RDONLY)) < 0) {
+        g_free(entry);
+        return FALSE;
+    }
+
+    /* the header is read first, a stale entry costs one small read and the
+     * waveform is read straight into the track
+     */
+
+    if (fstat(fd, &st) != 0 || (gsize)st.st_size < sizeof(CacheHeader)
+            || cache_read(fd, &header, sizeof(header), 0) != 0)
+    {
+        goto done;
+    }
+
+    path_len = strlen(track->path);
+    room = (gsize)st.st_size - sizeof(CacheHeader);
+
+    /* the lengths in the header are not trusted, they must fit in the file
+     * before the size of the entry is calculated from them
+     */
+
+    if (header.path_len != path_len || CACHE_ALIGN(path_len) > room
+            || header.waveform_len
+                > (room - CACHE_ALIGN(path_len)) / sizeof(WaveformValue))
+    {
+        goto done;
+    }
+
+    bytes = header.waveform_len * sizeof(WaveformValue);
+    expected = sizeof(CacheHeader) + CACHE_ALIGN(path_len) + bytes;
+
+    if (    memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+            || header.version != CACHE_VERSION
+            || header.size != size
+            || header.mtime != mtime
+            || expected != (gsize)st.st_size)
+    {
+        goto done;
+    }
+
+    if (!(path = malloc(path_len + 1))) {
+        fprintf(stderr, "cache malloc failed\n");
+        goto done;
+    }
+    if (cache_read(fd, path, path_len, sizeof(CacheHeader)) != 0
+            || memcmp(path, track->path, path_len) != 0)
+    {
+        goto done;
+    }
+
+    if (CACHE_CONTENT_HASH) {
+        if (cache_hash_file(track->path, size, hash) != 0) goto done;
+        if (memcmp(hash, header.hash, sizeof(hash)) != 0) goto done;
+    }
+
+    if (bytes) {
+        if (!(waveform = malloc(bytes))) {
+            fprintf(stderr, "cache malloc failed\n");
+            goto done;
+        }
+        if (cache_read(fd, waveform, bytes,
+                    (off_t)(sizeof(CacheHeader) + CACHE_ALIGN(path_len))) != 0)
+        {
+            goto done;
+        }
+    }
+
+    free(track->waveform);
+    track->waveform = waveform;
+    track->waveform_len = header.waveform_len;
+    track->waveform_window = header.waveform_window;
+    waveform = NULL;
+
+    waveform_free(track->pyramid);
+    track->pyramid = waveform_new(track->waveform, track->waveform_len);
+
+    track->sample_rate = header.sample_rate;
+    track->length = header.length;
+    track->lufs = header.lufs;
+    track->peak = header.peak;
+    track->true_peak = header.true_peak;
+    track->lra = header.lra;
+    track->momentary_max = header.momentary_max;
+    track->short_term_max = header.short_term_max;
+    track->profile = (int)header.profile;
+    track->analyzed = 1;
+
+    /* bump the mtime of the entry, eviction removes the oldest first */
+    utimensat(AT_FDCWD, entry, NULL, 0);
+    hit = TRUE;
+
+done:
+    close(fd);
+    free(waveform);
+    free(path);
+    g_free(entry);
+    return hit;
+}
+
+void cache_store(Cache* this, Track* track, gint64 size, gint64 mtime)
+{
+    CacheHeader header = { 0 };
+    gchar* entry, * tmp;
+    const guint8 pad[8] = { 0 };
+    gsize path_len, bytes;
+    struct stat st;
+    FILE* file;
+    int fd;
+
+    if (!this || !track) return;
+
+    path_len = strlen(track->path);
+    if (path_len > G_MAXUINT32) return;
+
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.path_len = (guint32)path_len;
+    header.size = size;
+    header.mtime = mtime;
+    header.length = track->length;
+    header.lufs = track->lufs;
+    header.peak = track->peak;
+    header.true_peak = track->true_peak;
+    header.lra = track->lra;
+    header.momentary_max = track->momentary_max;
+    header.short_term_max = track->short_term_max;
+    header.profile = (guint32)track->profile;
+    header.sample_rate = track->sample_rate;
+    header.waveform_window = (guint32)track->waveform_window;
+    header.waveform_len = track->waveform ? track->waveform_len : 0;
+
+    if (CACHE_CONTENT_HASH && cache_hash_file(track->path, size, header.hash)) {
+        return;
+    }
+
+    /* write to a temporary file first and rename it in place so a reader
+     * never maps a partially written entry
+     */
+
+    /* the temporary name is unique, an analysis thread storing the same
+     * file never writes into the entry of another one
+     */
+
+    entry = cache_entry_path(this, track->path);
+    tmp = g_strconcat(entry, ".XXXXXX", NULL);
+
+    if ((fd = g_mkstemp(tmp)) < 0) {
+        g_printerr("failed to open cache entry \"%s\": %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+
+    if (!(file = fdopen(fd, "wb"))) {
+        g_printerr("failed to open cache entry \"%s\": %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        goto fail;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(track->path, 1, path_len, file);
+    fwrite(pad, 1, CACHE_ALIGN(path_len) - path_len, file);
+    if (header.waveform_len) {
+        fwrite(track->waveform, sizeof(WaveformValue), header.waveform_len, file);
+    }
+
+    if (ferror(file) | fclose(file)) {
+        g_printerr("failed to write cache entry \"%s\"\n", tmp);
+        unlink(tmp);
+        goto fail;
+    }
+
+    bytes = sizeof(header) + CACHE_ALIGN(path_len)
+          + header.waveform_len * sizeof(WaveformValue);
+
+    g_mutex_lock(&this->lock);
+
+    if (stat(entry, &st) == 0) this->size -= MIN(this->size, (gsize)st.st_size);
+
+    if (rename(tmp, entry) != 0) {
+        g_printerr("failed to store cache entry \"%s\": %s\n", entry, strerror(errno));
+        unlink(tmp);
+    } else {
+        this->size += bytes;
+    }
+
+    if (this->size > this->max_size) cache_evict(this);
+
+    g_mutex_unlock(&this->lock);
+
+fail:
+    g_free(tmp);
+    g_free(entry);
+}
+
+void cache_free(Cache* this)
+{
+    if (!this) return;
+
+    g_mutex_clear(&this->lock);
+    g_free(this->dir);
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+gchar* cache_entry_path(Cache* this, const gchar* path)
+{
+    gchar* hash, * name, * entry;
+
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, path, -1);
+    name = g_strconcat(hash, ".bin", NULL);
+    entry = g_build_filename(this->dir, name, NULL);
+
+    g_free(hash);
+    g_free(name);
+    return entry;
+}
+
+int cache_hash_file(const gchar* path, gint64 size, guint8 hash[32])
+{
+    GChecksum* checksum;
+    FILE* file;
+    guint8* buffer;
+    gsize len = 32, bytes;
+
+    if (!(file = fopen(path, "rb"))) return -1;
+    if (!(buffer = malloc(CACHE_HASH_BLOCK))) {
+        fclose(file);
+        return -1;
+    }
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+    /* hash head and tail only, enough to detect a rewritten file without
+     * reading all of it
+     */
+
+    bytes = fread(buffer, 1, CACHE_HASH_BLOCK, file);
+    g_checksum_update(checksum, buffer, (gssize)bytes);
+
+    if (size > (gint64)(2 * CACHE_HASH_BLOCK)) {
+        fseeko(file, -(off_t)CACHE_HASH_BLOCK, SEEK_END);
+        bytes = fread(buffer, 1, CACHE_HASH_BLOCK, file);
+        g_checksum_update(checksum, buffer, (gssize)bytes);
+    }
+
+    g_checksum_get_digest(checksum, hash, &len);
+
+    g_checksum_free(checksum);
+    free(buffer);
+    fclose(file);
+    return 0;
+}
+
+int cache_read(int fd, void* buffer, gsize bytes, off_t offset)
+{
+    guint8* dest = buffer;
+    ssize_t n;
+
+    while (bytes) {
+        if ((n = pread(fd, dest, bytes, offset)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (!n) return -1;
+        dest += n;
+        bytes -= (gsize)n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+void cache_evict(Cache* this)
+{
+    GDir* gdir;
+    GArray* files;
+    const gchar* name;
+    gsize target;
+
+    if (!(gdir = g_dir_open(this->dir, 0, NULL))) return;
+
+    files = g_array_new(FALSE, FALSE, sizeof(CacheFile));
+
+    while ((name = g_dir_read_name(gdir))) {
+        struct stat st;
+        gchar* entry;
+
+        if (!g_str_has_suffix(name, ".bin")) continue;
+
+        entry = g_build_filename(this->dir, name, NULL);
+        if (stat(entry, &st) == 0 && S_ISREG(st.st_mode)) {
+            CacheFile file = {
+                g_strdup(name), (gint64)st.st_mtime, (gsize)st.st_size
+            };
+            g_array_append_val(files, file);
+        }
+        g_free(entry);
+    }
+    g_dir_close(gdir);
+
+    /* evict down to 3/4 of the limit so we don't have to scan the directory
+     * again for every new entry once the cache is full
+     */
+
+    target = this->max_size / 4 * 3;
+    g_array_sort(files, cache_file_compare);
+
+    for (guint i = 0; i < files->len; i++) {
+        CacheFile* file = &g_array_index(files, CacheFile, i);
+
+        if (this->size > target) {
+            gchar* entry = g_build_filename(this->dir, file->name, NULL);
+            if (unlink(entry) == 0) this->size -= MIN(this->size, file->size);
+            g_free(entry);
+        }
+        g_free(file->name);
+    }
+
+    g_array_free(files, TRUE);
+}
+
+gint cache_file_compare(gconstpointer a, gconstpointer b)
+{
+    const CacheFile* file_a = a;
+    const CacheFile* file_b = b;
+
+    return (file_a->mtime > file_b->mtime) - (file_a->mtime < file_b->mtime);
+}
@@ -22,12 +22,20 @@
 
 #include "../include/counter.h"
 
-void counter_update(Counter* this)
+void counter_update(Counter* this, gdouble position)
 {
     if (!this || !this->player) return;
     char count[100];
-    gdouble seconds = this->player->position;
+    gdouble seconds = position;
     seconds *= seconds < 0 ? -1 : 1;
+
+    /* setting the label is expensive (see FIXME), only do so when the
+     * displayed milliseconds change
+     */
+
+    if ((gint64)(seconds*1000) == (gint64)(this->position*1000)) return;
+    this->position = seconds;
+
     sprintf(count, "<big><tt>%02d:%02d.%03d</tt></big>", (int)(seconds/60), (int)(fmod(seconds,60)), (int)(fmod(seconds,1)*1000));
     gtk_label_set_markup(GTK_LABEL(this->label), count);
     /* FIXME: setting label emits size-allocate !!! check by connect signal and start playback*/
@@ -40,7 +48,7 @@ Counter* counter_new(Player* player)
 
     this->player = player;
     this->box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-    this->position = 0;
+    this->position = -1.0;
 
     frame = gtk_frame_new(NULL);
     gtk_box_pack_start(GTK_BOX(this->box), frame, TRUE, TRUE, 0);
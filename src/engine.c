@@ -0,0 +1,816 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        engine.c
+ * @brief       native decode and mix playback engine
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/ingest.h"
+#include "../include/resample.h"
+#include "../include/sink.h"
+#include "../include/track.h"
+
+#include "../include/engine.h"
+
+/**
+ * Create a source and start its decoder
+ *
+ * the engine lock must be held, the source is decoded from the current
+ * position
+ *
+ * @param this the engine object
+ * @param path the file to decode
+ * @return the newly created source or NULL when failed
+ */
+static EngineSource* engine_source_new(Engine* this, const char* path);
+
+/**
+ * Stop the decoder of a source and free it
+ *
+ * the engine lock must not be held, the source must be removed from the
+ * engine already
+ *
+ * @param source the source
+ */
+static void engine_source_free(EngineSource* source);
+
+/**
+ * Find the source of a file
+ *
+ * @param this the engine object
+ * @param path the file
+ * @return the source or NULL
+ */
+static EngineSource* engine_find(Engine* this, const char* path);
+
+/**
+ * Find a free source slot
+ *
+ * @param this the engine object
+ * @param victim when not NULL, a source that isn't playing can be removed
+ * to make room, it's returned here and must be freed by the caller
+ * @return index of the slot or -1 when all slots are used
+ */
+static int engine_slot(Engine* this, EngineSource** victim);
+
+/**
+ * Number of decoded frames of a source from the engine position
+ *
+ * @param this the engine object
+ * @param source the source
+ * @return number of frames that can be mixed
+ */
+static size_t engine_available(Engine* this, EngineSource* source);
+
+/**
+ * Check if a source won't decode more frames at this position
+ *
+ * @param this the engine object
+ * @param source the source
+ * @return TRUE at end of file or when the file can't be played
+ */
+static int engine_done(Engine* this, EngineSource* source);
+
+/**
+ * Move the engine to a frame
+ *
+ * the engine lock must be held, all decoders seek to the frame
+ *
+ * @param this the engine object
+ * @param frame the frame index
+ */
+static void engine_locate(Engine* this, uint64_t frame);
+
+/**
+ * Number of frames until the loop wraps
+ *
+ * @param this the engine object
+ * @return frames from the position to the loop stop or UINT64_MAX when
+ * there's no loop ahead
+ */
+static uint64_t engine_loop_distance(Engine* this);
+
+/**
+ * Drop the frames of a source that are not valid for a new loop anymore
+ *
+ * the frames up to keep are left in the ring, the decoder continues after
+ * them, this is not a seek and the other sources are not affected
+ * the engine lock must be held
+ *
+ * @param this the engine object
+ * @param source the source
+ * @param keep frames from the cursor that are still valid
+ */
+static void engine_trim(Engine* this, EngineSource* source, uint64_t keep);
+
+/**
+ * Mix a period of the active source, crossfaded with the previous one
+ *
+ * @param this the engine object
+ * @param out destination, n interleaved frames
+ * @param n number of frames, at most the available frames of the source
+ */
+static void engine_mix(Engine* this, float* out, size_t n);
+
+/**
+ * Call the notify callback
+ *
+ * the engine lock must not be held
+ *
+ * @param this the engine object
+ */
+static void engine_notify(Engine* this);
+
+/**
+ * Decoder thread of a source
+ */
+static gpointer engine_decode_thread(gpointer data);
+
+/**
+ * Mixer thread of the engine
+ */
+static gpointer engine_mix_thread(gpointer data);
+
+/**
+ * Convert dB to a linear gain factor
+ */
+static double db_to_gain(double db);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+Engine* engine_new(const char* sink, int realtime)
+{
+    Engine* this;
+
+    if (!(this = calloc(1, sizeof(Engine)))) {
+        fprintf(stderr, "failed to allocate engine\n");
+        return NULL;
+    }
+
+    if (!(this->sink = sink_new(sink))) {
+        free(this);
+        return NULL;
+    }
+
+    this->realtime = realtime;
+    g_mutex_init(&this->lock);
+    g_cond_init(&this->cond);
+    this->thread = g_thread_new("mixer", engine_mix_thread, this);
+
+    return this;
+}
+
+void engine_prepare(Engine* this, Track** tracks, guint n)
+{
+    EngineSource* victims[ENGINE_SOURCES];
+    guint n_victims = 0;
+
+    g_mutex_lock(&this->lock);
+
+    /* sources of tracks that are not wanted anymore are stopped first to
+     * make room, the tracks that don't fit are not decoded
+     */
+
+    for (guint i = 0; i < ENGINE_SOURCES; i++) {
+        EngineSource* source = this->sources[i];
+        int wanted = FALSE;
+
+        if (!source || source == this->active || source == this->fade_from) continue;
+
+        for (guint j = 0; j < n && !wanted; j++) {
+            wanted = tracks[j] && strcmp(tracks[j]->path, source->path) == 0;
+        }
+        if (!wanted) {
+            victims[n_victims++] = source;
+            this->sources[i] = NULL;
+        }
+    }
+
+    for (guint j = 0; j < n; j++) {
+        int i;
+
+        if (!tracks[j] || engine_find(this, tracks[j]->path)) continue;
+        if ((i = engine_slot(this, NULL)) < 0) break;
+        this->sources[i] = engine_source_new(this, tracks[j]->path);
+    }
+
+    g_mutex_unlock(&this->lock);
+
+    for (guint i = 0; i < n_victims; i++) {
+        engine_source_free(victims[i]);
+    }
+}
+
+int engine_select(Engine* this, Track* track, double gain)
+{
+    EngineSource* source;
+    EngineSource* victim = NULL;
+
+    g_mutex_lock(&this->lock);
+
+    if (!(source = engine_find(this, track->path))) {
+        int i = engine_slot(this, &victim);
+
+        if (i < 0 || !(source = engine_source_new(this, track->path))) {
+            g_mutex_unlock(&this->lock);
+            if (victim) engine_source_free(victim);
+            fprintf(stderr, "no engine source for \"%s\"\n", track->path);
+            return -1;
+        }
+        this->sources[i] = source;
+    }
+
+    source->gain = db_to_gain(gain);
+
+    /* the switch happens at the next period, both tracks are at the same
+     * frame so the crossfade is sample accurate
+     */
+
+    if (source != this->active) {
+        this->fade_from = this->fade_len ? this->active : NULL;
+        this->fade_pos = 0;
+        this->active = source;
+        this->stats.switches++;
+    }
+
+    g_cond_broadcast(&this->cond);
+    g_mutex_unlock(&this->lock);
+
+    if (victim) engine_source_free(victim);
+    return 0;
+}
+
+void engine_set_gain(Engine* this, double gain)
+{
+    g_mutex_lock(&this->lock);
+    if (this->active) this->active->gain = db_to_gain(gain);
+    g_mutex_unlock(&this->lock);
+}
+
+void engine_play(Engine* this, int play)
+{
+    g_mutex_lock(&this->lock);
+    if (play != this->playing) {
+        this->playing = play;
+        this->clock = 0;
+    }
+    g_cond_broadcast(&this->cond);
+    g_mutex_unlock(&this->lock);
+
+    engine_notify(this);
+}
+
+int engine_playing(Engine* this)
+{
+    int playing;
+
+    g_mutex_lock(&this->lock);
+    playing = this->playing;
+    g_mutex_unlock(&this->lock);
+
+    return playing;
+}
+
+void engine_seek(Engine* this, double position)
+{
+    /* before the first file opened the format is unknown, the position is
+     * applied when it is
+     */
+
+    g_mutex_lock(&this->lock);
+    if (this->sample_rate) {
+        engine_locate(this, (uint64_t)(MAX(position, 0.0) * this->sample_rate));
+    } else {
+        this->pending_position = MAX(position, 0.0);
+    }
+    g_mutex_unlock(&this->lock);
+
+    engine_notify(this);
+}
+
+double engine_get_position(Engine* this)
+{
+    double position = 0.0;
+
+    g_mutex_lock(&this->lock);
+    if (this->sample_rate) {
+        position = (double)this->position / (double)this->sample_rate;
+    } else {
+        position = this->pending_position;
+    }
+    g_mutex_unlock(&this->lock);
+
+    return position;
+}
+
+void engine_set_loop(Engine* this, double start, double stop)
+{
+    g_mutex_lock(&this->lock);
+    if (this->sample_rate) {
+        const uint64_t before = engine_loop_distance(this);
+
+        this->loop_start = (uint64_t)(MAX(start, 0.0) * this->sample_rate);
+        this->loop_stop = stop > 0.0 ? (uint64_t)(stop * this->sample_rate) : 0;
+
+        /* a loop behind the position is a jump, otherwise the decoded frames
+         * are kept up to where the old or the new loop wraps
+         */
+
+        if (this->loop_stop > this->loop_start && this->position >= this->loop_stop) {
+            engine_locate(this, this->loop_start);
+        } else {
+            const uint64_t keep = MIN(before, engine_loop_distance(this));
+
+            for (guint i = 0; i < ENGINE_SOURCES; i++) {
+                if (this->sources[i]) engine_trim(this, this->sources[i], keep);
+            }
+        }
+    } else {
+        this->pending_loop_start = MAX(start, 0.0);
+        this->pending_loop_stop = MAX(stop, 0.0);
+    }
+    g_mutex_unlock(&this->lock);
+}
+
+void engine_set_notify(Engine* this, void (*notify)(void*), void* data)
+{
+    g_mutex_lock(&this->lock);
+    this->notify = notify;
+    this->notify_data = data;
+    g_mutex_unlock(&this->lock);
+}
+
+void engine_print_stats(Engine* this)
+{
+    g_mutex_lock(&this->lock);
+    printf("engine       = %u Hz, %u channels\n", this->sample_rate, this->channels);
+    printf("periods      = %" G_GUINT64_FORMAT "\n", this->stats.periods);
+    printf("frames       = %" G_GUINT64_FORMAT "\n", this->stats.frames);
+    printf("underruns    = %" G_GUINT64_FORMAT "\n", this->stats.underruns);
+    printf("switches     = %" G_GUINT64_FORMAT "\n", this->stats.switches);
+    printf("mix avg      = %.1f us\n", this->stats.periods
+            ? (double)this->stats.mix_time / (double)this->stats.periods : 0.0);
+    printf("\n");
+    g_mutex_unlock(&this->lock);
+}
+
+void engine_free(Engine* this)
+{
+    if (!this) return;
+
+    g_mutex_lock(&this->lock);
+    this->quit = TRUE;
+    g_cond_broadcast(&this->cond);
+    g_mutex_unlock(&this->lock);
+
+    g_thread_join(this->thread);
+
+    for (guint i = 0; i < ENGINE_SOURCES; i++) {
+        if (this->sources[i]) engine_source_free(this->sources[i]);
+    }
+
+    sink_free(this->sink);
+    g_mutex_clear(&this->lock);
+    g_cond_clear(&this->cond);
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+EngineSource* engine_source_new(Engine* this, const char* path)
+{
+    EngineSource* source;
+
+    if (!(source = calloc(1, sizeof(EngineSource)))
+            || !(source->path = strdup(path)))
+    {
+        fprintf(stderr, "failed to allocate engine source\n");
+        free(source);
+        return NULL;
+    }
+
+    /* an outdated generation makes the decoder start at the engine position */
+
+    source->engine = this;
+    source->gain = 1.0;
+    source->generation = this->generation - 1;
+    source->thread = g_thread_new("decoder", engine_decode_thread, source);
+
+    return source;
+}
+
+void engine_source_free(EngineSource* source)
+{
+    Engine* this = source->engine;
+
+    g_mutex_lock(&this->lock);
+    source->quit = TRUE;
+    g_cond_broadcast(&this->cond);
+    g_mutex_unlock(&this->lock);
+
+    g_thread_join(source->thread);
+
+    free(source->ring);
+    free(source->path);
+    free(source);
+}
+
+EngineSource* engine_find(Engine* this, const char* path)
+{
+    for (guint i = 0; i < ENGINE_SOURCES; i++) {
+        if (this->sources[i] && strcmp(this->sources[i]->path, path) == 0) {
+            return this->sources[i];
+        }
+    }
+    return NULL;
+}
+
+int engine_slot(Engine* this, EngineSource** victim)
+{
+    for (guint i = 0; i < ENGINE_SOURCES; i++) {
+        if (!this->sources[i]) return (int)i;
+    }
+
+    if (!victim) return -1;
+
+    for (guint i = 0; i < ENGINE_SOURCES; i++) {
+        if (this->sources[i] != this->active && this->sources[i] != this->fade_from) {
+            *victim = this->sources[i];
+            this->sources[i] = NULL;
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+size_t engine_available(Engine* this, EngineSource* source)
+{
+    if (source->failed || source->generation != this->generation) return 0;
+    if (source->write_pos <= this->cursor) return 0;
+    return (size_t)(source->write_pos - this->cursor);
+}
+
+int engine_done(Engine* this, EngineSource* source)
+{
+    return source->failed
+        || (source->eof && source->generation == this->generation);
+}
+
+void engine_locate(Engine* this, uint64_t frame)
+{
+    this->position = frame;
+    this->generation++;
+    this->fade_from = NULL;
+    this->clock = 0;
+    g_cond_broadcast(&this->cond);
+}
+
+uint64_t engine_loop_distance(Engine* this)
+{
+    if (this->loop_stop <= this->loop_start || this->position >= this->loop_stop) {
+        return UINT64_MAX;
+    }
+    return this->loop_stop - this->position;
+}
+
+void engine_trim(Engine* this, EngineSource* source, uint64_t keep)
+{
+    uint64_t written;
+
+    if (source->generation != this->generation) return;
+
+    /* frames decoded straight from the position and before the wrap of
+     * either loop are still valid, a read in progress is dropped (epoch)
+     * and the decoder seeks to the frame after the kept ones
+     */
+
+    written = source->write_pos > this->cursor ? source->write_pos - this->cursor : 0;
+    written = MIN(written, keep);
+    source->write_pos = this->cursor + written;
+    source->file_pos = this->position + written;
+    if (engine_loop_distance(this) == written) source->file_pos = this->loop_start;
+    source->reseek = TRUE;
+    source->eof = FALSE;
+    source->epoch++;
+    g_cond_broadcast(&this->cond);
+}
+
+void engine_mix(Engine* this, float* out, size_t n)
+{
+    EngineSource* in = this->active;
+    EngineSource* fade = this->fade_from;
+    const unsigned int channels = this->channels;
+    const size_t fade_available = fade ? engine_available(this, fade) : 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const uint64_t frame = this->cursor + i;
+        const float* a = &in->ring[(frame % in->capacity) * channels];
+        const float* b = NULL;
+        double t = 1.0;
+
+        /* linear crossfade, the faded track is silent when its decoder is
+         * behind
+         */
+
+        if (fade && this->fade_pos < this->fade_len) {
+            t = (double)this->fade_pos++ / (double)this->fade_len;
+            if (i < fade_available) b = &fade->ring[(frame % fade->capacity) * channels];
+        }
+
+        for (unsigned int c = 0; c < channels; c++) {
+            double x = (double)a[c] * in->gain * t;
+            if (b) x += (double)b[c] * fade->gain * (1.0 - t);
+            *out++ = (float)x;
+        }
+    }
+
+    if (fade && this->fade_pos >= this->fade_len) this->fade_from = NULL;
+}
+
+void engine_notify(Engine* this)
+{
+    void (*notify)(void*);
+    void* data;
+
+    g_mutex_lock(&this->lock);
+    notify = this->notify;
+    data = this->notify_data;
+    g_mutex_unlock(&this->lock);
+
+    if (notify) notify(data);
+}
+
+gpointer engine_decode_thread(gpointer data)
+{
+    EngineSource* source = data;
+    Engine* this = source->engine;
+    Ingest* ingest = ingest_open(source->path, TRUE);
+    Resample* resample = NULL;
+    int fresh = TRUE;
+
+    g_mutex_lock(&this->lock);
+
+    if (!ingest) goto fail;
+
+    /* the first file that opens sets the format of the engine */
+
+    if (!this->sample_rate) {
+        if (sink_open(this->sink, ingest->sample_rate, ingest->channels) != 0) goto fail;
+        this->sample_rate = ingest->sample_rate;
+        this->channels = ingest->channels;
+        this->fade_len = (size_t)this->sample_rate * ENGINE_CROSSFADE / 1000;
+
+        /* a seek or loop set before the format was known, nothing has been
+         * decoded yet
+         */
+
+        this->loop_start = (uint64_t)(this->pending_loop_start * this->sample_rate);
+        this->loop_stop = (uint64_t)(this->pending_loop_stop * this->sample_rate);
+        this->position = (uint64_t)(this->pending_position * this->sample_rate);
+        if (this->loop_stop > this->loop_start && this->position >= this->loop_stop) {
+            this->position = this->loop_start;
+        }
+        if (this->position) engine_locate(this, this->position);
+    }
+
+    /* files with another format are converted to the format of the engine */
+
+    if (ingest->sample_rate != this->sample_rate || ingest->channels != this->channels) {
+        if (!(resample = resample_new(ingest, this->sample_rate, this->channels))) goto fail;
+    }
+
+    source->capacity = MAX((size_t)(ENGINE_BUFFER * this->sample_rate), 2 * ENGINE_PERIOD);
+
+    if (!(source->ring = malloc(source->capacity * this->channels * sizeof(float)))) {
+        fprintf(stderr, "engine malloc failed\n");
+        goto fail;
+    }
+
+    while (!source->quit) {
+        const guint generation = this->generation;
+        const guint epoch = source->epoch;
+        size_t offset, count, n;
+        int loop;
+
+        /* the engine moved, decoding starts over at the new position
+         * a freshly opened file is at the start already
+         */
+
+        if (source->generation != generation) {
+            source->write_pos = this->cursor;
+            source->file_pos = this->position;
+            source->reseek = !fresh || this->position;
+            source->eof = FALSE;
+            source->generation = generation;
+            fresh = FALSE;
+            g_cond_broadcast(&this->cond);
+            continue;
+        }
+
+        /* after a seek, the end of a loop or a new loop */
+
+        if (source->reseek) {
+            const uint64_t frame = source->file_pos;
+            int status;
+
+            g_mutex_unlock(&this->lock);
+            status = resample ? resample_seek(resample, frame)
+                              : ingest_seek(ingest, (size_t)frame, NULL);
+            g_mutex_lock(&this->lock);
+
+            if (source->generation == generation && source->epoch == epoch) {
+                source->reseek = FALSE;
+                source->eof = status != 0;
+            }
+            g_cond_broadcast(&this->cond);
+            continue;
+        }
+
+        /* the ring is full up to one capacity ahead of the mixer */
+
+        if (source->eof
+                || source->write_pos + ENGINE_PERIOD > this->cursor + source->capacity)
+        {
+            g_cond_wait(&this->cond, &this->lock);
+            continue;
+        }
+
+        offset = (size_t)(source->write_pos % source->capacity);
+        count = MIN((size_t)ENGINE_PERIOD, source->capacity - offset);
+
+        /* a read never crosses the end of the loop */
+
+        loop = this->loop_stop > this->loop_start && source->file_pos < this->loop_stop;
+        if (loop) count = (size_t)MIN((uint64_t)count, this->loop_stop - source->file_pos);
+
+        /* the frames beyond write_pos are not read by the mixer, they're
+         * written without holding the lock
+         */
+
+        g_mutex_unlock(&this->lock);
+
+        if (resample) {
+            n = resample_read(resample, &source->ring[offset * this->channels], count);
+        } else {
+            n = ingest_read(ingest, &source->ring[offset * this->channels], count,
+                    INGEST_FLOAT);
+        }
+
+        g_mutex_lock(&this->lock);
+
+        /* a new loop while reading trims the source (epoch), the loop is
+         * still the one count was limited by otherwise
+         */
+
+        if (source->generation == generation && source->epoch == epoch) {
+            source->write_pos += n;
+            source->file_pos += n;
+            if (n < count) {
+                source->eof = TRUE;
+            } else if (loop && source->file_pos == this->loop_stop) {
+                source->file_pos = this->loop_start;
+                source->reseek = TRUE;
+            }
+            g_cond_broadcast(&this->cond);
+        }
+    }
+
+    g_mutex_unlock(&this->lock);
+    resample_free(resample);
+    ingest_close(ingest);
+    return NULL;
+
+fail:
+    source->failed = TRUE;
+    g_cond_broadcast(&this->cond);
+    g_mutex_unlock(&this->lock);
+    resample_free(resample);
+    ingest_close(ingest);
+    return NULL;
+}
+
+gpointer engine_mix_thread(gpointer data)
+{
+    Engine* this = data;
+    float* out = NULL;
+    int waiting = FALSE;
+
+    g_mutex_lock(&this->lock);
+
+    while (!this->quit) {
+        EngineSource* source = this->active;
+        size_t n = ENGINE_PERIOD, available;
+        gint64 start, delay = 0;
+
+        if (!this->playing || !source) {
+            g_cond_wait(&this->cond, &this->lock);
+            continue;
+        }
+
+        available = engine_available(this, source);
+
+        /* the end of the active track stops the engine */
+
+        if (!available && engine_done(this, source)) {
+            this->playing = FALSE;
+            g_mutex_unlock(&this->lock);
+            engine_notify(this);
+            g_mutex_lock(&this->lock);
+            continue;
+        }
+
+        /* a period never crosses the end of the loop */
+
+        if (this->loop_stop > this->loop_start && this->position < this->loop_stop) {
+            n = (size_t)MIN((uint64_t)n, this->loop_stop - this->position);
+        }
+
+        /* wait for the decoder, unless the track ends within the period */
+
+        if (available < n && !engine_done(this, source)) {
+            if (!waiting) this->stats.underruns++;
+            waiting = TRUE;
+            this->clock = 0;
+            g_cond_wait(&this->cond, &this->lock);
+            continue;
+        }
+        waiting = FALSE;
+        n = MIN(n, available);
+
+        if (!out && !(out = malloc(ENGINE_PERIOD * this->channels * sizeof(float)))) {
+            fprintf(stderr, "engine malloc failed\n");
+            break;
+        }
+
+        start = g_get_monotonic_time();
+        engine_mix(this, out, n);
+        this->position += n;
+        this->cursor += n;
+
+        /* the decoders continued at the loop start already, the stream goes
+         * on without a seek, after a seek past the loop stop it's a jump
+         */
+
+        if (this->loop_stop > this->loop_start) {
+            if (this->position == this->loop_stop) {
+                this->position = this->loop_start;
+            } else if (this->position > this->loop_stop) {
+                engine_locate(this, this->loop_start);
+            }
+        }
+
+        this->stats.periods++;
+        this->stats.frames += n;
+        this->stats.mix_time += g_get_monotonic_time() - start;
+
+        /* in realtime, the mixer sleeps until the clock caught up with the
+         * frames mixed since it started or moved
+         */
+
+        if (this->realtime) {
+            gint64 now = g_get_monotonic_time();
+            if (!this->clock) {
+                this->clock = now;
+                this->clock_frames = 0;
+            }
+            this->clock_frames += n;
+            delay = this->clock + (gint64)(this->clock_frames * G_USEC_PER_SEC
+                    / this->sample_rate) - now;
+        }
+
+        g_cond_broadcast(&this->cond);
+        g_mutex_unlock(&this->lock);
+
+        sink_write(this->sink, out, n);
+        if (delay > 0) g_usleep((gulong)delay);
+
+        g_mutex_lock(&this->lock);
+    }
+
+    g_mutex_unlock(&this->lock);
+    free(out);
+    return NULL;
+}
+
+double db_to_gain(double db)
+{
+    return pow(10.0, db / 20.0);
+}
@@ -0,0 +1,675 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        ingest.c
+ * @brief       libav audio file reader
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/config.h"
+
+#include "../include/ingest.h"
+
+/**
+ * libavutil 57.24 replaced the channels member by ch_layout
+ */
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+#define INGEST_CHANNELS(par) ((par)->ch_layout.nb_channels)
+#else
+#define INGEST_CHANNELS(par) ((par)->channels)
+#endif
+
+/**
+ * seek this many seconds before the requested position so the decoder
+ * has settled (eg mdct overlap of lossy codecs) when we reach it
+ */
+#define INGEST_SEEK_PREROLL 1.0
+
+/**
+ * Convert count frames of type T starting at offset to interleaved samples
+ * of type D
+ *
+ * planar formats have one data pointer per channel, packed formats have
+ * all channels interleaved in data[0]
+ */
+#define INGEST_CONVERT(D, T, expr)                                             \
+    for (size_t i = 0; i < count; i++) {                                       \
+        for (unsigned int c = 0; c < channels; c++) {                          \
+            const T x = planar                                                 \
+                ? ((const T*)(const void*)data[c])[offset + i]                 \
+                : ((const T*)(const void*)data[0])[(offset + i)*channels + c]; \
+            *(D*)dest = (D)(expr);                                             \
+            dest = (D*)dest + 1;                                               \
+        }                                                                      \
+    }
+
+/**
+ * Read a little or big endian 32 bit integer
+ */
+#define INGEST_LE32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8               \
+        | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+#define INGEST_BE32(p) ((uint32_t)(p)[3] | (uint32_t)(p)[2] << 8               \
+        | (uint32_t)(p)[1] << 16 | (uint32_t)(p)[0] << 24)
+
+/**
+ * Find the samples in a wav or aiff file
+ *
+ * walks the chunks of the RIFF/WAVE or FORM/AIFF(C) header up to the data
+ * or SSND chunk, libav doesn't tell where it found them
+ *
+ * @param map the file
+ * @param size size of the file in bytes
+ * @param offset destination of the position of the first sample
+ * @param len destination of the number of bytes of samples, clipped to the
+ * end of the file
+ * @return 0 on success or -1 when the header is not understood
+ */
+static int ingest_pcm_find(const unsigned char* map, size_t size,
+size_t* offset, size_t* len);
+
+/**
+ * Decode the next frame
+ *
+ * packets are read from the demuxer until the decoder returns a frame
+ *
+ * @param this the ingest object
+ * @return 1 when a new frame is available, 0 at end of file, < 0 on error
+ */
+static int ingest_decode(Ingest* this);
+
+/**
+ * Convert samples of the current frame to interleaved samples
+ *
+ * integer samples are shifted between integer types, floats are scaled
+ * and clipped to integer types
+ *
+ * @param this the ingest object
+ * @param dest destination, must hold count * channels samples
+ * @param count number of frames to convert
+ * @param sample sample type of dest
+ */
+static void ingest_convert(Ingest* this, void* dest, size_t count,
+IngestSample sample);
+
+/**
+ * Sample type that holds a sample format without loss
+ *
+ * @param format libav sample format (planar or packed)
+ * @return the smallest matching type
+ */
+static IngestSample ingest_sample_type(enum AVSampleFormat format);
+
+/**
+ * Print libav error
+ *
+ * @param msg message to be included in error
+ * @param path the file that caused the error
+ * @param status libav status code
+ */
+static void ingest_print_status(const char* msg, const char* path, int status);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+Ingest* ingest_open(const char* path, int decode)
+{
+    Ingest* this;
+    AVStream* stream;
+    const AVCodec* decoder;
+    int status;
+
+    if (!(this = calloc(1, sizeof(Ingest)))) {
+        fprintf(stderr, "failed to allocate ingest\n");
+        return NULL;
+    }
+
+    if ((status = avformat_open_input(&this->format, path, NULL, NULL)) < 0) {
+        ingest_print_status("failed to open file", path, status);
+        free(this);
+        return NULL;
+    }
+
+    if ((this->stream = av_find_best_stream(this->format,
+                    AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0)) < 0)
+    {
+        ingest_print_status("no audio stream in file", path, this->stream);
+        goto fail;
+    }
+
+    stream = this->format->streams[this->stream];
+
+    /* most containers tell sample rate and channels in the header
+     * only probe the stream (which decodes frames) when they don't
+     */
+
+    if (!stream->codecpar->sample_rate || !INGEST_CHANNELS(stream->codecpar)) {
+        if ((status = avformat_find_stream_info(this->format, NULL)) < 0) {
+            ingest_print_status("failed to find stream info", path, status);
+            goto fail;
+        }
+    }
+
+    /* drop packets of all other streams (eg cover art) in the demuxer */
+    for (unsigned int i = 0; i < this->format->nb_streams; i++) {
+        if ((int)i != this->stream) {
+            this->format->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    this->channels = (unsigned int)INGEST_CHANNELS(stream->codecpar);
+    this->sample_rate = (unsigned int)stream->codecpar->sample_rate;
+
+    if (stream->duration != AV_NOPTS_VALUE) {
+        this->duration = (double)stream->duration * av_q2d(stream->time_base);
+    } else if (this->format->duration != AV_NOPTS_VALUE) {
+        this->duration = (double)this->format->duration / AV_TIME_BASE;
+    }
+
+    if (!decode) return this;
+
+    if (!(decoder = avcodec_find_decoder(stream->codecpar->codec_id))) {
+        fprintf(stderr, "no decoder for file \"%s\"\n", path);
+        goto fail;
+    }
+
+    if (!(this->codec = avcodec_alloc_context3(decoder))
+            || !(this->packet = av_packet_alloc())
+            || !(this->frame = av_frame_alloc()))
+    {
+        fprintf(stderr, "failed to allocate decoder\n");
+        goto fail;
+    }
+
+    if ((status = avcodec_parameters_to_context(this->codec, stream->codecpar)) < 0
+            || (status = avcodec_open2(this->codec, decoder, NULL)) < 0)
+    {
+        ingest_print_status("failed to open decoder", path, status);
+        goto fail;
+    }
+
+    this->sample = ingest_sample_type(this->codec->sample_fmt);
+
+    return this;
+
+fail:
+    ingest_close(this);
+    return NULL;
+}
+
+const char* ingest_tag(Ingest* this, const char* key)
+{
+    AVDictionaryEntry* tag;
+    int flags = AV_DICT_IGNORE_SUFFIX;
+
+    if ((tag = av_dict_get(this->format->metadata, key, NULL, flags))) {
+        return tag->value;
+    }
+    if ((tag = av_dict_get(this->format->streams[this->stream]->metadata,
+                    key, NULL, flags)))
+    {
+        return tag->value;
+    }
+    return NULL;
+}
+
+size_t ingest_read(Ingest* this, void* buffer, size_t frames,
+IngestSample sample)
+{
+    const size_t size = ingest_sample_size(sample) * this->channels;
+    size_t n = 0;
+
+    if (!this->codec) return 0;
+
+    while (n < frames) {
+        size_t available, count;
+
+        if (this->frame_pos >= this->frame->nb_samples) {
+            if (ingest_decode(this) <= 0) break;
+        }
+
+        available = (size_t)(this->frame->nb_samples - this->frame_pos);
+        count = MIN(available, frames - n);
+
+        ingest_convert(this, (char*)buffer + n * size, count, sample);
+        this->frame_pos += (int)count;
+        n += count;
+    }
+
+    return n;
+}
+
+size_t ingest_read_double(Ingest* this, double* buffer, size_t frames)
+{
+    return ingest_read(this, buffer, frames, INGEST_DOUBLE);
+}
+
+size_t ingest_sample_size(IngestSample sample)
+{
+    switch (sample) {
+        case INGEST_SHORT:
+            return sizeof(short);
+        case INGEST_INT:
+            return sizeof(int);
+        case INGEST_FLOAT:
+            return sizeof(float);
+        case INGEST_DOUBLE:
+        default:
+            return sizeof(double);
+    }
+}
+
+int ingest_seek(Ingest* this, size_t frame, size_t* landed)
+{
+    AVStream* stream = this->format->streams[this->stream];
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    double seconds = (double)frame / this->sample_rate - INGEST_SEEK_PREROLL;
+    int64_t ts = start;
+
+    if (!this->codec) return -1;
+
+    if (seconds > 0.0) ts += (int64_t)(seconds / av_q2d(stream->time_base));
+
+    if (av_seek_frame(this->format, this->stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "failed to seek in \"%s\"\n", this->format->url);
+        return -1;
+    }
+
+    avcodec_flush_buffers(this->codec);
+    this->eof = 0;
+
+    /* decode and discard whole frames until we reach the one containing the
+     * requested sample, the position of each frame is derived from its
+     * timestamp
+     */
+
+    while (ingest_decode(this) > 0) {
+        int64_t pts = this->frame->best_effort_timestamp;
+        int64_t pos;
+
+        if (pts == AV_NOPTS_VALUE) {
+            fprintf(stderr, "no timestamps to seek in \"%s\"\n", this->format->url);
+            return -1;
+        }
+
+        pos = (int64_t)((double)(pts - start) * av_q2d(stream->time_base)
+                * this->sample_rate + 0.5);
+
+        if (pos + this->frame->nb_samples > (int64_t)frame) {
+            this->frame_pos = (int)MAX(0, (int64_t)frame - pos);
+            if (landed) *landed = (size_t)MAX(pos, (int64_t)frame);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const IngestPcm* ingest_map(Ingest* this)
+{
+    const AVCodecParameters* par;
+    const char* container;
+    struct stat st;
+    size_t offset, len, frame;
+    int fd;
+
+    if (this->map) return &this->pcm;
+    if (!this->codec) return NULL;
+
+    par = this->format->streams[this->stream]->codecpar;
+    container = this->format->iformat->name;
+
+    if (strcmp(container, "wav") != 0 && strcmp(container, "aiff") != 0) {
+        return NULL;
+    }
+
+    switch (par->codec_id) {
+        case AV_CODEC_ID_PCM_S16LE:
+        case AV_CODEC_ID_PCM_S16BE:
+            this->pcm.bytes = 2;
+            break;
+        case AV_CODEC_ID_PCM_S24LE:
+        case AV_CODEC_ID_PCM_S24BE:
+            this->pcm.bytes = 3;
+            break;
+        case AV_CODEC_ID_PCM_S32LE:
+        case AV_CODEC_ID_PCM_S32BE:
+        case AV_CODEC_ID_PCM_F32LE:
+        case AV_CODEC_ID_PCM_F32BE:
+            this->pcm.bytes = 4;
+            break;
+        case AV_CODEC_ID_PCM_F64LE:
+        case AV_CODEC_ID_PCM_F64BE:
+            this->pcm.bytes = 8;
+            break;
+        default:
+            return NULL;
+    }
+
+    this->pcm.floating = par->codec_id == AV_CODEC_ID_PCM_F32LE
+        || par->codec_id == AV_CODEC_ID_PCM_F32BE
+        || par->codec_id == AV_CODEC_ID_PCM_F64LE
+        || par->codec_id == AV_CODEC_ID_PCM_F64BE;
+    this->pcm.big_endian = par->codec_id == AV_CODEC_ID_PCM_S16BE
+        || par->codec_id == AV_CODEC_ID_PCM_S24BE
+        || par->codec_id == AV_CODEC_ID_PCM_S32BE
+        || par->codec_id == AV_CODEC_ID_PCM_F32BE
+        || par->codec_id == AV_CODEC_ID_PCM_F64BE;
+
+    /* samples padded in a larger container (eg 24 bit in 32) are decoded */
+
+    frame = this->pcm.bytes * this->channels;
+    if (par->block_align && (size_t)par->block_align != frame) return NULL;
+
+    if ((fd = open(this->format->url, O_RDONLY)) < 0) return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    this->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (this->map == MAP_FAILED) {
+        this->map = NULL;
+        return NULL;
+    }
+    this->map_size = (size_t)st.st_size;
+
+    if (ingest_pcm_find(this->map, this->map_size, &offset, &len) != 0) {
+        munmap(this->map, this->map_size);
+        this->map = NULL;
+        return NULL;
+    }
+
+    madvise(this->map, this->map_size, MADV_SEQUENTIAL);
+
+    this->pcm.data = (const unsigned char*)this->map + offset;
+    this->pcm.frames = len / frame;
+
+    return &this->pcm;
+}
+
+void ingest_willneed(Ingest* this, size_t frame, size_t frames)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t size = this->pcm.bytes * this->channels;
+    size_t begin, end;
+
+    if (!this->map || frame >= this->pcm.frames) return;
+
+    frames = MIN(frames, this->pcm.frames - frame);
+
+    /* madvise wants a page aligned address */
+
+    begin = (size_t)(this->pcm.data - (const unsigned char*)this->map) + frame * size;
+    end = begin + frames * size;
+    begin -= begin % page;
+
+    madvise((char*)this->map + begin, end - begin, MADV_WILLNEED);
+}
+
+void ingest_close(Ingest* this)
+{
+    if (!this) return;
+
+    if (this->map) munmap(this->map, this->map_size);
+
+    av_frame_free(&this->frame);
+    av_packet_free(&this->packet);
+    avcodec_free_context(&this->codec);
+    avformat_close_input(&this->format);
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+int ingest_pcm_find(const unsigned char* map, size_t size,
+size_t* offset, size_t* len)
+{
+    int aiff;
+    size_t pos = 12;
+
+    if (size < 12) return -1;
+
+    if (memcmp(map, "RIFF", 4) == 0 && memcmp(map + 8, "WAVE", 4) == 0) {
+        aiff = FALSE;
+    } else if (memcmp(map, "FORM", 4) == 0 && (memcmp(map + 8, "AIFF", 4) == 0
+                || memcmp(map + 8, "AIFC", 4) == 0))
+    {
+        aiff = TRUE;
+    } else {
+        return -1;
+    }
+
+    /* chunks are an id and a size, padded to an even size */
+
+    while (pos + 8 <= size) {
+        const unsigned char* chunk = map + pos;
+        size_t chunk_size = aiff ? INGEST_BE32(chunk + 4) : INGEST_LE32(chunk + 4);
+
+        /* a wav written as a stream may leave the size of data 0 */
+
+        if (!aiff && memcmp(chunk, "data", 4) == 0) {
+            if (!chunk_size) chunk_size = SIZE_MAX;
+            *offset = pos + 8;
+            *len = MIN(chunk_size, size - *offset);
+            return 0;
+        }
+
+        /* SSND starts with the offset of the samples and a block size */
+
+        if (aiff && memcmp(chunk, "SSND", 4) == 0) {
+            size_t skip;
+
+            if (pos + 16 > size) return -1;
+            skip = INGEST_BE32(chunk + 8);
+            if (pos + 16 + skip > size || chunk_size < 8 + skip) return -1;
+            *offset = pos + 16 + skip;
+            *len = MIN(chunk_size - 8 - skip, size - *offset);
+            return 0;
+        }
+
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    return -1;
+}
+
+int ingest_decode(Ingest* this)
+{
+    int status;
+
+    for (;;) {
+        status = avcodec_receive_frame(this->codec, this->frame);
+
+        if (status == 0) {
+            this->frame_pos = 0;
+            return 1;
+        }
+        if (status == AVERROR_EOF) return 0;
+        if (status != AVERROR(EAGAIN)) return status;
+
+        /* decoder needs more input, feed it the next packet of our stream
+         * at the end of file, an empty packet flushes the decoder
+         */
+
+        if (this->eof) return 0;
+
+        if (av_read_frame(this->format, this->packet) < 0) {
+            this->eof = 1;
+            avcodec_send_packet(this->codec, NULL);
+            continue;
+        }
+
+        if (this->packet->stream_index == this->stream) {
+            if ((status = avcodec_send_packet(this->codec, this->packet)) < 0) {
+                ingest_print_status("skipped corrupt packet", this->format->url,
+                        status);
+            }
+        }
+        av_packet_unref(this->packet);
+    }
+}
+
+void ingest_convert(Ingest* this, void* dest, size_t count,
+IngestSample sample)
+{
+    enum AVSampleFormat format = this->frame->format;
+    const uint8_t* const* data = (const uint8_t* const*)this->frame->extended_data;
+    const size_t offset = (size_t)this->frame_pos;
+    const unsigned int channels = this->channels;
+    const int planar = av_sample_fmt_is_planar(format);
+
+    switch (sample) {
+        case INGEST_SHORT:
+            switch (av_get_packed_sample_fmt(format)) {
+                case AV_SAMPLE_FMT_U8:
+                    INGEST_CONVERT(short, uint8_t, ((int)x - 128) * 256);
+                    return;
+                case AV_SAMPLE_FMT_S16:
+                    INGEST_CONVERT(short, int16_t, x);
+                    return;
+                case AV_SAMPLE_FMT_S32:
+                    INGEST_CONVERT(short, int32_t, x / 65536);
+                    return;
+                case AV_SAMPLE_FMT_S64:
+                    INGEST_CONVERT(short, int64_t, x / 281474976710656LL);
+                    return;
+                case AV_SAMPLE_FMT_FLT:
+                    INGEST_CONVERT(short, float, lrintf(CLAMP(x, -1.0f, 1.0f) * 32767.0f));
+                    return;
+                case AV_SAMPLE_FMT_DBL:
+                    INGEST_CONVERT(short, double, lrint(CLAMP(x, -1.0, 1.0) * 32767.0));
+                    return;
+                default:
+                    break;
+            }
+            break;
+        case INGEST_INT:
+            switch (av_get_packed_sample_fmt(format)) {
+                case AV_SAMPLE_FMT_U8:
+                    INGEST_CONVERT(int, uint8_t, ((int)x - 128) * 16777216);
+                    return;
+                case AV_SAMPLE_FMT_S16:
+                    INGEST_CONVERT(int, int16_t, (int)x * 65536);
+                    return;
+                case AV_SAMPLE_FMT_S32:
+                    INGEST_CONVERT(int, int32_t, x);
+                    return;
+                case AV_SAMPLE_FMT_S64:
+                    INGEST_CONVERT(int, int64_t, x / 4294967296LL);
+                    return;
+                case AV_SAMPLE_FMT_FLT:
+                    INGEST_CONVERT(int, float, lrint(CLAMP((double)x, -1.0, 1.0) * 2147483647.0));
+                    return;
+                case AV_SAMPLE_FMT_DBL:
+                    INGEST_CONVERT(int, double, lrint(CLAMP(x, -1.0, 1.0) * 2147483647.0));
+                    return;
+                default:
+                    break;
+            }
+            break;
+        case INGEST_FLOAT:
+            switch (av_get_packed_sample_fmt(format)) {
+                case AV_SAMPLE_FMT_U8:
+                    INGEST_CONVERT(float, uint8_t, ((float)x - 128.0f) / 128.0f);
+                    return;
+                case AV_SAMPLE_FMT_S16:
+                    INGEST_CONVERT(float, int16_t, (float)x / 32768.0f);
+                    return;
+                case AV_SAMPLE_FMT_S32:
+                    INGEST_CONVERT(float, int32_t, (double)x / 2147483648.0);
+                    return;
+                case AV_SAMPLE_FMT_S64:
+                    INGEST_CONVERT(float, int64_t, (double)x / 9223372036854775808.0);
+                    return;
+                case AV_SAMPLE_FMT_FLT:
+                    INGEST_CONVERT(float, float, x);
+                    return;
+                case AV_SAMPLE_FMT_DBL:
+                    INGEST_CONVERT(float, double, x);
+                    return;
+                default:
+                    break;
+            }
+            break;
+        case INGEST_DOUBLE:
+        default:
+            switch (av_get_packed_sample_fmt(format)) {
+                case AV_SAMPLE_FMT_U8:
+                    INGEST_CONVERT(double, uint8_t, ((double)x - 128.0) / 128.0);
+                    return;
+                case AV_SAMPLE_FMT_S16:
+                    INGEST_CONVERT(double, int16_t, (double)x / 32768.0);
+                    return;
+                case AV_SAMPLE_FMT_S32:
+                    INGEST_CONVERT(double, int32_t, (double)x / 2147483648.0);
+                    return;
+                case AV_SAMPLE_FMT_S64:
+                    INGEST_CONVERT(double, int64_t, (double)x / 9223372036854775808.0);
+                    return;
+                case AV_SAMPLE_FMT_FLT:
+                    INGEST_CONVERT(double, float, (double)x);
+                    return;
+                case AV_SAMPLE_FMT_DBL:
+                    INGEST_CONVERT(double, double, x);
+                    return;
+                default:
+                    break;
+            }
+            break;
+    }
+
+    /* unknown format, silence */
+
+    memset(dest, 0, count * channels * ingest_sample_size(sample));
+}
+
+IngestSample ingest_sample_type(enum AVSampleFormat format)
+{
+    switch (av_get_packed_sample_fmt(format)) {
+        case AV_SAMPLE_FMT_U8:
+        case AV_SAMPLE_FMT_S16:
+            return INGEST_SHORT;
+        case AV_SAMPLE_FMT_S32:
+            return INGEST_INT;
+        case AV_SAMPLE_FMT_FLT:
+            return INGEST_FLOAT;
+        case AV_SAMPLE_FMT_S64:
+        case AV_SAMPLE_FMT_DBL:
+            return INGEST_DOUBLE;
+        default:
+            return INGEST_FLOAT;
+    }
+}
+
+void ingest_print_status(const char* msg, const char* path, int status)
+{
+    char err[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+
+    av_strerror(status, err, sizeof(err));
+    fprintf(stderr, "%s \"%s\"\n > %s\n", msg, path, err);
+}
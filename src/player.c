@@ -17,10 +17,50 @@
 #include <unistd.h>
 
 #include "../include/config.h"
+#include "../include/engine.h"
 #include "../include/track.h"
 
 #include "../include/player.h"
 
+/**
+ * max time in seconds the position is extrapolated past the last time-pos
+ * update, a stalled player (eg buffering) doesn't run away from its position
+ */
+#define PLAYER_EXTRAPOLATE_MAX 1.0
+
+/**
+ * max number of instances in the pool, see PLAYER_POOL_SIZE
+ */
+#define PLAYER_POOL_MAX 32
+
+/**
+ * Create and initialize an mpv instance
+ *
+ * all instances observe the same properties, with the PlayerProperty ids
+ *
+ * @return the mpv handle or NULL when failed
+ */
+static mpv_handle* player_mpv_new(void);
+
+/**
+ * Allocate a player and set all members to their initial state
+ *
+ * no mpv instance or engine is created
+ *
+ * @return the newly created player or NULL when failed
+ */
+static Player* player_new(void);
+
+/**
+ * Update the play state from the engine
+ *
+ * event handler of a player with an engine, the engine has no events but
+ * calls the wakeup callback whenever its state changes
+ *
+ * @param this the player object
+ */
+static void player_engine_event(Player* this);
+
 /**
  * Convert dB (double) to mpv volume number
  *
@@ -29,6 +69,156 @@
  */
 static double db_to_volume(double volume);
 
+/**
+ * Gain to apply to a track so it plays as loud as the quietest track
+ *
+ * tracks that are not analyzed yet play without gain
+ *
+ * @param this the player object
+ * @param track the track
+ * @return gain in dB
+ */
+static double player_track_gain(Player* this, Track* track);
+
+/**
+ * Set the position model
+ *
+ * the position is valid now, it's extrapolated from now on while playing
+ *
+ * @param this the player object
+ * @param position position in seconds
+ */
+static void player_set_position(Player* this, double position);
+
+/**
+ * Load the requested track in mpv
+ *
+ * idle callback scheduled by player_load_track
+ * nothing is sent while a previous loadfile is in flight, the request is
+ * picked up again by player_switch_done
+ *
+ * @param this the player object
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean player_switch(Player* this);
+
+/**
+ * Finish the track switch in flight
+ *
+ * the latency is recorded when the file is playing, the latest request is
+ * loaded if it came in during the switch
+ *
+ * @param this the player object
+ * @param ok the file is playing
+ */
+static void player_switch_done(Player* this, int ok);
+
+/**
+ * Wakeup callback of mpv
+ *
+ * called from an mpv thread whenever new events are available, the event
+ * callback is only called when no drain is pending yet
+ *
+ * @param data the player object
+ */
+static void player_wakeup(void* data);
+
+/**
+ * Handle a property change event
+ *
+ * @param this the player object
+ * @param id the PlayerProperty passed to mpv_observe_property
+ * @param prop the changed property
+ */
+static void player_property_changed(Player* this, uint64_t id,
+mpv_event_property* prop);
+
+/**
+ * Handle all pending events of an instance
+ *
+ * events of the active instance are handled by player_handle_event
+ *
+ * @param this the player object
+ * @param slot the pooled instance or NULL for the single instance
+ * @param events incremented for every event
+ * @return FALSE when mpv is shutting down
+ */
+static int player_drain(Player* this, PlayerSlot* slot, guint64* events);
+
+/**
+ * Handle an event of the active instance
+ *
+ * @param this the player object
+ * @param event the event
+ * @return FALSE when mpv is shutting down
+ */
+static int player_handle_event(Player* this, mpv_event* event);
+
+/**
+ * Update the state of a pooled instance
+ *
+ * @param slot the pooled instance
+ * @param event the event of the instance
+ */
+static void player_slot_event(PlayerSlot* slot, mpv_event* event);
+
+/**
+ * Find the pooled instance of a file
+ *
+ * an instance that has the file opened is preferred over one that is still
+ * opening it
+ *
+ * @param this the player object
+ * @param path the file
+ * @return index of the slot or -1 when not in the pool
+ */
+static int player_slot_find(Player* this, const char* path);
+
+/**
+ * Load a track in an inactive instance
+ *
+ * the instance is muted and follows the play state, speed and position of
+ * the active instance
+ *
+ * @param this the player object
+ * @param slot the inactive instance
+ * @param track the track to load
+ */
+static void player_slot_load(Player* this, PlayerSlot* slot, Track* track);
+
+/**
+ * Seek an inactive instance back to the position of the active instance
+ *
+ * only when it drifted more than PLAYER_POOL_DRIFT, while playing the seek
+ * is ahead by the time the previous seek took
+ *
+ * @param this the player object
+ * @param slot the inactive instance
+ */
+static void player_slot_sync(Player* this, PlayerSlot* slot);
+
+/**
+ * Make a pooled instance the audible one
+ *
+ * the gain and loop are applied to the instance, it's unmuted and the
+ * active instance is muted
+ *
+ * @param this the player object
+ * @param i index of the slot
+ */
+static void player_slot_activate(Player* this, guint i);
+
+/**
+ * Set a property of all inactive instances
+ *
+ * @param this the player object
+ * @param name the property
+ * @param format format of data
+ * @param data the value
+ */
+static void player_pool_set(Player* this, const char* name, mpv_format format,
+void* data);
+
 /**
  * Print mpv error if available
  *
@@ -47,6 +237,14 @@ void player_set_speed(Player* this, gdouble speed)
 {
     int status;
     if (speed < 0.1 || speed > 10.0) return;
+
+    /* the engine doesn't resample */
+
+    if (this->engine) return;
+
+    /* the position up to now advanced with the old speed */
+
+    player_set_position(this, player_get_position(this));
     this->speed = speed;
 
     if ((status = mpv_set_property(this->mpv, "speed", MPV_FORMAT_DOUBLE, &this->speed)) < 0) {
@@ -59,6 +257,13 @@ void player_stop(Player* this)
     int status;
     const char* cmd[] = {"stop", NULL};
 
+    if (this->engine) {
+        engine_play(this->engine, FALSE);
+        engine_seek(this->engine, 0.0);
+        this->play_state = PLAY_STATE_STOP;
+        return;
+    }
+
     player_goto(this, 0.0);
 
     /* update the play_state here to running load_track
@@ -71,6 +276,10 @@ void player_stop(Player* this)
         mpv_print_status("stop", status);
     }
 
+    /* the file is gone, don't wait for its end-file event to know */
+
+    if (this->n_slots) this->slots[this->active].loaded = FALSE;
+
     if (this->current) {
         player_load_track(this, this->current);
     }
@@ -83,7 +292,9 @@ void player_pause(Player* this)
     int status;
     int pause = 1;
 
-    if ((status = mpv_set_property(this->mpv, "pause", MPV_FORMAT_FLAG, &pause)) < 0) {
+    if (this->engine) {
+        engine_play(this->engine, FALSE);
+    } else if ((status = mpv_set_property(this->mpv, "pause", MPV_FORMAT_FLAG, &pause)) < 0) {
         mpv_print_status("pause", status);
     }
     if (this->rtn) player_goto(this, 0);
@@ -94,7 +305,9 @@ void player_toggle(Player* this)
     int status;
 
     const char* cmd[] = {"cycle", "pause", NULL};
-    if ((status = mpv_command(this->mpv, cmd)) < 0) {
+    if (this->engine) {
+        engine_play(this->engine, !engine_playing(this->engine));
+    } else if ((status = mpv_command(this->mpv, cmd)) < 0) {
         mpv_print_status("cycle, pause", status);
     }
     if (this->rtn) player_goto(this, 0);
@@ -106,9 +319,22 @@ void player_seek(Player* this, double secs)
     char secstr[10];
     sprintf(secstr, "%f", secs);
     const char* cmd[] = {"seek", secstr, NULL};
+
+    if (this->engine) {
+        player_goto(this, player_get_position(this) + secs);
+        return;
+    }
+
     if ((status = mpv_command(this->mpv, cmd)) < 0) {
         mpv_print_status("seek", status);
+        return;
     }
+
+    /* don't wait for time-pos, the next position query must see the seek */
+
+    secs += player_get_position(this);
+    if (this->current) secs = CLAMP(secs, 0.0, this->current->length);
+    player_set_position(this, secs);
 }
 
 void player_loop(Player* this)
@@ -131,7 +357,9 @@ void player_loop(Player* this)
         this->loop_start = player_get_position(this);
     }
 
-    if ((status = mpv_command(this->mpv, cmd)) < 0) {
+    if (this->engine) {
+        engine_set_loop(this->engine, this->loop_start, this->loop_stop);
+    } else if ((status = mpv_command(this->mpv, cmd)) < 0) {
         mpv_print_status("ab-loop", status);
     }
 }
@@ -151,28 +379,59 @@ void player_goto(Player* this, double position)
     g_snprintf(posstr, ELEMENTS(posstr), "%f", position);
 
     const char* cmd[] = {"seek", posstr, "absolute+keyframes", NULL};
+
+    if (this->engine) {
+        engine_seek(this->engine, position);
+        return;
+    }
+
     if ((status = mpv_command_async(this->mpv, 0, cmd)) < 0) {
         mpv_print_status("seek", status);
+        return;
     }
+    player_set_position(this, position);
 }
 
-/** deprecated */
 double player_get_position(Player* this)
 {
-    mpv_get_property(this->mpv, "time-pos", MPV_FORMAT_DOUBLE, &this->position);
-    return this->position;
+    return player_get_position_at(this, g_get_monotonic_time());
+}
+
+double player_get_position_at(Player* this, gint64 time)
+{
+    double elapsed;
+
+    /* the engine knows its position to the frame */
+
+    if (this->engine) return engine_get_position(this->engine);
+
+    /* time-pos is only updated a couple of times per second by mpv, in
+     * between the position advances with the playback speed
+     * time is in microseconds of the monotonic clock, like the frame clock
+     */
+
+    if (this->play_state != PLAY_STATE_PLAY) return this->position;
+
+    elapsed = (double)(time - this->position_time) / G_USEC_PER_SEC;
+    elapsed = CLAMP(elapsed, 0.0, PLAYER_EXTRAPOLATE_MAX);
+
+    if (this->current && this->current->length > 0.0) {
+        return MIN(this->position + elapsed * this->speed, this->current->length);
+    }
+    return this->position + elapsed * this->speed;
 }
 
 void player_load_track(Player* this, Track* track)
 {
-    int status;
-    char posstr[99];
-    double gain, volume, position = 0.0;
+    double position = 0.0;
+    int follow = FALSE;
 
     /* automatically deduce the position
      * when STOPPED position reverts to 0
      * when marker is set, position reverts to marker
      * when rtn is not set, position is the current playing position
+     * the current playing position is taken when the file is actually
+     * loaded, the others are fixed now
      */
 
     if (this->play_state != PLAY_STATE_STOP) {
@@ -181,71 +440,90 @@ void player_load_track(Player* this, Track* track)
             position = this->marker;
 
         } else if (!this->rtn) {
-            position = player_get_position(this);
+            follow = TRUE;
         }
     }
 
-    gain = this->min_lufs - track->lufs;
-    volume = db_to_volume(gain);
+    this->current = track;
+    this->switch_position = position;
+    this->switch_continue = follow;
+    this->stats.switch_requests++;
 
-    /* compensation for time-gap? */
-    /* if (position != 0.0) position += 0.050; */
+    /* the engine switches at the next period, there's nothing to coalesce */
 
-    g_snprintf(posstr,
-            ELEMENTS(posstr),
-            "start=%d.%d,volume=%d.%d",
-            (int)position,
-            (int)(fmod(position, 1.0)*10000000),
-            (int)volume,
-            (int)(fmod(volume, 1.0)*10000000)
-    );
+    if (this->engine) {
+        if (engine_select(this->engine, track, player_track_gain(this, track)) == 0) {
+            this->stats.switches++;
+        }
+        if (!follow) engine_seek(this->engine, position);
+        return;
+    }
 
-    this->current = track;
+    /* latency is measured from the first request of a burst */
 
-    const char *cmd[] = {"loadfile", track->path, "replace", posstr, NULL};
-    if ((status = mpv_command_async(this->mpv, 0, cmd)) < 0) {
-        mpv_print_status("loadfile", status);
+    if (!this->switch_pending) this->switch_time = g_get_monotonic_time();
+    this->switch_pending = TRUE;
+
+    /* a loadfile that mpv didn't handle yet is superseded, abort it
+     * the reply (with an error) will trigger loading this request
+     */
+
+    if (this->switch_state == PLAYER_SWITCH_COMMAND) {
+        mpv_abort_async_command(this->mpv, this->load_tag);
+        this->stats.switch_aborts++;
+    }
+
+    if (!this->switch_idle && this->switch_state == PLAYER_SWITCH_IDLE) {
+        this->switch_idle = g_idle_add(G_SOURCE_FUNC(player_switch), this);
     }
 }
 
 int player_event_handler(Player* this)
 {
-	while (this->mpv) {
+    gint64 start = g_get_monotonic_time(), elapsed;
+    guint64 events = 0;
+    int running = TRUE;
 
-		mpv_event *event = mpv_wait_event(this->mpv, 0);
+    /* the pending flag is cleared before draining, a wakeup during the drain
+     * queues a new drain so no event is left behind
+     * all events that are ready are handled in one go
+     */
 
-        switch (event->event_id) {
-            case MPV_EVENT_PROPERTY_CHANGE: {
-                mpv_event_property *prop = event->data;
-                if (!prop->data) break;
+    g_atomic_int_set(&this->dispatch_pending, 0);
 
-                if (g_strcmp0(prop->name, "time-pos") == 0) {
-                    this->position = *(double*)(prop->data);
+    if (this->engine) player_engine_event(this);
 
-                } else if (g_strcmp0(prop->name, "core-idle") == 0) {
-                    int core_idle = *(int*)(prop->data);
-                    this->play_state = core_idle ? PLAY_STATE_PAUSE : PLAY_STATE_PLAY;
+    /* inactive instances are synced after all events are handled, when
+     * the position of the active instance is up to date
+     */
 
-                } else if (g_strcmp0(prop->name, "length") == 0) {
-                    if (this->current) {
-                        this->current->length = *(double*)(prop->data);
-                    }
-                }
-                break;
-            }
-            case MPV_EVENT_LOG_MESSAGE: {
-                printf("mpv log: %s", (char*)event->data);
-                break;
-            }
-            case MPV_EVENT_SHUTDOWN:
-            case MPV_EVENT_NONE: {
-                return FALSE;
-            }
-            default: {
-                break;
-            };
+    if (this->n_slots) {
+        for (guint i = 0; i < this->n_slots && running; i++) {
+            running = player_drain(this, &this->slots[i], &events);
+        }
+        for (guint i = 0; i < this->n_slots && running; i++) {
+            if (i != this->active) player_slot_sync(this, &this->slots[i]);
         }
+    } else if (this->mpv) {
+        running = player_drain(this, NULL, &events);
     }
+
+    /* events per second are counted in windows of one second */
+
+    elapsed = g_get_monotonic_time() - start;
+    this->stats.events += events;
+    this->stats.drains++;
+    this->stats.drain_time += elapsed;
+    this->stats.drain_max = MAX(this->stats.drain_max, elapsed);
+    this->stats.window_events += events;
+
+    if (start - this->stats.window_start >= G_USEC_PER_SEC) {
+        this->stats.events_per_sec = (double)this->stats.window_events
+            * G_USEC_PER_SEC / (double)(start - this->stats.window_start);
+        this->stats.window_start = start;
+        this->stats.window_events = 0;
+    }
+
     return FALSE;
 }
 
@@ -253,73 +531,703 @@ void player_set_gain(Player* this, double gain)
 {
     int status;
 
+    if (this->engine) return;
+
     if ((status = mpv_set_property(this->mpv, "replaygain-preamp", MPV_FORMAT_DOUBLE, &gain)) < 0) {
         mpv_print_status("replay-gain-preamp", status);
     }
 }
 
+void player_update_gain(Player* this)
+{
+    int status;
+    double volume;
+
+    /* the volume set by loadfile is a per-file option, setting the property
+     * changes it for the file that is playing
+     */
+
+    if (!this->current) return;
+    if (this->engine) {
+        engine_set_gain(this->engine, player_track_gain(this, this->current));
+        return;
+    }
+
+    volume = db_to_volume(player_track_gain(this, this->current));
+
+    if ((status = mpv_set_property(this->mpv, "volume", MPV_FORMAT_DOUBLE, &volume)) < 0) {
+        mpv_print_status("volume", status);
+    }
+}
+
 void player_set_event_callback(Player* this, void(*event_callback)(void*))
 {
-	mpv_set_wakeup_callback(this->mpv, event_callback, this);
+    this->event_callback = event_callback;
+
+    if (this->engine) {
+        engine_set_notify(this->engine, player_wakeup, this);
+        return;
+    }
+
+    if (!this->n_slots) {
+        mpv_set_wakeup_callback(this->mpv, player_wakeup, this);
+        return;
+    }
+    for (guint i = 0; i < this->n_slots; i++) {
+        mpv_set_wakeup_callback(this->slots[i].mpv, player_wakeup, this);
+    }
+}
+
+void player_prepare(Player* this, Track** tracks, guint n)
+{
+    guint32 keep;
+
+    if (this->engine) {
+        engine_prepare(this->engine, tracks, n);
+        return;
+    }
+
+    if (!this->n_slots) return;
+
+    /* the active instance and the instances that already hold one of the
+     * tracks are kept, the others are free to load the missing tracks
+     * the current track is loaded by the switch (into the active instance)
+     * unless it's in the pool already
+     */
+
+    keep = 1U << this->active;
+    for (guint i = 0; i < n; i++) {
+        int slot;
+        if (tracks[i] && (slot = player_slot_find(this, tracks[i]->path)) >= 0) {
+            keep |= 1U << slot;
+        }
+    }
+
+    for (guint i = 0; i < n; i++) {
+        guint slot = 0;
+
+        if (!tracks[i] || tracks[i] == this->current) continue;
+        if (player_slot_find(this, tracks[i]->path) >= 0) continue;
+
+        while (slot < this->n_slots && keep & (1U << slot)) slot++;
+        if (slot == this->n_slots) break;
+
+        player_slot_load(this, &this->slots[slot], tracks[i]);
+        keep |= 1U << slot;
+    }
+}
+
+int player_set_option(Player* this, const char* name, const char* value)
+{
+    int status;
+
+    if (this->engine) return -1;
+
+    if (!this->n_slots) {
+        if ((status = mpv_set_property_string(this->mpv, name, value)) < 0) {
+            mpv_print_status(name, status);
+            return -1;
+        }
+        return 0;
+    }
+    for (guint i = 0; i < this->n_slots; i++) {
+        if ((status = mpv_set_property_string(this->slots[i].mpv, name, value)) < 0) {
+            mpv_print_status(name, status);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void player_print_stats(Player* this)
+{
+    printf("events       = %" G_GUINT64_FORMAT "\n", this->stats.events);
+    printf("events/s     = %.1f\n", this->stats.events_per_sec);
+    printf("drains       = %" G_GUINT64_FORMAT "\n", this->stats.drains);
+    printf("drain avg    = %.1f us\n", this->stats.drains
+            ? (double)this->stats.drain_time / (double)this->stats.drains : 0.0);
+    printf("drain max    = %" G_GINT64_FORMAT " us\n", this->stats.drain_max);
+    printf("switches     = %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+            " requests, %" G_GUINT64_FORMAT " aborted\n", this->stats.switches,
+            this->stats.switch_requests, this->stats.switch_aborts);
+    printf("switch last  = %" G_GINT64_FORMAT " us\n", this->stats.switch_last);
+    printf("switch avg   = %.1f us\n", this->stats.switches
+            ? (double)this->stats.switch_total / (double)this->stats.switches : 0.0);
+    printf("switch max   = %" G_GINT64_FORMAT " us\n", this->stats.switch_max);
+    printf("switch warm  = %" G_GUINT64_FORMAT "\n", this->stats.switch_warm);
+    printf("pool syncs   = %" G_GUINT64_FORMAT "\n", this->stats.syncs);
+    printf("\n");
+
+    if (this->engine) engine_print_stats(this->engine);
 }
 
 Player* player_init()
+{
+    Player* this;
+
+#ifdef PLAYER_ENGINE_SINK
+    return player_init_engine(PLAYER_ENGINE_SINK, TRUE);
+#endif
+
+    if (!(this = player_new())) return NULL;
+
+    setlocale(LC_NUMERIC, "C");
+    if (!(this->mpv = player_mpv_new())) return NULL;
+
+#if PLAYER_POOL_SIZE > 1
+
+    /* the first instance of the pool is the one created above, the pool
+     * is smaller when an instance fails to start
+     */
+
+    if (!(this->slots = calloc(MIN(PLAYER_POOL_SIZE, PLAYER_POOL_MAX),
+                    sizeof(PlayerSlot))))
+    {
+        fprintf(stderr, "failed to allocate player pool\n");
+        return this;
+    }
+
+    this->slots[0].mpv = this->mpv;
+    this->n_slots = 1;
+
+    while (this->n_slots < MIN(PLAYER_POOL_SIZE, PLAYER_POOL_MAX)) {
+        if (!(this->slots[this->n_slots].mpv = player_mpv_new())) break;
+        this->n_slots++;
+    }
+    this->n_prepare = this->n_slots;
+#endif
+
+    return this;
+}
+
+Player* player_init_engine(const char* sink, int realtime)
+{
+    Player* this;
+
+    if (!(this = player_new())) return NULL;
+
+    if (!(this->engine = engine_new(sink, realtime))) {
+        free(this);
+        return NULL;
+    }
+    this->n_prepare = ENGINE_SOURCES;
+
+    return this;
+}
+
+void player_free(Player* this)
+{
+    if (!this) return;
+
+#ifdef DEBUG
+    player_print_stats(this);
+#endif
+
+    if (this->switch_idle) g_source_remove(this->switch_idle);
+
+    if (this->n_slots) {
+        for (guint i = 0; i < this->n_slots; i++) {
+            mpv_terminate_destroy(this->slots[i].mpv);
+            g_free(this->slots[i].path);
+        }
+    } else if (this->mpv) {
+        mpv_terminate_destroy(this->mpv);
+    }
+    engine_free(this->engine);
+    free(this->slots);
+    if (this->current) free(this->current);
+    free(this);
+}
+
+double volume_to_db(double volume)
+{
+    return 60.0 * log(volume / 100.0) / log(10.0);
+}
+
+double player_track_gain(Player* this, Track* track)
+{
+    if (!track->analyzed) return 0.0;
+    return this->min_lufs - track->lufs;
+}
+
+double db_to_volume(double db)
+{
+    return exp(log(10.0)*(db/60.0 + 2));
+}
+
+gboolean player_switch(Player* this)
 {
     int status;
-    int false = 0;
-    /* int true = 1; */
+    char posstr[99];
+    const char* path;
+    double gain, volume, position;
+
+    this->switch_idle = 0;
+
+    if (!this->switch_pending || this->switch_state != PLAYER_SWITCH_IDLE) {
+        return G_SOURCE_REMOVE;
+    }
+    this->switch_pending = FALSE;
+
+    /* the current track was reset (eg removed) since the request */
+
+    if (!this->current) return G_SOURCE_REMOVE;
+
+    /* a pooled instance that has the file opened only has to be unmuted */
+
+    if (this->n_slots) {
+        int i = player_slot_find(this, this->current->path);
+
+        if (i >= 0 && this->slots[i].loaded) {
+            if ((guint)i != this->active) player_slot_activate(this, (guint)i);
+            if (!this->switch_continue) player_goto(this, this->switch_position);
+            this->load_time = this->switch_time;
+            this->stats.switch_warm++;
+            player_switch_done(this, TRUE);
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    position = this->switch_continue
+        ? player_get_position(this)
+        : this->switch_position;
 
-    Player* this = malloc(sizeof(Player));
+    gain = player_track_gain(this, this->current);
+    volume = db_to_volume(gain);
+
+    /* compensation for time-gap? */
+    /* if (position != 0.0) position += 0.050; */
+
+    g_snprintf(posstr,
+            ELEMENTS(posstr),
+            "start=%d.%d,volume=%d.%d",
+            (int)position,
+            (int)(fmod(position, 1.0)*10000000),
+            (int)volume,
+            (int)(fmod(volume, 1.0)*10000000)
+    );
+
+    /* every loadfile is tagged so its reply can be matched and the command
+     * can be aborted, tag 0 is used by all other commands
+     */
+
+    path = this->current->path;
+    this->load_tag = this->load_next_tag++;
+    this->load_time = this->switch_time;
+
+    const char *cmd[] = {"loadfile", path, "replace", posstr, NULL};
+    if ((status = mpv_command_async(this->mpv, this->load_tag, cmd)) < 0) {
+        mpv_print_status("loadfile", status);
+        return G_SOURCE_REMOVE;
+    }
+    this->switch_state = PLAYER_SWITCH_COMMAND;
+    player_set_position(this, position);
+
+    if (this->n_slots) {
+        PlayerSlot* slot = &this->slots[this->active];
+        g_free(slot->path);
+        slot->path = g_strdup(path);
+        slot->loaded = FALSE;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void player_switch_done(Player* this, int ok)
+{
+    this->switch_state = PLAYER_SWITCH_IDLE;
+
+    if (ok) {
+        gint64 latency = g_get_monotonic_time() - this->load_time;
+        this->stats.restart_time = this->load_time + latency;
+        this->stats.switches++;
+        this->stats.switch_last = latency;
+        this->stats.switch_total += latency;
+        this->stats.switch_max = MAX(this->stats.switch_max, latency);
+    }
+
+    if (this->switch_pending && !this->switch_idle) {
+        this->switch_idle = g_idle_add(G_SOURCE_FUNC(player_switch), this);
+    }
+}
+
+void player_set_position(Player* this, double position)
+{
+    this->position = position;
+    this->position_time = g_get_monotonic_time();
+}
+
+void player_wakeup(void* data)
+{
+    Player* this = data;
+
+    if (g_atomic_int_compare_and_exchange(&this->dispatch_pending, 0, 1)) {
+        if (this->event_callback) this->event_callback(this);
+    }
+}
+
+void player_property_changed(Player* this, uint64_t id, mpv_event_property* prop)
+{
+    if (!prop->data) return;
+
+    switch (id) {
+        case PLAYER_PROPERTY_TIME_POS:
+            player_set_position(this, *(double*)(prop->data));
+            this->stats.time_pos = this->position;
+            this->stats.time_pos_time = this->position_time;
+            break;
+
+        /* the position model is re-anchored before play state or speed
+         * change so the extrapolation up to now uses the old values
+         */
+
+        case PLAYER_PROPERTY_CORE_IDLE: {
+            int core_idle = *(int*)(prop->data);
+            PlayState state = core_idle ? PLAY_STATE_PAUSE : PLAY_STATE_PLAY;
+            if (state != this->play_state) {
+                player_set_position(this, player_get_position(this));
+                this->play_state = state;
+            }
+            break;
+        }
+
+        case PLAYER_PROPERTY_SPEED:
+            player_set_position(this, player_get_position(this));
+            this->speed = *(double*)(prop->data);
+            player_pool_set(this, "speed", MPV_FORMAT_DOUBLE, prop->data);
+            break;
+
+        case PLAYER_PROPERTY_PAUSE:
+            player_pool_set(this, "pause", MPV_FORMAT_FLAG, prop->data);
+            break;
+
+        case PLAYER_PROPERTY_LENGTH:
+            if (this->current) {
+                this->current->length = *(double*)(prop->data);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+Player* player_new(void)
+{
+    Player* this;
+
+    if (!(this = malloc(sizeof(Player)))) {
+        fprintf(stderr, "failed to allocate player\n");
+        return NULL;
+    }
 
+    this->mpv = NULL;
     this->current = NULL;
     this->loop_start = 0;
     this->loop_stop = 0;
     this->marker = 0;
     this->play_state = PLAY_STATE_STOP;
     this->position = 0;
+    this->position_time = 0;
+    this->speed = 1.0;
     this->rtn = 0;
+    this->min_lufs = 0.0;
+    this->dispatch_pending = 0;
+    this->switch_pending = FALSE;
+    this->switch_continue = FALSE;
+    this->switch_position = 0.0;
+    this->switch_time = 0;
+    this->switch_idle = 0;
+    this->switch_state = PLAYER_SWITCH_IDLE;
+    this->load_tag = 0;
+    this->load_next_tag = 1;
+    this->load_time = 0;
+    this->slots = NULL;
+    this->n_slots = 0;
+    this->active = 0;
+    this->engine = NULL;
+    this->n_prepare = 0;
+    this->event_callback = NULL;
+    memset(&this->stats, 0, sizeof(PlayerStats));
+    this->stats.window_start = g_get_monotonic_time();
 
-    setlocale(LC_NUMERIC, "C");
-    this->mpv = mpv_create();
-    if (!this->mpv) {
+    return this;
+}
+
+void player_engine_event(Player* this)
+{
+    /* a stopped player stays stopped until it plays again */
+
+    if (engine_playing(this->engine)) {
+        this->play_state = PLAY_STATE_PLAY;
+    } else if (this->play_state != PLAY_STATE_STOP) {
+        this->play_state = PLAY_STATE_PAUSE;
+    }
+}
+
+mpv_handle* player_mpv_new(void)
+{
+    mpv_handle* mpv;
+    int status;
+    int false = 0;
+
+    if (!(mpv = mpv_create())) {
         fprintf(stderr, "failed creating context\n");
         return NULL;
     }
-	mpv_observe_property(this->mpv, 0, "core-idle", MPV_FORMAT_FLAG);
-    mpv_observe_property(this->mpv, 0, "time-pos", MPV_FORMAT_DOUBLE);
-	mpv_observe_property(this->mpv, 0, "length", MPV_FORMAT_DOUBLE);
+    mpv_observe_property(mpv, PLAYER_PROPERTY_CORE_IDLE, "core-idle", MPV_FORMAT_FLAG);
+    mpv_observe_property(mpv, PLAYER_PROPERTY_TIME_POS, "time-pos", MPV_FORMAT_DOUBLE);
+    mpv_observe_property(mpv, PLAYER_PROPERTY_LENGTH, "length", MPV_FORMAT_DOUBLE);
+    mpv_observe_property(mpv, PLAYER_PROPERTY_SPEED, "speed", MPV_FORMAT_DOUBLE);
+    mpv_observe_property(mpv, PLAYER_PROPERTY_PAUSE, "pause", MPV_FORMAT_FLAG);
 
-    if ((status = mpv_set_property(this->mpv, "audio-pitch-correction", MPV_FORMAT_FLAG, &false)) < 0) {
+    if ((status = mpv_set_property(mpv, "audio-pitch-correction", MPV_FORMAT_FLAG, &false)) < 0) {
         mpv_print_status("audio-pitch-correction", status);
     }
 
-    if ((status = mpv_set_property(this->mpv, "audio-display", MPV_FORMAT_FLAG, &false)) < 0) {
+    if ((status = mpv_set_property(mpv, "audio-display", MPV_FORMAT_FLAG, &false)) < 0) {
         mpv_print_status("audio-display", status);
     }
 
-    if ((status = mpv_initialize(this->mpv)) < 0) {
+    if ((status = mpv_initialize(mpv)) < 0) {
         mpv_print_status("initialize", status);
     }
-    return this;
+    return mpv;
 }
 
-void player_free(Player* this)
+int player_drain(Player* this, PlayerSlot* slot, guint64* events)
 {
-    if (!this) return;
+    mpv_handle* mpv = slot ? slot->mpv : this->mpv;
 
-    mpv_terminate_destroy(this->mpv);
-    if (this->current) free(this->current);
-    free(this);
+    for (;;) {
+        mpv_event* event = mpv_wait_event(mpv, 0);
+
+        if (event->event_id == MPV_EVENT_NONE) return TRUE;
+        (*events)++;
+
+        if (slot) player_slot_event(slot, event);
+        if (mpv == this->mpv && !player_handle_event(this, event)) return FALSE;
+    }
 }
 
-double volume_to_db(double volume)
+int player_handle_event(Player* this, mpv_event* event)
 {
-    return 60.0 * log(volume / 100.0) / log(10.0);
+    switch (event->event_id) {
+        case MPV_EVENT_PROPERTY_CHANGE: {
+            player_property_changed(this, event->reply_userdata, event->data);
+            break;
+        }
+        case MPV_EVENT_LOG_MESSAGE: {
+            printf("mpv log: %s", (char*)event->data);
+            break;
+        }
+        case MPV_EVENT_COMMAND_REPLY: {
+            if (event->reply_userdata != this->load_tag) break;
+            if (this->switch_state != PLAYER_SWITCH_COMMAND) break;
+
+            /* an aborted or failed loadfile never starts playing */
+
+            if (event->error < 0) {
+                player_switch_done(this, FALSE);
+            } else {
+                this->switch_state = PLAYER_SWITCH_OPENING;
+            }
+            break;
+        }
+        case MPV_EVENT_PLAYBACK_RESTART: {
+            this->stats.restart_time = g_get_monotonic_time();
+            if (this->switch_state == PLAYER_SWITCH_OPENING) {
+                player_switch_done(this, TRUE);
+            }
+            break;
+        }
+        case MPV_EVENT_END_FILE: {
+            mpv_event_end_file* end = event->data;
+
+            /* the previous file ends with reason STOP when it's replaced,
+             * only an error means the new file won't play
+             */
+
+            if (this->switch_state == PLAYER_SWITCH_OPENING
+                    && end->reason == MPV_END_FILE_REASON_ERROR)
+            {
+                player_switch_done(this, FALSE);
+            }
+            break;
+        }
+        case MPV_EVENT_SHUTDOWN: {
+            return FALSE;
+        }
+        default: {
+            break;
+        };
+    }
+    return TRUE;
 }
 
-double db_to_volume(double db)
+void player_slot_event(PlayerSlot* slot, mpv_event* event)
 {
-    return exp(log(10.0)*(db/60.0 + 2));
+    switch (event->event_id) {
+        case MPV_EVENT_PROPERTY_CHANGE: {
+            mpv_event_property* prop = event->data;
+            if (event->reply_userdata == PLAYER_PROPERTY_TIME_POS && prop->data) {
+                slot->position = *(double*)(prop->data);
+                slot->position_time = g_get_monotonic_time();
+            }
+            break;
+        }
+        case MPV_EVENT_PLAYBACK_RESTART: {
+
+            /* the first restart is the file being opened, it doesn't tell
+             * how long a seek takes
+             */
+
+            if (slot->seeking && slot->loaded) {
+                slot->lag = g_get_monotonic_time() - slot->seek_time;
+            }
+            slot->seeking = FALSE;
+            slot->loaded = TRUE;
+            break;
+        }
+        case MPV_EVENT_END_FILE: {
+
+            /* also sent for the previous file when a file is replaced, the
+             * new file is loaded at its first restart
+             */
+
+            slot->seeking = FALSE;
+            slot->loaded = FALSE;
+            break;
+        }
+        default: {
+            break;
+        };
+    }
+}
+
+int player_slot_find(Player* this, const char* path)
+{
+    int found = -1;
+
+    for (guint i = 0; i < this->n_slots; i++) {
+        if (!this->slots[i].path || strcmp(this->slots[i].path, path) != 0) continue;
+        if (this->slots[i].loaded) return (int)i;
+        if (found < 0) found = (int)i;
+    }
+    return found;
+}
+
+void player_slot_load(Player* this, PlayerSlot* slot, Track* track)
+{
+    int status;
+    int mute = 1;
+    int pause = this->play_state != PLAY_STATE_PLAY;
+    char posstr[32];
+
+    if ((status = mpv_set_property(slot->mpv, "mute", MPV_FORMAT_FLAG, &mute)) < 0) {
+        mpv_print_status("mute", status);
+        return;
+    }
+    mpv_set_property(slot->mpv, "pause", MPV_FORMAT_FLAG, &pause);
+    mpv_set_property(slot->mpv, "speed", MPV_FORMAT_DOUBLE, &this->speed);
+
+    g_snprintf(posstr, ELEMENTS(posstr), "start=%f", player_get_position(this));
+
+    const char* cmd[] = {"loadfile", track->path, "replace", posstr, NULL};
+    if ((status = mpv_command_async(slot->mpv, 0, cmd)) < 0) {
+        mpv_print_status("loadfile", status);
+        return;
+    }
+
+    g_free(slot->path);
+    slot->path = g_strdup(track->path);
+    slot->loaded = FALSE;
+    slot->seeking = FALSE;
+}
+
+void player_slot_sync(Player* this, PlayerSlot* slot)
+{
+    int status;
+    char posstr[32];
+    gint64 now = g_get_monotonic_time();
+    double position, drift;
+
+    if (!slot->loaded || slot->seeking || !this->current) return;
+
+    /* time-pos of both instances is extrapolated to now, they're not
+     * reported at the same moment
+     */
+
+    position = player_get_position_at(this, now);
+    drift = slot->position - position;
+
+    if (this->play_state == PLAY_STATE_PLAY) {
+        double elapsed = (double)(now - slot->position_time) / G_USEC_PER_SEC;
+        drift += CLAMP(elapsed, 0.0, PLAYER_EXTRAPOLATE_MAX) * this->speed;
+        position += (double)slot->lag / G_USEC_PER_SEC * this->speed;
+    }
+
+    if (fabs(drift) < PLAYER_POOL_DRIFT) return;
+
+    g_snprintf(posstr, ELEMENTS(posstr), "%f", position);
+
+    const char* cmd[] = {"seek", posstr, "absolute+exact", NULL};
+    if ((status = mpv_command_async(slot->mpv, 0, cmd)) < 0) {
+        mpv_print_status("seek", status);
+        return;
+    }
+
+    slot->seeking = TRUE;
+    slot->seek_time = now;
+    this->stats.syncs++;
+}
+
+void player_slot_activate(Player* this, guint i)
+{
+    int status;
+    int mute = 1, unmute = 0;
+    double volume = db_to_volume(player_track_gain(this, this->current));
+    PlayerSlot* slot = &this->slots[i];
+    mpv_handle* old = this->mpv;
+
+    mpv_set_property(slot->mpv, "volume", MPV_FORMAT_DOUBLE, &volume);
+
+    /* the loop is set on the instance that was active when it was marked */
+
+    if (this->loop_start != 0.0) {
+        mpv_set_property(slot->mpv, "ab-loop-a", MPV_FORMAT_DOUBLE, &this->loop_start);
+    } else {
+        mpv_set_property_string(slot->mpv, "ab-loop-a", "no");
+    }
+    if (this->loop_stop != 0.0) {
+        mpv_set_property(slot->mpv, "ab-loop-b", MPV_FORMAT_DOUBLE, &this->loop_stop);
+    } else {
+        mpv_set_property_string(slot->mpv, "ab-loop-b", "no");
+    }
+
+    if ((status = mpv_set_property(slot->mpv, "mute", MPV_FORMAT_FLAG, &unmute)) < 0) {
+        mpv_print_status("mute", status);
+    }
+    if ((status = mpv_set_property(old, "mute", MPV_FORMAT_FLAG, &mute)) < 0) {
+        mpv_print_status("mute", status);
+    }
+
+    this->mpv = slot->mpv;
+    this->active = i;
+}
+
+void player_pool_set(Player* this, const char* name, mpv_format format, void* data)
+{
+    int status;
+
+    for (guint i = 0; i < this->n_slots; i++) {
+        if (i == this->active) continue;
+        if ((status = mpv_set_property_async(this->slots[i].mpv, 0, name,
+                        format, data)) < 0)
+        {
+            mpv_print_status(name, status);
+        }
+    }
 }
 
 void mpv_print_status(const char* cmd, int status)
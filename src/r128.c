@@ -0,0 +1,1272 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        r128.c
+ * @brief       ebu r128 loudness kernel
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+
+#include "../include/r128.h"
+
+/**
+ * the vector kernels are compiled for their instruction set only, the
+ * rest of the program doesn't need to be built for it
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define R128_X86
+#include <immintrin.h>
+#define R128_TARGET_SSE2 __attribute__((target("sse2")))
+#define R128_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/**
+ * frames converted to double at once
+ */
+#define R128_CHUNK 1024
+
+/**
+ * taps of the true peak interpolator
+ */
+#define R128_TAPS 49
+
+/**
+ * energy of the absolute gate, -70 LUFS
+ */
+#define R128_ABSOLUTE_GATE 1.1724653045822963e-7
+
+/**
+ * factor of the relative gate, -10 LU
+ */
+#define R128_RELATIVE_GATE 0.1
+
+/**
+ * factor of the relative gate of the loudness range, -20 LU
+ */
+#define R128_RANGE_GATE 0.01
+
+/**
+ * Convert frames of type T to the scratch buffer and process them, chunk
+ * by chunk
+ */
+#define R128_ADD(T, expr)                                                      \
+    while (frames) {                                                           \
+        const size_t n = r128_chunk(this, frames);                             \
+        for (size_t i = 0; i < n * this->channels; i++) {                      \
+            const T x = src[i];                                                \
+            this->scratch[i] = (expr);                                         \
+        }                                                                      \
+        r128_process(this, n);                                                 \
+        src += n * this->channels;                                             \
+        frames -= n;                                                           \
+    }
+
+/**
+ * Convert frames of packed pcm of size bytes per sample to the scratch
+ * buffer and process them, p points to the sample being converted
+ */
+#define R128_ADD_PCM(size, expr)                                               \
+    while (frames) {                                                           \
+        const size_t n = r128_chunk(this, frames);                             \
+        for (size_t i = 0; i < n * this->channels; i++, p += (size)) {         \
+            this->scratch[i] = (expr);                                         \
+        }                                                                      \
+        r128_process(this, n);                                                 \
+        frames -= n;                                                           \
+    }
+
+/**
+ * Unsigned integers of packed pcm, the bytes of a 24 bit sample are moved
+ * to the top of 32 bits
+ */
+#define R128_LE16(p) ((uint16_t)((p)[0] | (p)[1] << 8))
+#define R128_BE16(p) ((uint16_t)((p)[1] | (p)[0] << 8))
+#define R128_LE24(p) ((uint32_t)(p)[0] << 8 | (uint32_t)(p)[1] << 16          \
+        | (uint32_t)(p)[2] << 24)
+#define R128_BE24(p) ((uint32_t)(p)[2] << 8 | (uint32_t)(p)[1] << 16          \
+        | (uint32_t)(p)[0] << 24)
+#define R128_LE32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8                 \
+        | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+#define R128_BE32(p) ((uint32_t)(p)[3] | (uint32_t)(p)[2] << 8                 \
+        | (uint32_t)(p)[1] << 16 | (uint32_t)(p)[0] << 24)
+#define R128_LE64(p) ((uint64_t)R128_LE32((p) + 4) << 32 | R128_LE32(p))
+#define R128_BE64(p) ((uint64_t)R128_BE32(p) << 32 | R128_BE32((p) + 4))
+
+/**
+ * best instruction set r128_new may use, see r128_set_isa
+ */
+static R128Isa r128_isa_max = R128_AVX2;
+
+/**
+ * Number of frames of the next chunk
+ *
+ * a chunk never crosses a gating block or the end of the energy ring
+ *
+ * @param this the r128 object
+ * @param frames frames left to add
+ * @return number of frames
+ */
+static size_t r128_chunk(R128* this, size_t frames);
+
+/**
+ * Measure the scratch buffer
+ *
+ * @param this the r128 object
+ * @param frames number of frames in scratch
+ */
+static void r128_process(R128* this, size_t frames);
+
+/**
+ * @param bits an ieee float as stored in a file
+ * @return the float
+ */
+static inline double r128_float(uint32_t bits);
+
+/**
+ * @param bits an ieee double as stored in a file
+ * @return the double
+ */
+static inline double r128_double(uint64_t bits);
+
+/**
+ * Measure the gating block and short-term window that end at the 100ms
+ * step that was just completed
+ *
+ * @param this the r128 object
+ */
+static void r128_step(R128* this);
+
+/**
+ * Keep a gating block or short-term window, in a histogram or an array
+ *
+ * @param bins the histogram, NULL without R128_HISTOGRAM
+ * @param array the array, reallocated when full
+ * @param len number of values
+ * @param capacity allocated size
+ * @param energy mean energy of the block or window
+ */
+static void r128_keep(unsigned long* bins, double** array, size_t* len,
+size_t* capacity, double energy);
+
+/**
+ * Append a value to a growing array
+ *
+ * @param array the array, reallocated when full
+ * @param len number of values
+ * @param capacity allocated size
+ * @param value the value to append
+ * @return 0 on success or -1 when failed to allocate
+ */
+static int r128_append(double** array, size_t* len, size_t* capacity,
+double value);
+
+/**
+ * Sum of the energy of the last frames
+ *
+ * @param this the r128 object
+ * @param frames number of frames, at most ring_frames
+ * @return the sum
+ */
+static double r128_sum(R128* this, size_t frames);
+
+/**
+ * @return loudness in LUFS of a mean energy, -HUGE_VAL for silence
+ */
+static double r128_energy_to_loudness(double energy);
+
+/**
+ * @return histogram bin of a mean energy above the absolute gate
+ */
+static size_t r128_bin(double energy);
+
+/**
+ * @return mean energy of the center of a histogram bin
+ */
+static double r128_bin_energy(size_t bin);
+
+/**
+ * First bin at or above a gate, like libebur128 finds it
+ *
+ * @param gate mean energy of the gate
+ * @return the bin
+ */
+static size_t r128_bin_gate(double gate);
+
+/**
+ * Sum the histograms of several streams
+ *
+ * @param dest R128_BINS counts
+ * @param states r128 objects
+ * @param n number of objects
+ * @param range the short-term histograms instead of the gating blocks
+ */
+static void r128_bins_sum(unsigned long* dest, R128** states, size_t n,
+int range);
+
+/**
+ * Sort doubles ascending, for qsort
+ */
+static int r128_compare(const void* a, const void* b);
+
+/**
+ * Calculate the K-weighting filter coefficients
+ *
+ * a high shelf and a high pass, combined into one 4th order filter
+ *
+ * @param this the r128 object
+ */
+static void r128_init_filter(R128* this);
+
+/**
+ * Calculate the true peak interpolator
+ *
+ * a hanning windowed sinc split in one sub-filter per phase
+ *
+ * @param this the r128 object
+ * @return 0 on success or -1 when failed
+ */
+static int r128_init_peak(R128* this);
+
+static void r128_filter_scalar(R128* this, const double* src, size_t frames,
+double* energy);
+
+static void r128_filter_mono(R128* this, const double* src, size_t frames,
+double* energy);
+
+static void r128_peak_scalar(R128* this, const double* src, size_t frames);
+
+#ifdef R128_X86
+
+static void r128_filter_stereo_sse2(R128* this, const double* src,
+size_t frames, double* energy);
+
+static void r128_filter_51_sse2(R128* this, const double* src, size_t frames,
+double* energy);
+
+static void r128_filter_51_avx2(R128* this, const double* src, size_t frames,
+double* energy);
+
+static void r128_peak2_sse2(R128* this, const double* src, size_t frames);
+
+static void r128_peak4_sse2(R128* this, const double* src, size_t frames);
+
+static void r128_peak4_avx2(R128* this, const double* src, size_t frames);
+
+#endif
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+R128* r128_new(unsigned int channels, unsigned int sample_rate, int mode)
+{
+    R128* this;
+
+    if (!channels || !sample_rate) return NULL;
+
+    if (!(this = calloc(1, sizeof(R128)))) {
+        fprintf(stderr, "failed to allocate r128\n");
+        return NULL;
+    }
+
+    this->channels = channels;
+    this->sample_rate = sample_rate;
+    this->mode = mode;
+    this->isa = r128_get_isa();
+
+    /* blocks and ring are sized like libebur128 does so blocks start at the
+     * same frames, analysis relies on that to align segments
+     */
+
+    this->block_frames = (sample_rate + 5) / 10;
+    this->needed = this->block_frames;
+    this->ring_frames = (size_t)sample_rate * 400 / 1000;
+    if (this->ring_frames % this->block_frames) {
+        this->ring_frames += this->block_frames - this->ring_frames % this->block_frames;
+    }
+
+    if (!(this->weights = calloc(channels, sizeof(double)))
+            || !(this->state = calloc(4 * channels, sizeof(double)))
+            || !(this->scratch = malloc(R128_CHUNK * channels * sizeof(double)))
+            || !(this->energy = calloc(this->ring_frames, sizeof(double)))
+            || !(this->sample_peak = calloc(channels, sizeof(double)))
+            || !(this->true_peak = calloc(channels, sizeof(double))))
+    {
+        fprintf(stderr, "failed to allocate r128\n");
+        goto fail;
+    }
+
+    if ((mode & R128_HISTOGRAM)
+            && (!(this->block_bins = calloc(R128_BINS, sizeof(unsigned long)))
+                || !(this->short_term_bins = calloc(R128_BINS, sizeof(unsigned long)))))
+    {
+        fprintf(stderr, "failed to allocate r128\n");
+        goto fail;
+    }
+
+    /* default channel map of libebur128: L R C LFE Ls Rs, 4 channels are
+     * L R Ls Rs and 5 are L R C Ls Rs, surround channels weigh 1.41
+     */
+
+    for (unsigned int c = 0; c < channels; c++) {
+        if (channels == 4) this->weights[c] = c < 2 ? 1.0 : 1.41;
+        else if (channels == 5) this->weights[c] = c < 3 ? 1.0 : 1.41;
+        else if (c < 3) this->weights[c] = 1.0;
+        else if (c == 4 || c == 5) this->weights[c] = 1.41;
+    }
+
+    r128_init_filter(this);
+    if ((mode & R128_TRUE_PEAK) && r128_init_peak(this) != 0) goto fail;
+
+    this->filter = channels == 1 ? r128_filter_mono : r128_filter_scalar;
+    this->peak = r128_peak_scalar;
+
+#ifdef R128_X86
+    if (this->isa >= R128_SSE2) {
+        if (channels == 2) this->filter = r128_filter_stereo_sse2;
+        if (channels == 6) this->filter = r128_filter_51_sse2;
+        if (this->factor == 2) this->peak = r128_peak2_sse2;
+        if (this->factor == 4) this->peak = r128_peak4_sse2;
+    }
+    if (this->isa >= R128_AVX2) {
+        if (channels == 6) this->filter = r128_filter_51_avx2;
+        if (this->factor == 4) this->peak = r128_peak4_avx2;
+    }
+#endif
+
+    return this;
+
+fail:
+    r128_free(this);
+    return NULL;
+}
+
+void r128_set_origin(R128* this, size_t frame, size_t preroll)
+{
+    this->first = frame / this->block_frames;
+    this->start = (frame + preroll) / this->block_frames;
+    this->step = this->first;
+}
+
+void r128_add_frames_short(R128* this, const short* src, size_t frames)
+{
+    R128_ADD(short, (double)x / 32768.0);
+}
+
+void r128_add_frames_int(R128* this, const int* src, size_t frames)
+{
+    R128_ADD(int, (double)x / 2147483648.0);
+}
+
+void r128_add_frames_float(R128* this, const float* src, size_t frames)
+{
+    R128_ADD(float, (double)x);
+}
+
+void r128_add_frames_double(R128* this, const double* src, size_t frames)
+{
+    R128_ADD(double, x);
+}
+
+void r128_add_frames_pcm(R128* this, const void* src, size_t frames,
+unsigned int bytes, int floating, int big_endian)
+{
+    const unsigned char* p = src;
+
+    /* the compiler turns the byte shuffling into plain (or swapped) loads */
+
+    switch (bytes | (floating ? 0x10 : 0) | (big_endian ? 0x20 : 0)) {
+        case 2:
+            R128_ADD_PCM(2, (double)(int16_t)R128_LE16(p) / 32768.0);
+            break;
+        case 2 | 0x20:
+            R128_ADD_PCM(2, (double)(int16_t)R128_BE16(p) / 32768.0);
+            break;
+        case 3:
+            R128_ADD_PCM(3, (double)(int32_t)R128_LE24(p) / 2147483648.0);
+            break;
+        case 3 | 0x20:
+            R128_ADD_PCM(3, (double)(int32_t)R128_BE24(p) / 2147483648.0);
+            break;
+        case 4:
+            R128_ADD_PCM(4, (double)(int32_t)R128_LE32(p) / 2147483648.0);
+            break;
+        case 4 | 0x20:
+            R128_ADD_PCM(4, (double)(int32_t)R128_BE32(p) / 2147483648.0);
+            break;
+        case 4 | 0x10:
+            R128_ADD_PCM(4, r128_float(R128_LE32(p)));
+            break;
+        case 4 | 0x10 | 0x20:
+            R128_ADD_PCM(4, r128_float(R128_BE32(p)));
+            break;
+        case 8 | 0x10:
+            R128_ADD_PCM(8, r128_double(R128_LE64(p)));
+            break;
+        case 8 | 0x10 | 0x20:
+            R128_ADD_PCM(8, r128_double(R128_BE64(p)));
+            break;
+        default:
+            fprintf(stderr, "unsupported pcm of %u bytes\n", bytes);
+            break;
+    }
+}
+
+int r128_loudness_window(R128* this, unsigned long window, double* out)
+{
+    const size_t frames = (size_t)this->sample_rate * window / 1000;
+    double energy;
+
+    if (frames > this->ring_frames || !frames) return -1;
+
+    energy = r128_sum(this, frames) / (double)frames;
+    *out = r128_energy_to_loudness(energy);
+    return 0;
+}
+
+void r128_loudness_global_multiple(R128** states, size_t n, double* out)
+{
+    double threshold = 0.0, energy = 0.0;
+    size_t count = 0;
+
+    if (n && (states[0]->mode & R128_HISTOGRAM)) {
+        unsigned long bins[R128_BINS];
+        size_t gate;
+
+        /* the blocks of a bin are taken at its center */
+
+        r128_bins_sum(bins, states, n, FALSE);
+        for (size_t j = 0; j < R128_BINS; j++) {
+            threshold += (double)bins[j] * r128_bin_energy(j);
+            count += bins[j];
+        }
+
+        if (!count) {
+            *out = -HUGE_VAL;
+            return;
+        }
+        gate = r128_bin_gate(threshold / (double)count * R128_RELATIVE_GATE);
+
+        count = 0;
+        for (size_t j = gate; j < R128_BINS; j++) {
+            energy += (double)bins[j] * r128_bin_energy(j);
+            count += bins[j];
+        }
+
+        *out = count ? r128_energy_to_loudness(energy / (double)count) : -HUGE_VAL;
+        return;
+    }
+
+    /* blocks under the absolute gate were never stored */
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < states[i]->n_blocks; j++) {
+            threshold += states[i]->blocks[j];
+        }
+        count += states[i]->n_blocks;
+    }
+
+    if (!count) {
+        *out = -HUGE_VAL;
+        return;
+    }
+    threshold = threshold / (double)count * R128_RELATIVE_GATE;
+
+    count = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < states[i]->n_blocks; j++) {
+            if (states[i]->blocks[j] >= threshold) {
+                energy += states[i]->blocks[j];
+                count++;
+            }
+        }
+    }
+
+    *out = count ? r128_energy_to_loudness(energy / (double)count) : -HUGE_VAL;
+}
+
+int r128_loudness_range_multiple(R128** states, size_t n, double* out)
+{
+    double* windows;
+    double mean = 0.0;
+    size_t count = 0, m = 0;
+
+    *out = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        if (!(states[i]->mode & R128_RANGE)) return -1;
+    }
+
+    if (n && (states[0]->mode & R128_HISTOGRAM)) {
+        unsigned long bins[R128_BINS];
+        size_t gate, low, high, j, sum = 0;
+
+        r128_bins_sum(bins, states, n, TRUE);
+        for (j = 0; j < R128_BINS; j++) {
+            mean += (double)bins[j] * r128_bin_energy(j);
+            count += bins[j];
+        }
+        if (!count) return 0;
+        gate = r128_bin_gate(mean / (double)count * R128_RANGE_GATE);
+
+        count = 0;
+        for (j = gate; j < R128_BINS; j++) count += bins[j];
+        if (!count) return 0;
+
+        /* walk the bins up to the percentiles */
+
+        low = (size_t)((double)(count - 1) * 0.1 + 0.5);
+        high = (size_t)((double)(count - 1) * 0.95 + 0.5);
+
+        for (j = gate; sum <= low; j++) sum += bins[j];
+        mean = r128_bin_energy(j - 1);
+        for (; sum <= high; j++) sum += bins[j];
+
+        *out = 10.0 * log10(r128_bin_energy(j - 1)) - 10.0 * log10(mean);
+        return 0;
+    }
+
+    /* windows under the absolute gate were never stored */
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < states[i]->n_short_term; j++) {
+            mean += states[i]->short_term[j];
+        }
+        count += states[i]->n_short_term;
+    }
+    if (!count) return 0;
+    mean /= (double)count;
+
+    if (!(windows = malloc(count * sizeof(double)))) {
+        fprintf(stderr, "r128 malloc failed\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < states[i]->n_short_term; j++) {
+            if (states[i]->short_term[j] >= mean * R128_RANGE_GATE) {
+                windows[m++] = states[i]->short_term[j];
+            }
+        }
+    }
+    qsort(windows, m, sizeof(double), r128_compare);
+
+    if (m) {
+        *out = 10.0 * log10(windows[(size_t)((double)(m - 1) * 0.95 + 0.5)])
+            - 10.0 * log10(windows[(size_t)((double)(m - 1) * 0.1 + 0.5)]);
+    }
+
+    free(windows);
+    return 0;
+}
+
+double r128_momentary_max(R128* this)
+{
+    return r128_energy_to_loudness(this->momentary_max);
+}
+
+double r128_short_term_max(R128* this)
+{
+    return r128_energy_to_loudness(this->short_term_max);
+}
+
+double r128_sample_peak(R128* this, unsigned int channel)
+{
+    return channel < this->channels ? this->sample_peak[channel] : 0.0;
+}
+
+double r128_true_peak(R128* this, unsigned int channel)
+{
+    if (channel >= this->channels) return 0.0;
+    return MAX(this->true_peak[channel], this->sample_peak[channel]);
+}
+
+void r128_set_isa(R128Isa isa)
+{
+    r128_isa_max = isa;
+}
+
+R128Isa r128_get_isa(void)
+{
+    R128Isa isa = R128_SCALAR;
+
+#ifdef R128_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) isa = R128_SSE2;
+    if (__builtin_cpu_supports("avx2")) isa = R128_AVX2;
+#endif
+
+    return MIN(isa, r128_isa_max);
+}
+
+const char* r128_isa_name(R128Isa isa)
+{
+    switch (isa) {
+        case R128_AVX2:
+            return "avx2";
+        case R128_SSE2:
+            return "sse2";
+        case R128_SCALAR:
+        default:
+            return "scalar";
+    }
+}
+
+void r128_free(R128* this)
+{
+    if (!this) return;
+
+    free(this->weights);
+    free(this->state);
+    free(this->scratch);
+    free(this->energy);
+    free(this->blocks);
+    free(this->short_term);
+    free(this->block_bins);
+    free(this->short_term_bins);
+    free(this->sample_peak);
+    free(this->true_peak);
+    free(this->coeff);
+    free(this->taps);
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+size_t r128_chunk(R128* this, size_t frames)
+{
+    frames = MIN(frames, R128_CHUNK);
+    frames = MIN(frames, this->needed);
+    return MIN(frames, this->ring_frames - this->ring_pos);
+}
+
+void r128_process(R128* this, size_t frames)
+{
+    const unsigned int channels = this->channels;
+
+    for (unsigned int c = 0; c < channels; c++) {
+        double peak = this->sample_peak[c];
+        for (size_t i = 0; i < frames; i++) {
+            peak = MAX(peak, fabs(this->scratch[i * channels + c]));
+        }
+        this->sample_peak[c] = peak;
+    }
+
+    if (this->factor > 1) this->peak(this, this->scratch, frames);
+
+    this->filter(this, this->scratch, frames, &this->energy[this->ring_pos]);
+    this->ring_pos += frames;
+    this->needed -= frames;
+
+    if (!this->needed) {
+        r128_step(this);
+        this->needed = this->block_frames;
+    }
+
+    if (this->ring_pos == this->ring_frames) this->ring_pos = 0;
+
+    /* denormals slow down the filter in silence */
+
+    for (unsigned int i = 0; i < 4 * channels; i++) {
+        if (fabs(this->state[i]) < DBL_MIN) this->state[i] = 0.0;
+    }
+}
+
+double r128_float(uint32_t bits)
+{
+    float x;
+
+    memcpy(&x, &bits, sizeof(x));
+    return (double)x;
+}
+
+double r128_double(uint64_t bits)
+{
+    double x;
+
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+void r128_step(R128* this)
+{
+    const size_t steps = ++this->step - this->first;
+    double block = 0.0, window = 0.0;
+
+    this->sums[this->step % R128_SHORT_TERM] = r128_sum(this, this->block_frames);
+
+    /* nothing that ends in the pre-roll is counted */
+
+    if (this->step <= this->start) return;
+
+    /* a 400ms gating block every 100ms, from the first 400ms on */
+
+    if (steps >= 4) {
+        for (size_t i = 0; i < 4; i++) {
+            block += this->sums[(this->step - i) % R128_SHORT_TERM];
+        }
+        block /= (double)(4 * this->block_frames);
+
+        this->momentary_max = MAX(this->momentary_max, block);
+        if (block >= R128_ABSOLUTE_GATE) {
+            r128_keep(this->block_bins, &this->blocks, &this->n_blocks,
+                    &this->blocks_capacity, block);
+        }
+    }
+
+    /* a 3s window every 100ms for the maximum, the loudness range only takes
+     * the ones that end on a whole second of the stream
+     */
+
+    if (steps >= R128_SHORT_TERM) {
+        for (size_t i = 0; i < R128_SHORT_TERM; i++) window += this->sums[i];
+        window /= (double)(R128_SHORT_TERM * this->block_frames);
+
+        this->short_term_max = MAX(this->short_term_max, window);
+        if ((this->mode & R128_RANGE) && this->step % 10 == 0
+                && window >= R128_ABSOLUTE_GATE)
+        {
+            r128_keep(this->short_term_bins, &this->short_term,
+                    &this->n_short_term, &this->short_term_capacity, window);
+        }
+    }
+}
+
+void r128_keep(unsigned long* bins, double** array, size_t* len,
+size_t* capacity, double energy)
+{
+    if (bins) {
+        bins[r128_bin(energy)]++;
+    } else if (r128_append(array, len, capacity, energy) != 0) {
+        fprintf(stderr, "r128 malloc failed, value dropped\n");
+    }
+}
+
+int r128_append(double** array, size_t* len, size_t* capacity, double value)
+{
+    if (*len == *capacity) {
+        size_t grown_capacity = MAX(2 * *capacity, 64);
+        double* grown = realloc(*array, grown_capacity * sizeof(double));
+        if (!grown) return -1;
+        *array = grown;
+        *capacity = grown_capacity;
+    }
+    (*array)[(*len)++] = value;
+    return 0;
+}
+
+double r128_sum(R128* this, size_t frames)
+{
+    const size_t pos = this->ring_pos;
+    double sum = 0.0;
+
+    if (frames <= pos) {
+        for (size_t i = pos - frames; i < pos; i++) sum += this->energy[i];
+        return sum;
+    }
+    for (size_t i = 0; i < pos; i++) sum += this->energy[i];
+    for (size_t i = this->ring_frames - (frames - pos); i < this->ring_frames; i++) {
+        sum += this->energy[i];
+    }
+    return sum;
+}
+
+double r128_energy_to_loudness(double energy)
+{
+    return energy > 0.0 ? 10.0 * log10(energy) - 0.691 : -HUGE_VAL;
+}
+
+size_t r128_bin(double energy)
+{
+    const double bin = (r128_energy_to_loudness(energy) + 70.0) * 10.0;
+
+    /* louder than +30 LUFS falls in the last bin */
+
+    if (bin <= 0.0) return 0;
+    return bin >= R128_BINS - 1 ? R128_BINS - 1 : (size_t)bin;
+}
+
+double r128_bin_energy(size_t bin)
+{
+    return pow(10.0, ((double)bin / 10.0 - 69.95 + 0.691) / 10.0);
+}
+
+size_t r128_bin_gate(double gate)
+{
+    size_t bin;
+
+    if (gate < R128_ABSOLUTE_GATE) return 0;
+    bin = r128_bin(gate);
+    return gate > r128_bin_energy(bin) ? bin + 1 : bin;
+}
+
+void r128_bins_sum(unsigned long* dest, R128** states, size_t n, int range)
+{
+    memset(dest, 0, R128_BINS * sizeof(unsigned long));
+
+    for (size_t i = 0; i < n; i++) {
+        const unsigned long* bins = range
+            ? states[i]->short_term_bins : states[i]->block_bins;
+        for (size_t j = 0; j < R128_BINS; j++) dest[j] += bins[j];
+    }
+}
+
+int r128_compare(const void* a, const void* b)
+{
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+void r128_init_filter(R128* this)
+{
+    const double rate = this->sample_rate;
+    double f0, g, q, k, vh, vb, a0;
+    double pb[3], pa[3], rb[3], ra[3];
+
+    /* the constants of libebur128 (ITU-R BS.1770 for any sample rate) */
+
+    f0 = 1681.974450955533;
+    g = 3.999843853973347;
+    q = 0.7071752369554196;
+    k = tan(M_PI * f0 / rate);
+    vh = pow(10.0, g / 20.0);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+
+    pb[0] = (vh + vb * k / q + k * k) / a0;
+    pb[1] = 2.0 * (k * k - vh) / a0;
+    pb[2] = (vh - vb * k / q + k * k) / a0;
+    pa[0] = 1.0;
+    pa[1] = 2.0 * (k * k - 1.0) / a0;
+    pa[2] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / rate);
+
+    rb[0] = 1.0;
+    rb[1] = -2.0;
+    rb[2] = 1.0;
+    ra[0] = 1.0;
+    ra[1] = 2.0 * (k * k - 1.0) / (1.0 + k / q + k * k);
+    ra[2] = (1.0 - k / q + k * k) / (1.0 + k / q + k * k);
+
+    this->b[0] = pb[0] * rb[0];
+    this->b[1] = pb[0] * rb[1] + pb[1] * rb[0];
+    this->b[2] = pb[0] * rb[2] + pb[1] * rb[1] + pb[2] * rb[0];
+    this->b[3] = pb[1] * rb[2] + pb[2] * rb[1];
+    this->b[4] = pb[2] * rb[2];
+
+    this->a[0] = pa[0] * ra[0];
+    this->a[1] = pa[0] * ra[1] + pa[1] * ra[0];
+    this->a[2] = pa[0] * ra[2] + pa[1] * ra[1] + pa[2] * ra[0];
+    this->a[3] = pa[1] * ra[2] + pa[2] * ra[1];
+    this->a[4] = pa[2] * ra[2];
+}
+
+int r128_init_peak(R128* this)
+{
+    if (this->sample_rate < 96000) this->factor = 4;
+    else if (this->sample_rate < 192000) this->factor = 2;
+    else this->factor = 1;
+
+    if (this->factor == 1) return 0;
+
+    this->delay = (R128_TAPS + this->factor - 1) / this->factor;
+
+    if (!(this->coeff = calloc(this->delay * this->factor, sizeof(double)))
+            || !(this->taps = calloc(2 * this->delay * this->channels, sizeof(double))))
+    {
+        fprintf(stderr, "failed to allocate r128\n");
+        return -1;
+    }
+
+    /* tap j belongs to phase j % factor and is applied to the sample
+     * j / factor frames ago
+     */
+
+    for (unsigned int j = 0; j < R128_TAPS; j++) {
+        const double m = (double)j - (double)(R128_TAPS - 1) / 2.0;
+        double c = 1.0;
+
+        if (fabs(m) > 0.000001) {
+            c = sin(m * M_PI / this->factor) / (m * M_PI / this->factor);
+        }
+        c *= 0.5 * (1.0 - cos(2.0 * M_PI * j / (R128_TAPS - 1)));
+
+        if (fabs(c) > 0.000001) this->coeff[j] = c;
+    }
+    return 0;
+}
+
+void r128_filter_scalar(R128* this, const double* src, size_t frames,
+double* energy)
+{
+    const unsigned int channels = this->channels;
+    const double* a = this->a;
+    const double* b = this->b;
+    double* v1 = this->state;
+    double* v2 = v1 + channels;
+    double* v3 = v2 + channels;
+    double* v4 = v3 + channels;
+
+    for (size_t i = 0; i < frames; i++) {
+        double e = 0.0;
+
+        for (unsigned int c = 0; c < channels; c++) {
+            const double v0 = src[i * channels + c]
+                - a[1] * v1[c] - a[2] * v2[c] - a[3] * v3[c] - a[4] * v4[c];
+            const double y = b[0] * v0 + b[1] * v1[c] + b[2] * v2[c]
+                + b[3] * v3[c] + b[4] * v4[c];
+
+            v4[c] = v3[c];
+            v3[c] = v2[c];
+            v2[c] = v1[c];
+            v1[c] = v0;
+            e += this->weights[c] * y * y;
+        }
+        energy[i] = e;
+    }
+}
+
+void r128_filter_mono(R128* this, const double* src, size_t frames,
+double* energy)
+{
+    const double* a = this->a;
+    const double* b = this->b;
+    const double w = this->weights[0];
+    double v1 = this->state[0], v2 = this->state[1];
+    double v3 = this->state[2], v4 = this->state[3];
+
+    for (size_t i = 0; i < frames; i++) {
+        const double v0 = src[i] - a[1] * v1 - a[2] * v2 - a[3] * v3 - a[4] * v4;
+        const double y = b[0] * v0 + b[1] * v1 + b[2] * v2 + b[3] * v3 + b[4] * v4;
+
+        v4 = v3;
+        v3 = v2;
+        v2 = v1;
+        v1 = v0;
+        energy[i] = w * y * y;
+    }
+
+    this->state[0] = v1;
+    this->state[1] = v2;
+    this->state[2] = v3;
+    this->state[3] = v4;
+}
+
+void r128_peak_scalar(R128* this, const double* src, size_t frames)
+{
+    const unsigned int channels = this->channels;
+    const unsigned int factor = this->factor;
+    const unsigned int delay = this->delay;
+
+    for (size_t i = 0; i < frames; i++) {
+        const size_t pos = this->taps_pos;
+
+        for (unsigned int c = 0; c < channels; c++) {
+            double* h = &this->taps[2 * delay * c];
+            double peak = this->true_peak[c];
+
+            /* every sample is stored twice so the last delay samples are
+             * contiguous, newest at h[pos + delay]
+             */
+
+            h[pos] = h[pos + delay] = src[i * channels + c];
+
+            for (unsigned int f = 0; f < factor; f++) {
+                double acc = 0.0;
+                for (unsigned int k = 0; k < delay; k++) {
+                    acc += this->coeff[k * factor + f] * h[pos + delay - k];
+                }
+                peak = MAX(peak, fabs(acc));
+            }
+            this->true_peak[c] = peak;
+        }
+        this->taps_pos = pos + 1 == delay ? 0 : pos + 1;
+    }
+}
+
+#ifdef R128_X86
+
+/**
+ * One frame of the K-weighting filter for 2 channels
+ *
+ * @param x input
+ * @param v filter state v1..v4
+ * @param a denominator, broadcast
+ * @param b numerator, broadcast
+ * @return output
+ */
+R128_TARGET_SSE2
+static inline __m128d r128_step_sse2(__m128d x, __m128d v[4], const __m128d a[5],
+const __m128d b[5])
+{
+    __m128d v0, y;
+
+    v0 = _mm_sub_pd(x, _mm_mul_pd(a[1], v[0]));
+    v0 = _mm_sub_pd(v0, _mm_mul_pd(a[2], v[1]));
+    v0 = _mm_sub_pd(v0, _mm_mul_pd(a[3], v[2]));
+    v0 = _mm_sub_pd(v0, _mm_mul_pd(a[4], v[3]));
+
+    y = _mm_mul_pd(b[0], v0);
+    y = _mm_add_pd(y, _mm_mul_pd(b[1], v[0]));
+    y = _mm_add_pd(y, _mm_mul_pd(b[2], v[1]));
+    y = _mm_add_pd(y, _mm_mul_pd(b[3], v[2]));
+    y = _mm_add_pd(y, _mm_mul_pd(b[4], v[3]));
+
+    v[3] = v[2];
+    v[2] = v[1];
+    v[1] = v[0];
+    v[0] = v0;
+    return y;
+}
+
+/**
+ * One frame of the K-weighting filter for 4 channels
+ *
+ * @see r128_step_sse2
+ */
+R128_TARGET_AVX2
+static inline __m256d r128_step_avx2(__m256d x, __m256d v[4], const __m256d a[5],
+const __m256d b[5])
+{
+    __m256d v0, y;
+
+    v0 = _mm256_sub_pd(x, _mm256_mul_pd(a[1], v[0]));
+    v0 = _mm256_sub_pd(v0, _mm256_mul_pd(a[2], v[1]));
+    v0 = _mm256_sub_pd(v0, _mm256_mul_pd(a[3], v[2]));
+    v0 = _mm256_sub_pd(v0, _mm256_mul_pd(a[4], v[3]));
+
+    y = _mm256_mul_pd(b[0], v0);
+    y = _mm256_add_pd(y, _mm256_mul_pd(b[1], v[0]));
+    y = _mm256_add_pd(y, _mm256_mul_pd(b[2], v[1]));
+    y = _mm256_add_pd(y, _mm256_mul_pd(b[3], v[2]));
+    y = _mm256_add_pd(y, _mm256_mul_pd(b[4], v[3]));
+
+    v[3] = v[2];
+    v[2] = v[1];
+    v[1] = v[0];
+    v[0] = v0;
+    return y;
+}
+
+/**
+ * @return sum of both lanes
+ */
+R128_TARGET_SSE2
+static inline double r128_hsum_sse2(__m128d x)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x)));
+}
+
+/**
+ * @return largest lane
+ */
+R128_TARGET_SSE2
+static inline double r128_hmax_sse2(__m128d x)
+{
+    return _mm_cvtsd_f64(_mm_max_sd(x, _mm_unpackhi_pd(x, x)));
+}
+
+R128_TARGET_SSE2
+void r128_filter_stereo_sse2(R128* this, const double* src, size_t frames,
+double* energy)
+{
+    __m128d a[5], b[5], v[4];
+    const __m128d w = _mm_loadu_pd(this->weights);
+
+    for (int k = 0; k < 5; k++) {
+        a[k] = _mm_set1_pd(this->a[k]);
+        b[k] = _mm_set1_pd(this->b[k]);
+    }
+    for (int k = 0; k < 4; k++) v[k] = _mm_loadu_pd(&this->state[2 * k]);
+
+    for (size_t i = 0; i < frames; i++) {
+        const __m128d y = r128_step_sse2(_mm_loadu_pd(&src[2 * i]), v, a, b);
+        energy[i] = r128_hsum_sse2(_mm_mul_pd(w, _mm_mul_pd(y, y)));
+    }
+
+    for (int k = 0; k < 4; k++) _mm_storeu_pd(&this->state[2 * k], v[k]);
+}
+
+R128_TARGET_SSE2
+void r128_filter_51_sse2(R128* this, const double* src, size_t frames,
+double* energy)
+{
+    __m128d a[5], b[5], v[3][4], w[3];
+
+    for (int k = 0; k < 5; k++) {
+        a[k] = _mm_set1_pd(this->a[k]);
+        b[k] = _mm_set1_pd(this->b[k]);
+    }
+    for (size_t p = 0; p < 3; p++) {
+        w[p] = _mm_loadu_pd(&this->weights[2 * p]);
+        for (size_t k = 0; k < 4; k++) v[p][k] = _mm_loadu_pd(&this->state[6 * k + 2 * p]);
+    }
+
+    /* channel pairs L R, C LFE, Ls Rs */
+
+    for (size_t i = 0; i < frames; i++) {
+        __m128d e = _mm_setzero_pd();
+
+        for (size_t p = 0; p < 3; p++) {
+            const __m128d y = r128_step_sse2(_mm_loadu_pd(&src[6 * i + 2 * p]),
+                    v[p], a, b);
+            e = _mm_add_pd(e, _mm_mul_pd(w[p], _mm_mul_pd(y, y)));
+        }
+        energy[i] = r128_hsum_sse2(e);
+    }
+
+    for (size_t p = 0; p < 3; p++) {
+        for (size_t k = 0; k < 4; k++) _mm_storeu_pd(&this->state[6 * k + 2 * p], v[p][k]);
+    }
+}
+
+R128_TARGET_AVX2
+void r128_filter_51_avx2(R128* this, const double* src, size_t frames,
+double* energy)
+{
+    __m256d a4[5], b4[5], v4[4];
+    __m128d a2[5], b2[5], v2[4];
+    const __m256d w4 = _mm256_loadu_pd(&this->weights[0]);
+    const __m128d w2 = _mm_loadu_pd(&this->weights[4]);
+
+    for (int k = 0; k < 5; k++) {
+        a4[k] = _mm256_set1_pd(this->a[k]);
+        b4[k] = _mm256_set1_pd(this->b[k]);
+        a2[k] = _mm_set1_pd(this->a[k]);
+        b2[k] = _mm_set1_pd(this->b[k]);
+    }
+    for (int k = 0; k < 4; k++) {
+        v4[k] = _mm256_loadu_pd(&this->state[6 * k]);
+        v2[k] = _mm_loadu_pd(&this->state[6 * k + 4]);
+    }
+
+    /* L R C LFE in one vector, Ls Rs in another */
+
+    for (size_t i = 0; i < frames; i++) {
+        const __m256d y4 = r128_step_avx2(_mm256_loadu_pd(&src[6 * i]), v4, a4, b4);
+        const __m128d y2 = r128_step_sse2(_mm_loadu_pd(&src[6 * i + 4]), v2, a2, b2);
+        const __m256d e4 = _mm256_mul_pd(w4, _mm256_mul_pd(y4, y4));
+        __m128d e = _mm_mul_pd(w2, _mm_mul_pd(y2, y2));
+
+        e = _mm_add_pd(e, _mm256_castpd256_pd128(e4));
+        e = _mm_add_pd(e, _mm256_extractf128_pd(e4, 1));
+        energy[i] = r128_hsum_sse2(e);
+    }
+
+    for (int k = 0; k < 4; k++) {
+        _mm256_storeu_pd(&this->state[6 * k], v4[k]);
+        _mm_storeu_pd(&this->state[6 * k + 4], v2[k]);
+    }
+}
+
+R128_TARGET_SSE2
+void r128_peak2_sse2(R128* this, const double* src, size_t frames)
+{
+    const unsigned int channels = this->channels;
+    const unsigned int delay = this->delay;
+    const __m128d sign = _mm_set1_pd(-0.0);
+
+    /* both phases in one vector, see r128_peak_scalar */
+
+    for (size_t i = 0; i < frames; i++) {
+        const size_t pos = this->taps_pos;
+
+        for (unsigned int c = 0; c < channels; c++) {
+            double* h = &this->taps[2 * delay * c];
+            __m128d acc = _mm_setzero_pd();
+
+            h[pos] = h[pos + delay] = src[i * channels + c];
+
+            for (unsigned int k = 0; k < delay; k++) {
+                acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(&this->coeff[2 * k]),
+                            _mm_set1_pd(h[pos + delay - k])));
+            }
+            this->true_peak[c] = MAX(this->true_peak[c],
+                    r128_hmax_sse2(_mm_andnot_pd(sign, acc)));
+        }
+        this->taps_pos = pos + 1 == delay ? 0 : pos + 1;
+    }
+}
+
+R128_TARGET_SSE2
+void r128_peak4_sse2(R128* this, const double* src, size_t frames)
+{
+    const unsigned int channels = this->channels;
+    const unsigned int delay = this->delay;
+    const __m128d sign = _mm_set1_pd(-0.0);
+
+    /* phases 0 1 and 2 3 in two vectors, see r128_peak_scalar */
+
+    for (size_t i = 0; i < frames; i++) {
+        const size_t pos = this->taps_pos;
+
+        for (unsigned int c = 0; c < channels; c++) {
+            double* h = &this->taps[2 * delay * c];
+            __m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+
+            h[pos] = h[pos + delay] = src[i * channels + c];
+
+            for (unsigned int k = 0; k < delay; k++) {
+                const __m128d x = _mm_set1_pd(h[pos + delay - k]);
+                lo = _mm_add_pd(lo, _mm_mul_pd(_mm_loadu_pd(&this->coeff[4 * k]), x));
+                hi = _mm_add_pd(hi, _mm_mul_pd(_mm_loadu_pd(&this->coeff[4 * k + 2]), x));
+            }
+            this->true_peak[c] = MAX(this->true_peak[c], r128_hmax_sse2(
+                        _mm_max_pd(_mm_andnot_pd(sign, lo), _mm_andnot_pd(sign, hi))));
+        }
+        this->taps_pos = pos + 1 == delay ? 0 : pos + 1;
+    }
+}
+
+R128_TARGET_AVX2
+void r128_peak4_avx2(R128* this, const double* src, size_t frames)
+{
+    const unsigned int channels = this->channels;
+    const unsigned int delay = this->delay;
+    const __m256d sign = _mm256_set1_pd(-0.0);
+
+    /* all phases in one vector, see r128_peak_scalar */
+
+    for (size_t i = 0; i < frames; i++) {
+        const size_t pos = this->taps_pos;
+
+        for (unsigned int c = 0; c < channels; c++) {
+            double* h = &this->taps[2 * delay * c];
+            __m256d acc = _mm256_setzero_pd();
+            __m128d m;
+
+            h[pos] = h[pos + delay] = src[i * channels + c];
+
+            for (unsigned int k = 0; k < delay; k++) {
+                acc = _mm256_add_pd(acc, _mm256_mul_pd(
+                            _mm256_loadu_pd(&this->coeff[4 * k]),
+                            _mm256_broadcast_sd(&h[pos + delay - k])));
+            }
+            acc = _mm256_andnot_pd(sign, acc);
+            m = _mm_max_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+            this->true_peak[c] = MAX(this->true_peak[c], r128_hmax_sse2(m));
+        }
+        this->taps_pos = pos + 1 == delay ? 0 : pos + 1;
+    }
+}
+
+#endif
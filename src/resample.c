@@ -0,0 +1,270 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        resample.c
+ * @brief       sample rate and channel conversion of decoded files
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/ingest.h"
+
+#include "../include/resample.h"
+
+/**
+ * taps before the input frame of an output frame
+ */
+#define RESAMPLE_BEFORE (RESAMPLE_TAPS / 2 - 1)
+
+/**
+ * taps after the input frame of an output frame (including it)
+ */
+#define RESAMPLE_AFTER (RESAMPLE_TAPS / 2)
+
+/**
+ * Fill the filter table
+ *
+ * @param this the resample object
+ */
+static void resample_table(Resample* this);
+
+/**
+ * Make sure an input frame is in the input buffer
+ *
+ * frames before first are dropped, chunks are read from the file until
+ * frame is in the buffer or the file ends
+ *
+ * @param this the resample object
+ * @param first first input frame still needed
+ * @param frame last input frame needed
+ */
+static void resample_fill(Resample* this, int64_t first, int64_t frame);
+
+/**
+ * Append silent input frames
+ *
+ * @param this the resample object
+ * @param frames number of frames, must fit in the buffer
+ */
+static void resample_silence(Resample* this, size_t frames);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+Resample* resample_new(Ingest* ingest, unsigned int sample_rate,
+unsigned int channels)
+{
+    Resample* this;
+
+    if (!(this = calloc(1, sizeof(Resample)))) {
+        fprintf(stderr, "failed to allocate resampler\n");
+        return NULL;
+    }
+
+    this->ingest = ingest;
+    this->in_rate = ingest->sample_rate;
+    this->out_rate = sample_rate;
+    this->in_channels = ingest->channels;
+    this->out_channels = channels;
+    this->input_capacity = 2 * RESAMPLE_CHUNK + RESAMPLE_TAPS;
+
+    if (!(this->table = malloc((RESAMPLE_PHASES + 1) * RESAMPLE_TAPS * sizeof(float)))
+            || !(this->scratch = malloc(RESAMPLE_CHUNK * this->in_channels * sizeof(float)))
+            || !(this->input = malloc(this->input_capacity * channels * sizeof(float))))
+    {
+        fprintf(stderr, "failed to allocate resampler\n");
+        goto fail;
+    }
+
+    resample_table(this);
+
+    /* the taps before the start of the file are silent */
+
+    this->input_first = -RESAMPLE_BEFORE;
+    resample_silence(this, RESAMPLE_BEFORE);
+
+    return this;
+
+fail:
+    resample_free(this);
+    return NULL;
+}
+
+int resample_seek(Resample* this, uint64_t frame)
+{
+    const int64_t first = (int64_t)(frame * this->in_rate / this->out_rate)
+                        - RESAMPLE_BEFORE;
+
+    this->position = frame;
+    this->input_len = 0;
+    this->eof = FALSE;
+
+    if (ingest_seek(this->ingest, (size_t)MAX(first, 0), NULL) != 0) {
+        this->eof = TRUE;
+        this->end = first;
+        return -1;
+    }
+
+    this->input_first = first;
+    if (first < 0) resample_silence(this, (size_t)-first);
+
+    return 0;
+}
+
+size_t resample_read(Resample* this, float* dest, size_t frames)
+{
+    const unsigned int channels = this->out_channels;
+    float filter[RESAMPLE_TAPS];
+    size_t n;
+
+    for (n = 0; n < frames; n++, this->position++) {
+        const uint64_t x = this->position * this->in_rate;
+        const int64_t frame = (int64_t)(x / this->out_rate);
+        const uint64_t phase = x % this->out_rate * RESAMPLE_PHASES;
+        const size_t p = (size_t)(phase / this->out_rate);
+        const float t = (float)(phase % this->out_rate) / (float)this->out_rate;
+        const float* a = &this->table[p * RESAMPLE_TAPS];
+        const float* b = a + RESAMPLE_TAPS;
+        const float* in;
+
+        resample_fill(this, frame - RESAMPLE_BEFORE, frame + RESAMPLE_AFTER);
+
+        /* the output ends with the last frame of the file */
+
+        if (this->eof && frame >= this->end) break;
+
+        /* the taps past the end of the file are silent */
+
+        if (frame + RESAMPLE_AFTER >= this->input_first + (int64_t)this->input_len) {
+            resample_silence(this, (size_t)(frame + RESAMPLE_AFTER + 1
+                        - this->input_first - (int64_t)this->input_len));
+        }
+
+        for (unsigned int k = 0; k < RESAMPLE_TAPS; k++) {
+            filter[k] = a[k] + (b[k] - a[k]) * t;
+        }
+
+        in = &this->input[(size_t)(frame - RESAMPLE_BEFORE - this->input_first) * channels];
+
+        for (unsigned int c = 0; c < channels; c++) {
+            float y = 0.0f;
+            for (unsigned int k = 0; k < RESAMPLE_TAPS; k++) {
+                y += filter[k] * in[k * channels + c];
+            }
+            *dest++ = y;
+        }
+    }
+
+    return n;
+}
+
+void resample_free(Resample* this)
+{
+    if (!this) return;
+
+    free(this->table);
+    free(this->scratch);
+    free(this->input);
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void resample_table(Resample* this)
+{
+    /* the cutoff is at the nyquist frequency of the lowest rate, every
+     * phase is normalized so the filter doesn't change the level
+     */
+
+    const double cutoff = MIN(1.0, (double)this->out_rate / (double)this->in_rate);
+
+    for (unsigned int p = 0; p <= RESAMPLE_PHASES; p++) {
+        float* row = &this->table[p * RESAMPLE_TAPS];
+        const double frac = (double)p / RESAMPLE_PHASES;
+        double sum = 0.0;
+
+        for (int k = 0; k < RESAMPLE_TAPS; k++) {
+            const double x = k - RESAMPLE_BEFORE - frac;
+            const double w = 0.42 + 0.5 * cos(2.0 * M_PI * x / RESAMPLE_TAPS)
+                           + 0.08 * cos(4.0 * M_PI * x / RESAMPLE_TAPS);
+            const double s = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+
+            row[k] = (float)(cutoff * s * w);
+            sum += row[k];
+        }
+        for (int k = 0; k < RESAMPLE_TAPS; k++) {
+            row[k] = (float)(row[k] / sum);
+        }
+    }
+}
+
+void resample_fill(Resample* this, int64_t first, int64_t frame)
+{
+    const unsigned int channels = this->out_channels;
+
+    /* frames before the filter of this output frame are not needed anymore */
+
+    if (first > this->input_first) {
+        const size_t drop = (size_t)MIN(first - this->input_first, (int64_t)this->input_len);
+
+        memmove(this->input, &this->input[drop * channels],
+                (this->input_len - drop) * channels * sizeof(float));
+        this->input_len -= drop;
+        this->input_first += (int64_t)drop;
+    }
+
+    while (!this->eof && frame >= this->input_first + (int64_t)this->input_len) {
+        const float* src = this->scratch;
+        float* dest;
+        size_t n;
+
+        n = MIN((size_t)RESAMPLE_CHUNK, this->input_capacity - this->input_len);
+        n = ingest_read(this->ingest, this->scratch, n, INGEST_FLOAT);
+        if (!n) {
+            this->eof = TRUE;
+            this->end = this->input_first + (int64_t)this->input_len;
+            break;
+        }
+
+        /* channels are mapped while they're copied */
+
+        dest = &this->input[this->input_len * channels];
+        for (size_t i = 0; i < n; i++, src += this->in_channels, dest += channels) {
+            if (this->in_channels == channels) {
+                memcpy(dest, src, channels * sizeof(float));
+            } else if (this->in_channels == 1) {
+                for (unsigned int c = 0; c < channels; c++) dest[c] = src[0];
+            } else if (channels == 1) {
+                float sum = 0.0f;
+                for (unsigned int c = 0; c < this->in_channels; c++) sum += src[c];
+                dest[0] = sum / (float)this->in_channels;
+            } else {
+                for (unsigned int c = 0; c < channels; c++) {
+                    dest[c] = c < this->in_channels ? src[c] : 0.0f;
+                }
+            }
+        }
+        this->input_len += n;
+    }
+}
+
+void resample_silence(Resample* this, size_t frames)
+{
+    memset(&this->input[this->input_len * this->out_channels], 0,
+            frames * this->out_channels * sizeof(float));
+    this->input_len += frames;
+}
@@ -0,0 +1,189 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        sink.c
+ * @brief       audio output of the playback engine
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+
+#include "../include/sink.h"
+
+/**
+ * size of the wav header written by sink_wav_header
+ */
+#define SINK_WAV_HEADER 44
+
+/**
+ * wav format tag of ieee float samples
+ */
+#define SINK_WAV_FLOAT 3
+
+/**
+ * Store a little endian integer
+ *
+ * @param dest destination, must hold bytes bytes
+ * @param value the value
+ * @param bytes 2 or 4
+ */
+static void sink_le(unsigned char* dest, uint32_t value, size_t bytes);
+
+/**
+ * Write the wav header at the start of the file
+ *
+ * @param this the sink object
+ * @return 0 on success or -1 when failed
+ */
+static int sink_wav_header(Sink* this);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+Sink* sink_new(const char* name)
+{
+    Sink* this;
+
+    if (!(this = calloc(1, sizeof(Sink)))) {
+        fprintf(stderr, "failed to allocate sink\n");
+        return NULL;
+    }
+
+    if (!name || strcmp(name, SINK_NULL_NAME) == 0) {
+        this->type = SINK_NULL;
+        return this;
+    }
+
+    this->type = SINK_WAV;
+    if (!(this->path = strdup(name))) {
+        fprintf(stderr, "failed to allocate sink\n");
+        free(this);
+        return NULL;
+    }
+    return this;
+}
+
+int sink_open(Sink* this, unsigned int sample_rate, unsigned int channels)
+{
+    this->sample_rate = sample_rate;
+    this->channels = channels;
+    this->frames = 0;
+
+    if (this->type == SINK_NULL) return 0;
+
+    if (!(this->file = fopen(this->path, "wb"))) {
+        fprintf(stderr, "failed to open \"%s\"\n > %s\n", this->path, strerror(errno));
+        return -1;
+    }
+
+    /* sizes are unknown until the sink is freed, the header is rewritten
+     * then
+     */
+
+    if (sink_wav_header(this) != 0) {
+        fclose(this->file);
+        this->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int sink_write(Sink* this, const float* frames, size_t count)
+{
+    unsigned char buffer[4096];
+    size_t samples = count * this->channels, n = 0;
+
+    if (this->type == SINK_NULL) {
+        this->frames += count;
+        return 0;
+    }
+    if (!this->file) return -1;
+
+    /* wav is little endian whatever the host is */
+
+    for (size_t i = 0; i < samples; i++) {
+        uint32_t bits;
+        memcpy(&bits, &frames[i], sizeof(bits));
+        sink_le(&buffer[n], bits, 4);
+        n += 4;
+
+        if (n == sizeof(buffer) || i == samples - 1) {
+            if (fwrite(buffer, 1, n, this->file) != n) {
+                fprintf(stderr, "failed to write \"%s\"\n", this->path);
+                return -1;
+            }
+            n = 0;
+        }
+    }
+
+    this->frames += count;
+    return 0;
+}
+
+void sink_free(Sink* this)
+{
+    if (!this) return;
+
+    if (this->file) {
+        if (fseek(this->file, 0, SEEK_SET) != 0 || sink_wav_header(this) != 0) {
+            fprintf(stderr, "failed to finish \"%s\"\n", this->path);
+        }
+        fclose(this->file);
+    }
+    free(this->path);
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void sink_le(unsigned char* dest, uint32_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        dest[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+int sink_wav_header(Sink* this)
+{
+    unsigned char header[SINK_WAV_HEADER];
+    const uint32_t block = 4 * this->channels;
+    uint64_t data = this->frames * block;
+
+    /* riff sizes are 32 bit, longer files are truncated by readers */
+
+    if (data > UINT32_MAX - SINK_WAV_HEADER) data = UINT32_MAX - SINK_WAV_HEADER;
+
+    memcpy(&header[0], "RIFF", 4);
+    sink_le(&header[4], (uint32_t)data + SINK_WAV_HEADER - 8, 4);
+    memcpy(&header[8], "WAVE", 4);
+    memcpy(&header[12], "fmt ", 4);
+    sink_le(&header[16], 16, 4);
+    sink_le(&header[20], SINK_WAV_FLOAT, 2);
+    sink_le(&header[22], this->channels, 2);
+    sink_le(&header[24], this->sample_rate, 4);
+    sink_le(&header[28], this->sample_rate * block, 4);
+    sink_le(&header[32], block, 2);
+    sink_le(&header[34], 32, 2);
+    memcpy(&header[36], "data", 4);
+    sink_le(&header[40], (uint32_t)data, 4);
+
+    if (fwrite(header, 1, sizeof(header), this->file) != sizeof(header)) {
+        fprintf(stderr, "failed to write \"%s\"\n", this->path);
+        return -1;
+    }
+    return 0;
+}
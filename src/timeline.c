@@ -19,9 +19,17 @@
 #include "../include/track.h"
 #include "../include/player.h"
 #include "../include/config.h"
+#include "../include/waveform.h"
 
 #include "../include/timeline.h"
 
+/**
+ * width in pixels of the strip repainted around the cursor
+ * the cursor is drawn 2px wide, antialiasing may touch one more pixel on
+ * both sides
+ */
+#define TIMELINE_CURSOR_STRIP 4
+
 static gboolean on_click(Timeline* this, GdkEvent* event, GtkWidget* darea)
 {
     if (!this->player->current) return FALSE;
@@ -37,6 +45,73 @@ static gboolean on_click(Timeline* this, GdkEvent* event, GtkWidget* darea)
     return FALSE;
 }
 
+/**
+ * Check if the cached waveform surface is up to date
+ *
+ * the surface depends on the track, its analysis results (the pyramid and
+ * loudness arrive after the row is inserted) and the size of the widget
+ */
+static gboolean surface_valid(Timeline* this, gint w, gint h)
+{
+    Track* track = this->player->current;
+
+    return this->surface
+        && this->surface_track == track
+        && this->surface_pyramid == track->pyramid
+        && this->surface_lufs == track->lufs
+        && this->surface_w == w
+        && this->surface_h == h;
+}
+
+/**
+ * Render the waveform of the current track in an offscreen surface
+ */
+static void surface_render(Timeline* this, gint w, gint h)
+{
+    Track* track = this->player->current;
+    Waveform* pyramid = track->pyramid;
+    gdouble norm = h * TIMELINE_AVG_HEIGHT + track->lufs;
+    cairo_t* cr;
+
+    if (this->surface) cairo_surface_destroy(this->surface);
+
+    this->surface = gdk_window_create_similar_surface(
+            gtk_widget_get_window(this->darea), CAIRO_CONTENT_COLOR_ALPHA, w, h);
+    this->surface_track = track;
+    this->surface_pyramid = pyramid;
+    this->surface_lufs = track->lufs;
+    this->surface_w = w;
+    this->surface_h = h;
+
+    /* the waveform is missing until the track has been analyzed
+     * the level with at most one point per pixel is drawn, the max of the
+     * windows a point covers keeps short peaks visible
+     */
+
+    if (!pyramid) return;
+
+    cr = cairo_create(this->surface);
+    gdk_cairo_set_source_rgba(cr, &this->wave);
+    cairo_set_line_width(cr, 1);
+
+    {
+        const WaveformLevel* level = waveform_level(pyramid, (size_t)MAX(w, 1));
+        size_t len = level->len;
+
+        cairo_scale(cr, w / (gdouble)len, 1.0);
+
+        for (size_t i = 0; i < len; i++) {
+            gdouble y = - waveform_decode(level->max[i]) + norm ;
+            cairo_line_to(cr, (gdouble)i, y);
+        }
+
+        cairo_close_path(cr);
+        cairo_fill(cr);
+    }
+
+    cairo_destroy(cr);
+}
+
 static gboolean on_draw(Timeline* this, cairo_t* cr, GtkWidget* darea)
 {
     gint w = gtk_widget_get_allocated_width(darea);
@@ -45,31 +120,27 @@ static gboolean on_draw(Timeline* this, cairo_t* cr, GtkWidget* darea)
     gdouble scale;
 
     if (!this->player->current || this->player->current->length == 0.0) {
+        this->cursor = -1.0;
         return FALSE;
     }
 
-    gdk_cairo_set_source_rgba(cr, &this->wave);
-    cairo_set_line_width(cr, 1);
-
-    gdouble* wave = this->player->current->waveform;
-    size_t len = this->player->current->waveform_len;
-    gdouble norm = h * TIMELINE_AVG_HEIGHT + this->player->current->lufs;
+    /* the waveform is only rendered again when it changed, a draw for a
+     * cursor move only paints the strips the cursor covers (cairo clips to
+     * the invalidated area)
+     */
 
-    cairo_scale(cr, w / (gdouble)len, 1.0);
-
-    for (size_t i = 0; i < len; i++) {
-        gdouble y = - wave[i] + norm ;
-        cairo_line_to(cr, (gdouble)i, y);
-    }
+    if (!surface_valid(this, w, h)) surface_render(this, w, h);
 
-    cairo_close_path(cr);
-
-    cairo_fill(cr);
-    cairo_scale(cr, (gdouble)len / w, 1.0);
+    cairo_set_source_surface(cr, this->surface, 0, 0);
+    cairo_paint(cr);
 
     /* TODO: use cairo scale instead of calculating scale factor manually ?*/
     scale = this->player->current->length / w;
 
+    this->loop_start = this->player->loop_start;
+    this->loop_stop = this->player->loop_stop;
+    this->mark = this->player->marker;
+
     /* draw loop */
     if (this->player->loop_start != 0.0) {
         gdouble x_start = this->player->loop_start / scale;
@@ -97,20 +168,51 @@ static gboolean on_draw(Timeline* this, cairo_t* cr, GtkWidget* darea)
     }
 
     /* draw position */
-    x = this->player->position / scale;
+    x = this->playhead / scale;
     gdk_cairo_set_source_rgba(cr, &this->position);
     cairo_set_line_width(cr, 2);
     cairo_move_to(cr, x, 0);
     cairo_line_to(cr, x, h);
     cairo_stroke(cr);
 
+    this->cursor = x;
 
     return FALSE;
 }
 
-void timeline_update(Timeline* this)
+void timeline_update(Timeline* this, gdouble position)
 {
-    gtk_widget_queue_draw(this->box);
+    Player* player = this->player;
+    gint w = gtk_widget_get_allocated_width(this->darea);
+    gint h = gtk_widget_get_allocated_height(this->darea);
+    gdouble x;
+
+    this->playhead = position;
+
+    /* anything but the cursor changed, draw everything */
+
+    if (!player->current || player->current->length == 0.0
+            || this->cursor < 0.0
+            || !surface_valid(this, w, h)
+            || this->loop_start != player->loop_start
+            || this->loop_stop != player->loop_stop
+            || this->mark != player->marker)
+    {
+        gtk_widget_queue_draw(this->darea);
+        return;
+    }
+
+    /* only the strips of the old and new cursor position are invalidated */
+
+    x = position / (player->current->length / w);
+    if ((gint)x == (gint)this->cursor) return;
+
+    gtk_widget_queue_draw_area(this->darea,
+            (gint)this->cursor - TIMELINE_CURSOR_STRIP/2, 0,
+            TIMELINE_CURSOR_STRIP + 1, h);
+    gtk_widget_queue_draw_area(this->darea,
+            (gint)x - TIMELINE_CURSOR_STRIP/2, 0,
+            TIMELINE_CURSOR_STRIP + 1, h);
 }
 
 Timeline* timeline_new(Player* player)
@@ -119,6 +221,17 @@ Timeline* timeline_new(Player* player)
     Timeline* this = malloc(sizeof(Timeline));
 
     this->player = player;
+    this->surface = NULL;
+    this->surface_track = NULL;
+    this->surface_pyramid = NULL;
+    this->surface_lufs = 0.0;
+    this->surface_w = 0;
+    this->surface_h = 0;
+    this->playhead = 0.0;
+    this->cursor = -1.0;
+    this->loop_start = 0.0;
+    this->loop_stop = 0.0;
+    this->mark = 0.0;
     this->box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
 
     frame = gtk_frame_new(NULL);
@@ -131,6 +244,7 @@ Timeline* timeline_new(Player* player)
             && "allocate timeline colors");
 
     darea = gtk_drawing_area_new();
+    this->darea = darea;
     gtk_container_add(GTK_CONTAINER(frame), darea);
     gtk_widget_set_size_request(darea, WINDOW_X/12, -1);
     gtk_widget_set_hexpand(darea, TRUE);
@@ -147,6 +261,7 @@ Timeline* timeline_new(Player* player)
 void timeline_free(Timeline* this)
 {
     if (!this) return;
+    if (this->surface) cairo_surface_destroy(this->surface);
     gtk_widget_destroy(this->box);
     free(this);
 }
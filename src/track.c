@@ -6,60 +6,87 @@
  * @copyright   Copyright (c) 2021 Arno Lievens
  */
 
-#include <ebur128.h>
 #include <errno.h>
-#include <libavformat/avformat.h>
-#include <libavutil/dict.h>
 #include <math.h>
-#include <sndfile.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "../include/analysis.h"
 #include "../include/config.h"
+#include "../include/ingest.h"
+#include "../include/waveform.h"
 
 #include "../include/track.h"
 
+/**
+ * bytes of the blocks of an arena
+ */
+#define TRACK_ARENA_BLOCK 4096
+
+/**
+ * Allocate a new track and set defaults
+ *
+ * @param arena owner of the strings or NULL to create one for the track
+ * @param path absolute path of the file
+ * @param name displayed name of the file
+ * @return the newly created Track or NULL when failed
+ */
+static Track* track_alloc(TrackArena* arena, const char* name, const char* path);
+
 /**
  * Set metadata if available
  *
  * overrides the .name property if TITLE or NAME is available
  *
  * @param track the Track object
+ * @param ingest the opened file
  */
-static void track_set_libav_tags(Track* this);
+static void track_set_libav_tags(Track* this, Ingest* ingest);
 
 /**
- * Calculate aver loudness
+ * Read file info from the file header
  *
- * sets the loudness .lufs property in track
+ * sets the samplerate, length, ... properties in track
  *
  * @param this the track object
+ * @param ingest the opened file
  */
-static void track_set_r128(Track* this, SF_INFO* file_info, SNDFILE* file);
+static void track_set_file_info(Track* this, Ingest* ingest);
 
 /**
- * Read file info with libsndfile
+ * Replace string property
  *
- * sets the samplerate, format, ... properties in track
+ * the previous value stays in the arena until the arena is compacted
  *
  * @param this the track object
- * @param file_info the file info object
+ * @param dest the property to be replaced
+ * @param src the new value or NULL
+ * @param intern share the value with other tracks
  */
-static void track_set_file_info(Track* this, SF_INFO* file_info);
+static void track_set_string(Track* this, const char** dest, const char* src,
+int intern);
 
 /**
- * Allocate and copy string
+ * Copy a string into an arena
  *
- * convenience function to easily malloc and copy string
- * must be free-ed by caller
+ * @param this the arena
+ * @param src the string to be copied or NULL
+ * @param intern return the copy of an equal string inserted before
+ * @return the copy or NULL when src is NULL
+ */
+static const char* track_arena_insert(TrackArena* this, const char* src,
+int intern);
+
+/**
+ * Count a copy that is not used anymore
  *
- * @param src the string to be copied
- * @return the new string or NULL when failed to allocate
+ * @param this the arena
+ * @param str the copy, inserted without intern
  */
-static char* stralloc(const char* src);
+static void track_arena_release(TrackArena* this, const char* str);
 
 
 /*******************************************************************************
@@ -67,59 +94,93 @@ static char* stralloc(const char* src);
  */
 
 
-Track* track_new(const char* name, const char* path)
+Track* track_new(TrackArena* arena, const char* name, const char* path,
+int profile, const int* cancel)
 {
-    Track* this = NULL;
-    SF_INFO file_info = { 0 };
-    SNDFILE* file;
+    Track* this;
 
-    /* allocate new track and set defaults
-     * the name used by default is probided by the argument but overwritten
-     * by TITLE or NAME tag if present
-     * average loudness is calculated by r123
-     */
+    /* tags, file info and loudness are all read in one pass over the file */
 
-    if (!path) goto fail;
+    if (!(this = track_alloc(arena, name, path))) return NULL;
 
-    if (!(this = malloc(sizeof(Track)))) {
-        fprintf(stderr, "failed to allocate track\n");
-        goto fail;
+    if (track_analyze(this, profile, cancel) != 0) {
+        track_free(this);
+        return NULL;
     }
+    return this;
+}
 
-    this->artist = NULL;
-    this->album = NULL;
-    this->date = NULL;
-    this->offset = 0;
-    this->lufs = 0;
-    this->peak = 0;
-    this->format = 0;
-    this->length = 0;
-    this->sample_rate = NULL;
-    this->waveform = NULL;
-    this->waveform_len = 0;
+Track* track_probe(TrackArena* arena, const char* name, const char* path)
+{
+    Track* this;
+    Ingest* ingest;
 
-    this->path = stralloc(path);
-    if (name) this->name = stralloc(name);
-    else this->name = stralloc(path);
+    /* only the header is read, the file is not decoded
+     * average loudness is calculated later by track_analyze
+     */
 
-    track_set_libav_tags(this);
+    if (!(this = track_alloc(arena, name, path))) return NULL;
 
-    if (!(file = sf_open(this->path, SFM_READ, &file_info))) {
-        fprintf(stderr, "sndfile failed to open file\"%s\"\n", this->path);
+    if (!(ingest = ingest_open(this->path, FALSE))) {
+        track_free(this);
         return NULL;
     }
 
-    track_set_file_info(this, &file_info);
-    track_set_r128(this, &file_info, file);
+    track_set_libav_tags(this, ingest);
+    track_set_file_info(this, ingest);
+    ingest_close(ingest);
 
-    if (sf_close(file) != 0) {
-        fprintf(stderr, "sndfile failed to close file\"%s\"\n", this->path);
-        return NULL;
-    }
+    return this;
+}
 
+int track_analyze(Track* this, int profile, const int* cancel)
+{
+    Ingest* ingest;
+    AnalysisStats stats = { 0 };
+    gint64 start = g_get_monotonic_time();
+    int status;
+
+    ingest = ingest_open(this->path, TRUE);
+    stats.open = g_get_monotonic_time() - start;
+    if (!ingest) return -1;
+
+    start = g_get_monotonic_time();
+    track_set_libav_tags(this, ingest);
+    track_set_file_info(this, ingest);
+    stats.probe = g_get_monotonic_time() - start;
+    analysis_stats_add(&stats);
+
+    status = analysis_run(this, ingest, (AnalysisProfile)profile, cancel);
+    this->analyzed = status == 0;
+    this->profile = profile;
+
+    ingest_close(ingest);
+    return status;
+}
 
-fail:
-    return this;
+void track_set_analysis(Track* this, Track* src)
+{
+    free(this->waveform);
+    this->waveform = src->waveform;
+    this->waveform_len = src->waveform_len;
+    this->waveform_window = src->waveform_window;
+    src->waveform = NULL;
+    src->waveform_len = 0;
+
+    waveform_free(this->pyramid);
+    this->pyramid = src->pyramid;
+    src->pyramid = NULL;
+
+    this->sample_rate = src->sample_rate;
+    this->length = src->length;
+    this->lufs = src->lufs;
+    this->peak = src->peak;
+    this->true_peak = src->true_peak;
+    this->lra = src->lra;
+    this->momentary_max = src->momentary_max;
+    this->short_term_max = src->short_term_max;
+    this->analyzed = src->analyzed;
+    this->profile = src->profile;
 }
 
 void track_print(Track* this)
@@ -130,9 +191,11 @@ void track_print(Track* this)
     printf("album      = %s\n", this->album);
     printf("date       = %s\n", this->date);
     printf("format     = %s\n", this->format);
-    printf("samplerate = %s\n", this->sample_rate);
+    printf("samplerate = %u\n", this->sample_rate);
     printf("lufs       = %f\n", this->lufs);
     printf("peak       = %f\n", this->peak);
+    printf("true peak  = %f\n", this->true_peak);
+    printf("lra        = %f\n", this->lra);
     printf("\n");
 }
 
@@ -140,17 +203,100 @@ void track_free(Track* this)
 {
     if (!this) return;
 
-    free(this->path);
-    free(this->name);
-    free(this->artist);
-    free(this->album);
-    free(this->date);
-    free(this->format);
-    free(this->sample_rate);
+    if (this->owns_arena) {
+        track_arena_free(this->arena);
+    } else {
+        if (this->name != this->path) track_arena_release(this->arena, this->name);
+        track_arena_release(this->arena, this->path);
+    }
     free(this->waveform);
+    waveform_free(this->pyramid);
     free(this);
 }
 
+TrackArena* track_arena_new(void)
+{
+    TrackArena* this;
+
+    if (!(this = calloc(1, sizeof(TrackArena)))) {
+        fprintf(stderr, "failed to allocate track arena\n");
+        return NULL;
+    }
+
+    this->chunk = g_string_chunk_new(TRACK_ARENA_BLOCK);
+    this->interned = g_hash_table_new(g_str_hash, g_str_equal);
+    g_mutex_init(&this->lock);
+
+    return this;
+}
+
+void track_arena_free(TrackArena* this)
+{
+    if (!this) return;
+
+    g_hash_table_destroy(this->interned);
+    g_string_chunk_free(this->chunk);
+    g_mutex_clear(&this->lock);
+    free(this);
+}
+
+int track_arena_fragmented(TrackArena* this)
+{
+    int fragmented;
+
+    /* a compaction copies every string in use, it's worth it when at least
+     * as many bytes are freed and at least one block
+     */
+
+    g_mutex_lock(&this->lock);
+    fragmented = this->released >= TRACK_ARENA_BLOCK
+              && this->released > this->stored / 2;
+    g_mutex_unlock(&this->lock);
+
+    return fragmented;
+}
+
+int track_arena_compact(TrackArena* this, Track** tracks, size_t n)
+{
+    TrackArena* copy;
+    GStringChunk* chunk;
+    GHashTable* interned;
+
+    if (!(copy = track_arena_new())) return -1;
+
+    for (size_t i = 0; i < n; i++) {
+        Track* track = tracks[i];
+        const int alias = track->name == track->path;
+
+        if (track->arena != this) continue;
+
+        track->path = track_arena_insert(copy, track->path, FALSE);
+        track->name = alias ? track->path : track_arena_insert(copy, track->name, FALSE);
+        track->artist = track_arena_insert(copy, track->artist, TRUE);
+        track->album = track_arena_insert(copy, track->album, TRUE);
+        track->date = track_arena_insert(copy, track->date, TRUE);
+    }
+
+    /* the storage is swapped, the old one is freed with the copy */
+
+    g_mutex_lock(&this->lock);
+    chunk = this->chunk;
+    interned = this->interned;
+    this->chunk = copy->chunk;
+    this->interned = copy->interned;
+    this->strings = copy->strings;
+    this->requested = copy->requested;
+    this->stored = copy->stored;
+    this->released = 0;
+    g_mutex_unlock(&this->lock);
+
+    copy->chunk = chunk;
+    copy->interned = interned;
+    track_arena_free(copy);
+
+    return 0;
+}
+
 
 /*******************************************************************************
  * static functions
@@ -158,122 +304,131 @@ void track_free(Track* this)
  */
 
 
-char* stralloc(const char* src)
+const char* track_arena_insert(TrackArena* this, const char* src, int intern)
 {
-    char* dest;
+    const char* dest = NULL;
+    const gsize len = src ? strlen(src) + 1 : 0;
 
     if (!src) return NULL;
-    if (!(dest = calloc(strlen(src)+1, sizeof(src)))) {
-        fprintf(stderr, "could allocate string for \"%s\"\n", src);
-        return NULL;
-    }
-    strcpy(dest, src);
 
-    return dest;
-}
+    g_mutex_lock(&this->lock);
 
-void track_set_libav_tags(Track* this)
-{
-    AVFormatContext* ctx = avformat_alloc_context();
-    AVDictionaryEntry* tag = NULL;
-    int flags = AV_DICT_IGNORE_SUFFIX;
+    this->strings++;
+    this->requested += len;
 
-    avformat_open_input(&ctx, this->path, NULL, NULL);
-    avformat_find_stream_info(ctx, NULL);
+    /* the key of an interned string is its copy in the chunk */
 
-    /* print all tags */
-    /* while ((tag = av_dict_get(ctx->metadata, "", tag, flags))) {
-        printf("TAG: %s = %s\n", tag->key, tag->value);
-    } */
+    if (intern) dest = g_hash_table_lookup(this->interned, src);
 
-    if ((tag = av_dict_get(ctx->metadata, "title", NULL, flags))) {
-        free(this->name);
-        this->name = stralloc(tag->value);
-    }
-    if ((tag = av_dict_get(ctx->metadata, "name", NULL, flags))) {
-        free(this->name);
-        this->name = stralloc(tag->value);
-    }
-    if ((tag = av_dict_get(ctx->metadata, "artist", NULL, flags))) {
-        this->artist = stralloc(tag->value);
-    }
-    if ((tag = av_dict_get(ctx->metadata, "album", NULL, flags))) {
-        this->album = stralloc(tag->value);
-    }
-    if ((tag = av_dict_get(ctx->metadata, "date", NULL, flags))) {
-        this->date = stralloc(tag->value);
+    if (!dest) {
+        dest = g_string_chunk_insert_len(this->chunk, src, (gssize)len - 1);
+        this->stored += len;
+        if (intern) g_hash_table_add(this->interned, (gpointer)(uintptr_t)dest);
     }
 
-    avformat_close_input(&ctx);
-    avformat_free_context(ctx);
+    g_mutex_unlock(&this->lock);
+
+    return dest;
 }
 
-void track_set_file_info(Track* this, SF_INFO* file_info)
+void track_arena_release(TrackArena* this, const char* str)
 {
-    const size_t len = 7;
-    this->sample_rate = calloc(len+1, sizeof(char));
-    snprintf(this->sample_rate, len, "%d", file_info->samplerate);
+    if (!str) return;
 
-    this->length = (double)file_info->frames / file_info->samplerate;
-    return;
+    g_mutex_lock(&this->lock);
+    this->released += strlen(str) + 1;
+    g_mutex_unlock(&this->lock);
 }
 
-void track_set_r128(Track* this, SF_INFO* file_info, SNDFILE* file)
+Track* track_alloc(TrackArena* arena, const char* name, const char* path)
 {
-    sf_count_t frames_read;
-    ebur128_state* st = NULL;
-    double* buffer;
-    double lufs, peak;
-    int flags = EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK;
-    unsigned int sr = (unsigned int)file_info->samplerate;
-    unsigned int chs = (unsigned int)file_info->channels;
-    sf_count_t window;
-
-    if (!(st = ebur128_init(chs, sr, flags))) {
-        fprintf(stderr, "ebur128 could not create ebur128_state!\n");
-        return;
-    }
+    Track* this = NULL;
 
-    /* allocate buffer used to read chunks of size "window"
+    /* allocate new track and set defaults
+     * the name used by default is probided by the argument but overwritten
+     * by TITLE or NAME tag if present
      */
 
-    if (!(buffer = malloc(st->samplerate * st->channels * sizeof(double)))) {
-        fprintf(stderr, "ebur128 malloc failed\n");
-        return;
+    if (!path) return NULL;
+
+    if (!(this = malloc(sizeof(Track)))) {
+        fprintf(stderr, "failed to allocate track\n");
+        return NULL;
     }
 
-    /* calculate the amount of samples we should read in order to get enough
-     * for the time window used for the waveform
-     */
+    /* a track on its own gets an arena for its strings only */
 
-    window = (sf_count_t)((gdouble)st->samplerate * TIME_WINDOW/1000.0);
+    this->arena = arena;
+    this->owns_arena = FALSE;
+    if (!arena) {
+        if (!(this->arena = track_arena_new())) {
+            free(this);
+            return NULL;
+        }
+        this->owns_arena = TRUE;
+    }
 
-    /* allocate waveform buffer - we add one to make sure we don't get
-     * round-down erro due to int conversion
-     */
+    this->artist = NULL;
+    this->album = NULL;
+    this->date = NULL;
+    this->offset = 0;
+    this->lufs = 0;
+    this->peak = 0;
+    this->true_peak = NAN;
+    this->lra = NAN;
+    this->momentary_max = NAN;
+    this->short_term_max = NAN;
+    this->format = NULL;
+    this->length = 0;
+    this->sample_rate = 0;
+    this->waveform = NULL;
+    this->waveform_len = 0;
+    this->waveform_window = TIME_WINDOW;
+    this->pyramid = NULL;
+    this->analyzed = 0;
+    this->profile = ANALYSIS_QUICK;
 
-    this->waveform_len = 1 + (size_t)(file_info->frames / window);
+    this->path = track_arena_insert(this->arena, path, FALSE);
+    if (name) this->name = track_arena_insert(this->arena, name, FALSE);
+    else this->name = this->path;
 
-    if (!(this->waveform = malloc(this->waveform_len * sizeof(double)))) {
-        fprintf(stderr, "ebur128 malloc failed\n");
-        return;
-    }
+    return this;
+}
 
-    for (size_t n = 0; (frames_read = sf_readf_double(file, buffer, window));) {
-        ebur128_add_frames_double(st, buffer, (size_t)frames_read);
-        ebur128_loudness_window(st, TIME_WINDOW, &this->waveform[n++]);
-    }
+void track_set_string(Track* this, const char** dest, const char* src,
+int intern)
+{
+    /* interned values may be shared, only a copy of this track is released */
 
-    ebur128_loudness_global(st, &lufs);
-    this->lufs = lufs;
+    if (!intern && *dest != this->path) track_arena_release(this->arena, *dest);
+    *dest = track_arena_insert(this->arena, src, intern);
+}
 
-    /* TODO: unclear what peak value really is exactly
-     * -dBFS ?
-     */
-    ebur128_sample_peak(st, 0, &peak);
-    this->peak = peak;
+void track_set_libav_tags(Track* this, Ingest* ingest)
+{
+    const char* tag;
 
-    free(buffer);
-    ebur128_destroy(&st);
+    if ((tag = ingest_tag(ingest, "title"))) {
+        track_set_string(this, &this->name, tag, FALSE);
+    }
+    if ((tag = ingest_tag(ingest, "name"))) {
+        track_set_string(this, &this->name, tag, FALSE);
+    }
+    if ((tag = ingest_tag(ingest, "artist"))) {
+        track_set_string(this, &this->artist, tag, TRUE);
+    }
+    if ((tag = ingest_tag(ingest, "album"))) {
+        track_set_string(this, &this->album, tag, TRUE);
+    }
+    if ((tag = ingest_tag(ingest, "date"))) {
+        track_set_string(this, &this->date, tag, TRUE);
+    }
 }
 
+void track_set_file_info(Track* this, Ingest* ingest)
+{
+    this->sample_rate = ingest->sample_rate;
+
+    this->length = ingest->duration;
+    return;
+}
@@ -14,8 +14,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "../include/analysis.h"
+#include "../include/cache.h"
 #include "../include/config.h"
 #include "../include/player.h"
 #include "../include/track.h"
@@ -29,14 +32,172 @@
 */
 static void selection_changed(Tracklist* this, GtkTreeSelection* selection);
 
+/**
+ * Insert position shared by the files of one drop
+ *
+ * tracks dropped after a row are inserted after the previously inserted
+ * track of the same drop so they keep the order they were dropped in
+ */
+typedef struct LoadAnchor {
+    GtkTreeRowReference* row;       /**< insert relative to row, NULL appends */
+    GtkTreeViewDropPosition pos;    /**< before or after row */
+    gint ref;                       /**< number of jobs using the anchor */
+} LoadAnchor;
+
+/**
+ * Load job
+ *
+ * one file loaded by the load_thread pool
+ * only the worker thread writes track and done, under load_lock
+ */
+typedef struct LoadJob {
+    GFile* file;            /**< file to load */
+    LoadAnchor* anchor;     /**< where to insert the track in the list */
+    Track* track;           /**< the loaded track or NULL when failed */
+    gint64 size;            /**< file size, cache key */
+    gint64 mtime;           /**< file modification time, cache key */
+    gboolean done;          /**< set by worker when track is loaded */
+} LoadJob;
+
+/**
+ * Analysis job
+ *
+ * one track in the list analyzed by the analyze_thread pool
+ * the worker only uses path, size, mtime and cancel, the row reference and
+ * link are only touched in the main loop
+ */
+typedef struct AnalyzeJob {
+    GtkTreeRowReference* row;   /**< row of the track, invalid when removed */
+    gchar* path;                /**< file to analyze */
+    gint64 size;                /**< file size, cache key */
+    gint64 mtime;               /**< file modification time, cache key */
+    int profile;                /**< AnalysisProfile to analyze with */
+    Track* result;              /**< the analyzed track or NULL when failed */
+    gint cancel;                /**< set (atomically) to stop the analysis */
+    GList* link;                /**< link of the job in analyze_jobs */
+} AnalyzeJob;
+
 /**
  * function used by load_thread threadpool to async load tracks
  *
- * @param data file closure from thread_pool_push call
+ * @param data load job closure from thread_pool_push call
  * @param user_data tracklist object closure from thread_pool_new
  */
 static void load_async(gpointer data, gpointer user_data);
 
+/**
+ * function used by analyze_thread threadpool to async analyze tracks
+ *
+ * @param data analysis job closure from thread_pool_push call
+ * @param user_data tracklist object closure from thread_pool_new
+ */
+static void analyze_async(gpointer data, gpointer user_data);
+
+/**
+ * Deliver finished load and analysis jobs to the list
+ *
+ * runs in the main loop, scheduled by load_async and analyze_async
+ * load jobs are delivered in the order they were pushed, a finished job
+ * waits for all jobs pushed before it
+ * analysis results are delivered as they arrive
+ *
+ * @param this tracklist object
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean load_deliver(Tracklist* this);
+
+/**
+ * Queue a track in the list for analysis
+ *
+ * @param this tracklist object
+ * @param iter row of the track
+ * @param track the track
+ * @param size file size, cache key
+ * @param mtime file modification time, cache key
+ * @param profile AnalysisProfile to analyze with
+ */
+static void analyze_push(Tracklist* this, GtkTreeIter* iter, Track* track,
+gint64 size, gint64 mtime, int profile);
+
+/**
+ * Queue the tracks analyzed with a lower profile than upgrade
+ *
+ * runs once the import queue is empty after tracks were imported, so
+ * upgrades never delay an import and a track that fails to upgrade isn't
+ * retried until the next import
+ *
+ * @param this tracklist object
+ */
+static void analyze_upgrade(Tracklist* this);
+
+/**
+ * Cancel the analysis of tracks that are no longer in the list
+ *
+ * a cancelled job that is still queued is skipped by the worker, a running
+ * one stops decoding within one read window
+ *
+ * @param this tracklist object
+ */
+static void analyze_cancel_removed(Tracklist* this);
+
+/**
+ * Free an analysis job and its result
+ *
+ * @param job the analysis job
+ */
+static void analyze_job_free(AnalyzeJob* job);
+
+/**
+ * Insert a row for a track
+ *
+ * like tracklist_add_track but without queueing the analysis
+ *
+ * @param this tracklist object
+ * @param track the track to be added
+ * @param path insert relative to this row or NULL to append
+ * @param pos insert before or after path
+ * @param iter return location for the new row
+ */
+static void insert_track(Tracklist* this, Track* track, GtkTreePath* path,
+GtkTreeViewDropPosition pos, GtkTreeIter* iter);
+
+/**
+ * Write the track properties to the columns of its row
+ *
+ * @param this tracklist object
+ * @param iter row of the track
+ * @param track the track
+ */
+static void set_row(Tracklist* this, GtkTreeIter* iter, Track* track);
+
+/**
+ * Show the number of files being loaded and analyzed
+ *
+ * the progress bar is hidden when nothing is queued
+ *
+ * @param this tracklist object
+ */
+static void progress_update(Tracklist* this);
+
+/**
+ * Free a load job, the track is not free-ed
+ *
+ * @param job the load job
+ */
+static void load_job_free(LoadJob* job);
+
+/**
+ * Compact the strings of the tracks when most of the arena is unused
+ *
+ * removed tracks leave their path and name in the arena, they're dropped
+ * by copying the strings of the tracks in the list into a new chunk
+ * the load workers insert into the arena, so nothing is compacted while
+ * files are loading
+ *
+ * @param this tracklist object
+ */
+static void arena_compact(Tracklist* this);
+
 /*
  * Drag-and-Drop signal handlers
  */
@@ -100,10 +261,26 @@ GtkDragResult result, gpointer user_data);
 Tracklist* tracklist_new(Player* player)
 {
     GError* err = NULL;
+    gchar* cache_dir;
     Tracklist* this = malloc(sizeof(Tracklist));
     this->player = player;
     this->min_lufs = 0.0;
     this->tree = NULL;
+    this->progress = NULL;
+
+    /* the strings of all tracks live in one arena, those of removed tracks
+     * are dropped when the arena is compacted
+     */
+
+    this->arena = track_arena_new();
+
+    /* analysis results are cached in $XDG_CACHE_HOME/alphabet
+     * tracks are analyzed every time when the cache is not available
+     */
+
+    cache_dir = g_build_filename(g_get_user_cache_dir(), CACHE_DIR, NULL);
+    this->cache = cache_new(cache_dir, CACHE_MAX_SIZE);
+    g_free(cache_dir);
 
     this->list = gtk_list_store_new(TRACKLIST_COLUMNS,
                                     G_TYPE_STRING,      /* NAME */
@@ -112,16 +289,40 @@ Tracklist* tracklist_new(Player* player)
                                     G_TYPE_STRING,      /* DURATION */
                                     G_TYPE_POINTER);    /* DATA */
 
-    /* create threadpool for async loading of files
-     * files can be added: g_thread_pool_push(this->load_thread, file, &err);
+    /* create threadpools for async loading of files
+     * files can be added: g_thread_pool_push(this->load_thread, job, &err);
      * functions to add track from file asynchronously
      *  - tracklist_append_file
-     *  - tracklist_inset_file
-     * FIXME: only works for MAX THREADS = -1 - segfault for limited threads
+     *  - tracklist_insert_file(s)
+     *
+     * importing is done in two stages so rows appear right away
+     *  - load_thread only reads the file header (and the cache)
+     *  - analyze_thread decodes the tracks that were not in the cache
+     * one thread per core, more only makes decoders compete for the disk
+     * results are handed back to the main loop by load_deliver
      */
 
-    this->load_thread = g_thread_pool_new(
-            load_async, this, -1, FALSE, &err);
+    g_queue_init(&this->load_jobs);
+    g_queue_init(&this->analyze_jobs);
+    g_queue_init(&this->analyze_done);
+    g_mutex_init(&this->load_lock);
+    this->load_idle = 0;
+    this->closing = 0;
+    this->load_pending = 0;
+    this->analyze_pending = 0;
+    this->analyze_total = 0;
+    this->analyze_thread = NULL;
+    this->profile = ANALYSIS_PROFILE;
+    this->upgrade = MAX(ANALYSIS_UPGRADE, ANALYSIS_PROFILE);
+    this->upgrade_pending = FALSE;
+
+    this->load_thread = g_thread_pool_new(load_async, this,
+            (gint)g_get_num_processors(), FALSE, &err);
+
+    if (!err) {
+        this->analyze_thread = g_thread_pool_new(analyze_async, this,
+                (gint)g_get_num_processors(), FALSE, &err);
+    }
 
     if (err) {
         g_printerr("%s\n", err->message);
@@ -261,59 +462,39 @@ void tracklist_init(Tracklist* this)
             G_CALLBACK(drag_leave), this);
 
     gtk_widget_show_all(GTK_WIDGET(this->tree));
+
+    /* the progress bar shows the import queue, files may have been queued
+     * before the widgets were created ("open" signal)
+     */
+
+    this->progress = GTK_PROGRESS_BAR(gtk_progress_bar_new());
+    gtk_progress_bar_set_show_text(this->progress, TRUE);
+    gtk_widget_set_valign(GTK_WIDGET(this->progress), GTK_ALIGN_CENTER);
+    gtk_widget_set_no_show_all(GTK_WIDGET(this->progress), TRUE);
+    progress_update(this);
 }
 
 void tracklist_add_track(Tracklist* this, Track* track, GtkTreePath* path,
 GtkTreeViewDropPosition pos)
 {
     if (!track) return;
-    GtkTreeIter iter, prev;
-    GtkTreeModel* model = GTK_TREE_MODEL(this->list);
-
-    gchar lufs[7];
-    g_snprintf(lufs, G_N_ELEMENTS(lufs), "%.2f", track->lufs);
-
-    gchar peak[7];
-    g_snprintf(peak, G_N_ELEMENTS(peak), "%.2f", track->peak);
-
-    gchar duration[10];
-    dtoduration(duration, track->length);
-
-    if (path && gtk_tree_model_get_iter(model, &prev, path)) {
-        switch (pos) {
-            case GTK_TREE_VIEW_DROP_BEFORE:
-            case GTK_TREE_VIEW_DROP_INTO_OR_BEFORE:
-                gtk_list_store_insert_before(this->list, &iter, &prev);
-                break;
+    GtkTreeIter iter;
 
-            case GTK_TREE_VIEW_DROP_AFTER:
-            case GTK_TREE_VIEW_DROP_INTO_OR_AFTER:
-            default:
-                gtk_list_store_insert_after(this->list, &iter, &prev);
-        }
-    } else {
-        gtk_list_store_append(this->list, &iter);
-    }
-    gtk_list_store_set(
-            this->list, &iter,
-            TRACKLIST_COLUMN_NAME, track->name,
-            TRACKLIST_COLUMN_LUFS, lufs,
-            TRACKLIST_COLUMN_PEAK, peak,
-            TRACKLIST_COLUMN_DURATION, duration,
-            TRACKLIST_COLUMN_DATA, track,
-            -1);
+    insert_track(this, track, path, pos, &iter);
 
-    /* set the min_lufs value to the lowest loudness
-     * min_should accurately contain the lowest value even after deleting tracks
-     * so it's not neccessary to run through all tracks on each add
-     * min_lufs is stored in tracklist but must be sit in player to take effect
+    /* tracks added without their analysis results are analyzed now, the
+     * cache is not updated because the cache key is not known here
      */
 
-    this->min_lufs = MIN(this->min_lufs, track->lufs);
-    this->player->min_lufs = this->min_lufs;
+    this->upgrade_pending = TRUE;
+    if (!track->analyzed || track->profile < this->profile) {
+        analyze_push(this, &iter, track, -1, -1, this->profile);
+        progress_update(this);
+    }
 }
 
-Track* tracklist_file_to_track(UNUSED Tracklist* this, GFile* file)
+Track* tracklist_file_to_track(Tracklist* this, GFile* file, gint64* size,
+gint64* mtime)
 {
     if (!G_IS_FILE(file)) return NULL;
     Track* track = NULL;
@@ -325,8 +506,15 @@ Track* tracklist_file_to_track(UNUSED Tracklist* this, GFile* file)
 
     path = g_file_get_path(file);
 
-    /* get mimetype */
-    info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+    /* get mimetype, filename, size and mtime in one query
+     * size and mtime are used as cache key
+     */
+
+    info = g_file_query_info(file,
+            G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
+            G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME ","
+            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+            G_FILE_ATTRIBUTE_TIME_MODIFIED,
             G_FILE_QUERY_INFO_NONE, NULL, &err);
     if (err) {
         g_printerr("%s\n", err->message);
@@ -346,47 +534,78 @@ Track* tracklist_file_to_track(UNUSED Tracklist* this, GFile* file)
         goto fail;
     }
 
-    /* get filename */
-    info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME,
-            G_FILE_QUERY_INFO_NONE, NULL, &err);
-    if (err) {
-        g_printerr("%s\n", err->message);
-        g_error_free(err);
-        goto fail;
-    }
     if (!(name = g_file_info_get_display_name(info))) {
         g_printerr("Error getting display name for file \"%s\"\n", path);
         goto fail;
     }
 
-    track = track_new(name, path);
+    *size = g_file_info_get_size(info);
+    *mtime = (gint64)g_file_info_get_attribute_uint64(info,
+            G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+    /* tags are always read from the file, the analysis results are restored
+     * from cache when valid, the file is decoded later by analyze_async
+     */
+
+    if (!(track = track_probe(this->arena, name, path))) goto fail;
+
+    cache_lookup(this->cache, track, *size, *mtime);
 
 fail:
-    /* delete file here if creating track failed
-     * because it cannot be unreffed in load_async */
-    if (!track) g_object_unref(file);
     if (info) g_object_unref(info);
     g_free(path);
     return track;
 }
 
-void tracklist_insert_file(Tracklist* this, GFile* file, GtkTreePath* path,
-GtkTreeViewDropPosition pos)
+void tracklist_insert_files(Tracklist* this, GFile** files, gint n,
+GtkTreePath* path, GtkTreeViewDropPosition pos)
 {
     GError* err = NULL;
+    LoadAnchor* anchor;
 
-    /* allocate position to allow storing in GObject, free-ed by async loader */
-    GtkTreeViewDropPosition* position = malloc(sizeof(GtkTreeViewDropPosition));
-    *position = pos;
+    if (n <= 0) return;
 
-    g_object_set_data(G_OBJECT(file), "path", path);
-    g_object_set_data(G_OBJECT(file), "position", position);
+    /* a row reference follows the row when other rows are inserted or
+     * removed before the jobs are delivered
+     */
 
-    /* send data to load thread pool */
-    g_thread_pool_push(this->load_thread, file, &err);
-    if (err) {
-        g_printerr("%s\n", err->message);
+    anchor = malloc(sizeof(LoadAnchor));
+    anchor->row = path
+        ? gtk_tree_row_reference_new(GTK_TREE_MODEL(this->list), path)
+        : NULL;
+    anchor->pos = pos;
+    anchor->ref = n;
+    this->load_pending += (guint)n;
+
+    for (gint i = 0; i < n; i++) {
+        LoadJob* job = malloc(sizeof(LoadJob));
+        job->file = files[i];
+        job->anchor = anchor;
+        job->track = NULL;
+        job->size = -1;
+        job->mtime = -1;
+        job->done = FALSE;
+
+        /* the queue keeps the push order, load_deliver only inserts the
+         * head of the queue so tracks appear in a deterministic order
+         */
+
+        g_queue_push_tail(&this->load_jobs, job);
+
+        /* send data to load thread pool */
+        g_thread_pool_push(this->load_thread, job, &err);
+        if (err) {
+            g_printerr("%s\n", err->message);
+            g_clear_error(&err);
+        }
     }
+    progress_update(this);
+}
+
+void tracklist_insert_file(Tracklist* this, GFile* file, GtkTreePath* path,
+GtkTreeViewDropPosition pos)
+{
+    tracklist_insert_files(this, &file, 1, path, pos);
 }
 
 void tracklist_append_file(Tracklist* this, GFile* file)
@@ -428,6 +647,20 @@ void tracklist_update_min_lufs(Tracklist* this)
     this->player->min_lufs = this->min_lufs;
 }
 
+void tracklist_set_profile(Tracklist* this, int profile, int upgrade)
+{
+    this->profile = profile;
+    this->upgrade = MAX(upgrade, profile);
+
+    /* tracks already in the list are upgraded right away when idle */
+
+    this->upgrade_pending = TRUE;
+    if (!this->load_pending && !this->analyze_pending) {
+        analyze_upgrade(this);
+        progress_update(this);
+    }
+}
+
 void tracklist_remove_selected(Tracklist* this)
 {
     GtkTreeSelection* selection = gtk_tree_view_get_selection(this->tree);
@@ -444,11 +677,16 @@ void tracklist_remove_selected(Tracklist* this)
     gtk_list_store_remove(this->list, &iter);
     track_free(track);
 
+    /* the analysis result has nowhere to go anymore, stop decoding */
+
+    analyze_cancel_removed(this);
+
     /* it's possible the removed track had the lowest loudness so we must
      * update min_lufs now
      */
 
     tracklist_update_min_lufs(this);
+    arena_compact(this);
 }
 
 void tracklist_free(Tracklist* this)
@@ -460,6 +698,17 @@ void tracklist_free(Tracklist* this)
     GtkTreeSelection* selection;
     GtkTreeModel* model = GTK_TREE_MODEL(this->list);
 
+    /* stop all analyses first so the decoders can finish their current read
+     * window while the list is being cleared
+     * the workers never touch the tracks in the list so freeing them while
+     * workers are running is safe
+     */
+
+    g_atomic_int_set(&this->closing, 1);
+    for (GList* link = this->analyze_jobs.head; link; link = link->next) {
+        g_atomic_int_set(&((AnalyzeJob*)link->data)->cancel, 1);
+    }
+
     /* free each track contained in tracklist before destroying ourselves
      * we must first disconnect the selction signal handler or tracklist will
      * trigger play after each trag that gets deleted and selection moves to
@@ -481,7 +730,31 @@ void tracklist_free(Tracklist* this)
 
     if (this->player) this->player->current = NULL;
 
-    g_thread_pool_free(this->load_thread, FALSE, FALSE);
+    /* drop queued jobs and wait for the running ones, after that no thread
+     * touches the jobs anymore and the undelivered ones can be free-ed
+     * analyze_jobs holds every undelivered analysis job, including the
+     * finished ones in analyze_done
+     */
+
+    if (this->load_thread) g_thread_pool_free(this->load_thread, TRUE, TRUE);
+    if (this->analyze_thread) g_thread_pool_free(this->analyze_thread, TRUE, TRUE);
+    if (this->load_idle) g_source_remove(this->load_idle);
+
+    while (!g_queue_is_empty(&this->load_jobs)) {
+        LoadJob* job = g_queue_pop_head(&this->load_jobs);
+        track_free(job->track);
+        load_job_free(job);
+    }
+    g_queue_clear(&this->analyze_done);
+    while (!g_queue_is_empty(&this->analyze_jobs)) {
+        analyze_job_free(g_queue_pop_head(&this->analyze_jobs));
+    }
+    g_mutex_clear(&this->load_lock);
+
+    /* no track is left that points into the arena */
+
+    track_arena_free(this->arena);
+    cache_free(this->cache);
     g_object_unref(this->list);
     if (this->tree) {
 
@@ -515,29 +788,404 @@ void selection_changed(Tracklist* this, GtkTreeSelection* selection)
 
     gtk_tree_model_get(model, &iter, TRACKLIST_COLUMN_DATA, &track, -1);
     player_load_track(this->player, track);
+
+    /* keep the neighbours of the selected track loaded in the player pool
+     * alternating next and previous rows, the closest ones first
+     */
+
+    if (this->player->n_prepare) {
+        Track** tracks = g_newa(Track*, this->player->n_prepare);
+        GtkTreeIter next = iter, prev = iter;
+        gboolean has_next = TRUE, has_prev = TRUE;
+        guint n = 0;
+
+        tracks[n++] = track;
+
+        while (n < this->player->n_prepare && (has_next || has_prev)) {
+            if (has_next && (has_next = gtk_tree_model_iter_next(model, &next))) {
+                gtk_tree_model_get(model, &next, TRACKLIST_COLUMN_DATA, &tracks[n++], -1);
+            }
+            if (n < this->player->n_prepare && has_prev
+                    && (has_prev = gtk_tree_model_iter_previous(model, &prev)))
+            {
+                gtk_tree_model_get(model, &prev, TRACKLIST_COLUMN_DATA, &tracks[n++], -1);
+            }
+        }
+        player_prepare(this->player, tracks, n);
+    }
 }
 
-void load_async(gpointer file_data, gpointer tracklist_data)
+void load_async(gpointer job_data, gpointer tracklist_data)
 {
     /* the load-async handler is invoked when the thread_pool receives new data
-     * (called by g_thread_pool_push() in insert_file() or append_file()
-     * the file GObject in "file_data" has the row (path) as well as the
-     * before/after (pos) information embedded as data
-     * it is extracted here to call add_track
-     * file is unreffed here as it needs to stay alive until file_to_track
-     * has finished
+     * (called by g_thread_pool_push() in insert_files())
+     * the track is not added to the list here, the list store may only be
+     * touched in the main loop, load_deliver is scheduled to do that
+     * a single idle source delivers all jobs that finished in the meantime
      */
 
     Tracklist* this = tracklist_data;
-    GFile* file = file_data;
-    GtkTreePath* path = g_object_get_data(G_OBJECT(file), "path");
-    GtkTreeViewDropPosition* pos = g_object_get_data(G_OBJECT(file), "position");
-    Track* track = tracklist_file_to_track(this, file);
-    if (track) tracklist_add_track(this, track, path, *pos);
+    LoadJob* job = job_data;
+    gint64 size = -1, mtime = -1;
+    Track* track = tracklist_file_to_track(this, job->file, &size, &mtime);
+
+    g_mutex_lock(&this->load_lock);
+    job->track = track;
+    job->size = size;
+    job->mtime = mtime;
+    job->done = TRUE;
+    if (!this->load_idle) {
+        this->load_idle = g_idle_add(G_SOURCE_FUNC(load_deliver), this);
+    }
+    g_mutex_unlock(&this->load_lock);
+}
 
+void analyze_async(gpointer job_data, gpointer tracklist_data)
+{
+    /* the track in the list is not touched here, it may be playing or
+     * removed in the meantime, the file is analyzed into a new track and
+     * load_deliver moves the results to the track in the list
+     */
+
+    Tracklist* this = tracklist_data;
+    AnalyzeJob* job = job_data;
+    Track* result = NULL;
+
+    /* a job cancelled while it was queued is delivered without a result
+     * right away, the row it belonged to is already gone
+     */
+
+    if (!g_atomic_int_get(&job->cancel)) {
+        result = track_new(NULL, NULL, job->path, job->profile, &job->cancel);
+        if (result && job->size >= 0) {
+            cache_store(this->cache, result, job->size, job->mtime);
+        }
+    }
+
+    g_mutex_lock(&this->load_lock);
+    job->result = result;
+    g_queue_push_tail(&this->analyze_done, job);
+    if (!this->load_idle && !g_atomic_int_get(&this->closing)) {
+        this->load_idle = g_idle_add(G_SOURCE_FUNC(load_deliver), this);
+    }
+    g_mutex_unlock(&this->load_lock);
+}
+
+gboolean load_deliver(Tracklist* this)
+{
+    GQueue batch = G_QUEUE_INIT;
+    GQueue analyzed = G_QUEUE_INIT;
+    GtkTreeModel* model = GTK_TREE_MODEL(this->list);
+    gboolean gain_changed = FALSE;
+    gdouble min_lufs = this->min_lufs;
+    LoadJob* job;
+    AnalyzeJob* analyze_job;
+
+    /* collect the finished jobs at the head of the queue
+     * a finished job behind an unfinished one stays queued until the jobs
+     * before it are delivered
+     */
+
+    g_mutex_lock(&this->load_lock);
+    this->load_idle = 0;
+    while ((job = g_queue_peek_head(&this->load_jobs)) && job->done) {
+        g_queue_push_tail(&batch, g_queue_pop_head(&this->load_jobs));
+    }
+    while ((analyze_job = g_queue_pop_head(&this->analyze_done))) {
+        g_queue_push_tail(&analyzed, analyze_job);
+    }
+    g_mutex_unlock(&this->load_lock);
+
+    while ((job = g_queue_pop_head(&batch))) {
+        LoadAnchor* anchor = job->anchor;
+        GtkTreePath* path = NULL;
+        GtkTreeIter iter;
+
+        this->load_pending--;
+
+        if (job->track) {
+            if (anchor->row) path = gtk_tree_row_reference_get_path(anchor->row);
+
+            /* the row is playable right away, tracks that were not in the
+             * cache (or with a lower profile) are analyzed in the background
+             */
+
+            insert_track(this, job->track, path, anchor->pos, &iter);
+            this->upgrade_pending = TRUE;
+            if (!job->track->analyzed || job->track->profile < this->profile) {
+                analyze_push(this, &iter, job->track, job->size, job->mtime,
+                        this->profile);
+            }
+
+            /* the next track of the same drop goes after this one */
+
+            if (path && (anchor->pos == GTK_TREE_VIEW_DROP_AFTER
+                    || anchor->pos == GTK_TREE_VIEW_DROP_INTO_OR_AFTER))
+            {
+                gtk_tree_path_next(path);
+                gtk_tree_row_reference_free(anchor->row);
+                anchor->row = gtk_tree_row_reference_new(
+                        GTK_TREE_MODEL(this->list), path);
+            }
+            gtk_tree_path_free(path);
+        }
+        load_job_free(job);
+    }
+
+    /* analysis results are moved to the track in the list and the row is
+     * updated, a removed row has an invalid reference and is skipped
+     * a track that can't be decoded is removed like it would never have been
+     * added to the list, unless it has results of an earlier analysis
+     */
+
+    while ((analyze_job = g_queue_pop_head(&analyzed))) {
+        GtkTreePath* path = gtk_tree_row_reference_get_path(analyze_job->row);
+        GtkTreeIter iter;
+        Track* track;
+
+        this->analyze_pending--;
+
+        if (path && gtk_tree_model_get_iter(model, &iter, path)) {
+            gtk_tree_model_get(model, &iter, TRACKLIST_COLUMN_DATA, &track, -1);
+
+            if (analyze_job->result) {
+                track_set_analysis(track, analyze_job->result);
+                set_row(this, &iter, track);
+                this->min_lufs = MIN(this->min_lufs, track->lufs);
+                if (track == this->player->current) gain_changed = TRUE;
+            } else {
+                g_printerr("Error analyzing file \"%s\"\n", analyze_job->path);
+                if (!track->analyzed) {
+                    gtk_list_store_remove(this->list, &iter);
+                    track_free(track);
+                }
+            }
+        }
+        gtk_tree_path_free(path);
+        g_queue_delete_link(&this->analyze_jobs, analyze_job->link);
+        analyze_job_free(analyze_job);
+    }
+
+    /* min_lufs is stored in tracklist but must be set in player to take
+     * effect, the track that is playing is adjusted immediately
+     */
+
+    this->player->min_lufs = this->min_lufs;
+    if (gain_changed || this->min_lufs != min_lufs) {
+        player_update_gain(this->player);
+    }
+
+    if (!this->load_pending && !this->analyze_pending) analyze_upgrade(this);
+
+    arena_compact(this);
+    progress_update(this);
+    return G_SOURCE_REMOVE;
+}
+
+void analyze_push(Tracklist* this, GtkTreeIter* iter, Track* track,
+gint64 size, gint64 mtime, int profile)
+{
+    GError* err = NULL;
+    GtkTreePath* path;
+    AnalyzeJob* job = malloc(sizeof(AnalyzeJob));
+
+    path = gtk_tree_model_get_path(GTK_TREE_MODEL(this->list), iter);
+    job->row = gtk_tree_row_reference_new(GTK_TREE_MODEL(this->list), path);
+    job->path = g_strdup(track->path);
+    job->size = size;
+    job->mtime = mtime;
+    job->profile = profile;
+    job->result = NULL;
+    job->cancel = 0;
     gtk_tree_path_free(path);
-    free(pos);
-    g_object_unref(file);
+
+    g_queue_push_tail(&this->analyze_jobs, job);
+    job->link = g_queue_peek_tail_link(&this->analyze_jobs);
+
+    /* the total restarts when the queue ran empty so progress is relative to
+     * the current import
+     */
+
+    if (!this->analyze_pending) this->analyze_total = 0;
+    this->analyze_pending++;
+    this->analyze_total++;
+
+    g_thread_pool_push(this->analyze_thread, job, &err);
+    if (err) {
+        g_printerr("%s\n", err->message);
+        g_clear_error(&err);
+    }
+}
+
+void analyze_upgrade(Tracklist* this)
+{
+    GtkTreeModel* model = GTK_TREE_MODEL(this->list);
+    GtkTreeIter iter;
+
+    if (!this->upgrade_pending) return;
+    this->upgrade_pending = FALSE;
+
+    if (!gtk_tree_model_get_iter_first(model, &iter)) return;
+
+    do {
+        Track* track;
+        struct stat st;
+
+        gtk_tree_model_get(model, &iter, TRACKLIST_COLUMN_DATA, &track, -1);
+        if (!track->analyzed || track->profile >= this->upgrade) continue;
+
+        /* the file is stat-ed again for the cache key, the upgraded results
+         * are stored like those of an import
+         */
+
+        if (stat(track->path, &st) == 0) {
+            analyze_push(this, &iter, track, (gint64)st.st_size,
+                    (gint64)st.st_mtime, this->upgrade);
+        } else {
+            analyze_push(this, &iter, track, -1, -1, this->upgrade);
+        }
+    } while (gtk_tree_model_iter_next(model, &iter));
+}
+
+void analyze_cancel_removed(Tracklist* this)
+{
+    for (GList* link = this->analyze_jobs.head; link; link = link->next) {
+        AnalyzeJob* job = link->data;
+        if (!gtk_tree_row_reference_valid(job->row)) {
+            g_atomic_int_set(&job->cancel, 1);
+        }
+    }
+}
+
+void analyze_job_free(AnalyzeJob* job)
+{
+    gtk_tree_row_reference_free(job->row);
+    track_free(job->result);
+    g_free(job->path);
+    free(job);
+}
+
+void insert_track(Tracklist* this, Track* track, GtkTreePath* path,
+GtkTreeViewDropPosition pos, GtkTreeIter* iter)
+{
+    GtkTreeIter prev;
+    GtkTreeModel* model = GTK_TREE_MODEL(this->list);
+
+    if (path && gtk_tree_model_get_iter(model, &prev, path)) {
+        switch (pos) {
+            case GTK_TREE_VIEW_DROP_BEFORE:
+            case GTK_TREE_VIEW_DROP_INTO_OR_BEFORE:
+                gtk_list_store_insert_before(this->list, iter, &prev);
+                break;
+
+            case GTK_TREE_VIEW_DROP_AFTER:
+            case GTK_TREE_VIEW_DROP_INTO_OR_AFTER:
+            default:
+                gtk_list_store_insert_after(this->list, iter, &prev);
+        }
+    } else {
+        gtk_list_store_append(this->list, iter);
+    }
+    set_row(this, iter, track);
+
+    /* set the min_lufs value to the lowest loudness
+     * min_should accurately contain the lowest value even after deleting tracks
+     * so it's not neccessary to run through all tracks on each add
+     * min_lufs is stored in tracklist but must be sit in player to take effect
+     * tracks that are not analyzed have lufs 0.0 and don't change min_lufs
+     */
+
+    this->min_lufs = MIN(this->min_lufs, track->lufs);
+    this->player->min_lufs = this->min_lufs;
+}
+
+void set_row(Tracklist* this, GtkTreeIter* iter, Track* track)
+{
+    gchar lufs[7] = "";
+    gchar peak[7] = "";
+    gchar duration[10];
+
+    /* loudness and peak stay empty until the track is analyzed */
+
+    if (track->analyzed) {
+        g_snprintf(lufs, G_N_ELEMENTS(lufs), "%.2f", track->lufs);
+        g_snprintf(peak, G_N_ELEMENTS(peak), "%.2f", track->peak);
+    }
+
+    dtoduration(duration, track->length);
+
+    gtk_list_store_set(
+            this->list, iter,
+            TRACKLIST_COLUMN_NAME, track->name,
+            TRACKLIST_COLUMN_LUFS, lufs,
+            TRACKLIST_COLUMN_PEAK, peak,
+            TRACKLIST_COLUMN_DURATION, duration,
+            TRACKLIST_COLUMN_DATA, track,
+            -1);
+}
+
+void progress_update(Tracklist* this)
+{
+    gchar* text;
+    guint done = this->analyze_total - this->analyze_pending;
+
+    if (!this->progress) return;
+
+    if (!this->load_pending && !this->analyze_pending) {
+        gtk_widget_hide(GTK_WIDGET(this->progress));
+        return;
+    }
+
+    if (this->load_pending) {
+        text = g_strdup_printf("analyzed %u/%u, loading %u", done,
+                this->analyze_total, this->load_pending);
+    } else {
+        text = g_strdup_printf("analyzed %u/%u", done, this->analyze_total);
+    }
+
+    gtk_progress_bar_set_text(this->progress, text);
+    gtk_progress_bar_set_fraction(this->progress, this->analyze_total
+            ? (gdouble)done / (gdouble)this->analyze_total : 0.0);
+    gtk_widget_show(GTK_WIDGET(this->progress));
+    g_free(text);
+}
+
+void load_job_free(LoadJob* job)
+{
+    /* the anchor is shared by all jobs of the same drop */
+
+    if (--job->anchor->ref == 0) {
+        if (job->anchor->row) gtk_tree_row_reference_free(job->anchor->row);
+        free(job->anchor);
+    }
+    g_object_unref(job->file);
+    free(job);
+}
+
+void arena_compact(Tracklist* this)
+{
+    GtkTreeModel* model = GTK_TREE_MODEL(this->list);
+    GtkTreeIter iter;
+    Track** tracks = NULL;
+    size_t n = 0;
+    gint rows;
+
+    if (this->load_pending || !track_arena_fragmented(this->arena)) return;
+
+    rows = gtk_tree_model_iter_n_children(model, NULL);
+    if (rows && !(tracks = malloc((size_t)rows * sizeof(Track*)))) {
+        g_printerr("Error compacting track strings: out of memory\n");
+        return;
+    }
+
+    if (gtk_tree_model_get_iter_first(model, &iter)) {
+        do {
+            gtk_tree_model_get(model, &iter, TRACKLIST_COLUMN_DATA, &tracks[n++], -1);
+        } while (gtk_tree_model_iter_next(model, &iter));
+    }
+
+    track_arena_compact(this->arena, tracks, n);
+    free(tracks);
 }
 
 void drag_begin(UNUSED GtkTreeView *tree, UNUSED GdkDragContext *ctx,
@@ -642,6 +1290,7 @@ GtkSelectionData *selection, guint info, guint32 time, Tracklist* this)
             GtkTreePath* path;
             GtkTreeViewDropPosition pos;
             char* uri, * str;
+            GPtrArray* files;
             const gchar* delim = "\r\n";
             const guchar* uris = gtk_selection_data_get_data(selection);
 
@@ -650,19 +1299,24 @@ GtkSelectionData *selection, guint info, guint32 time, Tracklist* this)
              * somehow the file uris are line separated with <CR><LF>
              * we split them here and create files from uri for each line
              *
-             * the destination row position (path) is retrieved here but
-             * free-ed by the async_loader
+             * the destination row position (path) is retrieved here, the
+             * files of one drop are inserted in the order they were dropped
              */
 
             gtk_tree_view_get_dest_row_at_pos(tree, x, y, &path, &pos);
 
             str = g_strdup((const char*)uris);
+            files = g_ptr_array_new();
             uri = strtok(str, delim);
             do {
-                GFile* file = g_file_new_for_uri(uri);
-                tracklist_insert_file(this, file, path, pos);
+                g_ptr_array_add(files, g_file_new_for_uri(uri));
             } while ((uri = strtok(NULL, delim)));
 
+            tracklist_insert_files(this, (GFile**)files->pdata,
+                    (gint)files->len, path, pos);
+
+            g_ptr_array_free(files, TRUE);
+            if (path) gtk_tree_path_free(path);
             g_free(str);
             gtk_drag_finish(ctx, TRUE, FALSE, time);
             break;
@@ -101,6 +101,7 @@ Transport* transport_new(Player* player)
     gtk_widget_show_all(this->box_movement);
     gtk_widget_show_all(this->box_control);
 
+    this->state = G_MAXUINT;
     transport_update(this);
 
     return this;
@@ -108,35 +109,38 @@ Transport* transport_new(Player* player)
 
 void transport_update(Transport* this)
 {
+    guint state = 0;
+
     if (this->player->rtn && this->player->marker == 0.0) {
-        gtk_widget_show(this->rtn);
-        gtk_widget_hide(this->ctd);
-        gtk_widget_hide(this->mark);
+        state |= TRANSPORT_SHOW_RTN;
     } else if (this->player->marker != 0.0) {
-        gtk_widget_hide(this->rtn);
-        gtk_widget_hide(this->ctd);
-        gtk_widget_show(this->mark);
+        state |= TRANSPORT_SHOW_MARK;
     } else {
-        gtk_widget_hide(this->rtn);
-        gtk_widget_show(this->ctd);
-        gtk_widget_hide(this->mark);
+        state |= TRANSPORT_SHOW_CTD;
     }
 
     if (this->player->loop_start != 0.0 && this->player->loop_stop != 0.0) {
-        gtk_widget_show(this->loop);
-        gtk_widget_hide(this->noloop);
-    } else {
-        gtk_widget_hide(this->loop);
-        gtk_widget_show(this->noloop);
+        state |= TRANSPORT_SHOW_LOOP;
     }
 
     if (this->player->play_state == PLAY_STATE_PLAY) {
-        gtk_widget_show(this->pause);
-        gtk_widget_hide(this->play);
-    } else {
-        gtk_widget_hide(this->pause);
-        gtk_widget_show(this->play);
+        state |= TRANSPORT_SHOW_PAUSE;
     }
+
+    /* this is called every frame during playback, the buttons only change
+     * when the state of the player did
+     */
+
+    if (state == this->state) return;
+    this->state = state;
+
+    gtk_widget_set_visible(this->rtn, state & TRANSPORT_SHOW_RTN);
+    gtk_widget_set_visible(this->ctd, state & TRANSPORT_SHOW_CTD);
+    gtk_widget_set_visible(this->mark, state & TRANSPORT_SHOW_MARK);
+    gtk_widget_set_visible(this->loop, state & TRANSPORT_SHOW_LOOP);
+    gtk_widget_set_visible(this->noloop, !(state & TRANSPORT_SHOW_LOOP));
+    gtk_widget_set_visible(this->pause, state & TRANSPORT_SHOW_PAUSE);
+    gtk_widget_set_visible(this->play, !(state & TRANSPORT_SHOW_PAUSE));
 }
 
 
@@ -0,0 +1,193 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        waveform.c
+ * @brief       multi-resolution loudness curve
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/waveform.h"
+
+/**
+ * Allocate the min, max and mean arrays of a level in one block
+ *
+ * @param level the level to allocate
+ * @param len number of points
+ * @return 0 on success or -1 when failed to allocate
+ */
+static int waveform_level_alloc(WaveformLevel* level, size_t len);
+
+/**
+ * Reduce a level to the next coarser level
+ *
+ * two points are merged into one, the mean is weighted by the number of
+ * windows each point covers
+ *
+ * @param dest the coarser level, must be allocated
+ * @param src the finer level
+ * @param windows number of windows covered by every point of src
+ * @param total number of windows of level 0
+ */
+static void waveform_level_reduce(WaveformLevel* dest, const WaveformLevel* src,
+size_t windows, size_t total);
+
+
+/*******************************************************************************
+ * extern functions
+ */
+
+
+Waveform* waveform_new(const WaveformValue* values, size_t len)
+{
+    Waveform* this;
+    size_t windows = 1;
+
+    if (!values || !len) return NULL;
+
+    if (!(this = calloc(1, sizeof(Waveform)))) {
+        fprintf(stderr, "failed to allocate waveform\n");
+        return NULL;
+    }
+
+    if (waveform_level_alloc(&this->levels[0], len) != 0) goto fail;
+    this->n = 1;
+
+    memcpy(this->levels[0].min, values, len * sizeof(WaveformValue));
+    memcpy(this->levels[0].max, values, len * sizeof(WaveformValue));
+    memcpy(this->levels[0].mean, values, len * sizeof(WaveformValue));
+
+    /* halve the number of points until a single point is left */
+
+    while (this->levels[this->n-1].len > 1 && this->n < WAVEFORM_LEVELS) {
+        WaveformLevel* src = &this->levels[this->n-1];
+        WaveformLevel* dest = &this->levels[this->n];
+
+        if (waveform_level_alloc(dest, (src->len + 1) / 2) != 0) goto fail;
+        waveform_level_reduce(dest, src, windows, len);
+
+        windows *= 2;
+        this->n++;
+    }
+
+    return this;
+
+fail:
+    waveform_free(this);
+    return NULL;
+}
+
+WaveformValue waveform_encode(double loudness)
+{
+    const double steps = round(loudness / WAVEFORM_STEP);
+
+    if (isnan(loudness) || (isinf(loudness) && loudness < 0.0)) {
+        return WAVEFORM_SILENCE;
+    }
+    if (steps <= -INT16_MAX) return -INT16_MAX;
+    if (steps >= INT16_MAX) return INT16_MAX;
+    return (WaveformValue)steps;
+}
+
+double waveform_decode(WaveformValue value)
+{
+    return value == WAVEFORM_SILENCE ? -HUGE_VAL : value * WAVEFORM_STEP;
+}
+
+const WaveformLevel* waveform_level(Waveform* this, size_t width)
+{
+    for (size_t i = 0; i < this->n; i++) {
+        if (this->levels[i].len <= width) return &this->levels[i];
+    }
+    return &this->levels[this->n-1];
+}
+
+size_t waveform_size(const Waveform* this)
+{
+    size_t size = 0;
+
+    if (!this) return 0;
+    for (size_t i = 0; i < this->n; i++) {
+        size += 3 * this->levels[i].len * sizeof(WaveformValue);
+    }
+    return size;
+}
+
+void waveform_free(Waveform* this)
+{
+    if (!this) return;
+
+    /* min is the start of the block holding all three arrays */
+
+    for (size_t i = 0; i < WAVEFORM_LEVELS; i++) {
+        free(this->levels[i].min);
+    }
+    free(this);
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+int waveform_level_alloc(WaveformLevel* level, size_t len)
+{
+    WaveformValue* block;
+
+    if (!(block = malloc(3 * len * sizeof(WaveformValue)))) {
+        fprintf(stderr, "failed to allocate waveform level\n");
+        return -1;
+    }
+
+    level->min = block;
+    level->max = block + len;
+    level->mean = block + 2 * len;
+    level->len = len;
+
+    return 0;
+}
+
+void waveform_level_reduce(WaveformLevel* dest, const WaveformLevel* src,
+size_t windows, size_t total)
+{
+    for (size_t i = 0; i < dest->len; i++) {
+        const size_t a = 2 * i, b = 2 * i + 1;
+
+        /* the last point of a level with an odd length has no partner */
+
+        if (b >= src->len) {
+            dest->min[i] = src->min[a];
+            dest->max[i] = src->max[a];
+            dest->mean[i] = src->mean[a];
+            continue;
+        }
+
+        /* only the last point of src can cover less windows
+         * silence is the lowest value, so min and max need no special case,
+         * the mean with silence is silence like -inf would be
+         */
+
+        {
+            const size_t wb = total - b * windows < windows
+                ? total - b * windows : windows;
+            const double w = (double)windows + (double)wb;
+
+            dest->min[i] = src->min[a] < src->min[b] ? src->min[a] : src->min[b];
+            dest->max[i] = src->max[a] > src->max[b] ? src->max[a] : src->max[b];
+
+            if (src->mean[a] == WAVEFORM_SILENCE || src->mean[b] == WAVEFORM_SILENCE) {
+                dest->mean[i] = WAVEFORM_SILENCE;
+            } else {
+                dest->mean[i] = (WaveformValue)lround(((double)src->mean[a]
+                            * (double)windows + (double)src->mean[b] * (double)wb) / w);
+            }
+        }
+    }
+}
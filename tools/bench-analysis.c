@@ -0,0 +1,649 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        bench-analysis.c
+ * @brief       track loading and analysis throughput benchmark
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ *
+ * loads every file of a corpus with track_new, one at a time and in a
+ * thread pool, and writes the time per stage, real-time factor and MB/s
+ * per format, sample rate and channel count as json
+ *
+ * files are read once before they're timed, so the page cache is warm and
+ * runs are comparable, the stages measure the cpu cost of loading
+ *
+ * the sequential run reads the native sample type of the decoder and
+ * measures the standard profile with the vectorized loudness kernel, it's
+ * repeated with the quick and full profile, with true peak enabled, with
+ * doubles, with the scalar kernel and with libebur128 to compare speed and
+ * results, without streaming to compare the memory used, and with wav and
+ * aiff decoded instead of memory mapped
+ *
+ * the peak rss of an import is how much the resident set grew while one
+ * track was loaded (/proc/self/status, the peak is reset before every
+ * track through /proc/self/clear_refs), the largest of a run is reported
+ *
+ * the waveform memory of a session of 1000 tracks is extrapolated from the
+ * waveforms and pyramids of the standard run, quantized as they're kept
+ * and as doubles and floats as they were before
+ *
+ * usage: alphabet-bench-analysis [-o output.json] files|directories...
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../include/analysis.h"
+#include "../include/config.h"
+#include "../include/ingest.h"
+#include "../include/r128.h"
+#include "../include/track.h"
+
+/**
+ * BenchGroup
+ *
+ * files of the same format, sample rate and channel count
+ */
+typedef struct BenchGroup {
+    gchar* format;              /**< lowercase extension */
+    unsigned int sample_rate;   /**< sample rate in Hz */
+    unsigned int channels;      /**< number of channels */
+    GPtrArray* paths;           /**< files of the group */
+    guint64 bytes;              /**< total size of the files */
+    double seconds;             /**< total length of the files */
+    guint failed;               /**< files that failed to load */
+    guint64 waveform_bytes;     /**< waveforms and pyramids of the last run */
+    guint64 unquantized_bytes;  /**< the same as doubles and floats */
+    double session;             /**< MB of waveforms for 1000 tracks */
+    double unquantized_session; /**< MB of unquantized waveforms */
+    AnalysisStats stats;        /**< stage times of the sequential run */
+    gint64 peak;                /**< loudness time added by true peak */
+    gint64 sequential;          /**< wall time of the sequential run */
+    gint64 pool;                /**< wall time of the thread pool run */
+    gint64 quick;               /**< wall time of the ANALYSIS_QUICK run */
+    gint64 full;                /**< wall time of the ANALYSIS_FULL run */
+    gint64 reference;           /**< wall time of the double sample run */
+    AnalysisStats reference_stats; /**< stage times of the double run */
+    double lufs_error;          /**< max lufs difference with the double run */
+    double peak_error;          /**< max peak difference with the double run */
+    gint64 scalar;              /**< wall time of the scalar kernel run */
+    AnalysisStats scalar_stats; /**< stage times of the scalar kernel run */
+    double scalar_error;        /**< max lufs difference with the scalar run */
+    gint64 ebur128;             /**< wall time of the libebur128 run */
+    AnalysisStats ebur128_stats; /**< stage times of the libebur128 run */
+    double ebur128_lufs_error;  /**< max lufs difference with libebur128 */
+    double ebur128_peak_error;  /**< max peak difference with libebur128 */
+    long rss;                   /**< peak rss of an import in kB */
+    long full_rss;              /**< peak rss of an ANALYSIS_FULL import */
+    gint64 exact;               /**< wall time of the run without streaming */
+    long exact_rss;             /**< peak rss of an import without streaming */
+    double exact_error;         /**< max lufs difference without streaming */
+    gint64 decoded;             /**< wall time of the run without mapping */
+    AnalysisStats decoded_stats; /**< stage times of the run without mapping */
+    double decoded_error;       /**< max lufs difference without mapping */
+} BenchGroup;
+
+/**
+ * Add a file or all files of a directory (recursive) to the corpus
+ *
+ * @param groups BenchGroup* array
+ * @param path file or directory
+ */
+static void bench_add_path(GPtrArray* groups, const char* path);
+
+/**
+ * Get the group of a format, created if needed
+ *
+ * @param groups BenchGroup* array
+ * @param format lowercase extension
+ * @param sample_rate sample rate in Hz
+ * @param channels number of channels
+ * @return the group
+ */
+static BenchGroup* bench_group_get(GPtrArray* groups, const char* format,
+unsigned int sample_rate, unsigned int channels);
+
+/**
+ * Load all files of a group one by one, in this thread only
+ *
+ * @param this the group
+ * @param profile AnalysisProfile of the run
+ * @param stats stage times of the run
+ * @param results lufs and peak of every file are appended or NULL, NAN
+ * when the file failed
+ * @param rss destination of the peak rss of an import in kB or NULL
+ * @return wall time in usec
+ */
+static gint64 bench_sequential(BenchGroup* this, AnalysisProfile profile,
+AnalysisStats* stats, GArray* results, long* rss);
+
+/**
+ * Reset the peak rss of the process to the current rss
+ *
+ * @return 0 on success or -1 when not supported
+ */
+static int bench_rss_reset(void);
+
+/**
+ * Read a memory field of /proc/self/status
+ *
+ * @param field eg VmRSS or VmHWM
+ * @return the value in kB or -1 when unknown
+ */
+static long bench_rss(const char* field);
+
+/**
+ * Largest difference between the results of two runs
+ *
+ * @param a results of bench_sequential
+ * @param b results of bench_sequential
+ * @param index 0 for lufs, 1 for peak
+ * @return the difference, equal infinities (silence) don't differ
+ */
+static double bench_error(GArray* a, GArray* b, guint index);
+
+/**
+ * Load all files of a group in a thread pool
+ *
+ * @param this the group
+ * @param threads number of threads
+ * @return wall time in usec
+ */
+static gint64 bench_pool(BenchGroup* this, guint threads);
+
+/**
+ * Thread pool function of bench_pool
+ */
+static void bench_pool_load(gpointer path, gpointer data);
+
+/**
+ * Read a file to warm the page cache
+ */
+static void bench_warm(const char* path);
+
+/**
+ * Write the results as json
+ *
+ * @param out the output file
+ * @param groups BenchGroup* array
+ * @param threads number of threads of the pool runs
+ */
+static void bench_print(FILE* out, GPtrArray* groups, guint threads);
+
+/**
+ * Write a run as json
+ */
+static void bench_print_run(FILE* out, BenchGroup* this, gint64 wall);
+
+static gint bench_compare_group(gconstpointer a, gconstpointer b);
+
+static void bench_group_free(gpointer data);
+
+
+/*******************************************************************************
+ * main
+ */
+
+
+int main(int argc, char** argv)
+{
+    GPtrArray* groups = g_ptr_array_new_with_free_func(bench_group_free);
+    const char* output = "bench-analysis.json";
+    const guint threads = g_get_num_processors();
+    FILE* out;
+    int i = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+        i = 3;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-o output.json] files|directories...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (; i < argc; i++) bench_add_path(groups, argv[i]);
+    g_ptr_array_sort(groups, bench_compare_group);
+
+    for (guint g = 0; g < groups->len; g++) {
+        BenchGroup* group = g_ptr_array_index(groups, g);
+        GArray* native = g_array_new(FALSE, FALSE, sizeof(double));
+        GArray* reference = g_array_new(FALSE, FALSE, sizeof(double));
+        GArray* scalar = g_array_new(FALSE, FALSE, sizeof(double));
+        GArray* ebur128 = g_array_new(FALSE, FALSE, sizeof(double));
+        GArray* exact = g_array_new(FALSE, FALSE, sizeof(double));
+        GArray* decoded = g_array_new(FALSE, FALSE, sizeof(double));
+        AnalysisStats true_peak, profile;
+
+        fprintf(stderr, "%s %u Hz %u ch: %u files\n", group->format,
+                group->sample_rate, group->channels, group->paths->len);
+
+        for (guint f = 0; f < group->paths->len; f++) {
+            bench_warm(g_ptr_array_index(group->paths, f));
+        }
+
+        /* true peak is off by default, its cost is the difference with a
+         * run that enables it
+         */
+
+        group->sequential = bench_sequential(group, ANALYSIS_STANDARD,
+                &group->stats, native, &group->rss);
+
+        if (group->paths->len > group->failed) {
+            const double tracks = group->paths->len - group->failed;
+            group->session = (double)group->waveform_bytes / tracks * 1000.0 / 1e6;
+            group->unquantized_session = (double)group->unquantized_bytes
+                / tracks * 1000.0 / 1e6;
+        }
+
+        analysis_set_true_peak(TRUE);
+        bench_sequential(group, ANALYSIS_STANDARD, &true_peak, NULL, NULL);
+        analysis_set_true_peak(FALSE);
+
+        group->quick = bench_sequential(group, ANALYSIS_QUICK, &profile, NULL, NULL);
+        group->full = bench_sequential(group, ANALYSIS_FULL, &profile, NULL,
+                &group->full_rss);
+
+        group->peak = MAX(true_peak.loudness - group->stats.loudness, 0);
+
+        analysis_set_sample(INGEST_DOUBLE);
+        group->reference = bench_sequential(group, ANALYSIS_STANDARD,
+                &group->reference_stats, reference, NULL);
+        analysis_set_sample(ANALYSIS_NATIVE);
+
+        group->lufs_error = bench_error(native, reference, 0);
+        group->peak_error = bench_error(native, reference, 1);
+
+        r128_set_isa(R128_SCALAR);
+        group->scalar = bench_sequential(group, ANALYSIS_STANDARD,
+                &group->scalar_stats, scalar, NULL);
+        r128_set_isa(R128_AVX2);
+
+        group->scalar_error = bench_error(native, scalar, 0);
+
+        analysis_set_kernel(FALSE);
+        group->ebur128 = bench_sequential(group, ANALYSIS_STANDARD,
+                &group->ebur128_stats, ebur128, NULL);
+        analysis_set_kernel(TRUE);
+
+        group->ebur128_lufs_error = bench_error(native, ebur128, 0);
+        group->ebur128_peak_error = bench_error(native, ebur128, 1);
+
+        analysis_set_streaming(FALSE);
+        group->exact = bench_sequential(group, ANALYSIS_STANDARD, &profile,
+                exact, &group->exact_rss);
+        analysis_set_streaming(ANALYSIS_STREAMING);
+
+        group->exact_error = bench_error(native, exact, 0);
+
+        analysis_set_mmap(FALSE);
+        group->decoded = bench_sequential(group, ANALYSIS_STANDARD,
+                &group->decoded_stats, decoded, NULL);
+        analysis_set_mmap(ANALYSIS_MMAP);
+
+        group->decoded_error = bench_error(native, decoded, 0);
+
+        group->pool = bench_pool(group, threads);
+
+        g_array_free(native, TRUE);
+        g_array_free(reference, TRUE);
+        g_array_free(scalar, TRUE);
+        g_array_free(ebur128, TRUE);
+        g_array_free(exact, TRUE);
+        g_array_free(decoded, TRUE);
+    }
+
+    if (!(out = fopen(output, "w"))) {
+        fprintf(stderr, "failed to open \"%s\"\n", output);
+        return EXIT_FAILURE;
+    }
+    bench_print(out, groups, threads);
+    fclose(out);
+
+    g_ptr_array_free(groups, TRUE);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void bench_add_path(GPtrArray* groups, const char* path)
+{
+    const char* ext;
+    gchar* format;
+    Ingest* ingest;
+    BenchGroup* group;
+    struct stat st;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        GDir* dir = g_dir_open(path, 0, NULL);
+        const gchar* entry;
+
+        if (!dir) return;
+        while ((entry = g_dir_read_name(dir))) {
+            gchar* child = g_build_filename(path, entry, NULL);
+            bench_add_path(groups, child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        return;
+    }
+
+    if (!(ext = strrchr(path, '.')) || strchr(ext, '/')) return;
+    if (strcmp(ext, ".json") == 0) return;
+    if (stat(path, &st) != 0) return;
+
+    /* the header tells the group, the file is not decoded */
+
+    if (!(ingest = ingest_open(path, FALSE))) return;
+
+    format = g_ascii_strdown(ext + 1, -1);
+    group = bench_group_get(groups, format, ingest->sample_rate, ingest->channels);
+    g_ptr_array_add(group->paths, g_strdup(path));
+    group->bytes += (guint64)st.st_size;
+
+    g_free(format);
+    ingest_close(ingest);
+}
+
+BenchGroup* bench_group_get(GPtrArray* groups, const char* format,
+unsigned int sample_rate, unsigned int channels)
+{
+    BenchGroup* group;
+
+    for (guint i = 0; i < groups->len; i++) {
+        group = g_ptr_array_index(groups, i);
+        if (strcmp(group->format, format) == 0
+                && group->sample_rate == sample_rate
+                && group->channels == channels)
+        {
+            return group;
+        }
+    }
+
+    group = g_new0(BenchGroup, 1);
+    group->format = g_strdup(format);
+    group->sample_rate = sample_rate;
+    group->channels = channels;
+    group->paths = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(groups, group);
+
+    return group;
+}
+
+gint64 bench_sequential(BenchGroup* this, AnalysisProfile profile,
+AnalysisStats* stats, GArray* results, long* rss)
+{
+    gint64 start;
+
+    this->seconds = 0.0;
+    this->failed = 0;
+    this->waveform_bytes = 0;
+    this->unquantized_bytes = 0;
+    if (rss) *rss = 0;
+
+    /* one thread, long files are not split in segments */
+
+    analysis_set_segments(1);
+    analysis_stats_reset();
+    start = g_get_monotonic_time();
+
+    for (guint i = 0; i < this->paths->len; i++) {
+        Track* track;
+        long before = 0;
+
+        if (rss) {
+            bench_rss_reset();
+            before = bench_rss("VmRSS");
+        }
+
+        track = track_new(NULL, NULL, g_ptr_array_index(this->paths, i),
+                profile, NULL);
+
+        if (rss) *rss = MAX(*rss, bench_rss("VmHWM") - before);
+
+        if (!track) {
+            const double none[2] = { NAN, NAN };
+            if (results) g_array_append_vals(results, none, 2);
+            this->failed++;
+            continue;
+        }
+        if (results) {
+            g_array_append_val(results, track->lufs);
+            g_array_append_val(results, track->peak);
+        }
+        this->seconds += track->length;
+
+        /* a pyramid point is a min, max and mean */
+
+        if (track->waveform) {
+            const size_t pyramid = waveform_size(track->pyramid);
+            this->waveform_bytes += track->waveform_len * sizeof(WaveformValue) + pyramid;
+            this->unquantized_bytes += track->waveform_len * sizeof(double)
+                + pyramid / sizeof(WaveformValue) * sizeof(float);
+        }
+        track_free(track);
+    }
+
+    start = g_get_monotonic_time() - start;
+    analysis_stats_get(stats);
+    analysis_set_segments(0);
+
+    return start;
+}
+
+double bench_error(GArray* a, GArray* b, guint index)
+{
+    double error = 0.0;
+
+    for (guint i = index; i < MIN(a->len, b->len); i += 2) {
+        const double x = g_array_index(a, double, i);
+        const double y = g_array_index(b, double, i);
+
+        if (x == y || (isnan(x) && isnan(y))) continue;
+        error = MAX(error, fabs(x - y));
+    }
+    return error;
+}
+
+gint64 bench_pool(BenchGroup* this, guint threads)
+{
+    GThreadPool* pool;
+    gint64 start = g_get_monotonic_time();
+
+    if (!(pool = g_thread_pool_new(bench_pool_load, NULL, (gint)threads, TRUE, NULL))) {
+        fprintf(stderr, "failed to create thread pool\n");
+        return 0;
+    }
+
+    for (guint i = 0; i < this->paths->len; i++) {
+        g_thread_pool_push(pool, g_ptr_array_index(this->paths, i), NULL);
+    }
+
+    /* waits for all files to be loaded */
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    return g_get_monotonic_time() - start;
+}
+
+void bench_pool_load(gpointer path, UNUSED gpointer data)
+{
+    track_free(track_new(NULL, NULL, path, ANALYSIS_STANDARD, NULL));
+}
+
+int bench_rss_reset(void)
+{
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    int status;
+
+    if (!file) return -1;
+    status = fputs("5", file) < 0 ? -1 : 0;
+    if (fclose(file) != 0) status = -1;
+    return status;
+}
+
+long bench_rss(const char* field)
+{
+    char line[256];
+    const size_t len = strlen(field);
+    long value = -1;
+    FILE* file = fopen("/proc/self/status", "r");
+
+    if (!file) return -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            value = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+void bench_warm(const char* path)
+{
+    char buffer[64 * 1024];
+    FILE* file = fopen(path, "rb");
+
+    if (!file) return;
+    while (fread(buffer, 1, sizeof(buffer), file) == sizeof(buffer));
+    fclose(file);
+}
+
+void bench_print(FILE* out, GPtrArray* groups, guint threads)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"version\": \"%s\",\n", VERSION);
+    fprintf(out, "  \"threads\": %u,\n", threads);
+    fprintf(out, "  \"kernel\": \"%s\",\n", r128_isa_name(r128_get_isa()));
+    fprintf(out, "  \"rss_reset\": %s,\n", bench_rss_reset() == 0 ? "true" : "false");
+    fprintf(out, "  \"results\": [");
+
+    for (guint g = 0; g < groups->len; g++) {
+        BenchGroup* group = g_ptr_array_index(groups, g);
+        const AnalysisStats* stats = &group->stats;
+
+        fprintf(out, "%s\n    {\"format\": \"%s\", \"sample_rate\": %u, "
+                "\"channels\": %u, \"files\": %u, \"failed\": %u, "
+                "\"seconds\": %.3f, \"megabytes\": %.3f,\n",
+                g ? "," : "", group->format, group->sample_rate,
+                group->channels, group->paths->len, group->failed,
+                group->seconds, (double)group->bytes / 1e6);
+
+        fprintf(out, "     \"stages_ms\": {\"open\": %.3f, \"probe\": %.3f, "
+                "\"decode\": %.3f, \"loudness\": %.3f, \"true_peak\": %.3f, "
+                "\"windows\": %.3f, \"waveform\": %.3f}, "
+                "\"mapped_frames\": %" G_GUINT64_FORMAT ",\n",
+                (double)stats->open / 1000.0,
+                (double)stats->probe / 1000.0,
+                (double)stats->decode / 1000.0,
+                (double)stats->loudness / 1000.0,
+                (double)group->peak / 1000.0,
+                (double)stats->windows / 1000.0,
+                (double)stats->waveform / 1000.0,
+                stats->mapped);
+
+        fprintf(out, "     \"session_1000_tracks_mb\": {\"waveform\": %.3f, "
+                "\"unquantized\": %.3f},\n",
+                group->session, group->unquantized_session);
+
+        fprintf(out, "     \"sequential\": ");
+        bench_print_run(out, group, group->sequential);
+        fprintf(out, ", \"peak_rss_kb\": %ld", group->rss);
+        fprintf(out, ",\n     \"pool\": ");
+        bench_print_run(out, group, group->pool);
+        fprintf(out, ",\n     \"quick\": ");
+        bench_print_run(out, group, group->quick);
+        fprintf(out, ",\n     \"full\": ");
+        bench_print_run(out, group, group->full);
+        fprintf(out, ", \"full_peak_rss_kb\": %ld", group->full_rss);
+
+        /* every gating block and window kept, the lufs difference is the
+         * resolution of the histograms
+         */
+
+        fprintf(out, ",\n     \"exact\": ");
+        bench_print_run(out, group, group->exact);
+        fprintf(out, ", \"exact_peak_rss_kb\": %ld, \"exact_lufs_error\": %g",
+                group->exact_rss, group->exact_error);
+
+        /* wav and aiff through the decoder, the same for other formats */
+
+        fprintf(out, ",\n     \"decoded\": ");
+        bench_print_run(out, group, group->decoded);
+        fprintf(out, ", \"decoded_stages_ms\": {\"decode\": %.3f, "
+                "\"loudness\": %.3f}, \"decoded_lufs_error\": %g",
+                (double)group->decoded_stats.decode / 1000.0,
+                (double)group->decoded_stats.loudness / 1000.0,
+                group->decoded_error);
+
+        /* same analysis on doubles, the differences should be 0 */
+
+        fprintf(out, ",\n     \"double\": ");
+        bench_print_run(out, group, group->reference);
+        fprintf(out, ",\n     \"double_stages_ms\": {\"decode\": %.3f, "
+                "\"loudness\": %.3f}, \"lufs_error\": %g, \"peak_error\": %g",
+                (double)group->reference_stats.decode / 1000.0,
+                (double)group->reference_stats.loudness / 1000.0,
+                group->lufs_error, group->peak_error);
+
+        /* the kernel without simd and libebur128, the differences should be
+         * rounding only
+         */
+
+        fprintf(out, ",\n     \"scalar\": ");
+        bench_print_run(out, group, group->scalar);
+        fprintf(out, ", \"scalar_loudness_ms\": %.3f, \"scalar_lufs_error\": %g",
+                (double)group->scalar_stats.loudness / 1000.0, group->scalar_error);
+        fprintf(out, ",\n     \"ebur128\": ");
+        bench_print_run(out, group, group->ebur128);
+        fprintf(out, ", \"ebur128_loudness_ms\": %.3f, \"ebur128_lufs_error\": %g, "
+                "\"ebur128_peak_error\": %g}",
+                (double)group->ebur128_stats.loudness / 1000.0,
+                group->ebur128_lufs_error, group->ebur128_peak_error);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void bench_print_run(FILE* out, BenchGroup* this, gint64 wall)
+{
+    const double seconds = (double)wall / G_USEC_PER_SEC;
+
+    fprintf(out, "{\"wall_ms\": %.3f, \"realtime\": %.1f, \"mb_per_s\": %.3f}",
+            (double)wall / 1000.0,
+            seconds > 0.0 ? this->seconds / seconds : 0.0,
+            seconds > 0.0 ? (double)this->bytes / 1e6 / seconds : 0.0);
+}
+
+gint bench_compare_group(gconstpointer a, gconstpointer b)
+{
+    const BenchGroup* x = *(BenchGroup* const*)a;
+    const BenchGroup* y = *(BenchGroup* const*)b;
+    int cmp;
+
+    if ((cmp = strcmp(x->format, y->format)) != 0) return cmp;
+    if (x->sample_rate != y->sample_rate) return x->sample_rate < y->sample_rate ? -1 : 1;
+    if (x->channels != y->channels) return x->channels < y->channels ? -1 : 1;
+    return 0;
+}
+
+void bench_group_free(gpointer data)
+{
+    BenchGroup* group = data;
+
+    g_ptr_array_free(group->paths, TRUE);
+    g_free(group->format);
+    g_free(group);
+}
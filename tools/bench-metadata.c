@@ -0,0 +1,202 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        bench-metadata.c
+ * @brief       memory benchmark of the strings of tracks
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ *
+ * probes every file of a corpus into one arena, like a tracklist does, and
+ * writes the memory the strings take as json
+ *
+ * the strings used to be allocated one by one, 8 bytes per character and
+ * a sample rate string per track, that is reported as legacy_bytes
+ * every track is then removed and imported again, like a tracklist that is
+ * cleared and filled with the same files, and the arena is compacted
+ *
+ * usage: alphabet-bench-metadata [-o output.json] files|directories...
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/track.h"
+
+/**
+ * BenchMetadata
+ *
+ * memory taken by the strings of the corpus
+ */
+typedef struct BenchMetadata {
+    guint tracks;               /**< tracks of the corpus */
+    gsize strings;              /**< strings inserted by the import */
+    gsize requested;            /**< bytes inserted by the import */
+    gsize stored;               /**< bytes stored after the import */
+    gsize legacy;               /**< bytes of the old allocations */
+    gsize reimported;           /**< bytes stored after importing again */
+    gsize released;             /**< bytes of the removed tracks then */
+    gsize compacted;            /**< bytes stored after compaction */
+} BenchMetadata;
+
+/**
+ * strings of all tracks of the corpus
+ */
+static TrackArena* arena;
+
+/**
+ * Add a file or all files of a directory (recursive) to the corpus
+ *
+ * @param tracks Track* array
+ * @param path file or directory
+ */
+static void bench_add_path(GPtrArray* tracks, const char* path);
+
+/**
+ * Measure the strings of the corpus, imported, imported again and compacted
+ *
+ * @param tracks Track* array, the tracks are replaced by the second import
+ * @param this destination of the measurements
+ */
+static void bench_measure(GPtrArray* tracks, BenchMetadata* this);
+
+/**
+ * Write the results as json
+ *
+ * @param out the output file
+ * @param this the measurements
+ */
+static void bench_print(FILE* out, const BenchMetadata* this);
+
+
+/*******************************************************************************
+ * main
+ */
+
+
+int main(int argc, char** argv)
+{
+    GPtrArray* tracks = g_ptr_array_new_with_free_func((GDestroyNotify)track_free);
+    BenchMetadata metadata = { 0 };
+    const char* output = "bench-metadata.json";
+    FILE* out;
+    int i = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+        i = 3;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-o output.json] files|directories...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!(arena = track_arena_new())) return EXIT_FAILURE;
+
+    for (; i < argc; i++) bench_add_path(tracks, argv[i]);
+    fprintf(stderr, "%u files\n", tracks->len);
+
+    bench_measure(tracks, &metadata);
+
+    if (!(out = fopen(output, "w"))) {
+        fprintf(stderr, "failed to open \"%s\"\n", output);
+        return EXIT_FAILURE;
+    }
+    bench_print(out, &metadata);
+    fclose(out);
+
+    /* no track is left that points into the arena */
+
+    g_ptr_array_free(tracks, TRUE);
+    track_arena_free(arena);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void bench_add_path(GPtrArray* tracks, const char* path)
+{
+    const char* ext;
+    Track* track;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        GDir* dir = g_dir_open(path, 0, NULL);
+        const gchar* entry;
+
+        if (!dir) return;
+        while ((entry = g_dir_read_name(dir))) {
+            gchar* child = g_build_filename(path, entry, NULL);
+            bench_add_path(tracks, child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        return;
+    }
+
+    if (!(ext = strrchr(path, '.')) || strchr(ext, '/')) return;
+    if (strcmp(ext, ".json") == 0) return;
+    if (!(track = track_probe(arena, NULL, path))) return;
+
+    g_ptr_array_add(tracks, track);
+}
+
+void bench_measure(GPtrArray* tracks, BenchMetadata* this)
+{
+    for (guint t = 0; t < tracks->len; t++) {
+        Track* track = g_ptr_array_index(tracks, t);
+        const char* strings[] = {
+            track->path, track->name, track->artist, track->album,
+            track->date, track->format,
+        };
+
+        for (size_t s = 0; s < ELEMENTS(strings); s++) {
+            if (strings[s]) this->legacy += (strlen(strings[s]) + 1) * sizeof(char*);
+        }
+        this->legacy += 8;
+        this->tracks++;
+    }
+
+    this->strings = arena->strings;
+    this->requested = arena->requested;
+    this->stored = arena->stored;
+
+    /* a track that fails to probe again keeps its old copy */
+
+    for (guint t = 0; t < tracks->len; t++) {
+        Track* track = g_ptr_array_index(tracks, t);
+        Track* again = track_probe(arena, NULL, track->path);
+
+        if (again) {
+            tracks->pdata[t] = again;
+            track_free(track);
+        }
+    }
+
+    this->reimported = arena->stored;
+    this->released = arena->released;
+
+    track_arena_compact(arena, (Track**)tracks->pdata, tracks->len);
+    this->compacted = arena->stored;
+}
+
+void bench_print(FILE* out, const BenchMetadata* this)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"version\": \"%s\",\n", VERSION);
+    fprintf(out, "  \"tracks\": %u,\n", this->tracks);
+    fprintf(out, "  \"strings\": %zu,\n", this->strings);
+    fprintf(out, "  \"requested_bytes\": %zu,\n", this->requested);
+    fprintf(out, "  \"stored_bytes\": %zu,\n", this->stored);
+    fprintf(out, "  \"legacy_bytes\": %zu,\n", this->legacy);
+    fprintf(out, "  \"reimported_stored_bytes\": %zu,\n", this->reimported);
+    fprintf(out, "  \"released_bytes\": %zu,\n", this->released);
+    fprintf(out, "  \"compacted_stored_bytes\": %zu\n", this->compacted);
+    fprintf(out, "}\n");
+}
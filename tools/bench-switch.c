@@ -0,0 +1,519 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        bench-switch.c
+ * @brief       headless track switch latency benchmark
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ *
+ * drives the player with mpv's null audio output over a corpus of files
+ * and writes p50/p95/p99 of every measurement per file format as json
+ *
+ * usage: alphabet-bench-switch [-o output.json] files|directories...
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <mpv/client.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/player.h"
+#include "../include/track.h"
+
+/**
+ * number of switches, gotos and loops measured per format
+ */
+#define BENCH_ROUNDS 20
+
+/**
+ * a measurement fails when it takes longer than this (msec)
+ */
+#define BENCH_TIMEOUT 5000
+
+/**
+ * length of the measured loop in seconds
+ */
+#define BENCH_LOOP_LENGTH 1.0
+
+/**
+ * number of loop wraparounds measured per round
+ */
+#define BENCH_WRAPS 3
+
+typedef enum BenchMetric {
+    BENCH_SWITCH,       /**< player_load_track to first time-pos */
+    BENCH_GOTO,         /**< player_goto to playback restart */
+    BENCH_LOOP,         /**< gap at loop wraparound */
+    BENCH_METRICS,
+} BenchMetric;
+
+static const char* const bench_metric_names[BENCH_METRICS] = {
+    "switch",
+    "goto",
+    "loop",
+};
+
+/**
+ * BenchFormat
+ *
+ * the files and measurements of one file format (extension)
+ */
+typedef struct BenchFormat {
+    gchar* name;                        /**< lowercase extension */
+    GPtrArray* tracks;                  /**< Track* of the corpus */
+    GArray* samples[BENCH_METRICS];     /**< latencies in usec (double) */
+    guint failed[BENCH_METRICS];        /**< measurements that timed out */
+} BenchFormat;
+
+/**
+ * Condition to wait for
+ *
+ * @param since time the measurement started
+ * @return TRUE when met
+ */
+typedef int (*BenchDone)(gint64 since);
+
+static Player* player;
+
+/**
+ * Add a file or all files of a directory (recursive) to the corpus
+ *
+ * @param formats BenchFormat* array
+ * @param path file or directory
+ */
+static void bench_add_path(GPtrArray* formats, const char* path);
+
+/**
+ * Get the format of an extension, created if needed
+ *
+ * @param formats BenchFormat* array
+ * @param name lowercase extension
+ * @return the format
+ */
+static BenchFormat* bench_format_get(GPtrArray* formats, const char* name);
+
+/**
+ * Run all rounds on the files of a format
+ */
+static void bench_format_run(BenchFormat* format);
+
+/**
+ * Measure the loop wraparound at the current position
+ */
+static void bench_loop(BenchFormat* format);
+
+/**
+ * Add a measurement
+ *
+ * @param format the format
+ * @param metric the measurement
+ * @param usec latency or < 0 when it failed
+ */
+static void bench_sample(BenchFormat* format, BenchMetric metric, gint64 usec);
+
+/**
+ * Handle main loop events until a condition is met
+ *
+ * @param done the condition
+ * @param since time the measurement started
+ * @return TRUE when met, FALSE when timed out
+ */
+static int bench_wait(BenchDone done, gint64 since);
+
+static int bench_playing(gint64 since);
+
+static int bench_restarted(gint64 since);
+
+static int bench_switched(gint64 since);
+
+static int bench_time_pos(gint64 since);
+
+static int bench_elapsed(gint64 since);
+
+/**
+ * Timeout callback of bench_wait
+ */
+static gboolean bench_expire(gpointer data);
+
+/**
+ * Player event callback, called from an mpv thread
+ */
+static void bench_wakeup(void* data);
+
+/**
+ * Idle callback that drains the player events
+ */
+static gboolean bench_event(gpointer data);
+
+/**
+ * Percentile of sorted samples (nearest rank)
+ *
+ * @param samples sorted latencies
+ * @param p percentile (0-100)
+ * @return the latency or 0 when empty
+ */
+static double bench_percentile(GArray* samples, double p);
+
+/**
+ * Write the results as json
+ *
+ * @param out the output file
+ * @param formats BenchFormat* array
+ */
+static void bench_print(FILE* out, GPtrArray* formats);
+
+static gint bench_compare_double(gconstpointer a, gconstpointer b);
+
+static gint bench_compare_format(gconstpointer a, gconstpointer b);
+
+static void bench_format_free(gpointer data);
+
+
+/*******************************************************************************
+ * main
+ */
+
+
+int main(int argc, char** argv)
+{
+    GPtrArray* formats = g_ptr_array_new_with_free_func(bench_format_free);
+    const char* output = "bench-switch.json";
+    FILE* out;
+    int i = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+        i = 3;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-o output.json] files|directories...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (; i < argc; i++) bench_add_path(formats, argv[i]);
+    g_ptr_array_sort(formats, bench_compare_format);
+
+    if (!(player = player_init())) return EXIT_FAILURE;
+
+    if (player_set_option(player, "ao", "null") != 0) {
+        fprintf(stderr, "the benchmark needs mpv, not the engine\n");
+        return EXIT_FAILURE;
+    }
+    player_set_event_callback(player, bench_wakeup);
+
+    for (guint f = 0; f < formats->len; f++) {
+        BenchFormat* format = g_ptr_array_index(formats, f);
+        fprintf(stderr, "%s: %u files\n", format->name, format->tracks->len);
+        bench_format_run(format);
+    }
+
+    /* the tracks are owned by the corpus */
+
+    player_stop(player);
+    player->current = NULL;
+
+    if (!(out = fopen(output, "w"))) {
+        fprintf(stderr, "failed to open \"%s\"\n", output);
+        return EXIT_FAILURE;
+    }
+    bench_print(out, formats);
+    fclose(out);
+
+    player_free(player);
+    g_ptr_array_free(formats, TRUE);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void bench_add_path(GPtrArray* formats, const char* path)
+{
+    const char* ext;
+    gchar* name;
+    Track* track;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        GDir* dir = g_dir_open(path, 0, NULL);
+        const gchar* entry;
+
+        if (!dir) return;
+        while ((entry = g_dir_read_name(dir))) {
+            gchar* child = g_build_filename(path, entry, NULL);
+            bench_add_path(formats, child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        return;
+    }
+
+    if (!(ext = strrchr(path, '.')) || strchr(ext, '/')) return;
+    if (strcmp(ext, ".json") == 0) return;
+    if (!(track = track_probe(NULL, NULL, path))) return;
+
+    name = g_ascii_strdown(ext + 1, -1);
+    g_ptr_array_add(bench_format_get(formats, name)->tracks, track);
+    g_free(name);
+}
+
+BenchFormat* bench_format_get(GPtrArray* formats, const char* name)
+{
+    BenchFormat* format;
+
+    for (guint i = 0; i < formats->len; i++) {
+        format = g_ptr_array_index(formats, i);
+        if (strcmp(format->name, name) == 0) return format;
+    }
+
+    format = g_new0(BenchFormat, 1);
+    format->name = g_strdup(name);
+    format->tracks = g_ptr_array_new_with_free_func((GDestroyNotify)track_free);
+    for (guint m = 0; m < BENCH_METRICS; m++) {
+        format->samples[m] = g_array_new(FALSE, FALSE, sizeof(double));
+    }
+    g_ptr_array_add(formats, format);
+
+    return format;
+}
+
+void bench_format_run(BenchFormat* format)
+{
+    const guint n = format->tracks->len;
+    gint64 start;
+
+    /* switches continue at the playing position, the player must be
+     * playing before the first one
+     */
+
+    start = g_get_monotonic_time();
+    player_load_track(player, g_ptr_array_index(format->tracks, 0));
+    if (!bench_wait(bench_restarted, start) || !bench_wait(bench_playing, start)) {
+        fprintf(stderr, "%s: failed to start playing\n", format->name);
+        return;
+    }
+
+    for (guint round = 0; round < BENCH_ROUNDS; round++) {
+        Track* track = g_ptr_array_index(format->tracks, (round + 1) % n);
+        double position = 0.0;
+
+        start = g_get_monotonic_time();
+        player_load_track(player, track);
+        bench_sample(format, BENCH_SWITCH, bench_wait(bench_switched, start)
+                ? player->stats.time_pos_time - start : -1);
+
+        /* leave room for the loop after the goto position */
+
+        if (track->length > 2 * BENCH_LOOP_LENGTH + 1.0) {
+            position = g_random_double_range(0.0, track->length - 2 * BENCH_LOOP_LENGTH - 1.0);
+        }
+
+        start = g_get_monotonic_time();
+        player_goto(player, position);
+        bench_sample(format, BENCH_GOTO, bench_wait(bench_restarted, start)
+                ? player->stats.restart_time - start : -1);
+
+        bench_loop(format);
+    }
+}
+
+void bench_loop(BenchFormat* format)
+{
+    double a, b, p1;
+    gint64 t1;
+    guint wraps = 0;
+
+    /* mark A, play for the loop length and mark B */
+
+    player_loop(player);
+    bench_wait(bench_elapsed, g_get_monotonic_time()
+            + (gint64)(BENCH_LOOP_LENGTH * G_USEC_PER_SEC));
+    player_loop(player);
+
+    /* the loop points mpv uses, not the position model */
+
+    if (mpv_get_property(player->mpv, "ab-loop-a", MPV_FORMAT_DOUBLE, &a) < 0
+            || mpv_get_property(player->mpv, "ab-loop-b", MPV_FORMAT_DOUBLE, &b) < 0)
+    {
+        bench_sample(format, BENCH_LOOP, -1);
+        player_loop(player);
+        return;
+    }
+
+    p1 = player->stats.time_pos;
+    t1 = player->stats.time_pos_time;
+
+    while (wraps < BENCH_WRAPS) {
+        double p2;
+        gint64 t2;
+
+        if (!bench_wait(bench_time_pos, t1)) {
+            bench_sample(format, BENCH_LOOP, -1);
+            break;
+        }
+        p2 = player->stats.time_pos;
+        t2 = player->stats.time_pos_time;
+
+        /* B is due at the time extrapolated from the last position before
+         * the wrap, A is heard at the time extrapolated back from the first
+         * position after it
+         */
+
+        if (p2 < p1) {
+            gint64 due = t1 + (gint64)((b - p1) / player->speed * G_USEC_PER_SEC);
+            gint64 heard = t2 - (gint64)((p2 - a) / player->speed * G_USEC_PER_SEC);
+            bench_sample(format, BENCH_LOOP, MAX(heard - due, 0));
+            wraps++;
+        }
+        p1 = p2;
+        t1 = t2;
+    }
+
+    player_loop(player);
+}
+
+void bench_sample(BenchFormat* format, BenchMetric metric, gint64 usec)
+{
+    double value = (double)usec;
+
+    if (usec < 0) {
+        format->failed[metric]++;
+        return;
+    }
+    g_array_append_val(format->samples[metric], value);
+}
+
+int bench_wait(BenchDone done, gint64 since)
+{
+    int expired = FALSE;
+    int status;
+    guint timer = g_timeout_add(BENCH_TIMEOUT, bench_expire, &expired);
+
+    while (!done(since) && !expired) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    status = done(since);
+    if (!expired) g_source_remove(timer);
+
+    return status;
+}
+
+int bench_playing(UNUSED gint64 since)
+{
+    return player->play_state == PLAY_STATE_PLAY;
+}
+
+int bench_restarted(gint64 since)
+{
+    return player->stats.restart_time >= since;
+}
+
+int bench_switched(gint64 since)
+{
+    return player->stats.restart_time >= since
+        && player->stats.time_pos_time > player->stats.restart_time;
+}
+
+int bench_time_pos(gint64 since)
+{
+    return player->stats.time_pos_time > since;
+}
+
+int bench_elapsed(gint64 since)
+{
+    return g_get_monotonic_time() >= since;
+}
+
+gboolean bench_expire(gpointer data)
+{
+    *(int*)data = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+void bench_wakeup(void* data)
+{
+    g_idle_add(bench_event, data);
+}
+
+gboolean bench_event(gpointer data)
+{
+    player_event_handler(data);
+    return G_SOURCE_REMOVE;
+}
+
+double bench_percentile(GArray* samples, double p)
+{
+    size_t rank;
+
+    if (!samples->len) return 0.0;
+
+    rank = (size_t)ceil(p / 100.0 * samples->len);
+    rank = CLAMP(rank, 1, samples->len);
+
+    return g_array_index(samples, double, rank - 1);
+}
+
+void bench_print(FILE* out, GPtrArray* formats)
+{
+    int first = TRUE;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"version\": \"%s\",\n", VERSION);
+    fprintf(out, "  \"rounds\": %d,\n", BENCH_ROUNDS);
+    fprintf(out, "  \"results\": [");
+
+    for (guint f = 0; f < formats->len; f++) {
+        BenchFormat* format = g_ptr_array_index(formats, f);
+
+        for (guint m = 0; m < BENCH_METRICS; m++) {
+            GArray* samples = format->samples[m];
+
+            g_array_sort(samples, bench_compare_double);
+
+            fprintf(out, "%s\n    {\"format\": \"%s\", \"metric\": \"%s\", "
+                    "\"count\": %u, \"failed\": %u, "
+                    "\"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f}",
+                    first ? "" : ",", format->name, bench_metric_names[m],
+                    samples->len, format->failed[m],
+                    bench_percentile(samples, 50.0) / 1000.0,
+                    bench_percentile(samples, 95.0) / 1000.0,
+                    bench_percentile(samples, 99.0) / 1000.0);
+            first = FALSE;
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
+
+gint bench_compare_double(gconstpointer a, gconstpointer b)
+{
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+gint bench_compare_format(gconstpointer a, gconstpointer b)
+{
+    const BenchFormat* x = *(BenchFormat* const*)a;
+    const BenchFormat* y = *(BenchFormat* const*)b;
+    return strcmp(x->name, y->name);
+}
+
+void bench_format_free(gpointer data)
+{
+    BenchFormat* format = data;
+
+    for (guint m = 0; m < BENCH_METRICS; m++) {
+        g_array_free(format->samples[m], TRUE);
+    }
+    g_ptr_array_free(format->tracks, TRUE);
+    g_free(format->name);
+    g_free(format);
+}
@@ -0,0 +1,752 @@
+/**
+ * @author      Arno Lievens (arnolievens@gmail.com)
+ * @date        08/09/2021
+ * @file        corpus.c
+ * @brief       synthetic audio corpus generator
+ * @copyright   Copyright (c) 2021 Arno Lievens
+ *
+ * writes deterministic test files in every format of DESKTOP_MIME that has
+ * an encoder, over a range of sample rates, channel counts, lengths and
+ * contents, and a manifest.json with the values each file should measure
+ *
+ * lufs and peaks in the manifest are measured on the generated signal before
+ * it's encoded, lossy formats will be off by the coding error and shifted by
+ * their encoder delay
+ *
+ * usage: alphabet-corpus [-s] directory
+ *      -s  skip files longer than CORPUS_SHORT seconds
+ */
+
+#include <ebur128.h>
+#include <errno.h>
+#include <glib.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+
+/**
+ * frames per encoded frame for encoders that take any size
+ */
+#define CORPUS_BLOCK 4096
+
+/**
+ * longest file written with -s in seconds
+ */
+#define CORPUS_SHORT 60.0
+
+/**
+ * frequency of the tones, not a divisor of any sample rate so all sample
+ * values are hit
+ */
+#define CORPUS_TONE_HZ 997.0
+
+/**
+ * libavcodec 61.13 replaced AVCodec.sample_fmts by avcodec_get_supported_config
+ */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+#define CORPUS_SUPPORTED_CONFIG
+#endif
+
+/**
+ * libavutil 57.24 replaced the channels members by ch_layout
+ */
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+#define CORPUS_CH_LAYOUT
+#endif
+
+/**
+ * Convert count interleaved doubles to frame data of type T
+ */
+#define CORPUS_CONVERT(T, expr)                                                \
+    for (size_t i = 0; i < count; i++) {                                       \
+        for (unsigned int c = 0; c < channels; c++) {                          \
+            const double x = src[i*channels + c];                              \
+            if (planar) ((T*)(void*)data[c])[i] = (expr);                      \
+            else ((T*)(void*)data[0])[i*channels + c] = (expr);                \
+        }                                                                      \
+    }
+
+typedef enum CorpusContent {
+    CORPUS_TONE,            /**< CORPUS_TONE_HZ sine on all channels */
+    CORPUS_SILENCE,         /**< digital silence */
+    CORPUS_GATED,           /**< tone between silence, same lufs as tone */
+    CORPUS_CLIPPED,         /**< tone over full scale, clipped */
+    CORPUS_NOISE,           /**< noise with a slow envelope, per channel */
+} CorpusContent;
+
+static const char* const corpus_content_names[] = {
+    "tone", "silence", "gated", "clipped", "noise",
+};
+
+/**
+ * CorpusFormat
+ *
+ * container, by file extension, and the codec it's written with
+ */
+typedef struct CorpusFormat {
+    const char* ext;        /**< file extension, also selects the muxer */
+    enum AVCodecID codec;   /**< codec of the audio stream */
+    const char* encoder;    /**< preferred encoder or NULL for the default */
+} CorpusFormat;
+
+static const CorpusFormat corpus_formats[] = {
+    { "wav",    AV_CODEC_ID_PCM_S24LE,  NULL },
+    { "aiff",   AV_CODEC_ID_PCM_S24BE,  NULL },
+    { "flac",   AV_CODEC_ID_FLAC,       NULL },
+    { "ogg",    AV_CODEC_ID_VORBIS,     "libvorbis" },
+    { "m4a",    AV_CODEC_ID_AAC,        NULL },
+};
+
+static const unsigned int corpus_rates[] = { 44100, 48000, 96000, 192000 };
+
+static const unsigned int corpus_channels[] = { 1, 6, 8 };
+
+static const double corpus_offsets[] = { 0.25, 1.5 };
+
+static const double corpus_lengths[] = { 60.0, 600.0, 3600.0 };
+
+/**
+ * CorpusFile
+ *
+ * description of one generated file
+ */
+typedef struct CorpusFile {
+    const CorpusFormat* format;
+    unsigned int sample_rate;
+    unsigned int channels;
+    double seconds;         /**< length */
+    CorpusContent content;
+    double level;           /**< peak level of the content in dBFS */
+    double offset;          /**< content starts after offset seconds */
+} CorpusFile;
+
+/**
+ * Corpus
+ *
+ * output directory and manifest
+ */
+typedef struct Corpus {
+    const char* dir;        /**< output directory */
+    FILE* manifest;         /**< manifest.json in dir */
+    double max_seconds;     /**< longer files are skipped */
+    guint written;          /**< files written */
+    guint failed;           /**< files that could not be written */
+} Corpus;
+
+/**
+ * Write a file and add it to the manifest
+ *
+ * @param this the corpus
+ * @param file the file to write
+ */
+static void corpus_add(Corpus* this, const CorpusFile* file);
+
+/**
+ * Encode a file
+ *
+ * the generated signal is measured while it's written
+ *
+ * @param this the file
+ * @param path destination
+ * @param st ebur128 state the signal is added to
+ * @return 0 on success or -1 when failed
+ */
+static int corpus_write(const CorpusFile* this, const char* path, ebur128_state* st);
+
+/**
+ * Send a frame to the encoder and mux the packets it returns
+ *
+ * @param format the muxer
+ * @param codec the encoder
+ * @param stream the audio stream
+ * @param frame the frame or NULL to flush the encoder
+ * @param packet packet to receive into
+ * @return 0 on success or -1 when failed
+ */
+static int corpus_encode(AVFormatContext* format, AVCodecContext* codec,
+AVStream* stream, const AVFrame* frame, AVPacket* packet);
+
+/**
+ * Generate frames
+ *
+ * the signal only depends on the frame index, so any block size gives the
+ * same file
+ *
+ * @param this the file
+ * @param dest destination, must hold count * channels doubles
+ * @param pos index of the first frame
+ * @param count number of frames
+ */
+static void corpus_render(const CorpusFile* this, double* dest, uint64_t pos,
+size_t count);
+
+/**
+ * Convert interleaved doubles to the sample format of a frame
+ *
+ * @param frame the frame, format and data set
+ * @param src interleaved doubles
+ * @param count number of frames
+ * @param channels number of channels
+ */
+static void corpus_convert(AVFrame* frame, const double* src, size_t count,
+unsigned int channels);
+
+/**
+ * Pick a sample format of the encoder that corpus_convert supports
+ *
+ * 32 bit integer is preferred, it's written as 24 bit by pcm and flac
+ *
+ * @param encoder the encoder
+ * @return the sample format or AV_SAMPLE_FMT_NONE
+ */
+static enum AVSampleFormat corpus_sample_format(const AVCodec* encoder);
+
+/**
+ * @return file name of a file without directory
+ */
+static gchar* corpus_name(const CorpusFile* this, double offset);
+
+/**
+ * Uniform noise in [-1, 1) for a frame and channel
+ */
+static double corpus_noise(uint64_t frame, unsigned int channel);
+
+/**
+ * Write a dB value to json, null when not finite (eg lufs of silence)
+ */
+static void corpus_print_db(FILE* out, const char* key, double db);
+
+/**
+ * Print libav error
+ *
+ * @param msg message to be included in error
+ * @param path the file that caused the error
+ * @param status libav status code
+ */
+static void corpus_print_status(const char* msg, const char* path, int status);
+
+
+/*******************************************************************************
+ * main
+ */
+
+
+int main(int argc, char** argv)
+{
+    Corpus corpus = { .max_seconds = HUGE_VAL };
+    gchar* path;
+    int i = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        corpus.max_seconds = CORPUS_SHORT;
+        i++;
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: %s [-s] directory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    corpus.dir = argv[i];
+
+    if (g_mkdir_with_parents(corpus.dir, 0755) != 0) {
+        fprintf(stderr, "failed to create \"%s\"\n", corpus.dir);
+        return EXIT_FAILURE;
+    }
+
+    path = g_build_filename(corpus.dir, "manifest.json", NULL);
+    if (!(corpus.manifest = fopen(path, "w"))) {
+        fprintf(stderr, "failed to open \"%s\"\n", path);
+        g_free(path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(corpus.manifest, "{\n");
+    fprintf(corpus.manifest, "  \"version\": \"%s\",\n", VERSION);
+    fprintf(corpus.manifest, "  \"files\": [");
+
+    for (size_t f = 0; f < G_N_ELEMENTS(corpus_formats); f++) {
+        CorpusFile file = {
+            .format = &corpus_formats[f],
+            .sample_rate = 48000,
+            .channels = 2,
+            .seconds = 10.0,
+            .level = -18.0,
+        };
+
+        /* a -18 dBFS tone is -18 lufs in stereo */
+
+        for (size_t r = 0; r < G_N_ELEMENTS(corpus_rates); r++) {
+            file.sample_rate = corpus_rates[r];
+            corpus_add(&corpus, &file);
+        }
+        file.sample_rate = 48000;
+
+        for (size_t c = 0; c < G_N_ELEMENTS(corpus_channels); c++) {
+            file.channels = corpus_channels[c];
+            corpus_add(&corpus, &file);
+        }
+        file.channels = 2;
+
+        file.content = CORPUS_SILENCE;
+        corpus_add(&corpus, &file);
+        file.content = CORPUS_GATED;
+        corpus_add(&corpus, &file);
+        file.content = CORPUS_CLIPPED;
+        file.level = 6.0;
+        corpus_add(&corpus, &file);
+
+        /* shifted copies of the same noise for alignment */
+
+        file.content = CORPUS_NOISE;
+        file.level = -12.0;
+        file.seconds = 30.0;
+        corpus_add(&corpus, &file);
+
+        for (size_t o = 0; o < G_N_ELEMENTS(corpus_offsets); o++) {
+            file.offset = corpus_offsets[o];
+            corpus_add(&corpus, &file);
+        }
+    }
+
+    /* long files in the lossless formats that decode fastest */
+
+    for (size_t f = 0; f < 3; f += 2) {
+        for (size_t l = 0; l < G_N_ELEMENTS(corpus_lengths); l++) {
+            CorpusFile file = {
+                .format = &corpus_formats[f],
+                .sample_rate = 44100,
+                .channels = 2,
+                .seconds = corpus_lengths[l],
+                .content = CORPUS_NOISE,
+                .level = -12.0,
+            };
+            corpus_add(&corpus, &file);
+        }
+    }
+
+    fprintf(corpus.manifest, "\n  ]\n}\n");
+    fclose(corpus.manifest);
+
+    fprintf(stderr, "wrote %u files to \"%s\", %u failed\n", corpus.written,
+            corpus.dir, corpus.failed);
+    g_free(path);
+
+    return corpus.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/*******************************************************************************
+ * static functions
+ *
+ */
+
+
+void corpus_add(Corpus* this, const CorpusFile* file)
+{
+    gchar* name;
+    gchar* path;
+    ebur128_state* st;
+    double lufs = -HUGE_VAL, peak = 0.0, true_peak = 0.0;
+
+    if (file->seconds > this->max_seconds) return;
+
+    name = corpus_name(file, file->offset);
+    path = g_build_filename(this->dir, name, NULL);
+
+    if (!(st = ebur128_init(file->channels, file->sample_rate,
+                    EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK)))
+    {
+        fprintf(stderr, "ebur128 could not create ebur128_state!\n");
+        goto fail;
+    }
+
+    fprintf(stderr, "%s\n", name);
+
+    if (corpus_write(file, path, st) != 0) goto fail;
+
+    ebur128_loudness_global(st, &lufs);
+    for (unsigned int c = 0; c < file->channels; c++) {
+        double value;
+        ebur128_sample_peak(st, c, &value);
+        peak = MAX(peak, value);
+        ebur128_true_peak(st, c, &value);
+        true_peak = MAX(true_peak, value);
+    }
+
+    fprintf(this->manifest, "%s\n    {\"path\": \"%s\", \"format\": \"%s\", "
+            "\"sample_rate\": %u, \"channels\": %u, \"seconds\": %.3f, "
+            "\"content\": \"%s\", \"level\": %.1f, ",
+            this->written ? "," : "", name, file->format->ext,
+            file->sample_rate, file->channels, file->seconds,
+            corpus_content_names[file->content], file->level);
+
+    corpus_print_db(this->manifest, "lufs", lufs);
+    corpus_print_db(this->manifest, "peak", 20.0 * log10(peak));
+    corpus_print_db(this->manifest, "true_peak", 20.0 * log10(true_peak));
+
+    /* offsets are whole frames */
+
+    fprintf(this->manifest, "\"offset\": %.6f, ",
+            round(file->offset * file->sample_rate) / file->sample_rate);
+
+    if (file->offset > 0.0) {
+        gchar* reference = corpus_name(file, 0.0);
+        fprintf(this->manifest, "\"reference\": \"%s\"}", reference);
+        g_free(reference);
+    } else {
+        fprintf(this->manifest, "\"reference\": null}");
+    }
+
+    this->written++;
+    ebur128_destroy(&st);
+    g_free(path);
+    g_free(name);
+    return;
+
+fail:
+    fprintf(stderr, "skipped \"%s\"\n", path);
+    this->failed++;
+    if (st) ebur128_destroy(&st);
+    g_free(path);
+    g_free(name);
+}
+
+int corpus_write(const CorpusFile* this, const char* path, ebur128_state* st)
+{
+    AVFormatContext* format = NULL;
+    AVCodecContext* codec = NULL;
+    AVStream* stream;
+    AVFrame* frame = NULL;
+    AVPacket* packet = NULL;
+    const AVCodec* encoder = NULL;
+    double* buffer = NULL;
+    const uint64_t total = (uint64_t)(this->seconds * this->sample_rate + 0.5);
+    size_t frame_size;
+    int status, result = -1;
+
+    if ((status = avformat_alloc_output_context2(&format, NULL, NULL, path)) < 0) {
+        corpus_print_status("no muxer for file", path, status);
+        return -1;
+    }
+
+    if (this->format->encoder) {
+        encoder = avcodec_find_encoder_by_name(this->format->encoder);
+    }
+    if (!encoder && !(encoder = avcodec_find_encoder(this->format->codec))) {
+        fprintf(stderr, "no encoder for file \"%s\"\n", path);
+        goto fail;
+    }
+
+    if (!(codec = avcodec_alloc_context3(encoder))
+            || !(packet = av_packet_alloc())
+            || !(frame = av_frame_alloc()))
+    {
+        fprintf(stderr, "failed to allocate encoder\n");
+        goto fail;
+    }
+
+    if ((codec->sample_fmt = corpus_sample_format(encoder)) == AV_SAMPLE_FMT_NONE) {
+        fprintf(stderr, "no supported sample format for file \"%s\"\n", path);
+        goto fail;
+    }
+    if (av_get_packed_sample_fmt(codec->sample_fmt) == AV_SAMPLE_FMT_S32) {
+        codec->bits_per_raw_sample = 24;
+    }
+
+    codec->sample_rate = (int)this->sample_rate;
+    codec->time_base = (AVRational){ 1, (int)this->sample_rate };
+#ifdef CORPUS_CH_LAYOUT
+    av_channel_layout_default(&codec->ch_layout, (int)this->channels);
+#else
+    codec->channels = (int)this->channels;
+    codec->channel_layout = (uint64_t)av_get_default_channel_layout((int)this->channels);
+#endif
+
+    /* the native vorbis encoder is used when libvorbis is missing */
+
+    codec->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    if (format->oformat->flags & AVFMT_GLOBALHEADER) {
+        codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if ((status = avcodec_open2(codec, encoder, NULL)) < 0) {
+        corpus_print_status("failed to open encoder", path, status);
+        goto fail;
+    }
+
+    if (!(stream = avformat_new_stream(format, NULL))) {
+        fprintf(stderr, "failed to allocate stream\n");
+        goto fail;
+    }
+    stream->time_base = codec->time_base;
+
+    if ((status = avcodec_parameters_from_context(stream->codecpar, codec)) < 0) {
+        corpus_print_status("failed to set stream parameters", path, status);
+        goto fail;
+    }
+
+    if (!(format->oformat->flags & AVFMT_NOFILE)
+            && (status = avio_open(&format->pb, path, AVIO_FLAG_WRITE)) < 0)
+    {
+        corpus_print_status("failed to open file", path, status);
+        goto fail;
+    }
+
+    if ((status = avformat_write_header(format, NULL)) < 0) {
+        corpus_print_status("failed to write header", path, status);
+        goto fail;
+    }
+
+    /* lossy encoders take a fixed number of frames, but the last */
+
+    frame_size = codec->frame_size > 0
+        && !(encoder->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+        ? (size_t)codec->frame_size : CORPUS_BLOCK;
+
+    frame->nb_samples = (int)frame_size;
+    frame->format = codec->sample_fmt;
+    frame->sample_rate = codec->sample_rate;
+#ifdef CORPUS_CH_LAYOUT
+    av_channel_layout_copy(&frame->ch_layout, &codec->ch_layout);
+#else
+    frame->channels = codec->channels;
+    frame->channel_layout = codec->channel_layout;
+#endif
+
+    if ((status = av_frame_get_buffer(frame, 0)) < 0) {
+        corpus_print_status("failed to allocate frame", path, status);
+        goto fail;
+    }
+
+    if (!(buffer = malloc(frame_size * this->channels * sizeof(double)))) {
+        fprintf(stderr, "failed to allocate buffer\n");
+        goto fail;
+    }
+
+    for (uint64_t pos = 0; pos < total; pos += frame_size) {
+        const size_t count = (size_t)MIN(frame_size, total - pos);
+
+        corpus_render(this, buffer, pos, count);
+        ebur128_add_frames_double(st, buffer, count);
+
+        if ((status = av_frame_make_writable(frame)) < 0) {
+            corpus_print_status("failed to write frame", path, status);
+            goto fail;
+        }
+        frame->nb_samples = (int)count;
+        frame->pts = (int64_t)pos;
+        corpus_convert(frame, buffer, count, this->channels);
+
+        if (corpus_encode(format, codec, stream, frame, packet) != 0) goto fail;
+    }
+
+    if (corpus_encode(format, codec, stream, NULL, packet) != 0) goto fail;
+
+    if ((status = av_write_trailer(format)) < 0) {
+        corpus_print_status("failed to write trailer", path, status);
+        goto fail;
+    }
+
+    result = 0;
+
+fail:
+    free(buffer);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&codec);
+    if (!(format->oformat->flags & AVFMT_NOFILE)) avio_closep(&format->pb);
+    avformat_free_context(format);
+
+    /* don't leave a truncated file behind */
+
+    if (result != 0) remove(path);
+
+    return result;
+}
+
+int corpus_encode(AVFormatContext* format, AVCodecContext* codec,
+AVStream* stream, const AVFrame* frame, AVPacket* packet)
+{
+    int status;
+
+    if ((status = avcodec_send_frame(codec, frame)) < 0) {
+        corpus_print_status("failed to encode", format->url, status);
+        return -1;
+    }
+
+    while ((status = avcodec_receive_packet(codec, packet)) == 0) {
+        av_packet_rescale_ts(packet, codec->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+
+        /* the muxer takes the packet and leaves it blank */
+
+        if ((status = av_interleaved_write_frame(format, packet)) < 0) {
+            corpus_print_status("failed to write packet", format->url, status);
+            return -1;
+        }
+    }
+
+    if (status != AVERROR(EAGAIN) && status != AVERROR_EOF) {
+        corpus_print_status("failed to encode", format->url, status);
+        return -1;
+    }
+    return 0;
+}
+
+void corpus_render(const CorpusFile* this, double* dest, uint64_t pos,
+size_t count)
+{
+    const double amplitude = pow(10.0, this->level / 20.0);
+    const uint64_t total = (uint64_t)(this->seconds * this->sample_rate + 0.5);
+    const uint64_t offset = (uint64_t)round(this->offset * this->sample_rate);
+    const double rate = this->sample_rate;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint64_t frame = pos + i;
+        const double t = (double)frame / rate;
+        double x = 0.0;
+
+        switch (this->content) {
+            case CORPUS_TONE:
+                x = amplitude * sin(2.0 * G_PI * CORPUS_TONE_HZ * t);
+                break;
+            case CORPUS_GATED:
+                if (frame >= total / 4 && frame < total / 4 * 3) {
+                    x = amplitude * sin(2.0 * G_PI * CORPUS_TONE_HZ * t);
+                }
+                break;
+            case CORPUS_CLIPPED:
+                x = CLAMP(amplitude * sin(2.0 * G_PI * CORPUS_TONE_HZ * t), -1.0, 1.0);
+                break;
+            case CORPUS_NOISE:
+                break;
+            case CORPUS_SILENCE:
+            default:
+                break;
+        }
+
+        for (unsigned int c = 0; c < this->channels; c++) {
+            double* sample = &dest[i * this->channels + c];
+
+            if (this->content != CORPUS_NOISE) {
+                *sample = x;
+            } else if (frame < offset) {
+                *sample = 0.0;
+            } else {
+
+                /* noise and envelope are indexed from the start of the
+                 * content so shifted copies only differ by the offset
+                 */
+
+                const double s = (double)(frame - offset) / rate;
+                const double envelope = 0.55 + 0.45
+                    * sin(2.0 * G_PI * 0.37 * s) * sin(2.0 * G_PI * 0.11 * s);
+
+                *sample = amplitude * envelope * corpus_noise(frame - offset, c);
+            }
+        }
+    }
+}
+
+void corpus_convert(AVFrame* frame, const double* src, size_t count,
+unsigned int channels)
+{
+    enum AVSampleFormat format = frame->format;
+    uint8_t** data = frame->extended_data;
+    const int planar = av_sample_fmt_is_planar(format);
+
+    switch (av_get_packed_sample_fmt(format)) {
+        case AV_SAMPLE_FMT_S16:
+            CORPUS_CONVERT(int16_t, (int16_t)lrint(x * 32767.0));
+            break;
+        case AV_SAMPLE_FMT_S32:
+            CORPUS_CONVERT(int32_t, (int32_t)lrint(x * 2147483647.0));
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            CORPUS_CONVERT(float, (float)x);
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            CORPUS_CONVERT(double, x);
+            break;
+        default:
+            break;
+    }
+}
+
+enum AVSampleFormat corpus_sample_format(const AVCodec* encoder)
+{
+    const enum AVSampleFormat* formats;
+    enum AVSampleFormat result = AV_SAMPLE_FMT_NONE;
+
+#ifdef CORPUS_SUPPORTED_CONFIG
+    if (avcodec_get_supported_config(NULL, encoder, AV_CODEC_CONFIG_SAMPLE_FORMAT,
+                0, (const void**)&formats, NULL) < 0)
+    {
+        return AV_SAMPLE_FMT_NONE;
+    }
+#else
+    formats = encoder->sample_fmts;
+#endif
+
+    if (!formats) return AV_SAMPLE_FMT_NONE;
+
+    for (; *formats != AV_SAMPLE_FMT_NONE; formats++) {
+        switch (av_get_packed_sample_fmt(*formats)) {
+            case AV_SAMPLE_FMT_S32:
+                return *formats;
+            case AV_SAMPLE_FMT_S16:
+            case AV_SAMPLE_FMT_FLT:
+            case AV_SAMPLE_FMT_DBL:
+                if (result == AV_SAMPLE_FMT_NONE) result = *formats;
+                break;
+            default:
+                break;
+        }
+    }
+    return result;
+}
+
+gchar* corpus_name(const CorpusFile* this, double offset)
+{
+    gchar* shift = offset > 0.0 ? g_strdup_printf("-shift%gs", offset) : g_strdup("");
+    gchar* name = g_strdup_printf("%s-%u-%uch-%gs%s.%s",
+            corpus_content_names[this->content], this->sample_rate,
+            this->channels, this->seconds, shift, this->format->ext);
+
+    g_free(shift);
+    return name;
+}
+
+double corpus_noise(uint64_t frame, unsigned int channel)
+{
+    /* splitmix64 of the frame and channel, the top 53 bits as a double */
+
+    uint64_t z = frame * 8 + channel + 0x9e3779b97f4a7c15ULL;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+
+    return (double)(z >> 11) / 4503599627370496.0 - 1.0;
+}
+
+void corpus_print_db(FILE* out, const char* key, double db)
+{
+    if (isfinite(db)) fprintf(out, "\"%s\": %.2f, ", key, db);
+    else fprintf(out, "\"%s\": null, ", key);
+}
+
+void corpus_print_status(const char* msg, const char* path, int status)
+{
+    char err[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+
+    av_strerror(status, err, sizeof(err));
+    fprintf(stderr, "%s \"%s\"\n > %s\n", msg, path, err);
+}